@@ -25,25 +25,93 @@
 #include <trace.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <compiler.h>
+#include <err.h>
 #include <kernel/thread.h>
+#include <lib/console.h>
 #include <lib/minip.h>
 #include <lib/cksum.h>
+#include <lib/workqueue.h>
 #include <platform.h>
 
 #include "inetsrv.h"
 
-static int chargen_worker(void *socket)
+/* running totals for the chargen/discard throughput test. point a client
+ * at port 19 or 9 and read the numbers back with 'inetsrv stats'.
+ *
+ * the first byte numbers time each connection from tcp_accept() returning
+ * to its worker moving the first byte. a client that repeatedly connects to
+ * chargen and reads a single byte measures the connection rate and the cost
+ * of starting a worker thread. */
+struct inetsrv_stats {
+    const char *name;
+    int active;
+    uint32_t connections;
+    uint64_t bytes;
+    lk_bigtime_t usecs;
+    lk_bigtime_t since;
+    uint32_t first_byte_count;
+    lk_bigtime_t first_byte_total;
+    lk_bigtime_t first_byte_min;
+    lk_bigtime_t first_byte_max;
+};
+
+static struct inetsrv_stats chargen_stats = { .name = "chargen" };
+static struct inetsrv_stats discard_stats = { .name = "discard" };
+
+static void inetsrv_stats_open(struct inetsrv_stats *stats, int delta)
+{
+    enter_critical_section();
+    stats->active += delta;
+    if (delta > 0)
+        stats->connections++;
+    exit_critical_section();
+}
+
+static void inetsrv_stats_first_byte(struct inetsrv_stats *stats, lk_bigtime_t accept_time)
+{
+    lk_bigtime_t latency = current_time_hires() - accept_time;
+
+    enter_critical_section();
+    if (stats->first_byte_count == 0 || latency < stats->first_byte_min)
+        stats->first_byte_min = latency;
+    if (latency > stats->first_byte_max)
+        stats->first_byte_max = latency;
+    stats->first_byte_total += latency;
+    stats->first_byte_count++;
+    exit_critical_section();
+}
+
+static void inetsrv_stats_add(struct inetsrv_stats *stats, uint64_t bytes, lk_bigtime_t usecs)
+{
+    enter_critical_section();
+    stats->bytes += bytes;
+    stats->usecs += usecs;
+    exit_critical_section();
+}
+
+/* per connection state, handed from the accept loop to the connection's thread */
+struct inetsrv_conn {
+    tcp_socket_t *socket;
+    lk_bigtime_t accept_time;
+};
+
+static int chargen_worker(void *arg)
 {
     uint64_t count = 0;
-    tcp_socket_t *s = socket;
+    struct inetsrv_conn *conn = arg;
+    tcp_socket_t *s = conn->socket;
 
 /* enough buffer to hold an entire defacto chargen sequences */
 #define CHARGEN_BUFSIZE (0x5f * 0x5f) // 9025 bytes
 
     uint8_t *buf = malloc(CHARGEN_BUFSIZE);
-    if (!buf)
+    if (!buf) {
+        tcp_close(s);
+        free(conn);
         return -1;
+    }
 
     /* generate the sequence */
     uint8_t c = '!';
@@ -53,58 +121,48 @@ static int chargen_worker(void *socket)
             c = ' ';
     }
 
+    inetsrv_stats_open(&chargen_stats, 1);
+
     lk_time_t t = current_time();
+    lk_bigtime_t last = current_time_hires();
     for (;;) {
         ssize_t ret = tcp_write(s, buf, CHARGEN_BUFSIZE);
         //TRACEF("tcp_write returns %d\n", ret);
         if (ret < 0)
             break;
 
+        if (count == 0)
+            inetsrv_stats_first_byte(&chargen_stats, conn->accept_time);
+
         count += ret;
+
+        lk_bigtime_t now = current_time_hires();
+        inetsrv_stats_add(&chargen_stats, ret, now - last);
+        last = now;
     }
     t = current_time() - t;
+    inetsrv_stats_open(&chargen_stats, -1);
 
     TRACEF("chargen worker exiting, wrote %llu bytes in %u msecs (%llu bytes/sec)\n",
-        count, (uint32_t)t, count * 1000 / t);
+        count, (uint32_t)t, t ? count * 1000 / t : 0);
     free(buf);
     tcp_close(s);
+    free(conn);
 
     return 0;
 }
 
-static int chargen_server(void *arg)
-{
-    status_t err;
-    tcp_socket_t *listen_socket;
-
-    err = tcp_open_listen(&listen_socket, 19);
-    if (err < 0) {
-        TRACEF("error opening chargen listen socket\n");
-        return -1;
-    }
-
-    for (;;) {
-        tcp_socket_t *accept_socket;
-
-        err = tcp_accept(listen_socket, &accept_socket);
-        TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
-        if (err < 0) {
-            TRACEF("error accepting socket, retrying\n");
-            continue;
-        }
-
-        TRACEF("starting chargen worker\n");
-        thread_detach_and_resume(thread_create("chargen_worker", &chargen_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    }
-}
-
-static int discard_worker(void *socket)
+static int discard_worker(void *arg)
 {
     uint64_t count = 0;
     uint32_t crc = 0;
-    tcp_socket_t *s = socket;
+    struct inetsrv_conn *conn = arg;
+    tcp_socket_t *s = conn->socket;
+
+    inetsrv_stats_open(&discard_stats, 1);
 
     lk_time_t t = current_time();
+    lk_bigtime_t last = current_time_hires();
     for (;;) {
         uint8_t buf[1024];
 
@@ -112,71 +170,118 @@ static int discard_worker(void *socket)
         if (ret <= 0)
             break;
 
+        if (count == 0)
+            inetsrv_stats_first_byte(&discard_stats, conn->accept_time);
+
         crc = crc32(crc, buf, ret);
 
         count += ret;
+
+        lk_bigtime_t now = current_time_hires();
+        inetsrv_stats_add(&discard_stats, ret, now - last);
+        last = now;
     }
     t = current_time() - t;
+    inetsrv_stats_open(&discard_stats, -1);
 
     TRACEF("discard worker exiting, read %llu bytes in %u msecs (%llu bytes/sec), crc32 0x%x\n",
-        count, (uint32_t)t, count * 1000 / t, crc);
+        count, (uint32_t)t, t ? count * 1000 / t : 0, crc);
     tcp_close(s);
+    free(conn);
 
     return 0;
 }
 
-static int discard_server(void *arg)
+/* echo waits on every connection from one thread off a poll set, rather than
+ * tying up a thread per connection that mostly sits waiting to read. each
+ * batch of ready connections is short nonblocking work, which is spread
+ * over the work queue pool */
+struct echo_conn {
+    tcp_socket_t *socket;
+    uint32_t events;    // what it's waiting on in the poll set
+    size_t off;         // buf[off..len] is read but not yet written back
+    size_t len;
+    uint8_t buf[1024];
+};
+
+static status_t echo_conn_wait(minip_poll_set_t *set, struct echo_conn *conn, uint32_t events)
 {
-    status_t err;
-    tcp_socket_t *listen_socket;
+    if (conn->events == events)
+        return NO_ERROR;
 
-    err = tcp_open_listen(&listen_socket, 9);
-    if (err < 0) {
-        TRACEF("error opening discard listen socket\n");
-        return -1;
-    }
+    conn->events = events;
+    return minip_poll_modify(set, conn->socket, events);
+}
 
+/* move as much as the socket allows without blocking, then wait for whichever
+ * side stopped us. returns < 0 once the connection is done */
+static status_t echo_conn_run(minip_poll_set_t *set, struct echo_conn *conn)
+{
     for (;;) {
-        tcp_socket_t *accept_socket;
-
-        err = tcp_accept(listen_socket, &accept_socket);
-        TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
-        if (err < 0) {
-            TRACEF("error accepting socket, retrying\n");
-            continue;
+        if (conn->off == conn->len) {
+            ssize_t ret = tcp_read_etc(conn->socket, conn->buf, sizeof(conn->buf), MINIP_NONBLOCK);
+            if (ret == ERR_NOT_READY)
+                return echo_conn_wait(set, conn, MINIP_POLL_IN);
+            if (ret <= 0)
+                return ERR_CHANNEL_CLOSED;
+
+            conn->off = 0;
+            conn->len = ret;
         }
 
-        TRACEF("starting discard worker\n");
-        thread_detach_and_resume(thread_create("discard_worker", &discard_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        ssize_t ret = tcp_write_etc(conn->socket, conn->buf + conn->off, conn->len - conn->off, MINIP_NONBLOCK);
+        if (ret == ERR_NOT_READY)
+            return echo_conn_wait(set, conn, MINIP_POLL_OUT);
+        if (ret < 0)
+            return ret;
+
+        conn->off += ret;
     }
 }
 
-static int echo_worker(void *socket)
+static void echo_accept(minip_poll_set_t *set, tcp_socket_t *listen_socket)
 {
-    tcp_socket_t *s = socket;
-
-    for (;;) {
-        uint8_t buf[1024];
+    tcp_socket_t *accept_socket;
 
-        ssize_t ret = tcp_read(s, buf, sizeof(buf));
-        if (ret <= 0)
-            break;
+    while (tcp_accept_etc(listen_socket, &accept_socket, MINIP_NONBLOCK) == NO_ERROR) {
+        struct echo_conn *conn = calloc(1, sizeof(struct echo_conn));
+        if (!conn) {
+            tcp_close(accept_socket);
+            continue;
+        }
+        conn->socket = accept_socket;
+        conn->events = MINIP_POLL_IN;
 
-        tcp_write(s, buf, ret);
-        if (ret <= 0)
-            break;
+        if (minip_poll_add_tcp(set, accept_socket, conn->events, conn) < 0) {
+            tcp_close(accept_socket);
+            free(conn);
+        }
     }
+}
 
-    TRACEF("echo worker exiting\n");
-    tcp_close(s);
+/* the connections of one poll_wait, each runs on the pool at most once */
+struct echo_batch {
+    minip_poll_set_t *set;
+    struct echo_conn *conns[16];
+};
 
-    return 0;
+static void echo_batch_run(void *arg, uint index)
+{
+    struct echo_batch *batch = arg;
+    struct echo_conn *conn = batch->conns[index];
+
+    if (echo_conn_run(batch->set, conn) < 0) {
+        /* closing it takes it out of the set */
+        tcp_close(conn->socket);
+        free(conn);
+    }
 }
 
 static int echo_server(void *arg)
 {
     status_t err;
     tcp_socket_t *listen_socket;
+    minip_poll_set_t *set;
 
     err = tcp_open_listen(&listen_socket, 7);
     if (err < 0) {
@@ -184,23 +289,168 @@ static int echo_server(void *arg)
         return -1;
     }
 
+    err = minip_poll_create(&set);
+    if (err < 0) {
+        tcp_close(listen_socket);
+        return -1;
+    }
+
+    /* the listen socket is the one entry without a connection for a cookie */
+    minip_poll_add_tcp(set, listen_socket, MINIP_POLL_IN, NULL);
+
+    struct echo_batch batch = { .set = set };
+
+    for (;;) {
+        minip_poll_event_t events[countof(batch.conns)];
+        uint ready = 0;
+
+        ssize_t count = minip_poll_wait(set, events, countof(events), INFINITE_TIME);
+        for (ssize_t i = 0; i < count; i++) {
+            struct echo_conn *conn = events[i].cookie;
+
+            if (!conn) {
+                echo_accept(set, listen_socket);
+                continue;
+            }
+
+            batch.conns[ready++] = conn;
+        }
+
+        /* the batch is done before the next wait, so no connection is ever
+         * run by two workers at once */
+        work_parallel_for(ready, &echo_batch_run, &batch);
+    }
+}
+
+struct inetsrv_service {
+    const char *name;
+    uint16_t port;
+    thread_start_routine worker;
+};
+
+static const struct inetsrv_service services[] = {
+    { "chargen", 19, &chargen_worker },
+    { "discard", 9, &discard_worker },
+};
+
+/* accept connections forever, one thread per connection. these live as long
+ * as the client keeps the stream going, so they stay off the shared work
+ * queue pool, which is sized for short jobs */
+static int inetsrv_server(void *arg)
+{
+    const struct inetsrv_service *service = arg;
+    status_t err;
+    tcp_socket_t *listen_socket;
+
+    err = tcp_open_listen(&listen_socket, service->port);
+    if (err < 0) {
+        TRACEF("error opening %s listen socket\n", service->name);
+        return -1;
+    }
+
     for (;;) {
         tcp_socket_t *accept_socket;
 
         err = tcp_accept(listen_socket, &accept_socket);
+        lk_bigtime_t accept_time = current_time_hires();
         TRACEF("tcp_accept returns returns %d, handle %p\n", err, accept_socket);
         if (err < 0) {
             TRACEF("error accepting socket, retrying\n");
             continue;
         }
 
-        TRACEF("starting echo worker\n");
-        thread_detach_and_resume(thread_create("echo_worker", &echo_worker, accept_socket, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+        struct inetsrv_conn *conn = malloc(sizeof(struct inetsrv_conn));
+        if (!conn) {
+            tcp_close(accept_socket);
+            continue;
+        }
+        conn->socket = accept_socket;
+        conn->accept_time = accept_time;
+
+        TRACEF("starting %s worker\n", service->name);
+        thread_t *t = thread_create(service->name, service->worker, conn, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!t) {
+            TRACEF("error starting %s worker\n", service->name);
+            tcp_close(accept_socket);
+            free(conn);
+            continue;
+        }
+        thread_detach_and_resume(t);
+    }
+}
+
+static void dump_stats(struct inetsrv_stats *stats)
+{
+    uint64_t bytes;
+    lk_bigtime_t usecs;
+    uint32_t connections;
+    uint32_t first_byte_count;
+    lk_bigtime_t first_byte_total;
+
+    enter_critical_section();
+    bytes = stats->bytes;
+    usecs = stats->usecs;
+    connections = stats->connections;
+    first_byte_count = stats->first_byte_count;
+    first_byte_total = stats->first_byte_total;
+    exit_critical_section();
+
+    lk_bigtime_t elapsed = current_time_hires() - stats->since;
+
+    printf("%s: %u connections (%d active), %llu bytes in %llu usecs (%llu bytes/sec)\n",
+        stats->name, connections, stats->active, bytes, usecs,
+        usecs ? bytes * 1000000 / usecs : 0);
+    printf("\t%llu connections/sec, accept to first byte avg %llu min %llu max %llu usecs\n",
+        elapsed ? (uint64_t)connections * 1000000 / elapsed : 0,
+        first_byte_count ? first_byte_total / first_byte_count : 0,
+        stats->first_byte_min, stats->first_byte_max);
+}
+
+static void reset_stats(struct inetsrv_stats *stats)
+{
+    enter_critical_section();
+    stats->connections = 0;
+    stats->bytes = 0;
+    stats->usecs = 0;
+    stats->since = current_time_hires();
+    stats->first_byte_count = 0;
+    stats->first_byte_total = 0;
+    stats->first_byte_min = 0;
+    stats->first_byte_max = 0;
+    exit_critical_section();
+}
+
+static int cmd_inetsrv(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+usage:
+        printf("usage: %s stats\n", argv[0].str);
+        printf("usage: %s reset\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    if (!strcmp(argv[1].str, "stats")) {
+        dump_stats(&chargen_stats);
+        dump_stats(&discard_stats);
+    } else if (!strcmp(argv[1].str, "reset")) {
+        reset_stats(&chargen_stats);
+        reset_stats(&discard_stats);
+    } else {
+        printf("ERROR unknown command\n");
+        goto usage;
     }
+
+    return NO_ERROR;
 }
 
+STATIC_COMMAND_START
+STATIC_COMMAND("inetsrv", "chargen/discard throughput and connection latency counters", &cmd_inetsrv)
+STATIC_COMMAND_END(inetsrv);
+
 static void inetsrv_init(const struct app_descriptor *app)
 {
+    reset_stats(&chargen_stats);
+    reset_stats(&discard_stats);
 }
 
 static void inetsrv_entry(const struct app_descriptor *app, void *args)
@@ -209,8 +459,10 @@ static void inetsrv_entry(const struct app_descriptor *app, void *args)
 
     printf("starting internet servers\n");
 
-    thread_detach_and_resume(thread_create("chargen", &chargen_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
-    thread_detach_and_resume(thread_create("discard", &discard_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    for (size_t i = 0; i < countof(services); i++) {
+        thread_detach_and_resume(thread_create(services[i].name, &inetsrv_server,
+            (void *)&services[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+    }
     thread_detach_and_resume(thread_create("echo", &echo_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
 }
 
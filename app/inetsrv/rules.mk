@@ -8,5 +8,6 @@ MODULE_SRCS += \
 MODULE_DEPS := \
     lib/cksum \
     lib/minip \
+    lib/workqueue \
 
 include make/module.mk
@@ -298,6 +298,182 @@ static void validate_memset(void)
     }
 }
 
+/* byte at a time reference implementations of the string routines */
+static size_t c_strlen(const char *s)
+{
+    size_t i = 0;
+
+    while (s[i])
+        i++;
+    return i;
+}
+
+static size_t c_strnlen(const char *s, size_t count)
+{
+    size_t i = 0;
+
+    while (i < count && s[i])
+        i++;
+    return i;
+}
+
+static char *c_strchr(const char *s, int c)
+{
+    for (; *s != (char)c; s++)
+        if (*s == '\0')
+            return NULL;
+    return (char *)s;
+}
+
+static int c_strcmp(const char *cs, const char *ct)
+{
+    signed char res;
+
+    while (1) {
+        if ((res = *cs - *ct++) != 0 || !*cs++)
+            break;
+    }
+    return res;
+}
+
+static void *c_memchr(const void *buf, int c, size_t len)
+{
+    const unsigned char *b = buf;
+
+    for (size_t i = 0; i < len; i++) {
+        if (b[i] == (unsigned char)c)
+            return (void *)(b + i);
+    }
+    return NULL;
+}
+
+static inline int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+/* fill with non zero bytes, some with the top bit set */
+static void fillstr(char *ptr, size_t len, uint32_t seed)
+{
+    for (size_t i = 0; i < len; i++) {
+        ptr[i] = (seed >> 24) ? (seed >> 24) : 0x80;
+        seed *= 0x1234567;
+        seed += 0x89;
+    }
+}
+
+static void validate_str(void)
+{
+    const size_t maxsize = 256;
+    char *s = (char *)src;
+    char *t = (char *)dst;
+    uint errors = 0;
+
+    printf("testing strlen, strnlen, strchr, strcmp and memchr for correctness\n");
+
+    for (size_t align = 0; align < 16; align++) {
+        printf("align %zu\n", align);
+        for (size_t len = 0; len < maxsize; len++) {
+            fillstr(s, maxsize * 2, len * 16 + align);
+            char *str = s + align;
+            str[len] = 0;
+
+            if (strlen(str) != c_strlen(str)) {
+                printf("error! strlen align %zu, len %zu\n", align, len);
+                errors++;
+            }
+
+            for (size_t count = len > 20 ? len - 20 : 0; count < len + 20; count++) {
+                if (strnlen(str, count) != c_strnlen(str, count)) {
+                    printf("error! strnlen align %zu, len %zu, count %zu\n", align, len, count);
+                    errors++;
+                }
+            }
+
+            /* characters at either end, in the middle, absent and the terminator */
+            int chars[] = { str[0], str[len / 2], len ? str[len - 1] : 1, 0x1, 0, 0x100 | (uint8_t)str[len / 2] };
+            for (uint i = 0; i < countof(chars); i++) {
+                if (strchr(str, chars[i]) != c_strchr(str, chars[i])) {
+                    printf("error! strchr align %zu, len %zu, c 0x%x\n", align, len, chars[i]);
+                    errors++;
+                }
+                if (memchr(str, chars[i], len) != c_memchr(str, chars[i], len)) {
+                    printf("error! memchr align %zu, len %zu, c 0x%x\n", align, len, chars[i]);
+                    errors++;
+                }
+            }
+
+            /* equal, then differing or ending early at each end and the middle,
+             * with the second string at every relative alignment */
+            for (size_t talign = 0; talign < 16; talign++) {
+                char *str2 = t + talign;
+                size_t pos[] = { 0, len / 2, len ? len - 1 : 0 };
+
+                memcpy(str2, str, len + 1);
+                if (sign(strcmp(str, str2)) != sign(c_strcmp(str, str2))) {
+                    printf("error! strcmp align %zu/%zu, len %zu\n", align, talign, len);
+                    errors++;
+                }
+                for (uint i = 0; i < countof(pos) && len; i++) {
+                    for (uint j = 0; j < 2; j++) {
+                        memcpy(str2, str, len + 1);
+                        str2[pos[i]] = j ? 0 : (char)(str2[pos[i]] ^ 0x81);
+                        if (sign(strcmp(str, str2)) != sign(c_strcmp(str, str2)) ||
+                                sign(strcmp(str2, str)) != sign(c_strcmp(str2, str))) {
+                            printf("error! strcmp align %zu/%zu, len %zu, pos %zu\n", align, talign, len, pos[i]);
+                            errors++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%u errors\n", errors);
+}
+
+/* time each routine over strings of a few lengths, against the byte at a
+ * time reference versions */
+static void bench_str(void)
+{
+    static const size_t lens[] = { 8, 32, 128, 1024, 16384 };
+    char *s = (char *)src;
+    char *t = (char *)dst;
+
+    printf("string routine speed test, nsecs per call (libc / byte at a time)\n");
+    thread_sleep(200); // let the debug string clear the serial port
+
+    for (uint i = 0; i < countof(lens); i++) {
+        size_t len = lens[i];
+        uint iter = (16 * 1024 * 1024) / len;
+        volatile size_t sink = 0;
+        lk_bigtime_t t0, libc, c;
+
+        fillstr(s, len, 1234);
+        s[len] = 0;
+        memcpy(t, s, len + 1);
+
+#define BENCH_STR(name, libcall, ccall) \
+        t0 = current_time_hires(); \
+        for (uint j = 0; j < iter; j++) \
+            sink += (size_t)(libcall); \
+        libc = current_time_hires() - t0; \
+        t0 = current_time_hires(); \
+        for (uint j = 0; j < iter; j++) \
+            sink += (size_t)(ccall); \
+        c = current_time_hires() - t0; \
+        printf("%8s len %5zu: %6llu / %6llu\n", name, len, \
+               libc * 1000 / iter, c * 1000 / iter);
+
+        BENCH_STR("strlen", strlen(s), c_strlen(s));
+        BENCH_STR("strnlen", strnlen(s, len), c_strnlen(s, len));
+        BENCH_STR("strchr", strchr(s, 0), c_strchr(s, 0));
+        BENCH_STR("memchr", memchr(s, 0, len), c_memchr(s, 0, len));
+        BENCH_STR("strcmp", strcmp(s, t), c_strcmp(s, t));
+#undef BENCH_STR
+    }
+}
+
 #if defined(WITH_LIB_CONSOLE)
 #include <lib/console.h>
 
@@ -319,8 +495,8 @@ static int string_tests(int argc, const cmd_args *argv)
     if (argc < 3) {
         printf("not enough arguments:\n");
 usage:
-        printf("%s validate <routine>\n", argv[0].str);
-        printf("%s bench <routine>\n", argv[0].str);
+        printf("%s validate <memcpy|memset|str>\n", argv[0].str);
+        printf("%s bench <memcpy|memset|str>\n", argv[0].str);
         goto out;
     }
 
@@ -329,12 +505,16 @@ usage:
             validate_memcpy();
         } else if (!strcmp(argv[2].str, "memset")) {
             validate_memset();
+        } else if (!strcmp(argv[2].str, "str")) {
+            validate_str();
         }
     } else if (!strcmp(argv[1].str, "bench")) {
         if (!strcmp(argv[2].str, "memcpy")) {
             bench_memcpy();
         } else if (!strcmp(argv[2].str, "memset")) {
             bench_memset();
+        } else if (!strcmp(argv[2].str, "str")) {
+            bench_str();
         }
     } else {
         goto usage;
@@ -350,7 +530,7 @@ out:
 }
 
 STATIC_COMMAND_START
-{ "string", "memcpy tests", &string_tests },
+{ "string", "memcpy, memset and string routine tests", &string_tests },
 STATIC_COMMAND_END(stringtests);
 
 #endif
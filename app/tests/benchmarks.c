@@ -32,6 +32,9 @@
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
 #include <platform.h>
+#if WITH_LIB_HEAP
+#include <lib/heap.h>
+#endif
 
 #if ARCH_ARM
 void bench_set_overhead(void)
@@ -176,6 +179,98 @@ void bench_memcpy(void)
 }
 #endif
 
+/* throughput of the libc memory routines from 16 bytes to 1MB, with the
+ * buffers aligned and with the source and destination misaligned by odd
+ * amounts. memmove runs with the destination overlapping the source.
+ */
+enum bench_mem_op {
+	BENCH_MEMCPY,
+	BENCH_MEMMOVE,
+	BENCH_MEMSET,
+	BENCH_MEMCMP,
+	BENCH_MEM_OPS
+};
+
+static const char *bench_mem_op_names[BENCH_MEM_OPS] = {
+	"memcpy", "memmove", "memset", "memcmp"
+};
+
+#define BENCH_MEM_MIN   16
+#define BENCH_MEM_MAX   (1024 * 1024)
+#define BENCH_MEM_BYTES (8 * 1024 * 1024) /* per size, iterations scale to fit */
+
+__NO_INLINE static uint bench_mem_op(enum bench_mem_op op, uint8_t *dst, uint8_t *src, size_t len, uint iter)
+{
+	uint sum = 0;
+
+	for (uint i = 0; i < iter; i++) {
+		switch (op) {
+			case BENCH_MEMCPY:
+				memcpy(dst, src, len);
+				break;
+			case BENCH_MEMMOVE:
+				memmove(src + 8, src, len);
+				break;
+			case BENCH_MEMSET:
+				memset(dst, i, len);
+				break;
+			case BENCH_MEMCMP:
+				sum += memcmp(dst, src, len);
+				break;
+			default:
+				break;
+		}
+	}
+
+	return sum;
+}
+
+static void bench_mem_sweep(void)
+{
+	/* room for the largest size plus the misalignment and memmove offsets */
+	uint8_t *src = malloc(BENCH_MEM_MAX + 64);
+	uint8_t *dst = malloc(BENCH_MEM_MAX + 64);
+	if (!src || !dst) {
+		printf("not enough memory for the memory routine sweep\n");
+		goto out;
+	}
+
+	for (uint misalign = 0; misalign < 2; misalign++) {
+		uint8_t *s = src + (misalign ? 3 : 0);
+		uint8_t *d = dst + (misalign ? 13 : 0);
+
+		printf("%s buffers, MB/s\n", misalign ? "misaligned" : "aligned");
+		printf("%10s", "size");
+		for (uint op = 0; op < BENCH_MEM_OPS; op++)
+			printf(" %10s", bench_mem_op_names[op]);
+		printf("\n");
+
+		for (size_t len = BENCH_MEM_MIN; len <= BENCH_MEM_MAX; len *= 2) {
+			uint iter = BENCH_MEM_BYTES / len;
+
+			printf("%10zu", len);
+			for (uint op = 0; op < BENCH_MEM_OPS; op++) {
+				/* memcmp has to walk the whole buffer to find them equal */
+				memset(s, 0x55, len + 8);
+				memset(d, 0x55, len);
+
+				lk_bigtime_t t = current_time_hires();
+				bench_mem_op(op, d, s, len, iter);
+				t = current_time_hires() - t;
+
+				if (t == 0)
+					t = 1;
+				printf(" %10llu", (unsigned long long)len * iter * 1000000ULL / t / (1024 * 1024));
+			}
+			printf("\n");
+		}
+	}
+
+out:
+	free(src);
+	free(dst);
+}
+
 #if WITH_LIB_LIBM
 #include <math.h>
 
@@ -217,6 +312,61 @@ __NO_INLINE static void bench_sincos(void)
 
 #endif
 
+#if WITH_LIB_HEAP
+/* time small alloc/free pairs. Aligned requests bypass the heap size classes,
+ * so running the same pattern with an alignment measures the first fit path.
+ */
+static void bench_heap_pattern(const char *name, uint alignment)
+{
+	const uint COUNT = 512;
+	const uint ITER = 64;
+	void **ptrs = malloc(COUNT * sizeof(void *));
+	if (!ptrs)
+		return;
+
+	lk_bigtime_t t = current_time_hires();
+	for (uint i = 0; i < ITER; i++) {
+		for (uint j = 0; j < COUNT; j++) {
+			ptrs[j] = heap_alloc(16 + (j % 8) * 24, alignment);
+		}
+		for (uint j = 0; j < COUNT; j++) {
+			heap_free(ptrs[(j * 7) % COUNT]);
+		}
+	}
+	t = current_time_hires() - t;
+
+	printf("%s: took %llu usecs for %u alloc/free pairs (%llu nsecs per pair)\n",
+	       name, t, COUNT * ITER, t * 1000 / (COUNT * ITER));
+
+	free(ptrs);
+}
+
+static void bench_heap(void)
+{
+	const uint HOLES = 256;
+	void **holes = malloc(HOLES * sizeof(void *));
+	if (!holes)
+		return;
+
+	/* leave a run of small free chunks in the way of the first fit walk */
+	for (uint i = 0; i < HOLES; i++) {
+		holes[i] = heap_alloc(64, 16);
+	}
+	for (uint i = 0; i < HOLES; i += 2) {
+		heap_free(holes[i]);
+		holes[i] = NULL;
+	}
+
+	bench_heap_pattern("heap size classes", 0);
+	bench_heap_pattern("heap first fit", 16);
+
+	for (uint i = 0; i < HOLES; i++) {
+		heap_free(holes[i]);
+	}
+	free(holes);
+}
+#endif
+
 void benchmarks(void)
 {
 #if ARCH_ARM
@@ -229,6 +379,10 @@ void benchmarks(void)
 	bench_cset_wide();
 	bench_cset_stm();
 	bench_memcpy();
+#endif
+	bench_mem_sweep();
+#if WITH_LIB_HEAP
+	bench_heap();
 #endif
 #if WITH_LIB_LIBM
     bench_sincos();
@@ -29,6 +29,7 @@ int thread_tests(void);
 void printf_tests(void);
 void printf_tests_float(void);
 void clock_tests(void);
+void timer_tests(void);
 void float_tests(void);
 void benchmarks(void);
 int fibo(int argc, const cmd_args *argv);
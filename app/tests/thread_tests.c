@@ -29,6 +29,7 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <platform.h>
 
 static int sleep_thread(void *arg)
@@ -238,6 +239,97 @@ int mutex_test(void)
 	return 0;
 }
 
+/* priority inversion: a low priority thread holds a mutex a high priority
+ * thread wants while a medium priority thread spins. with priority
+ * inheritance the holder is boosted past the spinner, so the high priority
+ * thread waits about as long as the hold time rather than the spin time. */
+#define PI_HOLD_USECS 20000
+#define PI_SPIN_USECS 200000
+#define PI_ITERATIONS 5
+
+static mutex_t pi_mutex = MUTEX_INITIAL_VALUE(pi_mutex);
+static event_t pi_held = EVENT_INITIAL_VALUE(pi_held, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+static int pi_low_thread(void *arg)
+{
+	mutex_acquire(&pi_mutex);
+	event_signal(&pi_held, true);
+	spin(PI_HOLD_USECS);
+	mutex_release(&pi_mutex);
+
+	/* the boost must be gone once the mutex is released */
+	return (get_current_thread()->priority == LOW_PRIORITY) ? 0 : 1;
+}
+
+static int pi_medium_thread(void *arg)
+{
+	spin(PI_SPIN_USECS);
+
+	return 0;
+}
+
+static int pi_high_thread(void *arg)
+{
+	lk_bigtime_t t = current_time_hires();
+	mutex_acquire(&pi_mutex);
+	t = current_time_hires() - t;
+	mutex_release(&pi_mutex);
+
+	return (int)t;
+}
+
+static thread_t *pi_start(const char *name, thread_start_routine entry, int priority)
+{
+	thread_t *t = thread_create(name, entry, NULL, priority, DEFAULT_STACK_SIZE);
+
+	/* keep everything on one cpu so the spinner really competes with the holder */
+	thread_set_cpu_affinity(t, 1U << arch_curr_cpu_num());
+	thread_resume(t);
+
+	return t;
+}
+
+static void priority_inheritance_test(void)
+{
+	int old_priority = get_current_thread()->base_priority;
+	lk_bigtime_t worst = 0;
+	lk_bigtime_t total = 0;
+	int not_restored = 0;
+
+	printf("testing mutex priority inheritance\n");
+
+	/* run above all the testers so each one is started before any of them runs */
+	thread_set_priority(HIGHEST_PRIORITY);
+	thread_set_cpu_affinity(get_current_thread(), 1U << arch_curr_cpu_num());
+
+	for (int i = 0; i < PI_ITERATIONS; i++) {
+		int low_ret, high_ret;
+
+		thread_t *low = pi_start("pi low", &pi_low_thread, LOW_PRIORITY);
+		event_wait(&pi_held);
+
+		thread_t *medium = pi_start("pi medium", &pi_medium_thread, DEFAULT_PRIORITY);
+		thread_t *high = pi_start("pi high", &pi_high_thread, HIGH_PRIORITY);
+
+		thread_join(high, &high_ret, INFINITE_TIME);
+		thread_join(medium, NULL, INFINITE_TIME);
+		thread_join(low, &low_ret, INFINITE_TIME);
+
+		total += high_ret;
+		if ((lk_bigtime_t)high_ret > worst)
+			worst = high_ret;
+		not_restored += low_ret;
+	}
+
+	thread_set_cpu_affinity(get_current_thread(), MP_CPU_ALL);
+	thread_set_priority(old_priority);
+
+	printf("high priority wakeup latency avg %llu usecs, worst %llu usecs "
+	       "(should be under the %u usec hold time, not near the %u usec spin)\n",
+	       total / PI_ITERATIONS, worst, PI_HOLD_USECS, PI_SPIN_USECS);
+	printf("%d holders kept their boost after release (should be zero)\n", not_restored);
+}
+
 static event_t e;
 
 static int event_signaller(void *arg)
@@ -497,9 +589,90 @@ static void preempt_test(void)
 	printf("done with real-time preempt test, above time stamps should be 1 second apart\n");
 }
 
+#if WITH_SMP
+static spin_lock_t smp_test_lock = SPIN_LOCK_INITIAL_VALUE;
+static volatile int smp_test_counter;
+
+#define SMP_TEST_ITERATIONS 100000
+
+static int smp_tester(void *arg)
+{
+	uint cpu = (uintptr_t)arg;
+	int wrong_cpu = 0;
+
+	/* pinned before being resumed, make sure it stays put across reschedules */
+	for (int i = 0; i < 100; i++) {
+		if (arch_curr_cpu_num() != cpu)
+			wrong_cpu++;
+		thread_yield();
+	}
+
+	/* bang on a counter that is only protected by a spinlock */
+	for (int i = 0; i < SMP_TEST_ITERATIONS; i++) {
+		spin_lock_saved_state_t state;
+
+		spin_lock_save(&smp_test_lock, &state, SPIN_LOCK_FLAG_INTERRUPTS);
+		smp_test_counter++;
+		spin_unlock_restore(&smp_test_lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+	}
+
+	return wrong_cpu;
+}
+
+static void smp_test(void)
+{
+	thread_t *threads[SMP_MAX_CPUS];
+	uint count = 0;
+	int wrong_cpu = 0;
+
+	printf("testing smp, active cpu mask 0x%x\n", mp_get_active_mask());
+
+	/* one thread pinned to each cpu */
+	smp_test_counter = 0;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!mp_is_cpu_active(i))
+			continue;
+
+		threads[count] = thread_create("smp tester", &smp_tester, (void *)(uintptr_t)i, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+		thread_set_cpu_affinity(threads[count], 1U << i);
+		count++;
+	}
+
+	for (uint i = 0; i < count; i++)
+		thread_resume(threads[i]);
+
+	for (uint i = 0; i < count; i++) {
+		int ret;
+
+		thread_join(threads[i], &ret, INFINITE_TIME);
+		wrong_cpu += ret;
+	}
+
+	printf("%u threads, %d ran on the wrong cpu (should be zero), counter %d (should be %d)\n",
+	       count, wrong_cpu, smp_test_counter, count * SMP_TEST_ITERATIONS);
+
+	/* walk the current thread across the cpus by changing its affinity */
+	wrong_cpu = 0;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!mp_is_cpu_active(i))
+			continue;
+
+		thread_set_cpu_affinity(get_current_thread(), 1U << i);
+		if (arch_curr_cpu_num() != i)
+			wrong_cpu++;
+	}
+	thread_set_cpu_affinity(get_current_thread(), MP_CPU_ALL);
+
+	printf("migration: %d moves failed (should be zero)\n", wrong_cpu);
+
+	atomic_test();
+}
+#endif
+
 int thread_tests(void)
 {
 	mutex_test();
+	priority_inheritance_test();
 	semaphore_test();
 	event_test();
 
@@ -510,6 +683,10 @@ int thread_tests(void)
 
 	preempt_test();
 
+#if WITH_SMP
+	smp_test();
+#endif
+
 	return 0;
 }
 
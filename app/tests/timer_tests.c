@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <rand.h>
+#include <err.h>
+#include <app/tests.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/event.h>
+#include <platform.h>
+
+#define STRESS_TIMER_COUNT 4096
+#define STRESS_TIMER_MAX_DELAY 2000
+
+/* past the 16384 msec span of the kernel's timer wheel, so these start out
+ * on the overflow list and have to be pulled back into the wheel */
+#define STRESS_TIMER_FAR_DELAY 17000
+#define STRESS_TIMER_FAR_MAX_DELAY (STRESS_TIMER_FAR_DELAY + 3000)
+
+struct stress_timer {
+	timer_t timer;
+	lk_time_t deadline;
+	int fired;
+	bool canceled;
+};
+
+static event_t stress_done;
+static volatile int stress_remaining;
+static volatile int stress_early;
+
+static enum handler_return stress_timer_cb(struct timer *t, lk_time_t now, void *arg)
+{
+	struct stress_timer *st = (struct stress_timer *)arg;
+
+	if (TIME_LT(now, st->deadline))
+		stress_early++;
+	st->fired++;
+
+	if (--stress_remaining == 0) {
+		event_signal(&stress_done, false);
+		return INT_RESCHEDULE;
+	}
+
+	return INT_NO_RESCHEDULE;
+}
+
+/* arm thousands of one shot timers spread across the near and far future,
+ * cancel a portion of them and make sure the rest fire exactly once and
+ * never before their deadline. half the far timers are left armed, so the
+ * test takes a little over STRESS_TIMER_FAR_MAX_DELAY msecs.
+ */
+static void timer_stress_test(void)
+{
+	struct stress_timer *timers = calloc(STRESS_TIMER_COUNT, sizeof(struct stress_timer));
+	if (!timers) {
+		printf("failed to allocate timers\n");
+		return;
+	}
+
+	printf("arming %d timers\n", STRESS_TIMER_COUNT);
+
+	event_init(&stress_done, false, EVENT_FLAG_AUTOUNSIGNAL);
+	stress_early = 0;
+
+	/* every 16th timer is far enough out to land past the wheel. every 4th
+	 * timer is canceled, except every other far one */
+	int expected = 0, far = 0;
+	lk_bigtime_t t = current_time_hires();
+	enter_critical_section();
+	for (int i = 0; i < STRESS_TIMER_COUNT; i++) {
+		struct stress_timer *st = &timers[i];
+		lk_time_t delay = (i % 16 == 0) ?
+			STRESS_TIMER_FAR_DELAY + rand() % (STRESS_TIMER_FAR_MAX_DELAY - STRESS_TIMER_FAR_DELAY) :
+			1 + rand() % STRESS_TIMER_MAX_DELAY;
+
+		timer_initialize(&st->timer);
+		st->deadline = current_time() + delay;
+		st->canceled = (i % 4 == 0) && (i % 32 != 0);
+		if (!st->canceled) {
+			expected++;
+			if (i % 16 == 0)
+				far++;
+		}
+
+		timer_set_oneshot(&st->timer, delay, stress_timer_cb, st);
+	}
+	stress_remaining = expected;
+	exit_critical_section();
+	t = current_time_hires() - t;
+	printf("took %llu usecs to arm %d timers\n", t, STRESS_TIMER_COUNT);
+
+	t = current_time_hires();
+	for (int i = 0; i < STRESS_TIMER_COUNT; i++) {
+		if (timers[i].canceled)
+			timer_cancel(&timers[i].timer);
+	}
+	t = current_time_hires() - t;
+	printf("took %llu usecs to cancel %d timers\n", t, STRESS_TIMER_COUNT - expected);
+
+	printf("waiting for %d timers, %d of them past the timer wheel\n", expected, far);
+	status_t err = event_wait_timeout(&stress_done, STRESS_TIMER_FAR_MAX_DELAY + 1000);
+	if (err < 0)
+		printf("timed out waiting for timers, %d still pending\n", stress_remaining);
+
+	int missed = 0, extra = 0, canceled_fired = 0;
+	for (int i = 0; i < STRESS_TIMER_COUNT; i++) {
+		struct stress_timer *st = &timers[i];
+
+		if (st->canceled) {
+			if (st->fired)
+				canceled_fired++;
+		} else if (st->fired == 0) {
+			missed++;
+			timer_cancel(&st->timer);
+		} else if (st->fired > 1) {
+			extra++;
+		}
+	}
+
+	printf("%d timers fired early, %d missed, %d fired more than once, %d fired after cancel\n",
+	       stress_early, missed, extra, canceled_fired);
+	if (stress_early || missed || extra || canceled_fired)
+		printf("timer stress test FAILED\n");
+	else
+		printf("timer stress test passed\n");
+
+	free(timers);
+}
+
+void timer_tests(void)
+{
+	timer_stress_test();
+}
@@ -291,7 +291,15 @@ static inline uint32_t arch_cycle_count(void) { return _arch_cycle_count(); }
 
 #endif
 
+static inline uint arch_curr_cpu_num(void)
+{
+	return 0;
+}
+
 typedef unsigned long spin_lock_t;
+
+#define SPIN_LOCK_INITIAL_VALUE (0)
+
 void spin_lock(spin_lock_t *lock); /* interrupts should already be disabled */
 int spin_trylock(spin_lock_t *lock); /* Returns 0 on success, non-0 on failure */
 void spin_unlock(spin_lock_t *lock);
@@ -21,12 +21,21 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <trace.h>
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/arm64.h>
+#include <kernel/mp.h>
 #include <platform.h>
 
-void arch_early_init(void)
+#define LOCAL_TRACE 0
+
+#if WITH_SMP
+/* start.S holds the secondary cpus until this is set */
+volatile int arm64_secondaries_released;
+#endif
+
+void arm64_cpu_early_init(void)
 {
     /* set the vector base */
     ARM64_WRITE_SYSREG(VBAR_EL1, (uint64_t)&arm64_exception_base);
@@ -38,8 +47,23 @@ void arch_early_init(void)
     }
 }
 
+void arch_early_init(void)
+{
+    arm64_cpu_early_init();
+}
+
 void arch_init(void)
 {
+#if WITH_SMP
+    arch_mp_init_percpu();
+
+    LTRACEF("releasing %d secondary cpus\n", SMP_MAX_CPUS - 1);
+
+    /* let the secondary cpus out of the pen in start.S */
+    arm64_secondaries_released = 1;
+    DSB;
+    __asm__ volatile("sev" ::: "memory");
+#endif
 }
 
 void arch_quiesce(void)
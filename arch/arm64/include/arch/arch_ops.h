@@ -45,12 +45,11 @@ static inline void arch_disable_ints(void)
     CF;
 }
 
-// XXX
 static inline bool arch_ints_disabled(void)
 {
-    unsigned int state;
+    unsigned long state;
 
-    __asm__ volatile("mrs %0, cpsr" : "=r"(state));
+    __asm__ volatile("mrs %0, daif" : "=r"(state));
     state &= (1<<7);
 
     return !!state;
@@ -208,5 +207,88 @@ static inline void set_current_thread(struct thread *t)
     ARM64_WRITE_SYSREG(tpidr_el1, (uint64_t)t);
 }
 
+/* cpus are numbered by their affinity level 0 id, only the first cluster is used */
+static inline uint arch_curr_cpu_num(void)
+{
+    return ARM64_READ_SYSREG(mpidr_el1) & 0xff;
+}
+
+/* spinlocks */
+typedef unsigned long spin_lock_t;
+
+#define SPIN_LOCK_INITIAL_VALUE (0)
+
+/* interrupts should already be disabled */
+static inline void spin_lock(spin_lock_t *lock)
+{
+    unsigned long tmp;
+
+    __asm__ volatile(
+        "sevl\n"
+        "1: wfe\n"
+        "ldaxr  %[tmp], [%[lock]]\n"
+        "cbnz   %[tmp], 1b\n"
+        "stxr   %w[tmp], %[one], [%[lock]]\n"
+        "cbnz   %w[tmp], 1b\n"
+        : [tmp]"=&r" (tmp)
+        : [lock]"r" (lock), [one]"r" (1UL)
+        : "memory");
+}
+
+/* returns 0 on success, non-0 on failure */
+static inline int spin_trylock(spin_lock_t *lock)
+{
+    unsigned long tmp;
+
+    __asm__ volatile(
+        "ldaxr  %[tmp], [%[lock]]\n"
+        "cbnz   %[tmp], 1f\n"
+        "stxr   %w[tmp], %[one], [%[lock]]\n"
+        "1:\n"
+        : [tmp]"=&r" (tmp)
+        : [lock]"r" (lock), [one]"r" (1UL)
+        : "memory");
+
+    return (int)tmp;
+}
+
+static inline void spin_unlock(spin_lock_t *lock)
+{
+    /* the release store clears the waiters' exclusive monitors, waking them from wfe */
+    __asm__ volatile("stlr xzr, [%0]" :: "r" (lock) : "memory");
+}
+
+typedef unsigned long spin_lock_saved_state_t;
+typedef unsigned long spin_lock_save_flags_t;
+
+enum {
+    SPIN_LOCK_FLAG_INTERRUPTS       = 1,
+};
+
+enum {
+    /* private */
+    SPIN_LOCK_STATE_RESTORE_IRQ     = 1,
+};
+
+static inline void
+spin_lock_save(spin_lock_t *lock, spin_lock_saved_state_t *statep, spin_lock_save_flags_t flags)
+{
+    spin_lock_saved_state_t state = 0;
+    if ((flags & SPIN_LOCK_FLAG_INTERRUPTS) && !arch_ints_disabled()) {
+        state |= SPIN_LOCK_STATE_RESTORE_IRQ;
+        arch_disable_ints();
+    }
+    *statep = state;
+    spin_lock(lock);
+}
+
+static inline void
+spin_unlock_restore(spin_lock_t *lock, spin_lock_saved_state_t old_state, spin_lock_save_flags_t flags)
+{
+    spin_unlock(lock);
+    if ((flags & SPIN_LOCK_FLAG_INTERRUPTS) && (old_state & SPIN_LOCK_STATE_RESTORE_IRQ))
+        arch_enable_ints();
+}
+
 #endif // ASSEMBLY
 
@@ -28,7 +28,7 @@
 
 __BEGIN_CDECLS
 
-#define DSB __asm__ volatile("dsb" ::: "memory")
+#define DSB __asm__ volatile("dsb sy" ::: "memory")
 #define ISB __asm__ volatile("isb" ::: "memory")
 
 #define ARM64_READ_SYSREG(reg) \
@@ -62,5 +62,8 @@ struct arm64_iframe_short {
 extern void arm64_exception_base(void);
 void arm64_el3_to_el1(void);
 
+/* per cpu setup shared by the boot and secondary cpus */
+void arm64_cpu_early_init(void);
+
 __END_CDECLS
 
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <arch/ops.h>
+#include <arch/arm64.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <platform/interrupts.h>
+
+#define LOCAL_TRACE 0
+
+/* ipis are delivered as software generated interrupts, one per mp_ipi_t */
+#define GIC_IPI_BASE (14)
+
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
+{
+    LTRACEF("target 0x%x, ipi %u\n", target, ipi);
+
+    return platform_send_ipi(target, GIC_IPI_BASE + ipi);
+}
+
+static enum handler_return arm64_ipi_reschedule_handler(void *arg)
+{
+    return mp_mbx_reschedule_irq();
+}
+
+void arch_mp_init_percpu(void)
+{
+    /* sgis are banked per cpu, the handler table is shared */
+    register_int_handler(GIC_IPI_BASE + MP_IPI_RESCHEDULE, &arm64_ipi_reschedule_handler, NULL);
+    unmask_interrupt(GIC_IPI_BASE + MP_IPI_RESCHEDULE);
+}
+
+/* called from start.S on the cpu's own stack once released from the pen */
+void arm64_secondary_entry(ulong cpu_num) __NO_RETURN __EXTERNALLY_VISIBLE;
+void arm64_secondary_entry(ulong cpu_num)
+{
+    arm64_cpu_early_init();
+
+    /* the distributor is shared, but each cpu has its own interface and banked registers */
+    platform_init_percpu_interrupts();
+
+    lk_secondary_cpu_entry();
+}
@@ -28,6 +28,22 @@ MODULE_SRCS += \
 GLOBAL_DEFINES += \
 	ARCH_DEFAULT_STACK_SIZE=8192
 
+WITH_SMP ?= 1
+
+ifeq ($(WITH_SMP),1)
+SMP_MAX_CPUS ?= 4
+
+GLOBAL_DEFINES += \
+	WITH_SMP=1 \
+	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/mp.c
+else
+GLOBAL_DEFINES += \
+	SMP_MAX_CPUS=1
+endif
+
 ARCH_OPTFLAGS := -O2
 
 # try to find the toolchain
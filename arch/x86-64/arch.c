@@ -26,14 +26,43 @@
 #include <arch/x86.h>
 #include <arch/x86/mmu.h>
 #include <arch/x86/descriptor.h>
+#include <arch/x86/mp.h>
 #include <platform.h>
 #include <sys/types.h>
 #include <string.h>
 
 static tss_t system_tss;
 
+/* the boot cpu's gs base is pointed at the first entry in crt0.S */
+struct x86_percpu x86_percpu[SMP_MAX_CPUS];
+
+uint32_t x86_feature_erms;
+
+static void x86_feature_init(void)
+{
+	uint32_t a, b, c, d;
+
+	x86_cpuid(0, 0, &a, &b, &c, &d);
+	if (a < X86_CPUID_EXT_FEATURES)
+		return;
+
+	x86_cpuid(X86_CPUID_EXT_FEATURES, 0, &a, &b, &c, &d);
+	x86_feature_erms = !!(b & X86_CPUID_EXT_ERMS);
+}
+
+void x86_init_percpu(uint cpu_num)
+{
+	struct x86_percpu *percpu = &x86_percpu[cpu_num];
+
+	percpu->cpu_num = cpu_num;
+	x86_wrmsr(X86_MSR_GS_BASE, (uint64_t)percpu);
+}
+
 void arch_early_init(void)
 {
+	/* before anything large is copied, picks the string routine variants */
+	x86_feature_init();
+
 	x86_mmu_init();
 
 	platform_init_mmu_mappings();
@@ -58,6 +87,9 @@ void arch_early_init(void)
 
 void arch_init(void)
 {
+#if WITH_SMP
+	x86_mp_init();
+#endif
 }
 
 
@@ -77,3 +77,16 @@ void x86_unhandled_exception(struct x86_iframe *frame)
 {
 	exception_die(frame, "unhandled exception, halting\n");
 }
+
+enum handler_return platform_irq(struct x86_iframe *frame);
+
+/* common interrupt path, called from the stubs in crt0.S */
+void x86_irq(struct x86_iframe *frame)
+{
+	inc_critical_section();
+
+	if (platform_irq(frame) != INT_NO_RESCHEDULE)
+		thread_preempt();
+
+	dec_critical_section();
+}
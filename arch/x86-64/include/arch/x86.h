@@ -106,6 +106,33 @@ static inline void x86_ltr(uint16_t sel)
 	__asm__ __volatile__ ("ltr %%ax" :: "a" (sel));
 }
 
+static inline uint64_t x86_rdmsr(uint32_t msr)
+{
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void x86_wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm__ __volatile__ ("wrmsr" :: "c" (msr), "a" ((uint32_t)val), "d" ((uint32_t)(val >> 32)));
+}
+
+static inline void x86_cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	__asm__ __volatile__ ("cpuid"
+	                      : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+	                      : "a" (leaf), "c" (subleaf));
+}
+
+#define X86_CPUID_EXT_FEATURES  7
+#define X86_CPUID_EXT_ERMS      (1 << 9) /* leaf 7 ebx: enhanced rep movsb/stosb */
+
+/* set from cpuid in arch_early_init(), read by the libc string routines */
+extern uint32_t x86_feature_erms;
+
 static inline uint64_t x86_get_cr2(void)
 {
 	uint64_t rv;
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARCH_X86_MP_H
+#define __ARCH_X86_MP_H
+
+/* NOTE: keep crt0.S and start16.S in sync with these definitions */
+
+#define X86_MSR_GS_BASE         0xc0000101
+
+/* physical address the secondary cpu startup code is copied to */
+#define X86_AP_TRAMPOLINE_BASE  0x8000
+
+#ifndef ASSEMBLY
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <compiler.h>
+
+__BEGIN_CDECLS
+
+/* per cpu state, the gs base of each cpu points at its own copy */
+struct x86_percpu {
+	struct thread *current_thread;
+	uint cpu_num;
+	uint apic_id;
+};
+
+extern struct x86_percpu x86_percpu[SMP_MAX_CPUS];
+
+#define x86_read_percpu_u64(offset) ({ \
+	uint64_t __val; \
+	__asm__ volatile("movq %%gs:%c1, %0" : "=r" (__val) : "i" (offset)); \
+	__val; \
+})
+
+#define x86_write_percpu_u64(offset, val) \
+	__asm__ volatile("movq %0, %%gs:%c1" :: "r" ((uint64_t)(val)), "i" (offset) : "memory")
+
+#define x86_read_percpu_u32(offset) ({ \
+	uint32_t __val; \
+	__asm__ volatile("movl %%gs:%c1, %0" : "=r" (__val) : "i" (offset)); \
+	__val; \
+})
+
+/* point gs at the per cpu block for cpu_num on the running cpu */
+void x86_init_percpu(uint cpu_num);
+
+/* local apic */
+void x86_lapic_init_percpu(void);
+void x86_lapic_eoi(void);
+
+/* bring up the other cpus, called once on the boot cpu */
+void x86_mp_init(void);
+
+__END_CDECLS
+
+#endif // !ASSEMBLY
+
+#endif
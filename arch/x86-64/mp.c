@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <reg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <arch/x86.h>
+#include <arch/x86/mp.h>
+#include <kernel/thread.h>
+#include <kernel/mp.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+
+#define LOCAL_TRACE 0
+
+#define X86_MSR_APIC_BASE       0x1b
+
+/* local apic registers */
+#define LAPIC_ID                0x020
+#define LAPIC_TPR               0x080
+#define LAPIC_EOI               0x0b0
+#define LAPIC_SVR               0x0f0
+#define LAPIC_ICR_LOW           0x300
+#define LAPIC_ICR_HIGH          0x310
+
+#define LAPIC_SVR_ENABLE        (1 << 8)
+
+#define ICR_DELIVERY_FIXED      (0 << 8)
+#define ICR_DELIVERY_INIT       (5 << 8)
+#define ICR_DELIVERY_STARTUP    (6 << 8)
+#define ICR_DELIVERY_PENDING    (1 << 12)
+#define ICR_LEVEL_ASSERT        (1 << 14)
+#define ICR_TRIGGER_LEVEL       (1 << 15)
+#define ICR_DEST_ALL_BUT_SELF   (3 << 18)
+
+/* provided by start16.S */
+extern char x86_ap_trampoline[];
+extern char x86_ap_trampoline_end[];
+extern uint32_t x86_ap_trampoline_cr0;
+extern uint32_t x86_ap_trampoline_cr3;
+extern uint32_t x86_ap_trampoline_cr4;
+
+/* read by the trampoline as each cpu comes up, it takes the next number and the stack that goes with it */
+volatile int x86_ap_next_cpu = 1;
+vaddr_t x86_ap_stacks[SMP_MAX_CPUS];
+
+static addr_t lapic_base;
+
+static inline uint32_t lapic_read(uint reg)
+{
+	return *REG32(lapic_base + reg);
+}
+
+static inline void lapic_write(uint reg, uint32_t val)
+{
+	*REG32(lapic_base + reg) = val;
+}
+
+static void lapic_send_ipi(uint32_t apic_id, uint32_t icr)
+{
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING)
+		;
+
+	lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, icr);
+
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING)
+		;
+}
+
+void x86_lapic_eoi(void)
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+void x86_lapic_init_percpu(void)
+{
+	if (lapic_base == 0) {
+		lapic_base = x86_rdmsr(X86_MSR_APIC_BASE) & ~0xfffULL;
+
+		/* crt0.S only maps the top gigabyte of the 4GB space uncached */
+		ASSERT(lapic_base >= 0xc0000000 && lapic_base < 0x100000000ULL);
+	}
+
+	/* accept everything and turn it on */
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INT_APIC_SPURIOUS);
+
+	x86_percpu[arch_curr_cpu_num()].apic_id = lapic_read(LAPIC_ID) >> 24;
+}
+
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
+{
+	LTRACEF("target 0x%x, ipi %u\n", target, ipi);
+
+	DEBUG_ASSERT(ipi == MP_IPI_RESCHEDULE);
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (target & (1U << cpu))
+			lapic_send_ipi(x86_percpu[cpu].apic_id, ICR_LEVEL_ASSERT | ICR_DELIVERY_FIXED | INT_IPI_RESCHEDULE);
+	}
+
+	return NO_ERROR;
+}
+
+static enum handler_return x86_ipi_reschedule_handler(void *arg)
+{
+	x86_lapic_eoi();
+
+	return mp_mbx_reschedule_irq();
+}
+
+void arch_mp_init_percpu(void)
+{
+	/* the handler table is shared, the boot cpu registered the ipi handler */
+}
+
+/* called from start16.S on the new cpu's own stack, interrupts disabled */
+void x86_secondary_entry(uint cpu_num) __NO_RETURN __EXTERNALLY_VISIBLE;
+void x86_secondary_entry(uint cpu_num)
+{
+	x86_init_percpu(cpu_num);
+
+	/* enable caches, the boot cpu does the same in arch_early_init */
+	clear_in_cr0(X86_CR0_NW | X86_CR0_CD);
+
+	x86_lapic_init_percpu();
+
+	lk_secondary_cpu_entry();
+}
+
+void x86_mp_init(void)
+{
+	uint64_t cr;
+	size_t trampoline_len = x86_ap_trampoline_end - x86_ap_trampoline;
+
+	x86_lapic_init_percpu();
+
+	register_int_handler(INT_IPI_RESCHEDULE, &x86_ipi_reschedule_handler, NULL);
+
+	/* allocate a boot stack for every cpu we're willing to run */
+	for (uint i = 1; i < SMP_MAX_CPUS; i++) {
+		void *stack = malloc(ARCH_DEFAULT_STACK_SIZE);
+		if (!stack) {
+			dprintf(CRITICAL, "x86_mp_init: failed to allocate stack for cpu %u\n", i);
+			return;
+		}
+		x86_ap_stacks[i] = ROUNDDOWN((vaddr_t)stack + ARCH_DEFAULT_STACK_SIZE, 16);
+	}
+
+	/* the new cpus start in real mode, give them the boot cpu's control registers to switch with */
+	__asm__ volatile("mov %%cr0, %0" : "=r" (cr));
+	x86_ap_trampoline_cr0 = cr;
+	__asm__ volatile("mov %%cr3, %0" : "=r" (cr));
+	x86_ap_trampoline_cr3 = cr;
+	__asm__ volatile("mov %%cr4, %0" : "=r" (cr));
+	x86_ap_trampoline_cr4 = cr;
+
+	DEBUG_ASSERT(trampoline_len <= 4096);
+	memcpy((void *)X86_AP_TRAMPOLINE_BASE, x86_ap_trampoline, trampoline_len);
+
+	LTRACEF("trampoline %zu bytes, sending INIT\n", trampoline_len);
+
+	/* INIT then two STARTUPs to everyone but us, per the MP spec */
+	lapic_send_ipi(0, ICR_DEST_ALL_BUT_SELF | ICR_TRIGGER_LEVEL | ICR_LEVEL_ASSERT | ICR_DELIVERY_INIT);
+	thread_sleep(10);
+
+	for (int i = 0; i < 2; i++) {
+		lapic_send_ipi(0, ICR_DEST_ALL_BUT_SELF | ICR_LEVEL_ASSERT | ICR_DELIVERY_STARTUP |
+		               (X86_AP_TRAMPOLINE_BASE >> 12));
+		spin(200);
+	}
+
+	/* give them a moment to check in */
+	lk_time_t start = current_time();
+	while (current_time() - start < 100) {
+		if (__builtin_popcount(mp_get_active_mask()) >= SMP_MAX_CPUS)
+			break;
+		thread_sleep(10);
+	}
+
+	dprintf(INFO, "x86_mp_init: %d of %d cpus found, %d active\n",
+	        MIN(x86_ap_next_cpu, SMP_MAX_CPUS), SMP_MAX_CPUS, __builtin_popcount(mp_get_active_mask()));
+}
@@ -17,6 +17,23 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/faults.c \
 	$(LOCAL_DIR)/descriptor.c
 
+WITH_SMP ?= 1
+
+ifeq ($(WITH_SMP),1)
+SMP_MAX_CPUS ?= 4
+
+GLOBAL_DEFINES += \
+	WITH_SMP=1 \
+	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/mp.c \
+	$(LOCAL_DIR)/start16.S
+else
+GLOBAL_DEFINES += \
+	SMP_MAX_CPUS=1
+endif
+
 # set the default toolchain to x86 elf and set a #define
 ifndef TOOLCHAIN_PREFIX
 TOOLCHAIN_PREFIX := x86_64-elf-
@@ -37,18 +37,16 @@ struct context_switch_frame {
 	uint64_t rip;
 };
 
-/* we're uniprocessor at this point for x86-64, so store a global pointer to the current thread */
-struct thread *_current_thread;
-
 static void initial_thread_func(void) __NO_RETURN;
 static void initial_thread_func(void)
 {
 	int ret;
+	thread_t *ct = get_current_thread();
 
 	/* exit the implicit critical section we're within */
 	exit_critical_section();
 
-	ret = _current_thread->entry(_current_thread->arg);
+	ret = ct->entry(ct->arg);
 
 	thread_exit(ret);
 }
@@ -53,7 +53,7 @@ static inline inline bool arch_ints_disabled(void)
 	   : "=a" (state)
 	   :: "memory");
 
-	return !!(state & (1<<9));
+	return !(state & (1<<9));
 }
 
 int _atomic_and(volatile int *ptr, int val);
@@ -110,6 +110,80 @@ static inline void set_current_thread(struct thread *t)
     _current_thread = t;
 }
 
+static inline uint arch_curr_cpu_num(void)
+{
+	return 0;
+}
+
+/* spinlocks */
+typedef unsigned long spin_lock_t;
+
+#define SPIN_LOCK_INITIAL_VALUE (0)
+
+/* interrupts should already be disabled */
+static inline void spin_lock(spin_lock_t *lock)
+{
+	unsigned long val = 1;
+
+	for (;;) {
+		__asm__ volatile("xchgl %0, %1" : "+r" (val), "+m" (*lock) :: "memory");
+		if (val == 0)
+			return;
+
+		while (*(volatile spin_lock_t *)lock)
+			__asm__ volatile("pause");
+		val = 1;
+	}
+}
+
+/* returns 0 on success, non-0 on failure */
+static inline int spin_trylock(spin_lock_t *lock)
+{
+	unsigned long val = 1;
+
+	__asm__ volatile("xchgl %0, %1" : "+r" (val), "+m" (*lock) :: "memory");
+
+	return (int)val;
+}
+
+static inline void spin_unlock(spin_lock_t *lock)
+{
+	CF;
+	*(volatile spin_lock_t *)lock = 0;
+}
+
+typedef ulong spin_lock_saved_state_t;
+typedef ulong spin_lock_save_flags_t;
+
+enum {
+	SPIN_LOCK_FLAG_INTERRUPTS       = 1,
+};
+
+enum {
+	/* private */
+	SPIN_LOCK_STATE_RESTORE_IRQ     = 1,
+};
+
+static inline void
+spin_lock_save(spin_lock_t *lock, spin_lock_saved_state_t *statep, spin_lock_save_flags_t flags)
+{
+	spin_lock_saved_state_t state = 0;
+	if ((flags & SPIN_LOCK_FLAG_INTERRUPTS) && !arch_ints_disabled()) {
+		state |= SPIN_LOCK_STATE_RESTORE_IRQ;
+		arch_disable_ints();
+	}
+	*statep = state;
+	spin_lock(lock);
+}
+
+static inline void
+spin_unlock_restore(spin_lock_t *lock, spin_lock_saved_state_t old_state, spin_lock_save_flags_t flags)
+{
+	spin_unlock(lock);
+	if ((flags & SPIN_LOCK_FLAG_INTERRUPTS) && (old_state & SPIN_LOCK_STATE_RESTORE_IRQ))
+		arch_enable_ints();
+}
+
 #endif // !ASSEMBLY
 
 #endif
@@ -26,7 +26,22 @@
 #include <sys/types.h>
 #include <dev/virtio.h>
 
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) __NONNULL();
 
+/* completion callback for queued requests, called in interrupt context with
+ * the number of bytes transferred or an error */
+typedef void (*virtio_block_callback_t)(struct virtio_device *dev, void *arg, ssize_t result);
+
+/* queue a request without waiting for it, returns ERR_BUSY if the ring is full */
+status_t virtio_block_queue(struct virtio_device *dev, uint32_t type, void *buf, off_t offset, size_t len,
+                            virtio_block_callback_t callback, void *callback_arg);
+
+/* synchronous helpers, large transfers are split and issued in parallel */
 ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, size_t len);
+ssize_t virtio_block_write(struct virtio_device *dev, const void *buf, off_t offset, size_t len);
+status_t virtio_block_flush(struct virtio_device *dev);
 
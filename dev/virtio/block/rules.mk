@@ -9,6 +9,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/virtio-block.c
 
 MODULE_DEPS += \
-	dev/virtio
+	dev/virtio \
+	lib/bio
 
 include make/module.mk
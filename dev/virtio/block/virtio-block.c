@@ -28,6 +28,10 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lib/bio.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/vm.h>
@@ -61,17 +65,61 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_SCSI     (1<<7)
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 
-#define VIRTIO_BLK_T_IN         0
-#define VIRTIO_BLK_T_OUT        1
-#define VIRTIO_BLK_T_FLUSH      4
-
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
-static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+/* features we know how to drive */
+#define VIRTIO_BLK_DRIVER_FEATURES \
+    (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH)
+
+#define VIRTIO_BLK_RING_LEN     128
+#define VIRTIO_BLK_SECTOR_SIZE  512
+
+/* largest single request the synchronous path will issue, bigger transfers
+ * are split and the pieces are put in flight together */
+#define VIRTIO_BLK_MAX_XFER     (64 * 1024)
+
+/* one per outstanding request, indexed by the head descriptor of its chain.
+ * The array is page aligned and each entry is a power of 2 in size, so the
+ * header and status the device touches never straddle a page. */
+struct virtio_block_txn {
+    struct virtio_blk_req req;
+    uint8_t status;
+
+    size_t len;
+    virtio_block_callback_t callback;
+    void *callback_arg;
+} __ALIGNED(64);
+
+STATIC_ASSERT(sizeof(struct virtio_block_txn) == 64);
+
+struct virtio_block_dev {
+    struct list_node node;
+    struct virtio_device *dev;
+    bdev_t bdev;
+
+    uint32_t features;
+    size_t max_seg_size;
+    size_t max_xfer;
 
-static event_t *curr_event;
+    struct virtio_block_txn *txns;
+
+    /* signaled when a retired request hands its descriptors back to the ring */
+    event_t desc_event;
+
+    /* stats */
+    uint inflight;
+    uint max_inflight;
+    uint64_t requests;
+    uint64_t ring_full;
+};
+
+static struct list_node virtio_block_list = LIST_INITIAL_VALUE(virtio_block_list);
+
+static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
+static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
 {
@@ -84,19 +132,80 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     LTRACEF("seg_max  0x%x\n", config->seg_max);
     LTRACEF("blk_size 0x%x\n", config->blk_size);
 
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
+    if (!bdev)
+        return ERR_NO_MEMORY;
+
+    bdev->txns = memalign(PAGE_SIZE, VIRTIO_BLK_RING_LEN * sizeof(struct virtio_block_txn));
+    if (!bdev->txns) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    memset(bdev->txns, 0, VIRTIO_BLK_RING_LEN * sizeof(struct virtio_block_txn));
+
+    bdev->dev = dev;
+    bdev->features = host_features & VIRTIO_BLK_DRIVER_FEATURES;
+    event_init(&bdev->desc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    dev->priv = bdev;
+
+    virtio_set_guest_features(dev, bdev->features);
+
+    /* work out how big a single descriptor and a single request may be */
+    bdev->max_seg_size = SIZE_MAX;
+    if ((bdev->features & VIRTIO_BLK_F_SIZE_MAX) && config->size_max > 0)
+        bdev->max_seg_size = config->size_max;
+
+    /* a chain is header + data segments + status, and data segments are
+     * never longer than a page, so the seg limit bounds the request size */
+    bdev->max_xfer = VIRTIO_BLK_MAX_XFER;
+    if ((bdev->features & VIRTIO_BLK_F_SEG_MAX) && config->seg_max > 1)
+        bdev->max_xfer = MIN(bdev->max_xfer, (config->seg_max - 1) * PAGE_SIZE);
+
+    size_t block_size = VIRTIO_BLK_SECTOR_SIZE;
+    if ((bdev->features & VIRTIO_BLK_F_BLK_SIZE) && config->blk_size >= VIRTIO_BLK_SECTOR_SIZE)
+        block_size = config->blk_size;
+    bdev->max_xfer = ROUNDDOWN(bdev->max_xfer, block_size);
+
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 128);
+    status_t err = virtio_alloc_ring(dev, 0, VIRTIO_BLK_RING_LEN);
+    if (err < 0) {
+        free(bdev->txns);
+        free(bdev);
+        dev->priv = NULL;
+        return err;
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
 
+    /* publish it to the block io layer */
+    char name[16];
+    snprintf(name, sizeof(name), "virtio%u", dev->index);
+
+    uint64_t count = config->capacity * VIRTIO_BLK_SECTOR_SIZE / block_size;
+    bio_initialize_bdev(&bdev->bdev, name, block_size, count);
+
+    bdev->bdev.read_block = &virtio_bdev_read_block;
+    bdev->bdev.write_block = &virtio_bdev_write_block;
+
+    bio_register_device(&bdev->bdev);
+    list_add_tail(&virtio_block_list, &bdev->node);
+
+    printf("virtio-block %s: %llu blocks of %zu bytes%s\n", name, count, block_size,
+           (bdev->features & VIRTIO_BLK_F_RO) ? " (read only)" : "");
+
     return NO_ERROR;
 }
 
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
 {
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    DEBUG_ASSERT(e->id < VIRTIO_BLK_RING_LEN);
+    struct virtio_block_txn *txn = &bdev->txns[e->id];
+
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
     for (;;) {
@@ -117,88 +226,327 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(curr_event, false);
+    LTRACEF("status 0x%hhx\n", txn->status);
+
+    status_t err;
+    switch (txn->status) {
+        case VIRTIO_BLK_S_OK:
+            err = NO_ERROR;
+            break;
+        case VIRTIO_BLK_S_UNSUPP:
+            err = ERR_NOT_SUPPORTED;
+            break;
+        default:
+            err = ERR_IO;
+            break;
+    }
+
+    /* retire the transaction before the callback so it may queue a new one */
+    virtio_block_callback_t callback = txn->callback;
+    void *callback_arg = txn->callback_arg;
+    size_t len = txn->len;
+    txn->callback = NULL;
+    bdev->inflight--;
+
+    if (callback)
+        callback(dev, callback_arg, (err < 0) ? err : (ssize_t)len);
+
+    /* let anyone waiting for descriptors try again */
+    event_signal(&bdev->desc_event, false);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, size_t len)
+/* number of descriptors needed to describe a buffer, one per page touched */
+static uint virtio_block_buf_segs(const void *buf, size_t len)
 {
-    uint16_t i;
-    struct vring_desc *desc;
+    if (len == 0)
+        return 0;
+
+    vaddr_t va = (vaddr_t)buf;
+    return ((va + len - 1) / PAGE_SIZE) - (va / PAGE_SIZE) + 1;
+}
+
+static paddr_t virtio_block_vaddr_to_paddr(const void *ptr)
+{
+#if WITH_KERNEL_VM
     paddr_t pa;
+    status_t err = arch_mmu_query((vaddr_t)ptr, &pa, NULL);
+    DEBUG_ASSERT(err >= 0);
+    return pa;
+#else
+    return (paddr_t)(uintptr_t)ptr;
+#endif
+}
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+/* append descriptors covering a buffer to the chain, splitting it wherever
+ * the physical mapping is not contiguous */
+static void virtio_block_add_buf(struct virtio_block_dev *bdev, struct vring_desc **last, uint16_t *head,
+                                 const void *buf, size_t len, uint16_t flags)
+{
+    struct virtio_device *dev = bdev->dev;
+    struct vring_desc *desc = NULL;
+    const uint8_t *ptr = (const uint8_t *)buf;
 
-    /* set up the request */
-    struct virtio_blk_req blk_req;
-    blk_req.type = VIRTIO_BLK_T_IN;
-    blk_req.ioprio = 0;
-    blk_req.sector = offset / 512;
+    while (len > 0) {
+        size_t seg_len = MIN(len, PAGE_SIZE - ((vaddr_t)ptr % PAGE_SIZE));
+        paddr_t pa = virtio_block_vaddr_to_paddr(ptr);
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+        /* extend the previous descriptor if this page follows it physically */
+        if (desc && desc->addr + desc->len == pa && desc->len + seg_len <= bdev->max_seg_size) {
+            desc->len += seg_len;
+        } else {
+            uint16_t i = virtio_alloc_desc(dev, 0);
+            DEBUG_ASSERT(i != 0xffff);
+
+            desc = virtio_desc_index_to_desc(dev, 0, i);
+            desc->addr = (uint64_t)pa;
+            desc->len = seg_len;
+            desc->flags = flags;
+            desc->next = 0;
+
+            if (*last) {
+                (*last)->flags |= VRING_DESC_F_NEXT;
+                (*last)->next = i;
+            } else {
+                *head = i;
+            }
+            *last = desc;
+        }
 
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
+        ptr += seg_len;
+        len -= seg_len;
+    }
+}
 
-    /* set up the descriptor pointing to the head */
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)&blk_req, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)&blk_req;
-#endif
-    desc->len = sizeof(blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
-    virtio_dump_desc(desc);
+status_t virtio_block_queue(struct virtio_device *dev, uint32_t type, void *buf, off_t offset, size_t len,
+                            virtio_block_callback_t callback, void *callback_arg)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)buf, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-#endif
-    desc->len = len;
-    desc->flags |= VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
-    virtio_dump_desc(desc);
+    LTRACEF("dev %p, type %u, buf %p, offset 0x%llx, len %zu\n", dev, type, buf, offset, len);
 
-    /* set up the descriptor pointing to the response */
-    uint8_t blk_response;
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)&blk_response, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)&blk_response;
-#endif
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
-    virtio_dump_desc(desc);
+    DEBUG_ASSERT(bdev);
+    DEBUG_ASSERT((offset % VIRTIO_BLK_SECTOR_SIZE) == 0);
 
-    /* set up an event to block on */
-    event_t event;
-    event_init(&event, false, 0);
-    curr_event = &event;
+    switch (type) {
+        case VIRTIO_BLK_T_IN:
+            break;
+        case VIRTIO_BLK_T_OUT:
+            if (bdev->features & VIRTIO_BLK_F_RO)
+                return ERR_NOT_ALLOWED;
+            break;
+        case VIRTIO_BLK_T_FLUSH:
+            if ((bdev->features & VIRTIO_BLK_F_FLUSH) == 0)
+                return ERR_NOT_SUPPORTED;
+            len = 0;
+            break;
+        default:
+            return ERR_INVALID_ARGS;
+    }
+
+    /* header + data + status */
+    uint needed = virtio_block_buf_segs(buf, len) + 2;
+    if (needed > VIRTIO_BLK_RING_LEN)
+        return ERR_TOO_BIG;
+
+    enter_critical_section();
+
+    // XXX not cache safe.
+    // At the moment only tested on qemu, which doesn't emulate cache.
+
+    if (dev->ring[0].free_count < needed) {
+        bdev->ring_full++;
+        exit_critical_section();
+        return ERR_BUSY;
+    }
+
+    /* the head descriptor picks the transaction slot, so grab it by hand */
+    uint16_t head = virtio_alloc_desc(dev, 0);
+    DEBUG_ASSERT(head != 0xffff);
+    struct virtio_block_txn *txn = &bdev->txns[head];
+
+    txn->req.type = type;
+    txn->req.ioprio = 0;
+    txn->req.sector = offset / VIRTIO_BLK_SECTOR_SIZE;
+    txn->status = 0xff;
+    txn->len = len;
+    txn->callback = callback;
+    txn->callback_arg = callback_arg;
+
+    /* set up the descriptor pointing to the header */
+    struct vring_desc *last = virtio_desc_index_to_desc(dev, 0, head);
+    last->addr = (uint64_t)virtio_block_vaddr_to_paddr(&txn->req);
+    last->len = sizeof(txn->req);
+    last->flags = 0;
+    last->next = 0;
+
+    /* the data buffer, device writes into it for reads */
+    if (len > 0)
+        virtio_block_add_buf(bdev, &last, &head, buf, len, (type == VIRTIO_BLK_T_IN) ? VRING_DESC_F_WRITE : 0);
+
+    /* and the status byte */
+    virtio_block_add_buf(bdev, &last, &head, &txn->status, 1, VRING_DESC_F_WRITE);
+
+    bdev->requests++;
+    bdev->inflight++;
+    if (bdev->inflight > bdev->max_inflight)
+        bdev->max_inflight = bdev->inflight;
 
     /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+    virtio_submit_chain(dev, 0, head);
 
     /* kick it off */
     virtio_kick(dev, 0);
 
-    /* wait for the transfer to complete */
-    event_wait(&event);
+    exit_critical_section();
+
+    return NO_ERROR;
+}
+
+/* state shared by the pieces of one synchronous transfer */
+struct virtio_block_sync {
+    event_t event;
+    uint outstanding;
+    status_t err;
+};
+
+static void virtio_block_sync_callback(struct virtio_device *dev, void *arg, ssize_t result)
+{
+    struct virtio_block_sync *sync = (struct virtio_block_sync *)arg;
 
-    LTRACEF("status 0x%hhx\n", blk_response);
+    if (result < 0 && sync->err >= 0)
+        sync->err = result;
 
-    return len;
+    DEBUG_ASSERT(sync->outstanding > 0);
+    if (--sync->outstanding == 0)
+        event_signal(&sync->event, false);
 }
 
+/* queue a request, waiting for descriptors to come back if the ring is full */
+static status_t virtio_block_queue_wait(struct virtio_device *dev, uint32_t type, void *buf, off_t offset, size_t len,
+                                        struct virtio_block_sync *sync)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    /* account for the piece before it can possibly complete */
+    enter_critical_section();
+    sync->outstanding++;
+    exit_critical_section();
+
+    for (;;) {
+        status_t err = virtio_block_queue(dev, type, buf, offset, len, &virtio_block_sync_callback, sync);
+        if (err != ERR_BUSY) {
+            if (err < 0) {
+                enter_critical_section();
+                sync->outstanding--;
+                exit_critical_section();
+            }
+            return err;
+        }
+
+        event_wait(&bdev->desc_event);
+    }
+}
+
+static ssize_t virtio_block_transfer(struct virtio_device *dev, uint32_t type, void *buf, off_t offset, size_t len)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    struct virtio_block_sync sync;
+
+    event_init(&sync.event, false, 0);
+    sync.outstanding = 1; /* held by us until everything is queued */
+    sync.err = NO_ERROR;
+
+    /* split the transfer and let every piece be in flight at once */
+    size_t pos = 0;
+    do {
+        size_t chunk = MIN(len - pos, bdev->max_xfer);
+        status_t err = virtio_block_queue_wait(dev, type, (uint8_t *)buf + pos, offset + pos, chunk, &sync);
+        if (err < 0) {
+            sync.err = err;
+            break;
+        }
+        pos += chunk;
+    } while (pos < len);
+
+    /* drop our reference and wait for the device to catch up */
+    enter_critical_section();
+    bool done = (--sync.outstanding == 0);
+    exit_critical_section();
+
+    if (!done)
+        event_wait(&sync.event);
+
+    event_destroy(&sync.event);
+
+    return (sync.err < 0) ? sync.err : (ssize_t)len;
+}
+
+ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, size_t len)
+{
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    return virtio_block_transfer(dev, VIRTIO_BLK_T_IN, buf, offset, len);
+}
+
+ssize_t virtio_block_write(struct virtio_device *dev, const void *buf, off_t offset, size_t len)
+{
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    return virtio_block_transfer(dev, VIRTIO_BLK_T_OUT, (void *)buf, offset, len);
+}
+
+status_t virtio_block_flush(struct virtio_device *dev)
+{
+    LTRACEF("dev %p\n", dev);
+
+    ssize_t err = virtio_block_transfer(dev, VIRTIO_BLK_T_FLUSH, NULL, 0, 0);
+
+    return (err < 0) ? err : NO_ERROR;
+}
+
+static ssize_t virtio_bdev_read_block(struct bdev *_bdev, void *buf, bnum_t block, uint count)
+{
+    struct virtio_block_dev *bdev = containerof(_bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, buf %p, block %u, count %u\n", bdev->dev, buf, block, count);
+
+    return virtio_block_read(bdev->dev, buf, (off_t)block * _bdev->block_size, (size_t)count * _bdev->block_size);
+}
+
+static ssize_t virtio_bdev_write_block(struct bdev *_bdev, const void *buf, bnum_t block, uint count)
+{
+    struct virtio_block_dev *bdev = containerof(_bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, buf %p, block %u, count %u\n", bdev->dev, buf, block, count);
+
+    return virtio_block_write(bdev->dev, buf, (off_t)block * _bdev->block_size, (size_t)count * _bdev->block_size);
+}
+
+static void virtio_block_dump(struct virtio_block_dev *bdev)
+{
+    struct virtio_device *dev = bdev->dev;
+
+    printf("virtio-block %s: features 0x%x, max xfer %zu\n", bdev->bdev.name, bdev->features, bdev->max_xfer);
+    printf("\trequests %llu, in flight %u (max %u), ring full %llu, free descriptors %u\n",
+           bdev->requests, bdev->inflight, bdev->max_inflight, bdev->ring_full, dev->ring[0].free_count);
+}
+
+#if defined(WITH_LIB_CONSOLE)
+#include <lib/console.h>
+
+static int cmd_virtio_block(int argc, const cmd_args *argv)
+{
+    struct virtio_block_dev *bdev;
+    list_for_every_entry(&virtio_block_list, bdev, struct virtio_block_dev, node) {
+        virtio_block_dump(bdev);
+    }
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("virtio_blk", "dump virtio block devices", &cmd_virtio_block)
+STATIC_COMMAND_END(virtio_block);
+#endif
@@ -31,7 +31,9 @@
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[]);
 
-#define MAX_VIRTIO_RINGS 4
+/* enough for a multiqueue net device with a handful of queue pairs plus its
+ * control queue */
+#define MAX_VIRTIO_RINGS 16
 
 struct virtio_mmio_config;
 
@@ -76,3 +78,6 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
 
 void virtio_kick(struct virtio_device *dev, uint ring_idnex);
 
+/* write the subset of host features the driver understands back to the device */
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features);
+
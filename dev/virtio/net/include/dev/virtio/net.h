@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+#include <dev/virtio.h>
+#include <lib/pktbuf.h>
+
+status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features) __NONNULL();
+
+/* number of network devices the bus found, the calls below act on the first */
+int virtio_net_found(void);
+
+status_t virtio_net_get_mac_addr(uint8_t mac_addr[6]);
+
+/* frames are handed to the callback from the device's rx threads and the
+ * buffer goes back on the ring as soon as it returns */
+typedef void (*virtio_net_rx_callback_t)(pktbuf_t *p);
+
+/* post the rx rings and start delivering frames */
+status_t virtio_net_start(virtio_net_rx_callback_t callback);
+
+/* queue a burst of frames on one tx queue with a single kick, taking
+ * ownership of every one of them. returns the number queued, anything
+ * that could not be queued is freed and counted as a drop */
+int virtio_net_send_batch(pktbuf_t **p, uint count);
+
+/* minip tx_func, use with the flags from virtio_net_minip_tx_flags() */
+int virtio_net_send_minip_pkt(pktbuf_t *p);
+uint32_t virtio_net_minip_tx_flags(void);
+
+/* register the device with the lwip netif glue and start it, the caller
+ * must have already called tcpip_init() */
+status_t virtio_net_netif_add(void);
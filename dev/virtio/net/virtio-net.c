@@ -0,0 +1,970 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <dev/virtio/net.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <compiler.h>
+#include <list.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rand.h>
+#include <arch/arm.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/vm.h>
+#include <lib/minip.h>
+
+#if WITH_LIB_LWIP
+#include <dev/class/netif.h>
+#include <lwip/pbuf.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+struct virtio_net_config {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+} __PACKED;
+
+/* precedes every frame in both directions */
+struct virtio_net_hdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers; /* only present with VIRTIO_NET_F_MRG_RXBUF */
+} __PACKED;
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VIRTIO_NET_HDR_GSO_NONE     0
+#define VIRTIO_NET_HDR_GSO_TCPV4    1
+
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} __PACKED;
+
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define VIRTIO_NET_OK   0
+#define VIRTIO_NET_ERR  1
+
+#define VIRTIO_NET_F_CSUM       (1<<0)
+#define VIRTIO_NET_F_GUEST_CSUM (1<<1)
+#define VIRTIO_NET_F_MAC        (1<<5)
+#define VIRTIO_NET_F_GUEST_TSO4 (1<<7)
+#define VIRTIO_NET_F_HOST_TSO4  (1<<11)
+#define VIRTIO_NET_F_MRG_RXBUF  (1<<15)
+#define VIRTIO_NET_F_STATUS     (1<<16)
+#define VIRTIO_NET_F_CTRL_VQ    (1<<17)
+#define VIRTIO_NET_F_MQ         (1<<22)
+
+#define VIRTIO_NET_S_LINK_UP    1
+
+/* features we know how to drive. GUEST_TSO4 is left off since neither stack
+ * can take a frame larger than a pktbuf, which also keeps every received
+ * frame in a single buffer when MRG_RXBUF is on. */
+#define VIRTIO_NET_DRIVER_FEATURES \
+    (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MAC | VIRTIO_NET_F_HOST_TSO4 | \
+     VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ)
+
+#define VIRTIO_NET_MAX_QUEUE_PAIRS  4
+#define VIRTIO_NET_RX_RING_LEN      128
+#define VIRTIO_NET_TX_RING_LEN      128
+
+/* pktbufs carved out per device, enough to fill every rx ring with room
+ * left over for the stack to build frames in */
+#define VIRTIO_NET_TX_PKTBUFS       128
+
+/* received frames start here in the pktbuf, which puts the ip header
+ * behind the 14 byte ethernet header on a 4 byte boundary */
+#define VIRTIO_NET_RX_FRAME_OFFSET  14
+
+#define VIRTIO_NET_MTU              1500
+
+/* how long a full tx ring may hold up a sender before frames are dropped */
+#define VIRTIO_NET_TX_TIMEOUT       100
+
+/* rx queue n is ring 2n, tx queue n is ring 2n + 1 */
+#define VIRTIO_NET_RX_RING(q)       ((q) * 2)
+#define VIRTIO_NET_TX_RING(q)       ((q) * 2 + 1)
+
+struct virtio_net_dev;
+
+struct virtio_net_rxq {
+    struct virtio_net_dev *ndev;
+    uint ring;
+
+    /* buffer posted behind each head descriptor */
+    pktbuf_t *bufs[VIRTIO_NET_RX_RING_LEN];
+
+    /* buffers the device filled, waiting for the rx thread */
+    struct list_node done_list;
+    event_t event;
+    thread_t *thread;
+
+    /* stats */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t wakeups;
+    uint max_batch;
+    uint64_t csum_valid;
+    uint64_t oversize;
+    uint64_t dropped;
+};
+
+struct virtio_net_txq {
+    uint ring;
+
+    /* header and frame of each chain in flight, indexed by head descriptor */
+    struct virtio_net_hdr *hdrs;
+    pktbuf_t *pkts[VIRTIO_NET_TX_RING_LEN];
+
+    /* signaled by completions while a sender waits for descriptors */
+    event_t desc_event;
+    bool waiting;
+
+    /* stats */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t kicks;
+    uint64_t csum_offload;
+    uint64_t gso;
+    uint64_t ring_full;
+    uint64_t dropped;
+};
+
+/* control queue command, one outstanding at a time */
+struct virtio_net_ctrl {
+    struct virtio_net_ctrl_hdr hdr;
+    uint16_t data;
+    uint8_t ack;
+} __PACKED;
+
+struct virtio_net_dev {
+    struct list_node node;
+    struct virtio_device *dev;
+    char name[16];
+
+    uint32_t features;
+    size_t hdr_len;
+    uint8_t mac[6];
+    bool started;
+
+    /* queue pairs in use, and how many the device has. the control queue
+     * comes after all of the device's pairs, used or not */
+    uint queue_pairs;
+    uint max_queue_pairs;
+    uint ctrl_ring;
+
+    struct virtio_net_rxq rxq[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    struct virtio_net_txq txq[VIRTIO_NET_MAX_QUEUE_PAIRS];
+
+    struct virtio_net_ctrl *ctrl;
+    event_t ctrl_event;
+
+    /* where received frames go */
+    virtio_net_rx_callback_t rx_callback;
+#if WITH_LIB_LWIP
+    struct device netif_dev;
+    struct netstack_state *netstack_state;
+#endif
+};
+
+static struct list_node virtio_net_list = LIST_INITIAL_VALUE(virtio_net_list);
+
+static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+
+static paddr_t virtio_net_vaddr_to_paddr(const void *ptr)
+{
+#if WITH_KERNEL_VM
+    paddr_t pa;
+    status_t err = arch_mmu_query((vaddr_t)ptr, &pa, NULL);
+    DEBUG_ASSERT(err >= 0);
+    return pa;
+#else
+    return (paddr_t)(uintptr_t)ptr;
+#endif
+}
+
+static struct virtio_net_dev *virtio_net_first(void)
+{
+    return list_peek_head_type(&virtio_net_list, struct virtio_net_dev, node);
+}
+
+/* carve a physically contiguous block into pktbufs for the global pool */
+static status_t virtio_net_create_pktbufs(uint count)
+{
+    size_t size = count * PKTBUF_SIZE;
+
+#if WITH_KERNEL_VM
+    void *ptr;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_net_pktbufs", size, &ptr, 0, 0,
+                                        ARCH_MMU_FLAG_CACHED);
+    if (err < 0)
+        return err;
+#else
+    void *ptr = memalign(PKTBUF_SIZE, size);
+    if (!ptr)
+        return ERR_NO_MEMORY;
+#endif
+
+    paddr_t pa = virtio_net_vaddr_to_paddr(ptr);
+    for (uint i = 0; i < count; i++)
+        pktbuf_create((uint8_t *)ptr + i * PKTBUF_SIZE, pa + i * PKTBUF_SIZE, PKTBUF_SIZE);
+
+    return NO_ERROR;
+}
+
+status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
+{
+    LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
+
+    volatile struct virtio_net_config *config = (struct virtio_net_config *)dev->config_ptr;
+
+    struct virtio_net_dev *ndev = calloc(1, sizeof(struct virtio_net_dev));
+    if (!ndev)
+        return ERR_NO_MEMORY;
+
+    ndev->dev = dev;
+    ndev->features = host_features & VIRTIO_NET_DRIVER_FEATURES;
+    snprintf(ndev->name, sizeof(ndev->name), "virtio-net%u", dev->index);
+
+    /* tso needs checksum offload underneath it */
+    if (!(ndev->features & VIRTIO_NET_F_CSUM))
+        ndev->features &= ~VIRTIO_NET_F_HOST_TSO4;
+
+    /* multiqueue is driven through the control queue, which sits after every
+     * pair the device has, so only take it if that fits in our ring table */
+    ndev->queue_pairs = 1;
+    ndev->max_queue_pairs = 1;
+    if ((ndev->features & (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ)) == (VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ))
+        ndev->max_queue_pairs = MAX(config->max_virtqueue_pairs, 1);
+    if (ndev->max_queue_pairs * 2 < MAX_VIRTIO_RINGS)
+        ndev->queue_pairs = MIN(MIN(ndev->max_queue_pairs, VIRTIO_NET_MAX_QUEUE_PAIRS), SMP_MAX_CPUS);
+    if (ndev->queue_pairs < 2)
+        ndev->features &= ~(VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ);
+    ndev->ctrl_ring = ndev->max_queue_pairs * 2;
+
+    /* the header grows a buffer count when rx buffers can be merged */
+    ndev->hdr_len = (ndev->features & VIRTIO_NET_F_MRG_RXBUF) ?
+                    sizeof(struct virtio_net_hdr) : __offsetof(struct virtio_net_hdr, num_buffers);
+
+    if (ndev->features & VIRTIO_NET_F_MAC) {
+        for (uint i = 0; i < sizeof(ndev->mac); i++)
+            ndev->mac[i] = config->mac[i];
+    } else {
+        /* make one up, unicast and locally administered */
+        for (uint i = 0; i < sizeof(ndev->mac); i++)
+            ndev->mac[i] = rand() & 0xff;
+        ndev->mac[0] &= ~(1<<0);
+        ndev->mac[0] |= (1<<1);
+    }
+
+    virtio_set_guest_features(dev, ndev->features);
+
+    status_t err = NO_ERROR;
+    event_init(&ndev->ctrl_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    for (uint q = 0; q < ndev->queue_pairs; q++) {
+        struct virtio_net_rxq *rxq = &ndev->rxq[q];
+        struct virtio_net_txq *txq = &ndev->txq[q];
+
+        rxq->ndev = ndev;
+        rxq->ring = VIRTIO_NET_RX_RING(q);
+        list_initialize(&rxq->done_list);
+        event_init(&rxq->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+        txq->ring = VIRTIO_NET_TX_RING(q);
+        event_init(&txq->desc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+        /* page aligned and smaller than a page, so no header straddles one */
+        STATIC_ASSERT(VIRTIO_NET_TX_RING_LEN * sizeof(struct virtio_net_hdr) <= PAGE_SIZE);
+        txq->hdrs = memalign(PAGE_SIZE, VIRTIO_NET_TX_RING_LEN * sizeof(struct virtio_net_hdr));
+        if (!txq->hdrs) {
+            err = ERR_NO_MEMORY;
+            goto error;
+        }
+
+        err = virtio_alloc_ring(dev, rxq->ring, VIRTIO_NET_RX_RING_LEN);
+        if (err < 0)
+            goto error;
+        err = virtio_alloc_ring(dev, txq->ring, VIRTIO_NET_TX_RING_LEN);
+        if (err < 0)
+            goto error;
+    }
+
+    if (ndev->features & VIRTIO_NET_F_CTRL_VQ) {
+        ndev->ctrl = calloc(1, sizeof(struct virtio_net_ctrl));
+        if (!ndev->ctrl) {
+            err = ERR_NO_MEMORY;
+            goto error;
+        }
+
+        err = virtio_alloc_ring(dev, ndev->ctrl_ring, 4);
+        if (err < 0)
+            goto error;
+    }
+
+    /* back the rx rings and give the stack something to transmit from */
+    err = virtio_net_create_pktbufs(ndev->queue_pairs * VIRTIO_NET_RX_RING_LEN + VIRTIO_NET_TX_PKTBUFS);
+    if (err < 0)
+        goto error;
+
+    /* set our irq handler */
+    dev->irq_driver_callback = &virtio_net_irq_driver_callback;
+    dev->priv = ndev;
+
+    list_add_tail(&virtio_net_list, &ndev->node);
+
+    printf("virtio-net %s: mac %02x:%02x:%02x:%02x:%02x:%02x, features 0x%x, %u queue pair%s\n",
+           ndev->name, ndev->mac[0], ndev->mac[1], ndev->mac[2], ndev->mac[3], ndev->mac[4], ndev->mac[5],
+           ndev->features, ndev->queue_pairs, (ndev->queue_pairs > 1) ? "s" : "");
+
+    return NO_ERROR;
+
+error:
+    /* rings and pktbufs handed to the device stay allocated, the device is
+     * marked failed and never touches them */
+    for (uint q = 0; q < ndev->queue_pairs; q++)
+        free(ndev->txq[q].hdrs);
+    free(ndev->ctrl);
+    free(ndev);
+    return err;
+}
+
+/* hand a chain's descriptors back to the ring */
+static void virtio_net_free_chain(struct virtio_device *dev, uint ring, uint16_t i)
+{
+    for (;;) {
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
+        bool more = desc->flags & VRING_DESC_F_NEXT;
+        uint16_t next = desc->next;
+
+        virtio_free_desc(dev, ring, i);
+
+        if (!more)
+            break;
+        i = next;
+    }
+}
+
+static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
+{
+    struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
+
+    LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
+
+    virtio_net_free_chain(dev, ring, e->id);
+
+    if (ndev->ctrl && ring == ndev->ctrl_ring) {
+        event_signal(&ndev->ctrl_event, false);
+        return INT_RESCHEDULE;
+    }
+
+    uint q = ring / 2;
+    DEBUG_ASSERT(q < ndev->queue_pairs);
+
+    if (ring == VIRTIO_NET_TX_RING(q)) {
+        struct virtio_net_txq *txq = &ndev->txq[q];
+
+        DEBUG_ASSERT(e->id < VIRTIO_NET_TX_RING_LEN);
+        pktbuf_t *p = txq->pkts[e->id];
+        txq->pkts[e->id] = NULL;
+
+        /* may wake a thread waiting in pktbuf_alloc, which gets to run once
+         * the handler returns */
+        pktbuf_free_irq(p);
+
+        if (txq->waiting) {
+            txq->waiting = false;
+            event_signal(&txq->desc_event, false);
+        }
+        return INT_RESCHEDULE;
+    }
+
+    /* rx, queue the buffer for the rx thread which hands it up and reposts it */
+    struct virtio_net_rxq *rxq = &ndev->rxq[q];
+
+    DEBUG_ASSERT(e->id < VIRTIO_NET_RX_RING_LEN);
+    pktbuf_t *p = rxq->bufs[e->id];
+    rxq->bufs[e->id] = NULL;
+    DEBUG_ASSERT(p);
+
+    p->dlen = e->len;
+    list_add_tail(&rxq->done_list, &p->list);
+    event_signal(&rxq->event, false);
+
+    return INT_RESCHEDULE;
+}
+
+/* notify the device about new descriptors unless it said it is polling,
+ * returns true if it had to be told */
+static bool virtio_net_kick(struct virtio_net_dev *ndev, uint ring)
+{
+    DSB;
+    if (ndev->dev->ring[ring].used->flags & VRING_USED_F_NO_NOTIFY)
+        return false;
+
+    virtio_kick(ndev->dev, ring);
+    return true;
+}
+
+/* post an rx buffer, called in a critical section */
+static status_t virtio_net_post_rx(struct virtio_net_rxq *rxq, pktbuf_t *p)
+{
+    struct virtio_net_dev *ndev = rxq->ndev;
+    struct virtio_device *dev = ndev->dev;
+    bool merge = ndev->features & VIRTIO_NET_F_MRG_RXBUF;
+
+    /* without merged buffers the header needs a descriptor of its own */
+    if (dev->ring[rxq->ring].free_count < (merge ? 1u : 2u))
+        return ERR_NOT_READY;
+
+    uint offset = VIRTIO_NET_RX_FRAME_OFFSET - ndev->hdr_len;
+    paddr_t pa = p->phys_base + offset;
+
+    uint16_t head = virtio_alloc_desc(dev, rxq->ring);
+    struct vring_desc *desc = virtio_desc_index_to_desc(dev, rxq->ring, head);
+    desc->addr = (uint64_t)pa;
+    desc->flags = VRING_DESC_F_WRITE;
+    desc->next = 0;
+
+    if (merge) {
+        desc->len = PKTBUF_BUF_SIZE - offset;
+    } else {
+        uint16_t i = virtio_alloc_desc(dev, rxq->ring);
+        struct vring_desc *data = virtio_desc_index_to_desc(dev, rxq->ring, i);
+
+        desc->len = ndev->hdr_len;
+        desc->flags |= VRING_DESC_F_NEXT;
+        desc->next = i;
+
+        data->addr = (uint64_t)(pa + ndev->hdr_len);
+        data->len = PKTBUF_BUF_SIZE - VIRTIO_NET_RX_FRAME_OFFSET;
+        data->flags = VRING_DESC_F_WRITE;
+        data->next = 0;
+    }
+
+    rxq->bufs[head] = p;
+    virtio_submit_chain(dev, rxq->ring, head);
+
+    return NO_ERROR;
+}
+
+#if WITH_LIB_LWIP
+static void virtio_net_lwip_input(struct virtio_net_dev *ndev, pktbuf_t *p)
+{
+    struct pbuf *pb = pbuf_alloc(PBUF_RAW, p->dlen, PBUF_POOL);
+    if (!pb)
+        return;
+
+    pbuf_take(pb, p->data, p->dlen);
+    class_netstack_input(&ndev->netif_dev, ndev->netstack_state, pb);
+}
+#endif
+
+/* strip the header off a filled buffer and pass the frame up, returns false
+ * if it was dropped */
+static bool virtio_net_rx_frame(struct virtio_net_rxq *rxq, pktbuf_t *p, struct list_node *batch,
+                                struct list_node *recycle)
+{
+    struct virtio_net_dev *ndev = rxq->ndev;
+    const struct virtio_net_hdr *hdr =
+        (const struct virtio_net_hdr *)(p->buffer + VIRTIO_NET_RX_FRAME_OFFSET - ndev->hdr_len);
+
+    /* a frame spilling into more buffers is bigger than anything we asked for,
+     * so pull the rest of it off the batch and drop the lot */
+    if ((ndev->features & VIRTIO_NET_F_MRG_RXBUF) && hdr->num_buffers > 1) {
+        for (uint i = 1; i < hdr->num_buffers; i++) {
+            pktbuf_t *extra = list_remove_head_type(batch, pktbuf_t, list);
+            if (!extra)
+                break;
+            list_add_tail(recycle, &extra->list);
+        }
+        rxq->oversize++;
+        return false;
+    }
+
+    if (p->dlen < ndev->hdr_len + 14)
+        return false;
+
+    p->data = p->buffer + VIRTIO_NET_RX_FRAME_OFFSET;
+    p->dlen -= ndev->hdr_len;
+    p->next = NULL;
+    p->flags = 0;
+
+    /* frames with a partial checksum come from the host itself and are as
+     * good as verified */
+    if (hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        p->flags |= PKTBUF_FLAG_CSUM_VALID;
+        rxq->csum_valid++;
+    }
+
+    rxq->packets++;
+    rxq->bytes += p->dlen;
+
+    if (ndev->rx_callback) {
+        ndev->rx_callback(p);
+        return true;
+    }
+#if WITH_LIB_LWIP
+    if (ndev->netstack_state) {
+        virtio_net_lwip_input(ndev, p);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+static int virtio_net_rx_thread(void *arg)
+{
+    struct virtio_net_rxq *rxq = (struct virtio_net_rxq *)arg;
+    struct virtio_net_dev *ndev = rxq->ndev;
+
+    for (;;) {
+        event_wait(&rxq->event);
+        rxq->wakeups++;
+
+        /* take everything the irq queued in one go */
+        struct list_node batch = LIST_INITIAL_VALUE(batch);
+        uint count = 0;
+        pktbuf_t *p;
+
+        enter_critical_section();
+        while ((p = list_remove_head_type(&rxq->done_list, pktbuf_t, list)) != NULL) {
+            list_add_tail(&batch, &p->list);
+            count++;
+        }
+        exit_critical_section();
+
+        if (count > rxq->max_batch)
+            rxq->max_batch = count;
+
+        struct list_node recycle = LIST_INITIAL_VALUE(recycle);
+        while ((p = list_remove_head_type(&batch, pktbuf_t, list)) != NULL) {
+            if (!virtio_net_rx_frame(rxq, p, &batch, &recycle))
+                rxq->dropped++;
+            list_add_tail(&recycle, &p->list);
+        }
+
+        /* put the whole batch back on the ring behind a single kick */
+        enter_critical_section();
+        while ((p = list_remove_head_type(&recycle, pktbuf_t, list)) != NULL) {
+            status_t err = virtio_net_post_rx(rxq, p);
+            DEBUG_ASSERT(err == NO_ERROR);
+        }
+        virtio_net_kick(ndev, rxq->ring);
+        exit_critical_section();
+    }
+
+    return 0;
+}
+
+/* ask the device to spread traffic over queue pairs */
+static status_t virtio_net_set_queue_pairs(struct virtio_net_dev *ndev, uint pairs)
+{
+    struct virtio_device *dev = ndev->dev;
+    struct virtio_net_ctrl *ctrl = ndev->ctrl;
+
+    DEBUG_ASSERT(ctrl);
+
+    ctrl->hdr.class = VIRTIO_NET_CTRL_MQ;
+    ctrl->hdr.cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    ctrl->data = pairs;
+    ctrl->ack = VIRTIO_NET_ERR;
+
+    enter_critical_section();
+
+    /* command header, argument and the ack the device writes back */
+    uint16_t head;
+    struct vring_desc *desc = virtio_alloc_desc_chain(dev, ndev->ctrl_ring, 3, &head);
+    DEBUG_ASSERT(desc);
+
+    desc->addr = (uint64_t)virtio_net_vaddr_to_paddr(&ctrl->hdr);
+    desc->len = sizeof(ctrl->hdr);
+
+    desc = virtio_desc_index_to_desc(dev, ndev->ctrl_ring, desc->next);
+    desc->addr = (uint64_t)virtio_net_vaddr_to_paddr(&ctrl->data);
+    desc->len = sizeof(ctrl->data);
+
+    desc = virtio_desc_index_to_desc(dev, ndev->ctrl_ring, desc->next);
+    desc->addr = (uint64_t)virtio_net_vaddr_to_paddr(&ctrl->ack);
+    desc->len = sizeof(ctrl->ack);
+    desc->flags |= VRING_DESC_F_WRITE;
+
+    virtio_submit_chain(dev, ndev->ctrl_ring, head);
+    virtio_kick(dev, ndev->ctrl_ring);
+
+    exit_critical_section();
+
+    status_t err = event_wait_timeout(&ndev->ctrl_event, 1000);
+    if (err < 0)
+        return err;
+
+    return (ctrl->ack == VIRTIO_NET_OK) ? NO_ERROR : ERR_IO;
+}
+
+status_t virtio_net_start(virtio_net_rx_callback_t callback)
+{
+    struct virtio_net_dev *ndev = virtio_net_first();
+    if (!ndev)
+        return ERR_NOT_FOUND;
+    if (ndev->started)
+        return ERR_ALREADY_STARTED;
+
+    ndev->rx_callback = callback;
+
+    /* the device starts out on the first pair only */
+    if (ndev->queue_pairs > 1) {
+        status_t err = virtio_net_set_queue_pairs(ndev, ndev->queue_pairs);
+        if (err < 0) {
+            printf("virtio-net %s: failed to enable %u queue pairs (%d), using one\n",
+                   ndev->name, ndev->queue_pairs, err);
+            ndev->queue_pairs = 1;
+        }
+    }
+
+    for (uint q = 0; q < ndev->queue_pairs; q++) {
+        struct virtio_net_rxq *rxq = &ndev->rxq[q];
+
+        /* fill the ring, then tell the device about all of it at once */
+        uint slots = VIRTIO_NET_RX_RING_LEN;
+        if (!(ndev->features & VIRTIO_NET_F_MRG_RXBUF))
+            slots /= 2;
+
+        for (uint i = 0; i < slots; i++) {
+            pktbuf_t *p = pktbuf_alloc();
+            if (!p)
+                return ERR_NO_MEMORY;
+
+            enter_critical_section();
+            status_t err = virtio_net_post_rx(rxq, p);
+            exit_critical_section();
+            DEBUG_ASSERT(err == NO_ERROR);
+        }
+
+        enter_critical_section();
+        virtio_kick(ndev->dev, rxq->ring);
+        exit_critical_section();
+
+        char name[32];
+        snprintf(name, sizeof(name), "%s-rx%u", ndev->name, q);
+        rxq->thread = thread_create(name, &virtio_net_rx_thread, rxq, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!rxq->thread)
+            return ERR_NO_MEMORY;
+        if (ndev->queue_pairs > 1)
+            thread_set_cpu_affinity(rxq->thread, 1U << (q % SMP_MAX_CPUS));
+        thread_detach_and_resume(rxq->thread);
+    }
+
+    ndev->started = true;
+
+    return NO_ERROR;
+}
+
+/* put a frame on a tx queue, called in a critical section */
+static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, struct virtio_net_txq *txq, pktbuf_t *p)
+{
+    struct virtio_device *dev = ndev->dev;
+
+    /* header + one descriptor per segment */
+    uint needed = 1;
+    for (pktbuf_t *seg = p; seg; seg = seg->next)
+        needed++;
+    if (needed > VIRTIO_NET_TX_RING_LEN)
+        return ERR_TOO_BIG;
+
+    if ((p->flags & PKTBUF_FLAG_CSUM_PARTIAL) && !(ndev->features & VIRTIO_NET_F_CSUM))
+        return ERR_NOT_SUPPORTED;
+    if ((p->flags & PKTBUF_FLAG_GSO_TCPV4) && !(ndev->features & VIRTIO_NET_F_HOST_TSO4))
+        return ERR_NOT_SUPPORTED;
+
+    if (dev->ring[txq->ring].free_count < needed)
+        return ERR_BUSY;
+
+    uint16_t head = virtio_alloc_desc(dev, txq->ring);
+    DEBUG_ASSERT(head != 0xffff);
+
+    struct virtio_net_hdr *hdr = &txq->hdrs[head];
+    memset(hdr, 0, sizeof(*hdr));
+
+    if (p->flags & (PKTBUF_FLAG_CSUM_PARTIAL | PKTBUF_FLAG_GSO_TCPV4)) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = (p->buffer + p->csum_start) - p->data;
+        hdr->csum_offset = p->csum_offset;
+        txq->csum_offload++;
+
+        if (p->flags & PKTBUF_FLAG_GSO_TCPV4) {
+            /* headers run up to the end of the tcp header, its data offset
+             * is the high nibble of byte 12 */
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            hdr->gso_size = p->gso_size;
+            hdr->hdr_len = hdr->csum_start + ((p->data[hdr->csum_start + 12] >> 4) * 4);
+            txq->gso++;
+        }
+    }
+
+    struct vring_desc *last = virtio_desc_index_to_desc(dev, txq->ring, head);
+    last->addr = (uint64_t)virtio_net_vaddr_to_paddr(hdr);
+    last->len = ndev->hdr_len;
+    last->flags = 0;
+    last->next = 0;
+
+    for (pktbuf_t *seg = p; seg; seg = seg->next) {
+        uint16_t i = virtio_alloc_desc(dev, txq->ring);
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, txq->ring, i);
+
+        desc->addr = (uint64_t)pktbuf_data_phys(seg);
+        desc->len = seg->dlen;
+        desc->flags = 0;
+        desc->next = 0;
+
+        last->flags |= VRING_DESC_F_NEXT;
+        last->next = i;
+        last = desc;
+
+        txq->bytes += seg->dlen;
+    }
+
+    txq->pkts[head] = p;
+    txq->packets++;
+    virtio_submit_chain(dev, txq->ring, head);
+
+    return NO_ERROR;
+}
+
+int virtio_net_send_batch(pktbuf_t **p, uint count)
+{
+    struct virtio_net_dev *ndev = virtio_net_first();
+    uint sent = 0;
+    uint pending = 0;
+    uint i = 0;
+
+    if (!ndev) {
+        for (; i < count; i++)
+            pktbuf_free(p[i]);
+        return ERR_NOT_FOUND;
+    }
+
+    enter_critical_section();
+
+    struct virtio_net_txq *txq = &ndev->txq[arch_curr_cpu_num() % ndev->queue_pairs];
+
+    while (i < count) {
+        status_t err = virtio_net_queue_tx(ndev, txq, p[i]);
+        if (err == ERR_BUSY) {
+            /* let the device start on what we have while waiting for room */
+            txq->ring_full++;
+            if (pending > 0 && virtio_net_kick(ndev, txq->ring))
+                txq->kicks++;
+            pending = 0;
+
+            txq->waiting = true;
+            exit_critical_section();
+            err = event_wait_timeout(&txq->desc_event, VIRTIO_NET_TX_TIMEOUT);
+            enter_critical_section();
+            if (err >= 0)
+                continue;
+        }
+
+        if (err < 0) {
+            txq->dropped++;
+            pktbuf_free(p[i]);
+        } else {
+            pending++;
+            sent++;
+        }
+        i++;
+    }
+
+    if (pending > 0 && virtio_net_kick(ndev, txq->ring))
+        txq->kicks++;
+
+    exit_critical_section();
+
+    return sent;
+}
+
+int virtio_net_send_minip_pkt(pktbuf_t *p)
+{
+    return (virtio_net_send_batch(&p, 1) == 1) ? 0 : -1;
+}
+
+uint32_t virtio_net_minip_tx_flags(void)
+{
+    struct virtio_net_dev *ndev = virtio_net_first();
+    if (!ndev)
+        return 0;
+
+    uint32_t flags = MINIP_TX_GATHER;
+    if (ndev->features & VIRTIO_NET_F_CSUM)
+        flags |= MINIP_TX_CSUM;
+
+    return flags;
+}
+
+int virtio_net_found(void)
+{
+    return list_length(&virtio_net_list);
+}
+
+status_t virtio_net_get_mac_addr(uint8_t mac_addr[6])
+{
+    struct virtio_net_dev *ndev = virtio_net_first();
+    if (!ndev)
+        return ERR_NOT_FOUND;
+
+    memcpy(mac_addr, ndev->mac, sizeof(ndev->mac));
+    return NO_ERROR;
+}
+
+#if WITH_LIB_LWIP
+static status_t virtio_net_netif_set_state(struct device *dev, struct netstack_state *state)
+{
+    struct virtio_net_dev *ndev = dev->state;
+
+    ndev->netstack_state = state;
+    return NO_ERROR;
+}
+
+static ssize_t virtio_net_netif_get_hwaddr(struct device *dev, void *buf, size_t max_len)
+{
+    struct virtio_net_dev *ndev = dev->state;
+
+    size_t len = MIN(sizeof(ndev->mac), max_len);
+    memcpy(buf, ndev->mac, len);
+    return len;
+}
+
+static ssize_t virtio_net_netif_get_mtu(struct device *dev)
+{
+    return VIRTIO_NET_MTU;
+}
+
+static status_t virtio_net_netif_output(struct device *dev, struct pbuf *p)
+{
+    if (p->tot_len > PKTBUF_MAX_DATA)
+        return ERR_TOO_BIG;
+
+    /* lwip keeps the pbuf, so the frame is copied into a pktbuf of our own */
+    pktbuf_t *pb = pktbuf_alloc();
+    if (!pb)
+        return ERR_NO_MEMORY;
+
+    pbuf_copy_partial(p, pktbuf_append(pb, p->tot_len), p->tot_len, 0);
+
+    return (virtio_net_send_batch(&pb, 1) == 1) ? NO_ERROR : ERR_IO;
+}
+
+static struct netif_ops virtio_net_netif_ops = {
+    .set_state = virtio_net_netif_set_state,
+    .get_hwaddr = virtio_net_netif_get_hwaddr,
+    .get_mtu = virtio_net_netif_get_mtu,
+
+    .output = virtio_net_netif_output,
+};
+
+/* devices are found at runtime rather than declared with DEVICE_INSTANCE,
+ * so the driver is not exported and each device carries its own instance */
+static const struct driver virtio_net_driver = {
+    .type = "netif",
+    .ops = &virtio_net_netif_ops.std,
+};
+
+status_t virtio_net_netif_add(void)
+{
+    struct virtio_net_dev *ndev = virtio_net_first();
+    if (!ndev)
+        return ERR_NOT_FOUND;
+
+    ndev->netif_dev.name = ndev->name;
+    ndev->netif_dev.driver = &virtio_net_driver;
+    ndev->netif_dev.state = ndev;
+
+    status_t err = class_netif_add(&ndev->netif_dev);
+    if (err < 0)
+        return err;
+
+    return virtio_net_start(NULL);
+}
+#else
+status_t virtio_net_netif_add(void)
+{
+    return ERR_NOT_SUPPORTED;
+}
+#endif
+
+static void virtio_net_dump(struct virtio_net_dev *ndev)
+{
+    volatile struct virtio_net_config *config = (struct virtio_net_config *)ndev->dev->config_ptr;
+
+    printf("virtio-net %s: mac %02x:%02x:%02x:%02x:%02x:%02x, features 0x%x, header %zu bytes, link %s\n",
+           ndev->name, ndev->mac[0], ndev->mac[1], ndev->mac[2], ndev->mac[3], ndev->mac[4], ndev->mac[5],
+           ndev->features, ndev->hdr_len,
+           !(ndev->features & VIRTIO_NET_F_STATUS) ? "unknown" :
+           (config->status & VIRTIO_NET_S_LINK_UP) ? "up" : "down");
+    printf("\t%u of %u queue pairs in use, %s\n", ndev->queue_pairs, ndev->max_queue_pairs,
+           ndev->started ? "started" : "stopped");
+
+    for (uint q = 0; q < ndev->queue_pairs; q++) {
+        struct virtio_net_rxq *rxq = &ndev->rxq[q];
+        struct virtio_net_txq *txq = &ndev->txq[q];
+
+        printf("\trx%u: packets %llu, bytes %llu, wakeups %llu (max batch %u), csum valid %llu, oversize %llu, dropped %llu\n",
+               q, rxq->packets, rxq->bytes, rxq->wakeups, rxq->max_batch, rxq->csum_valid, rxq->oversize, rxq->dropped);
+        printf("\ttx%u: packets %llu, bytes %llu, kicks %llu, csum offload %llu, gso %llu, ring full %llu, dropped %llu, free descriptors %u\n",
+               q, txq->packets, txq->bytes, txq->kicks, txq->csum_offload, txq->gso, txq->ring_full, txq->dropped,
+               ndev->dev->ring[txq->ring].free_count);
+    }
+}
+
+#if defined(WITH_LIB_CONSOLE)
+#include <lib/console.h>
+
+static int cmd_virtio_net(int argc, const cmd_args *argv)
+{
+    struct virtio_net_dev *ndev;
+    list_for_every_entry(&virtio_net_list, ndev, struct virtio_net_dev, node) {
+        virtio_net_dump(ndev);
+    }
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("virtio_net", "dump virtio network devices", &cmd_virtio_net)
+STATIC_COMMAND_END(virtio_net);
+#endif
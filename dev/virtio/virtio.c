@@ -43,6 +43,9 @@
 #if WITH_DEV_VIRTIO_BLOCK
 #include <dev/virtio/block.h>
 #endif
+#if WITH_DEV_VIRTIO_NET
+#include <dev/virtio/net.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -84,26 +87,57 @@ static enum handler_return virtio_mmio_irq(void *arg)
         // XXX is this safe?
         dev->mmio_config->interrupt_ack = 0x1;
 
-        // XXX only handles ring 0
-        struct vring *ring = &dev->ring[0];
-        printf("used flags 0x%hhx idx 0x%hhx\n", ring->used->flags, ring->used->idx);
+        /* the interrupt doesn't say which queue moved, so look at all of them */
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            struct vring *ring = &dev->ring[r];
+            if (!ring->desc)
+                continue;
+
+            LTRACEF("ring %u used flags 0x%hx idx 0x%hx last_used 0x%hx\n", r, ring->used->flags, ring->used->idx, ring->last_used);
 
-        uint cur_idx = ring->used->idx;
-        for (uint i = ring->last_used; i != cur_idx; i = (i + 1) & ring->num_mask) {
-            LTRACEF("looking at idx %u\n", i);
+            /* consume every element the device has retired since the last irq,
+             * last_used and used->idx are free running 16 bit counters */
+            uint16_t cur_idx = ring->used->idx;
+            DSB;
+            while (ring->last_used != cur_idx) {
+                // process chain
+                struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+                LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
 
-            // process chain
-            struct vring_used_elem *used_elem = &ring->used->ring[i];
-            LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+                DEBUG_ASSERT(dev->irq_driver_callback);
+                ret |= dev->irq_driver_callback(dev, r, used_elem);
 
-            DEBUG_ASSERT(dev->irq_driver_callback);
-            ret |= dev->irq_driver_callback(dev, 0, used_elem);
+                ring->last_used++;
+            }
         }
     }
 
     return ret;
 }
 
+/* hand a detected device to its driver and bring it to DRIVER_OK if it takes it */
+static void virtio_mmio_probe(struct virtio_device *dev, volatile struct virtio_mmio_config *mmio,
+                              status_t (*init)(struct virtio_device *, uint32_t))
+{
+    dev->mmio_config = mmio;
+    dev->config_ptr = (void *)mmio->config;
+
+    mmio->status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+    status_t err = init(dev, mmio->host_features);
+    if (err >= 0) {
+        // good device
+        dev->valid = true;
+
+        if (dev->irq_driver_callback)
+            unmask_interrupt(dev->irq);
+
+        mmio->status |= VIRTIO_STATUS_DRIVER_OK;
+    } else {
+        mmio->status |= VIRTIO_STATUS_FAILED;
+    }
+}
+
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 {
     LTRACEF("ptr %p, count %u\n", ptr, count);
@@ -139,26 +173,13 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 #if WITH_DEV_VIRTIO_BLOCK
         if (mmio->device_id == 2) { // block device
             LTRACEF("found block device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-            status_t err = virtio_block_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-
-                // XXX quick test code, remove
-#if 0
-                uint8_t buf[512];
-                memset(buf, 0x99, sizeof(buf));
-                virtio_block_read(dev, buf, 0, sizeof(buf));
-                hexdump8(buf, sizeof(buf));
+            virtio_mmio_probe(dev, mmio, &virtio_block_init);
+        }
 #endif
-            }
-
+#if WITH_DEV_VIRTIO_NET
+        if (mmio->device_id == 1) { // network device
+            LTRACEF("found net device\n");
+            virtio_mmio_probe(dev, mmio, &virtio_net_init);
         }
 #endif
     }
@@ -203,6 +224,7 @@ struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_
         struct vring_desc *desc = &dev->ring[ring_index].desc[i];
 
         dev->ring[ring_index].free_list = desc->next;
+        dev->ring[ring_index].free_count--;
 
         if (last) {
             desc->flags = VRING_DESC_F_NEXT;
@@ -234,7 +256,17 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
     DSB;
     avail->idx++;
 
+#if LOCAL_TRACE
     hexdump(avail, 16);
+#endif
+}
+
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features)
+{
+    LTRACEF("dev %p, features 0x%x\n", dev, features);
+
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
 }
 
 void virtio_kick(struct virtio_device *dev, uint ring_index)
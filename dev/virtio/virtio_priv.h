@@ -55,3 +55,8 @@ struct virtio_mmio_config {
 STATIC_ASSERT(sizeof(struct virtio_mmio_config) == 0x100);
 
 #define VIRTIO_MMIO_MAGIC 0x74726976 // 'virt'
+
+#define VIRTIO_STATUS_ACKNOWLEDGE (1<<0)
+#define VIRTIO_STATUS_DRIVER      (1<<1)
+#define VIRTIO_STATUS_DRIVER_OK   (1<<2)
+#define VIRTIO_STATUS_FAILED      (1<<7)
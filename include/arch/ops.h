@@ -45,6 +45,20 @@ static int atomic_or(volatile int *ptr, int val);
 
 static uint32_t arch_cycle_count(void);
 
+static uint arch_curr_cpu_num(void);
+
+/* spinlocks, also implemented inline in arch_ops.h:
+ *
+ *  spin_lock_t, initialized to SPIN_LOCK_INITIAL_VALUE
+ *  void spin_lock(spin_lock_t *lock)       - local interrupts should already be disabled
+ *  int spin_trylock(spin_lock_t *lock)     - returns 0 if the lock was acquired
+ *  void spin_unlock(spin_lock_t *lock)
+ *
+ *  spin_lock_save(lock, &state, flags) and spin_unlock_restore(lock, state, flags)
+ *  disable and restore local interrupts around the lock if SPIN_LOCK_FLAG_INTERRUPTS
+ *  is passed in flags.
+ */
+
 #endif // !ASSEMBLY
 #define ICACHE 1
 #define DCACHE 2
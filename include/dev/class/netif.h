@@ -58,6 +58,10 @@ status_t class_netif_add(struct device *dev);
 /* network stack API - called by drivers */
 status_t class_netstack_input(struct device *dev, struct netstack_state *state, struct pbuf *p);
 
+/* hand a batch of received packets to the stack in one call. takes ownership
+ * of every pbuf in pkts, including on error */
+status_t class_netstack_input_batch(struct device *dev, struct netstack_state *state, struct pbuf **pkts, size_t count);
+
 status_t class_netstack_wait_for_network(lk_time_t timeout);
 
 __END_CDECLS
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_MP_H
+#define __KERNEL_MP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <compiler.h>
+
+__BEGIN_CDECLS
+
+/* arches that support more than one cpu set WITH_SMP and SMP_MAX_CPUS */
+#ifndef SMP_MAX_CPUS
+#define SMP_MAX_CPUS 1
+#endif
+
+typedef uint32_t mp_cpu_mask_t;
+
+#define MP_CPU_ALL ((mp_cpu_mask_t)-1)
+
+STATIC_ASSERT(SMP_MAX_CPUS <= sizeof(mp_cpu_mask_t) * 8);
+
+/* inter processor interrupts */
+typedef enum {
+	MP_IPI_RESCHEDULE,
+} mp_ipi_t;
+
+struct mp_state {
+	volatile mp_cpu_mask_t active_cpus;
+	volatile mp_cpu_mask_t idle_cpus;
+};
+
+extern struct mp_state mp;
+
+#if WITH_SMP
+
+/* ask the cpus in the mask to run the scheduler, the local cpu is never signalled */
+void mp_reschedule(mp_cpu_mask_t target);
+
+/* called from the arch ipi handler */
+enum handler_return mp_mbx_reschedule_irq(void);
+
+/* arch hooks */
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi);
+void arch_mp_init_percpu(void);
+
+/* arch code calls this on each secondary cpu once it has a stack, with interrupts disabled */
+void lk_secondary_cpu_entry(void) __NO_RETURN;
+
+#else
+
+static inline void mp_reschedule(mp_cpu_mask_t target) {}
+
+#endif
+
+/* mark the calling cpu as available to the scheduler */
+void mp_set_curr_cpu_active(bool active);
+
+static inline mp_cpu_mask_t mp_get_active_mask(void)
+{
+	return mp.active_cpus;
+}
+
+static inline bool mp_is_cpu_active(uint cpu)
+{
+	return !!(mp.active_cpus & (1U << cpu));
+}
+
+static inline mp_cpu_mask_t mp_get_idle_mask(void)
+{
+	return mp.idle_cpus;
+}
+
+/* only called by the scheduler, inside a critical section */
+static inline void mp_set_cpu_idle(uint cpu)
+{
+	mp.idle_cpus |= 1U << cpu;
+}
+
+static inline void mp_set_cpu_busy(uint cpu)
+{
+	mp.idle_cpus &= ~(1U << cpu);
+}
+
+__END_CDECLS
+
+#endif
@@ -35,6 +35,7 @@ typedef struct mutex {
 	thread_t *holder;
 	int count;
 	wait_queue_t wait;
+	struct list_node held_node; /* in the holder's held_mutexes list */
 } mutex_t;
 
 #define MUTEX_INITIAL_VALUE(m) \
@@ -43,11 +44,16 @@ typedef struct mutex {
 	.holder = NULL, \
 	.count = 0, \
 	.wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+	.held_node = LIST_INITIAL_CLEARED_VALUE, \
 }
 
 /* Rules for Mutexes:
  * - Mutexes are only safe to use from thread context.
  * - Mutexes are non-recursive.
+ * - Mutexes use priority inheritance: while a thread is blocked on a mutex the
+ *   holder runs at no less than the waiter's priority, passed along chains of
+ *   holders that are themselves blocked on mutexes.
+ * - On release the mutex is handed directly to the highest priority waiter.
 */
 
 void mutex_init(mutex_t *);
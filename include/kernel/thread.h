@@ -30,6 +30,7 @@
 #include <arch/ops.h>
 #include <arch/thread.h>
 #include <kernel/wait.h>
+#include <kernel/mp.h>
 #include <debug.h>
 
 enum thread_state {
@@ -55,22 +56,54 @@ enum thread_tls_list {
 
 #define THREAD_MAGIC 'thrd'
 
+struct mutex;
+
+#if THREAD_STATS
+/* bucket n of the wakeup latency histogram counts latencies under 2^n usecs,
+ * the last one also takes everything longer */
+#define THREAD_LATENCY_BUCKETS 16
+
+/* per thread scheduler accounting, all times in usecs from current_time_hires() */
+struct thread_sched_stats {
+	lk_bigtime_t runtime;
+	lk_bigtime_t last_run;      /* when it was last switched in */
+	lk_bigtime_t ready_time;    /* when it was last woken, 0 once it has run */
+	lk_bigtime_t blocked_time;  /* total time spent in wait queues */
+	lk_bigtime_t block_start;
+	lk_bigtime_t latency_max;
+	uint32_t switches;          /* times switched in */
+	uint32_t preemptions;       /* times switched out while still runnable */
+	uint32_t latency_hist[THREAD_LATENCY_BUCKETS];
+};
+#endif
+
 typedef struct thread {
 	int magic;
 	struct list_node thread_list_node;
 
 	/* active bits */
 	struct list_node queue_node;
-	int priority;
+	int priority; /* effective priority, may be boosted above base_priority */
+	int base_priority;
 	enum thread_state state;
 	int saved_critical_section_count;
-	int remaining_quantum;
+	int remaining_quantum; /* msecs */
 	unsigned int flags;
 
+	/* cpu the thread is running on, queued on, or last ran on */
+	uint curr_cpu;
+	/* cpus the thread may be scheduled on */
+	mp_cpu_mask_t cpu_affinity;
+
 	/* if blocked, a pointer to the wait queue */
 	struct wait_queue *blocking_wait_queue;
 	status_t wait_queue_block_ret;
 
+	/* priority inheritance, see kernel/mutex.c */
+	struct list_node held_mutexes;
+	struct mutex *blocking_mutex;
+	int inherited_priority; /* highest waiter on a held mutex, or -1 */
+
 	/* architecture stuff */
 	struct arch_thread arch;
 
@@ -89,6 +122,10 @@ typedef struct thread {
 	/* thread local storage */
 	uint32_t tls[MAX_TLS_ENTRY];
 
+#if THREAD_STATS
+	struct thread_sched_stats stats;
+#endif
+
 	char name[32];
 } thread_t;
 
@@ -102,6 +139,14 @@ typedef struct thread {
 #define DEFAULT_PRIORITY (NUM_PRIORITIES / 2)
 #define HIGH_PRIORITY ((NUM_PRIORITIES / 4) * 3)
 
+/* the time slice a thread gets is set per band of THREAD_QUANTUM_BAND_SIZE
+ * priorities, in msecs */
+#define THREAD_QUANTUM_BAND_SIZE 8
+#define THREAD_QUANTUM_BANDS (NUM_PRIORITIES / THREAD_QUANTUM_BAND_SIZE)
+#ifndef THREAD_DEFAULT_QUANTUM
+#define THREAD_DEFAULT_QUANTUM 50
+#endif
+
 /* stack size */
 #ifdef CUSTOM_DEFAULT_STACK_SIZE
 #define DEFAULT_STACK_SIZE CUSTOM_DEFAULT_STACK_SIZE
@@ -124,6 +169,13 @@ status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+status_t thread_set_cpu_affinity(thread_t *t, mp_cpu_mask_t mask);
+status_t thread_set_quantum(int priority, lk_time_t quantum); /* for the band holding priority */
+lk_time_t thread_get_quantum(int priority);
+
+/* called on secondary cpus as they come up */
+void thread_secondary_cpu_init_early(void);
+void thread_secondary_cpu_entry(void) __NO_RETURN;
 
 void dump_thread(thread_t *t);
 void dump_all_threads(void);
@@ -131,8 +183,10 @@ void dump_all_threads(void);
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
 void thread_preempt(void); /* get preempted (inserted into head of run queue) */
+void thread_preempt_by(thread_t *t); /* like thread_preempt, but the ready thread t goes in front of us */
 void thread_block(void); /* block on something and reschedule */
 void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
+void thread_set_effective_priority(thread_t *t, int priority); /* boost or restore, leaving the base priority alone */
 
 /* called on every timer tick for the scheduler to do quantum expiration */
 enum handler_return thread_timer_tick(void);
@@ -142,8 +196,49 @@ thread_t *get_current_thread(void);
 void set_current_thread(thread_t *);
 
 /* critical sections */
+#if WITH_SMP
+/* the count is per cpu, the outermost critical section on each cpu holds the thread lock */
+extern int critical_section_count[SMP_MAX_CPUS];
+extern spin_lock_t thread_lock;
+
+#define CRITICAL_SECTION_COUNT (critical_section_count[arch_curr_cpu_num()])
+
+static inline __ALWAYS_INLINE void enter_critical_section(void)
+{
+	CF;
+	arch_disable_ints();
+	if (CRITICAL_SECTION_COUNT++ == 0)
+		spin_lock(&thread_lock);
+	CF;
+}
+
+static inline __ALWAYS_INLINE void exit_critical_section(void)
+{
+	CF;
+	if (--CRITICAL_SECTION_COUNT == 0) {
+		spin_unlock(&thread_lock);
+		arch_enable_ints();
+	}
+	CF;
+}
+
+/* only used by interrupt glue */
+static inline void inc_critical_section(void)
+{
+	if (CRITICAL_SECTION_COUNT++ == 0)
+		spin_lock(&thread_lock);
+}
+
+static inline void dec_critical_section(void)
+{
+	if (--CRITICAL_SECTION_COUNT == 0)
+		spin_unlock(&thread_lock);
+}
+#else
 extern int critical_section_count;
 
+#define CRITICAL_SECTION_COUNT critical_section_count
+
 static inline __ALWAYS_INLINE void enter_critical_section(void)
 {
 	CF;
@@ -162,16 +257,17 @@ static inline __ALWAYS_INLINE void exit_critical_section(void)
 	CF;
 }
 
+/* only used by interrupt glue */
+static inline void inc_critical_section(void) { critical_section_count++; }
+static inline void dec_critical_section(void) { critical_section_count--; }
+#endif
+
 static inline __ALWAYS_INLINE bool in_critical_section(void)
 {
 	CF;
-	return critical_section_count > 0;
+	return CRITICAL_SECTION_COUNT > 0;
 }
 
-/* only used by interrupt glue */
-static inline void inc_critical_section(void) { critical_section_count++; }
-static inline void dec_critical_section(void) { critical_section_count--; }
-
 /* thread local storage */
 static inline __ALWAYS_INLINE uint32_t tls_get(uint entry)
 {
@@ -185,12 +281,7 @@ static inline __ALWAYS_INLINE uint32_t tls_set(uint entry, uint32_t val)
 	return oldval;
 }
 
-/* thread level statistics */
-#if LK_DEBUGLEVEL > 1
-#define THREAD_STATS 1
-#else
-#define THREAD_STATS 0
-#endif
+/* thread level statistics, THREAD_STATS comes from kernel/wait.h */
 #if THREAD_STATS
 struct thread_stats {
 	lk_bigtime_t idle_time;
@@ -202,11 +293,56 @@ struct thread_stats {
 	int interrupts; /* platform code increment this */
 	int timer_ints; /* timer code increment this */
 	int timers; /* timer code increment this */
+	int reschedule_ipis;
+	int idle_wakeups; /* switches away from the idle thread */
 };
 
-extern struct thread_stats thread_stats;
+/* one set per cpu, only ever updated by the cpu it belongs to */
+extern struct thread_stats thread_stats[SMP_MAX_CPUS];
+
+#define THREAD_STATS_INC(name) do { thread_stats[arch_curr_cpu_num()].name++; } while(0)
 
-#define THREAD_STATS_INC(name) do { thread_stats.name++; } while(0)
+/* binary snapshot of the per thread stats for offline analysis, a header
+ * followed by count records of record_size bytes in native byte order */
+#define THREAD_STATS_DUMP_MAGIC 0x53544854 /* "THTS" */
+#define THREAD_STATS_DUMP_VERSION 2
+
+struct thread_stats_dump_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t count;
+	uint32_t num_cpus;
+	uint64_t timestamp;
+} __PACKED;
+
+struct thread_stats_dump_record {
+	uint64_t id;
+	char name[32];
+	int32_t priority;
+	int32_t base_priority;
+	uint32_t state;
+	uint32_t cpu;
+	uint64_t runtime;
+	uint64_t blocked_time;
+	uint64_t latency_max;
+	uint32_t switches;
+	uint32_t preemptions;
+	uint32_t latency_hist[THREAD_LATENCY_BUCKETS];
+	/* the wait queue the thread is blocked on, 0 if none, with the totals
+	 * for every thread that has blocked there and how long this one has
+	 * been waiting so far */
+	uint64_t wait_queue;
+	uint64_t wait_queue_blocked_time;
+	uint32_t wait_queue_wakeups;
+	uint64_t waiting_time;
+} __PACKED;
+
+/* fill buf with a snapshot, returns the number of bytes used or, if buf is
+ * NULL, the number needed for the threads that exist right now */
+size_t thread_stats_dump(void *buf, size_t len);
+void thread_stats_reset(void);
 
 #else
 
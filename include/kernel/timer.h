@@ -58,8 +58,12 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Without PLATFORM_HAS_DYNAMIC_TIMER timers are dispatched from a periodic
+ *   tick every TIMER_TICK_INTERVAL ms, otherwise the hardware is programmed
+ *   for the earliest pending timer.
 */
+#define TIMER_TICK_INTERVAL 10
+
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
@@ -60,10 +60,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8;
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_BUDDY    (0x2) /* first page of a free block, order is valid */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -81,6 +83,10 @@ static inline bool is_kernel_address(vaddr_t va)
 }
 
 /* physical allocator */
+
+/* largest block the buddy allocator tracks is 2^PMM_MAX_ORDER pages */
+#define PMM_MAX_ORDER 10
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -94,7 +100,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_area[PMM_MAX_ORDER + 1];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -30,6 +30,13 @@
 #include <arch/ops.h>
 #include <arch/thread.h>
 
+/* thread level statistics */
+#if LK_DEBUGLEVEL > 1
+#define THREAD_STATS 1
+#else
+#define THREAD_STATS 0
+#endif
+
 /* wait queue stuff */
 #define WAIT_QUEUE_MAGIC 'wait'
 
@@ -37,6 +44,11 @@ typedef struct wait_queue {
 	int magic;
 	struct list_node list;
 	int count;
+#if THREAD_STATS
+	/* usecs threads have spent blocked here, counted as they are woken */
+	lk_bigtime_t blocked_time;
+	uint32_t wakeups;
+#endif
 } wait_queue_t;
 
 #define WAIT_QUEUE_INITIAL_VALUE(q) \
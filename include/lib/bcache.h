@@ -36,5 +36,8 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+// print hit, miss and eviction counters
+void bcache_dump(bcache_t, const char *name);
+
 #endif
 
@@ -24,6 +24,7 @@
 
 #include <sys/types.h>
 #include <list.h>
+#include <iovec.h>
 
 typedef uint32_t bnum_t;
 
@@ -41,8 +42,10 @@ typedef struct bdev {
 	/* function pointers */
 	ssize_t (*read)(struct bdev *, void *buf, off_t offset, size_t len);
 	ssize_t (*read_block)(struct bdev *, void *buf, bnum_t block, uint count);
+	ssize_t (*readv)(struct bdev *, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len);
 	ssize_t (*write)(struct bdev *, const void *buf, off_t offset, size_t len);
 	ssize_t (*write_block)(struct bdev *, const void *buf, bnum_t block, uint count);
+	ssize_t (*writev)(struct bdev *, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len);
 	ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
 	int (*ioctl)(struct bdev *, int request, void *argp);
 	void (*close)(struct bdev *);
@@ -53,8 +56,10 @@ bdev_t *bio_open(const char *name);
 void bio_close(bdev_t *dev);
 ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len);
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count);
+ssize_t bio_readv(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset);
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len);
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
+ssize_t bio_writev(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
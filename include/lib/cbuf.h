@@ -24,18 +24,29 @@
 #define __LIB_CBUF_H
 
 #include <sys/types.h>
+#include <iovec.h>
 #include <kernel/event.h>
 
 typedef struct cbuf {
 	uint head;
 	uint tail;
 	uint len_pow2;
+	uint flags;
+	uint watermark;
 	char *buf;
 	event_t event;
 } cbuf_t;
 
+/* In SPSC mode the buffer is lock free for exactly one writer and one
+ * reader, each of which may be an interrupt handler or a thread. The
+ * writer only moves head and the reader only moves tail, published with
+ * release stores, so neither side masks interrupts around the copy.
+ */
+#define CBUF_FLAG_SPSC 0x1
+
 void cbuf_initialize(cbuf_t *cbuf, size_t len);
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf);
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags);
 size_t cbuf_read(cbuf_t *cbuf, void *_buf, size_t buflen, bool block);
 size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule);
 size_t cbuf_space_avail(cbuf_t *cbuf);
@@ -49,5 +60,23 @@ static size_t cbuf_size(cbuf_t *cbuf) {
 size_t cbuf_read_char(cbuf_t *cbuf, char *c, bool block);
 size_t cbuf_write_char(cbuf_t *cbuf, char c, bool canreschedule);
 
+/* Zero copy access. peek returns the total length and fills in up to two
+ * regions (the second one is used when the data or space wraps around the
+ * end of the buffer), commit then consumes or publishes len bytes of them.
+ * A blocked reader is woken by write_commit as it is by cbuf_write.
+ */
+size_t cbuf_peek(cbuf_t *cbuf, iovec_t regions[2]);
+void cbuf_read_commit(cbuf_t *cbuf, size_t len);
+size_t cbuf_peek_write(cbuf_t *cbuf, iovec_t regions[2]);
+void cbuf_write_commit(cbuf_t *cbuf, size_t len, bool canreschedule);
+
+/* The reader is only signalled when the buffer goes from empty to non
+ * empty. With a watermark set, it is instead signalled when the amount
+ * buffered reaches the watermark, and a writer ending a burst short of it
+ * calls cbuf_signal() to hand over what is there.
+ */
+void cbuf_set_watermark(cbuf_t *cbuf, size_t watermark);
+void cbuf_signal(cbuf_t *cbuf, bool canreschedule);
+
 #endif
 
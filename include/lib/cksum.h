@@ -2,6 +2,7 @@
 #define __CKSUM_H
 
 #include <compiler.h>
+#include <sys/types.h>
 
 __BEGIN_CDECLS
 
@@ -20,7 +21,23 @@ unsigned short crc16(const unsigned char *buf, unsigned int length);
   */
 unsigned short update_crc16(unsigned short crc, const unsigned char *buf, unsigned int len);
 
+/*
+ * crc32 (ieee 802.3) and crc32c (castagnoli) with zlib's conventions: start
+ * with a crc of 0 and pass the previous result back in to continue over
+ * more data. Both use the fastest implementation the cpu supports.
+ */
 unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * The individual implementations behind crc32()/crc32c(), for testing and
+ * benchmarking. The hardware versions are NULL if the cpu lacks support.
+ */
+unsigned long crc32_bytewise(unsigned long crc, const unsigned char *buf, unsigned int len);
+uint32_t crc32_slice8(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_slice8(uint32_t crc, const void *buf, size_t len);
+extern uint32_t (*crc32_hw)(uint32_t crc, const void *buf, size_t len);
+extern uint32_t (*crc32c_hw)(uint32_t crc, const void *buf, size_t len);
 
 unsigned long adler32(unsigned long adler, const unsigned char *buf, unsigned int len);
 
@@ -25,12 +25,56 @@
 
 #include <list.h>
 #include <sys/types.h>
+#include <compiler.h>
+
+__BEGIN_CDECLS
+
+/* Deferred procedure calls, run at DPC_PRIORITY on a small pool of worker
+ * threads (one per cpu on SMP builds). Queueing never allocates, so both
+ * forms below may be used from interrupt context as long as
+ * DPC_FLAG_NORESCHED is passed there.
+ *
+ * Calls may run concurrently on different workers and in a different order
+ * than they were queued. A dpc_t is taken off the queue before its callback
+ * runs, so the callback may queue it again.
+ */
 
 typedef void (*dpc_callback)(void *arg);
 
+typedef struct dpc {
+	struct list_node node;
+
+	dpc_callback cb;
+	void *arg;
+	uint flags;
+
+	/* queue to start of callback, in usecs */
+	lk_bigtime_t queue_time;
+	lk_bigtime_t latency_max;
+	lk_bigtime_t latency_total;
+	uint32_t runs;
+} dpc_t;
+
+#define DPC_INITIAL_VALUE(d, _cb, _arg) \
+{ \
+	.node = LIST_INITIAL_CLEARED_VALUE, \
+	.cb = _cb, \
+	.arg = _arg, \
+}
+
 #define DPC_FLAG_NORESCHED 0x1
 
+void dpc_init(dpc_t *, dpc_callback, void *arg);
+
+/* queue a caller owned dpc. returns ERR_ALREADY_STARTED if it is still
+ * waiting to run from an earlier call. */
+status_t dpc_queue_etc(dpc_t *, uint flags);
+
+/* queue a call using an entry from a preallocated pool. returns
+ * ERR_NO_MEMORY if every pool entry is in use. */
 status_t dpc_queue(dpc_callback, void *arg, uint flags);
 
+__END_CDECLS
+
 #endif
 
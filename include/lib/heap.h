@@ -26,12 +26,23 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+/* number of power of 2 size classes small allocations are serviced from */
+#define HEAP_NUM_CLASSES 5
+
+struct heap_class_stats {
+	size_t size;
+	size_t total;
+	size_t free;
+	size_t allocs;
+};
+
 struct heap_stats {
 	void* heap_start;
 	size_t heap_len;
 	size_t heap_free;
 	size_t heap_max_chunk;
 	size_t heap_low_watermark;
+	struct heap_class_stats heap_class[HEAP_NUM_CLASSES];
 };
 
 void *heap_alloc(size_t, unsigned int alignment);
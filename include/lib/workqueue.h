@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __LIB_WORKQUEUE_H
+#define __LIB_WORKQUEUE_H
+
+#include <list.h>
+#include <sys/types.h>
+#include <compiler.h>
+#include <kernel/wait.h>
+
+__BEGIN_CDECLS
+
+/* A pool of kernel worker threads that run submitted work items.
+ *
+ * Workers are created on demand up to WORKQUEUE_MAX_THREADS and park on a
+ * wait queue when there is nothing to do, so a burst of short jobs reuses
+ * the same threads instead of paying for thread_create()/thread_exit() on
+ * every item. Workers above WORKQUEUE_MIN_THREADS retire after sitting idle
+ * for WORKQUEUE_IDLE_TIMEOUT msecs.
+ *
+ * At most WORKQUEUE_MAX_QUEUED items may be waiting for a worker at once;
+ * work_submit() blocks (or fails with WORK_FLAG_NOWAIT) past that point.
+ * Queued items are dispatched highest priority first and each runs on the
+ * worker at its own priority.
+ */
+
+typedef int (*work_func)(void *arg);
+
+typedef struct work {
+	int magic;
+	struct list_node node;
+
+	work_func func;
+	void *arg;
+	int priority;
+
+	uint flags;
+	int state;
+	int retcode;
+	lk_bigtime_t queue_time;
+
+	wait_queue_t done_wait;
+} work_t;
+
+#define WORK_MAGIC 'work'
+
+enum {
+	WORK_STATE_IDLE = 0,
+	WORK_STATE_QUEUED,
+	WORK_STATE_RUNNING,
+	WORK_STATE_DONE,
+};
+
+/* flags for work_submit() and work_queue() */
+#define WORK_FLAG_NOWAIT    0x1 /* return ERR_NOT_READY instead of blocking if the queue is full */
+#define WORK_FLAG_NORESCHED 0x2 /* don't reschedule when waking a worker */
+
+void work_init(work_t *, work_func, void *arg, int priority);
+
+/* queue a caller owned work item. the item must stay valid until work_wait()
+ * returns or the item otherwise reaches WORK_STATE_DONE. */
+status_t work_submit(work_t *, uint flags);
+
+/* wait for a submitted item to finish, returns its result in retcode */
+status_t work_wait(work_t *, lk_time_t timeout, int *retcode);
+
+/* fire and forget: queue func using one of the pool's own work items */
+status_t work_queue(work_func, void *arg, int priority, uint flags);
+
+/* run func(arg, i) for every i in [0, count), spread across the pool and
+ * the calling thread, and return once all of them have completed. safe to
+ * call from a pool worker, ranges no worker has started run on the caller */
+typedef void (*work_range_func)(void *arg, uint index);
+void work_parallel_for(uint count, work_range_func, void *arg);
+
+__END_CDECLS
+
+#endif
+
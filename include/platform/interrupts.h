@@ -32,4 +32,12 @@ typedef enum handler_return (*int_handler)(void *arg);
 
 void register_int_handler(unsigned int vector, int_handler handler, void *arg);
 
+#if WITH_SMP
+#include <kernel/mp.h>
+
+/* for platforms whose interrupt controller has a per cpu interface */
+void platform_init_percpu_interrupts(void);
+status_t platform_send_ipi(mp_cpu_mask_t target, uint vector);
+#endif
+
 #endif
@@ -33,9 +33,12 @@
 
 #include <debug.h>
 #include <stdio.h>
+#include <string.h>
+#include <malloc.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
+#include <kernel/mp.h>
 #include <err.h>
 #include <platform.h>
 
@@ -45,6 +48,8 @@
 static int cmd_threads(int argc, const cmd_args *argv);
 static int cmd_threadstats(int argc, const cmd_args *argv);
 static int cmd_threadload(int argc, const cmd_args *argv);
+static int cmd_top(int argc, const cmd_args *argv);
+static int cmd_quantum(int argc, const cmd_args *argv);
 static int cmd_kevlog(int argc, const cmd_args *argv);
 
 STATIC_COMMAND_START
@@ -54,7 +59,9 @@ STATIC_COMMAND("threads", "list kernel threads", &cmd_threads)
 #if THREAD_STATS
 STATIC_COMMAND("threadstats", "thread level statistics", &cmd_threadstats)
 STATIC_COMMAND("threadload", "toggle thread load display", &cmd_threadload)
+STATIC_COMMAND("top", "per thread cpu usage and scheduling latency", &cmd_top)
 #endif
+STATIC_COMMAND("quantum", "show or set the time slice per priority band", &cmd_quantum)
 #if WITH_KERNEL_EVLOG
 STATIC_COMMAND("kevlog", "dump kernel event log", &cmd_kevlog)
 #endif
@@ -70,48 +77,226 @@ static int cmd_threads(int argc, const cmd_args *argv)
 }
 #endif
 
+static int cmd_quantum(int argc, const cmd_args *argv)
+{
+	if (argc == 3) {
+		if (thread_set_quantum(argv[1].i, argv[2].u) < 0) {
+			printf("invalid priority or quantum\n");
+			return ERR_INVALID_ARGS;
+		}
+	} else if (argc != 1) {
+		printf("usage: %s [<priority> <msecs>]\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	for (int prio = LOWEST_PRIORITY; prio <= HIGHEST_PRIORITY; prio += THREAD_QUANTUM_BAND_SIZE) {
+		printf("priority %2d-%2d: %u msecs\n", prio, prio + THREAD_QUANTUM_BAND_SIZE - 1,
+		       (uint)thread_get_quantum(prio));
+	}
+
+	return 0;
+}
+
 #if THREAD_STATS
 static int cmd_threadstats(int argc, const cmd_args *argv)
 {
-	printf("thread stats:\n");
-	printf("\ttotal idle time: %lld\n", thread_stats.idle_time);
-	printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats.idle_time);
-	printf("\treschedules: %d\n", thread_stats.reschedules);
-	printf("\tcontext_switches: %d\n", thread_stats.context_switches);
-	printf("\tpreempts: %d\n", thread_stats.preempts);
-	printf("\tyields: %d\n", thread_stats.yields);
-	printf("\tinterrupts: %d\n", thread_stats.interrupts);
-	printf("\ttimer interrupts: %d\n", thread_stats.timer_ints);
-	printf("\ttimers: %d\n", thread_stats.timers);
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!mp_is_cpu_active(i))
+			continue;
+
+		printf("thread stats (cpu %u):\n", i);
+		printf("\ttotal idle time: %lld\n", thread_stats[i].idle_time);
+		printf("\ttotal busy time: %lld\n", current_time_hires() - thread_stats[i].idle_time);
+		printf("\treschedules: %d\n", thread_stats[i].reschedules);
+		printf("\tcontext_switches: %d\n", thread_stats[i].context_switches);
+		printf("\tpreempts: %d\n", thread_stats[i].preempts);
+		printf("\tyields: %d\n", thread_stats[i].yields);
+		printf("\tinterrupts: %d\n", thread_stats[i].interrupts);
+		printf("\ttimer interrupts: %d\n", thread_stats[i].timer_ints);
+		printf("\ttimers: %d\n", thread_stats[i].timers);
+		printf("\tidle wakeups: %d\n", thread_stats[i].idle_wakeups);
+#if WITH_SMP
+		printf("\treschedule ipis: %d\n", thread_stats[i].reschedule_ipis);
+#endif
+	}
 
 	return 0;
 }
 
+static bool cpu_is_idle(uint cpu)
+{
+#if WITH_SMP
+	return !!(mp_get_idle_mask() & (1U << cpu));
+#else
+	return get_current_thread()->priority == IDLE_PRIORITY;
+#endif
+}
+
 static enum handler_return threadload(struct timer *t, lk_time_t now, void *arg)
 {
-	static struct thread_stats old_stats;
-	static lk_bigtime_t last_idle_time;
+	static struct thread_stats old_stats[SMP_MAX_CPUS];
+	static lk_bigtime_t last_idle_time[SMP_MAX_CPUS];
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (!mp_is_cpu_active(i))
+			continue;
+
+		lk_bigtime_t idle_time = thread_stats[i].idle_time;
+		if (cpu_is_idle(i)) {
+			idle_time += current_time_hires() - thread_stats[i].last_idle_timestamp;
+		}
+		lk_bigtime_t delta_time = idle_time - last_idle_time[i];
+		lk_bigtime_t busy_time = 1000000ULL - (delta_time > 1000000ULL ? 1000000ULL : delta_time);
+
+		uint busypercent = (busy_time * 10000) / (1000000);
+
+//		printf("idle_time %lld, busytime %lld\n", idle_time - last_idle_time[i], busy_time);
+		if (SMP_MAX_CPUS > 1)
+			printf("cpu %u ", i);
+		printf("LOAD: %d.%02d%%, cs %d, ints %d, timer ints %d, timers %d, idle wakeups %d\n",
+		       busypercent / 100, busypercent % 100,
+		       thread_stats[i].context_switches - old_stats[i].context_switches,
+		       thread_stats[i].interrupts - old_stats[i].interrupts,
+		       thread_stats[i].timer_ints - old_stats[i].timer_ints,
+		       thread_stats[i].timers - old_stats[i].timers,
+		       thread_stats[i].idle_wakeups - old_stats[i].idle_wakeups);
+
+		old_stats[i] = thread_stats[i];
+		last_idle_time[i] = idle_time;
+	}
 
-	lk_bigtime_t idle_time = thread_stats.idle_time;
-	if (get_current_thread()->priority == IDLE_PRIORITY) {
-		idle_time += current_time_hires() - thread_stats.last_idle_timestamp;
+	return INT_NO_RESCHEDULE;
+}
+
+static const char *top_state_str(uint32_t state)
+{
+	switch (state) {
+		case THREAD_SUSPENDED: return "susp";
+		case THREAD_READY: return "rdy";
+		case THREAD_RUNNING: return "run";
+		case THREAD_BLOCKED: return "blk";
+		case THREAD_SLEEPING: return "slp";
+		case THREAD_DEATH: return "dth";
+		default: return "?";
 	}
-	lk_bigtime_t delta_time = idle_time - last_idle_time;
-	lk_bigtime_t busy_time = 1000000ULL - (delta_time > 1000000ULL ? 1000000ULL : delta_time);
+}
 
-	uint busypercent = (busy_time * 10000) / (1000000);
+/* take a snapshot with thread_stats_dump(), the caller frees it */
+static struct thread_stats_dump_header *top_snapshot(size_t *len)
+{
+	/* leave some room for threads created while allocating */
+	size_t size = thread_stats_dump(NULL, 0) + 4 * sizeof(struct thread_stats_dump_record);
+	struct thread_stats_dump_header *header = malloc(size);
+	if (!header)
+		return NULL;
+
+	*len = thread_stats_dump(header, size);
+	return header;
+}
 
-//	printf("idle_time %lld, busytime %lld\n", idle_time - last_idle_time, busy_time);
-	printf("LOAD: %d.%02d%%, cs %d, ints %d, timer ints %d, timers %d\n", busypercent / 100, busypercent % 100,
-	       thread_stats.context_switches - old_stats.context_switches,
-	       thread_stats.interrupts - old_stats.interrupts,
-	       thread_stats.timer_ints - old_stats.timer_ints,
-	       thread_stats.timers - old_stats.timers);
+static int cmd_top(int argc, const cmd_args *argv)
+{
+	/* the previous snapshot, cpu usage is reported since then */
+	static struct thread_stats_dump_header *last;
+
+	if (argc >= 2 && !strcmp(argv[1].str, "reset")) {
+		thread_stats_reset();
+		free(last);
+		last = NULL;
+		return 0;
+	}
 
-	old_stats = thread_stats;
-	last_idle_time = idle_time;
+	size_t len;
+	struct thread_stats_dump_header *header = top_snapshot(&len);
+	if (!header) {
+		printf("out of memory\n");
+		return ERR_NO_MEMORY;
+	}
+	struct thread_stats_dump_record *rec = (void *)(header + 1);
+
+	if (argc >= 2 && !strcmp(argv[1].str, "dump")) {
+		/* raw blob, see struct thread_stats_dump_header */
+		printf("thread stats dump, %zu bytes\n", len);
+		hexdump8(header, len);
+		free(header);
+		return 0;
+	}
 
-	return INT_NO_RESCHEDULE;
+	if (argc >= 2 && !strcmp(argv[1].str, "latency")) {
+		printf("wakeup to run latency, bucket n counts latencies under 2^n usecs\n");
+		for (uint i = 0; i < header->count; i++) {
+			printf("%-20s max %8llu:", rec[i].name, rec[i].latency_max);
+			for (uint b = 0; b < THREAD_LATENCY_BUCKETS; b++)
+				printf(" %u", rec[i].latency_hist[b]);
+			printf("\n");
+		}
+		free(header);
+		return 0;
+	}
+
+	if (argc >= 2 && !strcmp(argv[1].str, "waits")) {
+		/* totals for each wait queue someone is blocked on right now, counted
+		 * over every thread that has been woken from it */
+		printf("%-18s %12s %8s %12s  %s\n", "wait queue", "blk usecs", "wakeups", "avg usecs", "waiters (usecs so far)");
+		for (uint i = 0; i < header->count; i++) {
+			if (!rec[i].wait_queue)
+				continue;
+
+			/* list each queue once, at its first waiter */
+			bool seen = false;
+			for (uint j = 0; j < i && !seen; j++)
+				seen = (rec[j].wait_queue == rec[i].wait_queue);
+			if (seen)
+				continue;
+
+			printf("0x%-16llx %12llu %8u %12llu ", rec[i].wait_queue,
+			       rec[i].wait_queue_blocked_time, rec[i].wait_queue_wakeups,
+			       rec[i].wait_queue_wakeups ? rec[i].wait_queue_blocked_time / rec[i].wait_queue_wakeups : 0);
+			for (uint j = i; j < header->count; j++) {
+				if (rec[j].wait_queue == rec[i].wait_queue)
+					printf(" %s (%llu)", rec[j].name, rec[j].waiting_time);
+			}
+			printf("\n");
+		}
+		free(header);
+		return 0;
+	}
+
+	if (argc >= 2) {
+		printf("usage: %s [latency|waits|dump|reset]\n", argv[0].str);
+		free(header);
+		return ERR_INVALID_ARGS;
+	}
+
+	lk_bigtime_t elapsed = last ? header->timestamp - last->timestamp : header->timestamp;
+	struct thread_stats_dump_record *last_rec = last ? (void *)(last + 1) : NULL;
+
+	printf("%-20s %4s %3s %3s %6s %12s %12s %8s %8s %8s\n",
+	       "name", "st", "pri", "cpu", "%cpu", "run usecs", "blk usecs", "switches", "preempts", "lat max");
+	for (uint i = 0; i < header->count; i++) {
+		uint64_t runtime = rec[i].runtime;
+
+		/* subtract what it had at the last snapshot, if it was around then */
+		if (last_rec) {
+			for (uint j = 0; j < last->count; j++) {
+				if (last_rec[j].id == rec[i].id && last_rec[j].runtime <= runtime) {
+					runtime -= last_rec[j].runtime;
+					break;
+				}
+			}
+		}
+		uint permille = elapsed ? (uint)((runtime * 1000) / elapsed) : 0;
+
+		printf("%-20s %4s %3d %3u %3u.%u %12llu %12llu %8u %8u %8llu\n",
+		       rec[i].name, top_state_str(rec[i].state), rec[i].priority, rec[i].cpu,
+		       permille / 10, permille % 10, rec[i].runtime, rec[i].blocked_time,
+		       rec[i].switches, rec[i].preemptions, rec[i].latency_max);
+	}
+
+	free(last);
+	last = header;
+
+	return 0;
 }
 
 static int cmd_threadload(int argc, const cmd_args *argv)
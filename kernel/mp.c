@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/mp.h>
+
+#include <debug.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+
+#define LOCAL_TRACE 0
+
+/* cpu bookkeeping shared with the scheduler */
+struct mp_state mp;
+
+void mp_set_curr_cpu_active(bool active)
+{
+	if (active)
+		atomic_or((volatile int *)&mp.active_cpus, 1U << arch_curr_cpu_num());
+	else
+		atomic_and((volatile int *)&mp.active_cpus, ~(1U << arch_curr_cpu_num()));
+}
+
+#if WITH_SMP
+void mp_reschedule(mp_cpu_mask_t target)
+{
+	uint local_cpu = arch_curr_cpu_num();
+
+	LTRACEF("local %u, target 0x%x\n", local_cpu, target);
+
+	/* mask out cpus that are not active and the local cpu */
+	target &= mp.active_cpus;
+	target &= ~(1U << local_cpu);
+	if (target == 0)
+		return;
+
+	THREAD_STATS_INC(reschedule_ipis);
+
+	arch_mp_send_ipi(target, MP_IPI_RESCHEDULE);
+}
+
+enum handler_return mp_mbx_reschedule_irq(void)
+{
+	LTRACEF("cpu %u\n", arch_curr_cpu_num());
+
+	/* the interrupt glue calls thread_preempt() on our way out */
+	return mp_is_cpu_active(arch_curr_cpu_num()) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
+}
+#endif
+
+/* vim: set ts=4 sw=4 noexpandtab: */
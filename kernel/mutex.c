@@ -34,8 +34,83 @@
 #include <debug.h>
 #include <assert.h>
 #include <err.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
 
+/* bound on how far a boost is passed along a chain of blocked holders, this
+ * also keeps a deadlock cycle from looping forever */
+#define MUTEX_MAX_INHERIT_DEPTH 16
+
+/* highest priority among the threads waiting for the mutex, or -1 */
+static int mutex_waiter_priority(mutex_t *m)
+{
+	int priority = -1;
+	thread_t *t;
+
+	list_for_every_entry(&m->wait.list, t, thread_t, queue_node) {
+		if (t->priority > priority)
+			priority = t->priority;
+	}
+
+	return priority;
+}
+
+/* oldest of the highest priority waiters */
+static thread_t *mutex_pick_waiter(mutex_t *m)
+{
+	thread_t *best = NULL;
+	thread_t *t;
+
+	list_for_every_entry(&m->wait.list, t, thread_t, queue_node) {
+		if (!best || t->priority > best->priority)
+			best = t;
+	}
+
+	return best;
+}
+
+/* raise the holder of m, and the holders of whatever it is blocked on, to at
+ * least priority. must be called in a critical section */
+static void mutex_boost_holders(mutex_t *m, int priority)
+{
+	for (int depth = 0; m && depth < MUTEX_MAX_INHERIT_DEPTH; depth++) {
+		thread_t *holder = m->holder;
+		if (!holder)
+			break;
+
+		if (priority > holder->inherited_priority)
+			holder->inherited_priority = priority;
+		if (holder->priority >= priority)
+			break;
+
+		thread_set_effective_priority(holder, priority);
+		m = holder->blocking_mutex;
+	}
+}
+
+/* recompute t's priority from its base priority and the waiters on the
+ * mutexes it still holds, then let any change flow down the chain t is
+ * blocked on. must be called in a critical section */
+static void mutex_update_priority(thread_t *t)
+{
+	for (int depth = 0; t && depth < MUTEX_MAX_INHERIT_DEPTH; depth++) {
+		int inherited = -1;
+		mutex_t *m;
+
+		list_for_every_entry(&t->held_mutexes, m, mutex_t, held_node) {
+			inherited = MAX(inherited, mutex_waiter_priority(m));
+		}
+		t->inherited_priority = inherited;
+
+		int priority = MAX(t->base_priority, inherited);
+		if (priority == t->priority)
+			break;
+
+		thread_set_effective_priority(t, priority);
+		t = t->blocking_mutex ? t->blocking_mutex->holder : NULL;
+	}
+}
+
 /**
  * @brief  Initialize a mutex_t
  */
@@ -61,6 +136,10 @@ void mutex_destroy(mutex_t *m)
 #endif
 
 	enter_critical_section();
+	if (m->holder) {
+		list_delete(&m->held_node);
+		mutex_update_priority(m->holder);
+	}
 	m->magic = 0;
 	m->count = 0;
 	wait_queue_destroy(&m->wait, true);
@@ -87,11 +166,19 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
 		      get_current_thread(), get_current_thread()->name, m);
 #endif
 
+	thread_t *current_thread = get_current_thread();
+
 	enter_critical_section();
 
 	status_t ret = NO_ERROR;
 	if (unlikely(++m->count > 1)) {
+		if (timeout != 0)
+			mutex_boost_holders(m, current_thread->priority);
+
+		current_thread->blocking_mutex = m;
 		ret = wait_queue_block(&m->wait, timeout);
+		current_thread->blocking_mutex = NULL;
+
 		if (unlikely(ret < NO_ERROR)) {
 			/* if the acquisition timed out, back out the acquire and exit */
 			if (likely(ret == ERR_TIMED_OUT)) {
@@ -101,15 +188,23 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
 				 * count variable dangerous.
 				 */
 				m->count--;
+
+				/* take back whatever boost we gave the holder */
+				if (m->holder)
+					mutex_update_priority(m->holder);
 			}
 			/* if there was a general error, it may have been destroyed out from
 			 * underneath us, so just exit (which is really an invalid state anyway)
 			 */
 			goto err;
 		}
-	}
 
-	m->holder = get_current_thread();
+		/* mutex_release() handed the mutex to us */
+		DEBUG_ASSERT(m->holder == current_thread);
+	} else {
+		m->holder = current_thread;
+		list_add_tail(&current_thread->held_mutexes, &m->held_node);
+	}
 
 err:
 	exit_critical_section();
@@ -130,15 +225,35 @@ status_t mutex_release(mutex_t *m)
 	}
 #endif
 
+	thread_t *current_thread = get_current_thread();
+	thread_t *t = NULL;
+
 	enter_critical_section();
 
 	m->holder = 0;
+	list_delete(&m->held_node);
 
 	if (unlikely(--m->count >= 1)) {
-		/* release a thread */
-		wait_queue_wake_one(&m->wait, true, NO_ERROR);
+		/* hand the mutex straight to the highest priority waiter, so a boost
+		 * from the waiters still queued follows the mutex to its new holder */
+		t = mutex_pick_waiter(m);
+		if (t) {
+			m->holder = t;
+			list_add_tail(&t->held_mutexes, &m->held_node);
+			t->blocking_mutex = NULL;
+			thread_unblock_from_wait_queue(t, NO_ERROR);
+			mutex_update_priority(t);
+		}
 	}
 
+	/* drop any boost this mutex was giving us */
+	mutex_update_priority(current_thread);
+
+	/* let the new holder run now, ahead of us even at the same priority, as
+	 * waking the wait queue with a reschedule used to */
+	if (t && t->priority >= current_thread->priority)
+		thread_preempt_by(t);
+
 	exit_critical_section();
 	return NO_ERROR;
 }
@@ -35,11 +35,14 @@
 #include <list.h>
 #include <malloc.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <err.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
+#include <kernel/mp.h>
 #include <platform.h>
 #include <target.h>
 #include <lib/heap.h>
@@ -49,35 +52,133 @@
 #endif
 
 #if THREAD_STATS
-struct thread_stats thread_stats;
+struct thread_stats thread_stats[SMP_MAX_CPUS];
 #endif
 
 /* global thread list */
 static struct list_node thread_list;
 
+#if WITH_SMP
+/* the per cpu critical section counts and the lock the outermost section holds */
+int critical_section_count[SMP_MAX_CPUS];
+spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
+#else
 /* the global critical section count */
 int critical_section_count;
+#endif
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues, one set per cpu */
+static struct list_node run_queue[SMP_MAX_CPUS][NUM_PRIORITIES];
+static uint32_t run_queue_bitmap[SMP_MAX_CPUS];
 
 /* the bootstrap thread (statically allocated) */
 static thread_t bootstrap_thread;
 
-/* the idle thread */
-static thread_t *idle_thread;
+/* the idle threads, one per cpu */
+static thread_t *idle_threads[SMP_MAX_CPUS];
+
+#if WITH_SMP
+/* the threads the secondary cpus boot on, they become that cpu's idle thread */
+static thread_t secondary_bootstrap_threads[SMP_MAX_CPUS];
+
+/* what each cpu is running, used to place threads and to expire quantums remotely */
+static thread_t *running_thread[SMP_MAX_CPUS];
+static int cpu_priority[SMP_MAX_CPUS];
+#endif
 
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
 
+/* time slice length for each band of priorities, in msecs */
+static lk_time_t thread_quantum[THREAD_QUANTUM_BANDS];
+
 #if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
-static timer_t preempt_timer;
+/* one shot preemption timers, one per cpu. a cpu's timer is only armed while
+ * another thread at the priority of what it is running is waiting for it. a
+ * thread running alone at its priority runs untimed, leaving the timer wheel
+ * to program the hardware for nothing but real timer expiries */
+static timer_t preempt_timer[SMP_MAX_CPUS];
+static bool preempt_armed[SMP_MAX_CPUS];
+static lk_time_t preempt_slice_start[SMP_MAX_CPUS];
+
+static void thread_arm_preempt_timer(thread_t *t, uint cpu);
+#endif
+
+/* pick the run queue a thread should go into */
+static uint thread_pick_cpu(thread_t *t)
+{
+#if WITH_SMP
+	uint local_cpu = arch_curr_cpu_num();
+	uint last_cpu = t->curr_cpu;
+	mp_cpu_mask_t allowed = t->cpu_affinity & mp_get_active_mask();
+
+	/* none of its cpus are up yet, park it on the first one it may run on */
+	if (allowed == 0)
+		return __builtin_ctz(t->cpu_affinity);
+
+	/* the current thread stays put when yielding or being preempted */
+	if (t == get_current_thread() && (allowed & (1U << local_cpu)))
+		return local_cpu;
+
+	/* go back where it last ran if it would preempt what's there, the cache may still be warm */
+	if ((allowed & (1U << last_cpu)) && cpu_priority[last_cpu] < t->priority)
+		return last_cpu;
+
+	mp_cpu_mask_t idle = allowed & mp_get_idle_mask();
+	if (idle) {
+		if (idle & (1U << last_cpu))
+			return last_cpu;
+		if (idle & (1U << local_cpu))
+			return local_cpu;
+		return __builtin_ctz(idle);
+	}
+
+	if (allowed & (1U << local_cpu))
+		return local_cpu;
+	if (allowed & (1U << last_cpu))
+		return last_cpu;
+	return __builtin_ctz(allowed);
+#else
+	return 0;
 #endif
+}
 
 /* run queue manipulation */
+static void insert_in_run_queue(thread_t *t, bool head)
+{
+	uint cpu = thread_pick_cpu(t);
+
+	t->curr_cpu = cpu;
+	if (head)
+		list_add_head(&run_queue[cpu][t->priority], &t->queue_node);
+	else
+		list_add_tail(&run_queue[cpu][t->priority], &t->queue_node);
+	run_queue_bitmap[cpu] |= (1<<t->priority);
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	/* the thread running there now has company at its priority, time its slice */
+#if WITH_SMP
+	thread_t *running = running_thread[cpu];
+#else
+	thread_t *running = get_current_thread();
+#endif
+	if (running && running->state == THREAD_RUNNING && running->priority == t->priority)
+		thread_arm_preempt_timer(running, cpu);
+#endif
+
+#if WITH_SMP
+	/* kick the other cpu if the new thread should run there now */
+	if (cpu != arch_curr_cpu_num() &&
+	        ((mp_get_idle_mask() & (1U << cpu)) || cpu_priority[cpu] < t->priority)) {
+		/* claim it, so the next thread made runnable looks elsewhere */
+		mp_set_cpu_busy(cpu);
+		cpu_priority[cpu] = t->priority;
+		mp_reschedule(1U << cpu);
+	}
+#endif
+}
+
 static void insert_in_run_queue_head(thread_t *t)
 {
 #if THREAD_CHECKS
@@ -87,8 +188,7 @@ static void insert_in_run_queue_head(thread_t *t)
 	ASSERT(in_critical_section());
 #endif
 
-	list_add_head(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+	insert_in_run_queue(t, true);
 }
 
 static void insert_in_run_queue_tail(thread_t *t)
@@ -100,14 +200,64 @@ static void insert_in_run_queue_tail(thread_t *t)
 	ASSERT(in_critical_section());
 #endif
 
-	list_add_tail(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+	insert_in_run_queue(t, false);
+}
+
+static void remove_from_run_queue(thread_t *t)
+{
+#if THREAD_CHECKS
+	ASSERT(t->state == THREAD_READY);
+	ASSERT(list_in_list(&t->queue_node));
+	ASSERT(in_critical_section());
+#endif
+
+	list_delete(&t->queue_node);
+	if (list_is_empty(&run_queue[t->curr_cpu][t->priority]))
+		run_queue_bitmap[t->curr_cpu] &= ~(1<<t->priority);
+}
+
+#if THREAD_STATS
+/* a thread woken from a wait queue, charge the time it spent there */
+static void thread_stats_wakeup(thread_t *t, wait_queue_t *wait)
+{
+	lk_bigtime_t now = current_time_hires();
+	lk_bigtime_t blocked = now - t->stats.block_start;
+
+	t->stats.blocked_time += blocked;
+	t->stats.ready_time = now;
+	wait->blocked_time += blocked;
+	wait->wakeups++;
 }
 
+/* account the switch from oldthread to newthread */
+static void thread_stats_switch(thread_t *oldthread, thread_t *newthread, lk_bigtime_t now)
+{
+	oldthread->stats.runtime += now - oldthread->stats.last_run;
+	if (oldthread->state == THREAD_READY)
+		oldthread->stats.preemptions++;
+
+	newthread->stats.last_run = now;
+	newthread->stats.switches++;
+	if (newthread->stats.ready_time) {
+		lk_bigtime_t latency = now - newthread->stats.ready_time;
+		uint bucket = latency ? 32 - __builtin_clz((uint32_t)MIN(latency, 0xffffffffULL)) : 0;
+
+		newthread->stats.latency_hist[MIN(bucket, THREAD_LATENCY_BUCKETS - 1)]++;
+		if (latency > newthread->stats.latency_max)
+			newthread->stats.latency_max = latency;
+		newthread->stats.ready_time = 0;
+	}
+}
+#else
+static inline void thread_stats_wakeup(thread_t *t, wait_queue_t *wait) {}
+#endif
+
 static void init_thread_struct(thread_t *t, const char *name)
 {
 	memset(t, 0, sizeof(thread_t));
 	t->magic = THREAD_MAGIC;
+	list_initialize(&t->held_mutexes);
+	t->inherited_priority = -1;
 	strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -154,10 +304,12 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 	t->entry = entry;
 	t->arg = arg;
 	t->priority = priority;
+	t->base_priority = priority;
 	t->saved_critical_section_count = 1; /* we always start inside a critical section */
 	t->state = THREAD_SUSPENDED;
 	t->blocking_wait_queue = NULL;
 	t->wait_queue_block_ret = NO_ERROR;
+	t->cpu_affinity = MP_CPU_ALL;
 
 	t->retcode = 0;
 	wait_queue_init(&t->retcode_wait_queue);
@@ -218,9 +370,10 @@ status_t thread_set_real_time(thread_t *t)
 
 	enter_critical_section();
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	if (t == get_current_thread()) {
-		/* if we're currently running, cancel the preemption timer. */
-		timer_cancel(&preempt_timer);
+	if (t->state == THREAD_RUNNING && preempt_armed[t->curr_cpu]) {
+		/* if it's currently running, cancel the preemption timer. */
+		timer_cancel(&preempt_timer[t->curr_cpu]);
+		preempt_armed[t->curr_cpu] = false;
 	}
 #endif
 	t->flags |= THREAD_FLAG_REAL_TIME;
@@ -234,6 +387,132 @@ static bool thread_is_real_time(thread_t *t)
 	return !!(t->flags & THREAD_FLAG_REAL_TIME);
 }
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+static enum handler_return thread_preempt_timer_tick(timer_t *timer, lk_time_t now, void *arg)
+{
+	uint cpu = (uintptr_t)arg;
+
+	preempt_armed[cpu] = false;
+
+#if WITH_SMP
+	/* the timer wheel runs on whichever cpu took the interrupt, pass the
+	 * expiry on to the cpu the slice belongs to */
+	if (cpu != arch_curr_cpu_num()) {
+		running_thread[cpu]->remaining_quantum = 0;
+		mp_reschedule(1U << cpu);
+		return INT_NO_RESCHEDULE;
+	}
+#endif
+
+	/* out of quantum, thread_preempt() will send it to the back of the queue */
+	get_current_thread()->remaining_quantum = 0;
+
+	return INT_RESCHEDULE;
+}
+
+/* start timing the slice of t, running on cpu, if something else at its
+ * priority wants that cpu */
+static void thread_arm_preempt_timer(thread_t *t, uint cpu)
+{
+	if (preempt_armed[cpu] || thread_is_real_time(t))
+		return;
+	if ((run_queue_bitmap[cpu] & (1U << t->priority)) == 0)
+		return;
+
+	preempt_armed[cpu] = true;
+	preempt_slice_start[cpu] = current_time();
+	timer_set_oneshot(&preempt_timer[cpu], MAX(t->remaining_quantum, 1),
+	                  thread_preempt_timer_tick, (void *)(uintptr_t)cpu);
+}
+
+/* charge the outgoing thread for the part of its slice it used */
+static void thread_disarm_preempt_timer(thread_t *t, uint cpu)
+{
+	if (!preempt_armed[cpu])
+		return;
+
+	t->remaining_quantum -= current_time() - preempt_slice_start[cpu];
+	timer_cancel(&preempt_timer[cpu]);
+	preempt_armed[cpu] = false;
+}
+#endif
+
+/**
+ * @brief Set the time slice for a band of priorities
+ *
+ * @param priority Any priority in the band to change
+ * @param quantum Slice length in msecs
+ *
+ * Threads pick up the new length the next time their quantum is refilled.
+ */
+status_t thread_set_quantum(int priority, lk_time_t quantum)
+{
+	if (priority < LOWEST_PRIORITY || priority > HIGHEST_PRIORITY || quantum == 0)
+		return ERR_INVALID_ARGS;
+
+	enter_critical_section();
+	thread_quantum[priority / THREAD_QUANTUM_BAND_SIZE] = quantum;
+	exit_critical_section();
+
+	return NO_ERROR;
+}
+
+lk_time_t thread_get_quantum(int priority)
+{
+	if (priority < LOWEST_PRIORITY || priority > HIGHEST_PRIORITY)
+		return 0;
+
+	return thread_quantum[priority / THREAD_QUANTUM_BAND_SIZE];
+}
+
+/**
+ * @brief Restrict the cpus a thread may run on
+ *
+ * @param t Thread to change
+ * @param mask Bitmap of cpus, cpus beyond SMP_MAX_CPUS are ignored
+ *
+ * A thread that is running on a cpu it is no longer allowed on moves at its
+ * next reschedule, which is forced right away.
+ *
+ * @return NO_ERROR on success, ERR_INVALID_ARGS if no usable cpu is in the mask
+ */
+status_t thread_set_cpu_affinity(thread_t *t, mp_cpu_mask_t mask)
+{
+	if (!t)
+		return ERR_INVALID_ARGS;
+
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+#endif
+
+	if (SMP_MAX_CPUS < sizeof(mp_cpu_mask_t) * 8)
+		mask &= (1U << SMP_MAX_CPUS) - 1;
+	if (mask == 0)
+		return ERR_INVALID_ARGS;
+
+	enter_critical_section();
+
+	t->cpu_affinity = mask;
+
+#if WITH_SMP
+	if ((mask & (1U << t->curr_cpu)) == 0) {
+		if (t->state == THREAD_READY) {
+			/* move it to a run queue it is allowed on */
+			remove_from_run_queue(t);
+			insert_in_run_queue_tail(t);
+		} else if (t == get_current_thread()) {
+			thread_yield();
+		} else if (t->state == THREAD_RUNNING) {
+			mp_reschedule(1U << t->curr_cpu);
+		}
+	}
+#endif
+
+	exit_critical_section();
+
+	return NO_ERROR;
+}
+
 /**
  * @brief  Make a suspended thread executable.
  *
@@ -403,6 +682,81 @@ static void idle_thread_routine(void)
 		arch_idle();
 }
 
+#if WITH_SMP
+/* find the best thread queued on another cpu that is allowed to run here */
+static thread_t *thread_steal(uint cpu)
+{
+	thread_t *best = NULL;
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		uint32_t bitmap = run_queue_bitmap[i];
+
+		if (i == cpu)
+			continue;
+
+		while (bitmap) {
+			int prio = HIGHEST_PRIORITY - __builtin_clz(bitmap) - (32 - NUM_PRIORITIES);
+			if (best && prio <= best->priority)
+				break;
+
+			thread_t *t;
+			list_for_every_entry(&run_queue[i][prio], t, thread_t, queue_node) {
+				if (t->cpu_affinity & (1U << cpu)) {
+					best = t;
+					break;
+				}
+			}
+			if (best && best->priority == prio)
+				break;
+
+			bitmap &= ~(1<<prio);
+		}
+	}
+
+	if (best)
+		remove_from_run_queue(best);
+
+	return best;
+}
+#endif
+
+/* dequeue the next thread to run on this cpu */
+static thread_t *thread_pick_next(uint cpu)
+{
+	thread_t *newthread;
+
+	// at the moment, can't deal with more than 32 priority levels
+	ASSERT(NUM_PRIORITIES <= 32);
+
+	// should at least find the idle thread
+#if THREAD_CHECKS
+	ASSERT(run_queue_bitmap[cpu] != 0);
+#endif
+
+	int next_queue = HIGHEST_PRIORITY - __builtin_clz(run_queue_bitmap[cpu]) - (32 - NUM_PRIORITIES);
+	//dprintf(SPEW, "bitmap 0x%x, next %d\n", run_queue_bitmap[cpu], next_queue);
+
+#if WITH_SMP
+	/* nothing but idle work here, help out another cpu */
+	if (next_queue == IDLE_PRIORITY) {
+		newthread = thread_steal(cpu);
+		if (newthread)
+			return newthread;
+	}
+#endif
+
+	newthread = list_remove_head_type(&run_queue[cpu][next_queue], thread_t, queue_node);
+
+	if (list_is_empty(&run_queue[cpu][next_queue]))
+		run_queue_bitmap[cpu] &= ~(1<<next_queue);
+
+#if THREAD_CHECKS
+	ASSERT(newthread);
+#endif
+
+	return newthread;
+}
+
 /**
  * @brief  Cause another thread to be executed.
  *
@@ -419,6 +773,7 @@ void thread_resched(void)
 	thread_t *newthread;
 
 	thread_t *current_thread = get_current_thread();
+	uint cpu = arch_curr_cpu_num();
 
 //	printf("thread_resched: current %p: ", current_thread);
 //	dump_thread(current_thread);
@@ -431,79 +786,66 @@ void thread_resched(void)
 
 	oldthread = current_thread;
 
-	// at the moment, can't deal with more than 32 priority levels
-	ASSERT(NUM_PRIORITIES <= 32);
-
-	// should at least find the idle thread
-#if THREAD_CHECKS
-	ASSERT(run_queue_bitmap != 0);
-#endif
-
-	int next_queue = HIGHEST_PRIORITY - __builtin_clz(run_queue_bitmap) - (32 - NUM_PRIORITIES);
-	//dprintf(SPEW, "bitmap 0x%x, next %d\n", run_queue_bitmap, next_queue);
-
-	newthread = list_remove_head_type(&run_queue[next_queue], thread_t, queue_node);
-
-	if (list_is_empty(&run_queue[next_queue]))
-		run_queue_bitmap &= ~(1<<next_queue);
-
-#if THREAD_CHECKS
-	ASSERT(newthread);
-#endif
+	newthread = thread_pick_next(cpu);
 
 //	printf("newthread: ");
 //	dump_thread(newthread);
 
 	newthread->state = THREAD_RUNNING;
 
-	if (newthread == oldthread)
-		return;
+#if WITH_SMP
+	newthread->curr_cpu = cpu;
+	running_thread[cpu] = newthread;
+	cpu_priority[cpu] = newthread->priority;
+	if (newthread == idle_threads[cpu])
+		mp_set_cpu_idle(cpu);
+	else
+		mp_set_cpu_busy(cpu);
+#endif
 
 	/* set up quantum for the new thread if it was consumed */
 	if (newthread->remaining_quantum <= 0) {
-		newthread->remaining_quantum = 5; // XXX make this smarter
+		newthread->remaining_quantum = thread_quantum[newthread->priority / THREAD_QUANTUM_BAND_SIZE];
 	}
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	/* one shot preemption deadline for the new thread, if it needs one at all */
+	if (newthread != oldthread)
+		thread_disarm_preempt_timer(oldthread, cpu);
+	thread_arm_preempt_timer(newthread, cpu);
+#endif
+
+	if (newthread == oldthread)
+		return;
+
 #if THREAD_STATS
 	THREAD_STATS_INC(context_switches);
 
-	if (oldthread == idle_thread) {
-		lk_bigtime_t now = current_time_hires();
-		thread_stats.idle_time += now - thread_stats.last_idle_timestamp;
+	lk_bigtime_t now = current_time_hires();
+	if (oldthread == idle_threads[cpu]) {
+		thread_stats[cpu].idle_time += now - thread_stats[cpu].last_idle_timestamp;
+		THREAD_STATS_INC(idle_wakeups);
 	}
-	if (newthread == idle_thread) {
-		thread_stats.last_idle_timestamp = current_time_hires();
+	if (newthread == idle_threads[cpu]) {
+		thread_stats[cpu].last_idle_timestamp = now;
 	}
+	thread_stats_switch(oldthread, newthread, now);
 #endif
 
 	KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
 #if THREAD_CHECKS
-	ASSERT(critical_section_count > 0);
+	ASSERT(CRITICAL_SECTION_COUNT > 0);
 	ASSERT(newthread->saved_critical_section_count > 0);
 #endif
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-	if (thread_is_real_time(newthread)) {
-		if (!thread_is_real_time(oldthread)) {
-			/* if we're switching from a non real time to a real time, cancel
-			 * the preemption timer. */
-			timer_cancel(&preempt_timer);
-		}
-	} else if (thread_is_real_time(oldthread)) {
-		/* if we're switching from a real time (or idle thread) to a regular one,
-		 * set up a periodic timer to run our preemption tick. */
-		timer_set_periodic(&preempt_timer, 10, (timer_callback)thread_timer_tick, NULL);
-	}
-#endif
-
 	/* set some optional target debug leds */
-	target_set_debug_led(0, newthread != idle_thread);
+	target_set_debug_led(0, newthread != idle_threads[cpu]);
 
 	/* do the switch */
-	oldthread->saved_critical_section_count = critical_section_count;
+	oldthread->saved_critical_section_count = CRITICAL_SECTION_COUNT;
 	set_current_thread(newthread);
-	critical_section_count = newthread->saved_critical_section_count;
+	CRITICAL_SECTION_COUNT = newthread->saved_critical_section_count;
 	arch_context_switch(oldthread, newthread);
 }
 
@@ -564,7 +906,7 @@ void thread_preempt(void)
 #endif
 
 #if THREAD_STATS
-	if (current_thread != idle_thread)
+	if (current_thread != idle_threads[arch_curr_cpu_num()])
 		THREAD_STATS_INC(preempts); /* only track when a meaningful preempt happens */
 #endif
 
@@ -579,6 +921,37 @@ void thread_preempt(void)
 	thread_resched();
 }
 
+/**
+ * @brief  Hand the cpu to a thread that was just made ready
+ *
+ * The current thread goes back into the head of its run queue and \a t is
+ * moved in front of it, so \a t runs first even at the same priority. This is
+ * the ordering wait_queue_wake_one() gives a woken thread when asked to
+ * reschedule.
+ *
+ * Must be called inside a critical section.
+ */
+void thread_preempt_by(thread_t *t)
+{
+	thread_t *current_thread = get_current_thread();
+
+#if THREAD_CHECKS
+	ASSERT(current_thread->state == THREAD_RUNNING);
+	ASSERT(t->magic == THREAD_MAGIC);
+	ASSERT(in_critical_section());
+#endif
+
+	current_thread->state = THREAD_READY;
+	insert_in_run_queue_head(current_thread);
+
+	if (t->state == THREAD_READY) {
+		remove_from_run_queue(t);
+		insert_in_run_queue_head(t);
+	}
+
+	thread_resched();
+}
+
 /**
  * @brief  Suspend thread until woken.
  *
@@ -612,20 +985,85 @@ void thread_unblock(thread_t *t, bool resched)
 #endif
 
 	t->state = THREAD_READY;
+#if THREAD_STATS
+	t->stats.ready_time = current_time_hires();
+#endif
 	insert_in_run_queue_head(t);
 	if (resched)
 		thread_resched();
 }
 
+/**
+ * @brief  Change the priority a thread is scheduled at
+ *
+ * Used by priority inheritance to boost a mutex holder to the priority of
+ * its highest waiter and to drop it back again. The base priority set at
+ * creation or by thread_set_priority() is left untouched. A ready thread is
+ * moved to the run queue for its new priority, to the head if it was raised
+ * so the boost takes effect at the next reschedule.
+ *
+ * Must be called inside a critical section.
+ */
+void thread_set_effective_priority(thread_t *t, int priority)
+{
+#if THREAD_CHECKS
+	ASSERT(t->magic == THREAD_MAGIC);
+	ASSERT(in_critical_section());
+#endif
+
+	if (priority < LOWEST_PRIORITY)
+		priority = LOWEST_PRIORITY;
+	if (priority > HIGHEST_PRIORITY)
+		priority = HIGHEST_PRIORITY;
+
+	if (t->priority == priority)
+		return;
+
+	if (t->state == THREAD_READY) {
+		bool raise = priority > t->priority;
+
+		remove_from_run_queue(t);
+		t->priority = priority;
+		insert_in_run_queue(t, raise);
+	} else {
+		t->priority = priority;
+#if WITH_SMP
+		if (t->state == THREAD_RUNNING)
+			cpu_priority[t->curr_cpu] = priority;
+#endif
+	}
+}
+
 enum handler_return thread_timer_tick(void)
 {
 	thread_t *current_thread = get_current_thread();
 
+#if WITH_SMP
+	/* the tick only arrives on one cpu, age the threads running on the others from here */
+	uint local_cpu = arch_curr_cpu_num();
+	mp_cpu_mask_t expired = 0;
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		thread_t *t = running_thread[i];
+
+		if (i == local_cpu || !t || thread_is_real_time(t))
+			continue;
+
+		/* only bother the cpu if something is waiting to take over */
+		t->remaining_quantum -= TIMER_TICK_INTERVAL;
+		if (t->remaining_quantum <= 0 && (run_queue_bitmap[i] >> t->priority))
+			expired |= 1U << i;
+	}
+	mp_reschedule(expired);
+#endif
+
 	if (thread_is_real_time(current_thread))
 		return INT_NO_RESCHEDULE;
 
-	current_thread->remaining_quantum--;
-	if (current_thread->remaining_quantum <= 0) {
+	/* a thread alone at its priority keeps the cpu without a trip through the scheduler */
+	current_thread->remaining_quantum -= TIMER_TICK_INTERVAL;
+	if (current_thread->remaining_quantum <= 0 &&
+	        (run_queue_bitmap[arch_curr_cpu_num()] >> current_thread->priority)) {
 		return INT_RESCHEDULE;
 	} else {
 		return INT_NO_RESCHEDULE;
@@ -643,6 +1081,9 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
 #endif
 
 	t->state = THREAD_READY;
+#if THREAD_STATS
+	t->stats.ready_time = current_time_hires();
+#endif
 	insert_in_run_queue_head(t);
 
 	return INT_RESCHEDULE;
@@ -685,27 +1126,41 @@ void thread_sleep(lk_time_t delay)
  */
 void thread_init_early(void)
 {
-	int i;
+	int i, cpu;
 
 	/* initialize the run queues */
-	for (i=0; i < NUM_PRIORITIES; i++)
-		list_initialize(&run_queue[i]);
+	for (cpu=0; cpu < SMP_MAX_CPUS; cpu++) {
+		for (i=0; i < NUM_PRIORITIES; i++)
+			list_initialize(&run_queue[cpu][i]);
+	}
 
 	/* initialize the thread list */
 	list_initialize(&thread_list);
 
+	for (i=0; i < THREAD_QUANTUM_BANDS; i++)
+		thread_quantum[i] = THREAD_DEFAULT_QUANTUM;
+
 	/* create a thread to cover the current running state */
 	thread_t *t = &bootstrap_thread;
 	init_thread_struct(t, "bootstrap");
 
 	/* half construct this thread, since we're already running */
 	t->priority = HIGHEST_PRIORITY;
+	t->base_priority = HIGHEST_PRIORITY;
 	t->state = THREAD_RUNNING;
 	t->saved_critical_section_count = 1;
 	t->flags = THREAD_FLAG_DETACHED;
+	t->curr_cpu = arch_curr_cpu_num();
+	t->cpu_affinity = MP_CPU_ALL;
 	wait_queue_init(&t->retcode_wait_queue);
 	list_add_head(&thread_list, &t->thread_list_node);
 	set_current_thread(t);
+
+	mp_set_curr_cpu_active(true);
+#if WITH_SMP
+	running_thread[t->curr_cpu] = t;
+	cpu_priority[t->curr_cpu] = t->priority;
+#endif
 }
 
 /**
@@ -716,10 +1171,81 @@ void thread_init_early(void)
 void thread_init(void)
 {
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	timer_initialize(&preempt_timer);
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		timer_initialize(&preempt_timer[i]);
 #endif
 }
 
+#if WITH_SMP
+/**
+ * @brief Give a secondary cpu a thread context
+ *
+ * Called on the secondary cpu with interrupts disabled, before anything that
+ * may want the current thread, such as printf.
+ */
+void thread_secondary_cpu_init_early(void)
+{
+	uint cpu = arch_curr_cpu_num();
+	thread_t *t = &secondary_bootstrap_threads[cpu];
+	char name[16];
+
+	DEBUG_ASSERT(cpu > 0 && cpu < SMP_MAX_CPUS);
+
+	snprintf(name, sizeof(name), "idle %u", cpu);
+	init_thread_struct(t, name);
+
+	/* half construct this thread, since we're already running */
+	t->priority = IDLE_PRIORITY;
+	t->base_priority = IDLE_PRIORITY;
+#if THREAD_STATS
+	t->stats.last_run = current_time_hires();
+#endif
+	t->state = THREAD_RUNNING;
+	t->saved_critical_section_count = 1;
+	t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_REAL_TIME;
+	t->curr_cpu = cpu;
+	t->cpu_affinity = 1U << cpu;
+	wait_queue_init(&t->retcode_wait_queue);
+	set_current_thread(t);
+}
+
+/**
+ * @brief Put a secondary cpu in service
+ *
+ * Called from within a critical section after the arch has set up the cpu's
+ * interrupts. The boot thread becomes the cpu's idle thread. Does not return.
+ */
+void thread_secondary_cpu_entry(void)
+{
+	uint cpu = arch_curr_cpu_num();
+	thread_t *t = get_current_thread();
+
+#if THREAD_CHECKS
+	ASSERT(CRITICAL_SECTION_COUNT == 1);
+#endif
+
+	list_add_head(&thread_list, &t->thread_list_node);
+
+	idle_threads[cpu] = t;
+	running_thread[cpu] = t;
+	cpu_priority[cpu] = t->priority;
+	mp_set_cpu_idle(cpu);
+#if THREAD_STATS
+	thread_stats[cpu].last_idle_timestamp = current_time_hires();
+#endif
+
+	mp_set_curr_cpu_active(true);
+
+	dprintf(SPEW, "cpu %u now active\n", cpu);
+
+	/* release the critical section we came in with and look for work */
+	exit_critical_section();
+	thread_yield();
+
+	idle_thread_routine();
+}
+#endif
+
 /**
  * @brief Change name of current thread
  */
@@ -740,7 +1266,14 @@ void thread_set_priority(int priority)
 		priority = LOWEST_PRIORITY;
 	if (priority > HIGHEST_PRIORITY)
 		priority = HIGHEST_PRIORITY;
-	get_current_thread()->priority = priority;
+
+	thread_t *current_thread = get_current_thread();
+
+	enter_critical_section();
+	current_thread->base_priority = priority;
+	/* a boost from a mutex we hold stays in effect until it is released */
+	thread_set_effective_priority(current_thread, MAX(priority, current_thread->inherited_priority));
+	exit_critical_section();
 }
 
 /**
@@ -752,14 +1285,20 @@ void thread_set_priority(int priority)
  */
 void thread_become_idle(void)
 {
-	idle_thread = get_current_thread();
+	thread_t *t = get_current_thread();
+	uint cpu = arch_curr_cpu_num();
+
+	idle_threads[cpu] = t;
 
 	thread_set_name("idle");
 	thread_set_priority(IDLE_PRIORITY);
 
+	/* the idle thread has to stay on its own cpu's run queue */
+	t->cpu_affinity = 1U << cpu;
+
 	/* mark the idle thread as real time, to avoid running the preemption
 	 * timer when it is scheduled. */
-	thread_set_real_time(idle_thread);
+	thread_set_real_time(t);
 
 	/* release the implicit boot critical section and yield to the scheduler */
 	exit_critical_section();
@@ -787,12 +1326,21 @@ static const char *thread_state_to_str(enum thread_state state)
 void dump_thread(thread_t *t)
 {
 	dprintf(INFO, "dump_thread: t %p (%s)\n", t, t->name);
-	dprintf(INFO, "\tstate %s, priority %d, remaining quantum %d, critical section %d\n",
-				  thread_state_to_str(t->state), t->priority, t->remaining_quantum,
+	dprintf(INFO, "\tstate %s, priority %d (base %d), remaining quantum %d, critical section %d\n",
+				  thread_state_to_str(t->state), t->priority, t->base_priority, t->remaining_quantum,
 				  t->saved_critical_section_count);
 	dprintf(INFO, "\tstack %p, stack_size %zd\n", t->stack, t->stack_size);
 	dprintf(INFO, "\tentry %p, arg %p, flags 0x%x\n", t->entry, t->arg, t->flags);
-	dprintf(INFO, "\twait queue %p, wait queue ret %d\n", t->blocking_wait_queue, t->wait_queue_block_ret);
+	dprintf(INFO, "\tcurr_cpu %u, cpu_affinity 0x%x\n", t->curr_cpu, t->cpu_affinity);
+	dprintf(INFO, "\twait queue %p, wait queue ret %d, blocking mutex %p\n",
+				  t->blocking_wait_queue, t->wait_queue_block_ret, t->blocking_mutex);
+#if THREAD_STATS
+	if (t->state == THREAD_BLOCKED && t->blocking_wait_queue) {
+		dprintf(INFO, "\twaiting %llu usecs, wait queue totals: %llu usecs blocked, %u wakeups\n",
+					  current_time_hires() - t->stats.block_start,
+					  t->blocking_wait_queue->blocked_time, t->blocking_wait_queue->wakeups);
+	}
+#endif
 	dprintf(INFO, "\ttls:");
 	int i;
 	for (i=0; i < MAX_TLS_ENTRY; i++) {
@@ -815,6 +1363,102 @@ void dump_all_threads(void)
 	exit_critical_section();
 }
 
+#if THREAD_STATS
+size_t thread_stats_dump(void *buf, size_t len)
+{
+	struct thread_stats_dump_header *header = buf;
+	struct thread_stats_dump_record *rec;
+	uint32_t count = 0;
+	thread_t *t;
+
+	enter_critical_section();
+
+	if (!buf) {
+		list_for_every_entry(&thread_list, t, thread_t, thread_list_node)
+			count++;
+		exit_critical_section();
+		return sizeof(*header) + count * sizeof(*rec);
+	}
+
+	if (len < sizeof(*header)) {
+		exit_critical_section();
+		return 0;
+	}
+
+	lk_bigtime_t now = current_time_hires();
+	rec = (struct thread_stats_dump_record *)(header + 1);
+
+	list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+		if (len < sizeof(*header) + (count + 1) * sizeof(*rec))
+			break;
+
+		memset(rec, 0, sizeof(*rec));
+		rec->id = (uintptr_t)t;
+		strlcpy(rec->name, t->name, sizeof(rec->name));
+		rec->priority = t->priority;
+		rec->base_priority = t->base_priority;
+		rec->state = t->state;
+		rec->cpu = t->curr_cpu;
+		rec->runtime = t->stats.runtime;
+		if (t->state == THREAD_RUNNING)
+			rec->runtime += now - t->stats.last_run;
+		rec->blocked_time = t->stats.blocked_time;
+		rec->latency_max = t->stats.latency_max;
+		rec->switches = t->stats.switches;
+		rec->preemptions = t->stats.preemptions;
+		memcpy(rec->latency_hist, t->stats.latency_hist, sizeof(rec->latency_hist));
+		if (t->state == THREAD_BLOCKED && t->blocking_wait_queue) {
+			rec->wait_queue = (uintptr_t)t->blocking_wait_queue;
+			rec->wait_queue_blocked_time = t->blocking_wait_queue->blocked_time;
+			rec->wait_queue_wakeups = t->blocking_wait_queue->wakeups;
+			rec->waiting_time = now - t->stats.block_start;
+		}
+
+		rec++;
+		count++;
+	}
+
+	exit_critical_section();
+
+	header->magic = THREAD_STATS_DUMP_MAGIC;
+	header->version = THREAD_STATS_DUMP_VERSION;
+	header->header_size = sizeof(*header);
+	header->record_size = sizeof(*rec);
+	header->count = count;
+	header->num_cpus = SMP_MAX_CPUS;
+	header->timestamp = now;
+
+	return sizeof(*header) + count * sizeof(*rec);
+}
+
+void thread_stats_reset(void)
+{
+	thread_t *t;
+
+	enter_critical_section();
+	lk_bigtime_t now = current_time_hires();
+	list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+		lk_bigtime_t last_run = t->stats.last_run;
+		lk_bigtime_t ready_time = t->stats.ready_time;
+		lk_bigtime_t block_start = t->stats.block_start;
+
+		memset(&t->stats, 0, sizeof(t->stats));
+
+		/* keep the in flight timestamps, restarting a running thread's slice */
+		t->stats.last_run = (t->state == THREAD_RUNNING) ? now : last_run;
+		t->stats.ready_time = ready_time;
+		t->stats.block_start = block_start;
+
+		/* queues nobody is blocked on keep their totals, there's no list of them */
+		if (t->state == THREAD_BLOCKED && t->blocking_wait_queue) {
+			t->blocking_wait_queue->blocked_time = 0;
+			t->blocking_wait_queue->wakeups = 0;
+		}
+	}
+	exit_critical_section();
+}
+#endif
+
 /** @} */
 
 
@@ -879,6 +1523,9 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 	current_thread->state = THREAD_BLOCKED;
 	current_thread->blocking_wait_queue = wait;
 	current_thread->wait_queue_block_ret = NO_ERROR;
+#if THREAD_STATS
+	current_thread->stats.block_start = current_time_hires();
+#endif
 
 	/* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
 	if (timeout != INFINITE_TIME) {
@@ -931,6 +1578,7 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
 		t->state = THREAD_READY;
 		t->wait_queue_block_ret = wait_queue_error;
 		t->blocking_wait_queue = NULL;
+		thread_stats_wakeup(t, wait);
 
 		/* if we're instructed to reschedule, stick the current thread on the head
 		 * of the run queue first, so that the newly awakened thread gets a chance to run
@@ -994,6 +1642,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 		t->state = THREAD_READY;
 		t->wait_queue_block_ret = wait_queue_error;
 		t->blocking_wait_queue = NULL;
+		thread_stats_wakeup(t, wait);
 
 		insert_in_run_queue_head(t);
 		ret++;
@@ -1054,6 +1703,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
 
 	list_delete(&t->queue_node);
 	t->blocking_wait_queue->count--;
+	thread_stats_wakeup(t, t->blocking_wait_queue);
 	t->blocking_wait_queue = NULL;
 	t->state = THREAD_READY;
 	t->wait_queue_block_ret = wait_queue_error;
@@ -38,6 +38,7 @@
 #include <trace.h>
 #include <assert.h>
 #include <list.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -46,7 +47,43 @@
 
 #define LOCAL_TRACE 0
 
-static struct list_node timer_queue;
+/*
+ * Pending timers are kept in a two level hashed timing wheel. The first level
+ * has one slot per millisecond for the next TIMER_WHEEL0_SIZE ms, the second
+ * level has one slot per rotation of the first level. Timers further out than
+ * that sit on an unsorted overflow list that is rescanned once per rotation of
+ * the second level. Arming and canceling are O(1), a second level slot is
+ * cascaded into the first level as soon as the wheel moves into the range
+ * it covers, so the slot for the current range is always empty.
+ */
+#define TIMER_WHEEL0_BITS 8
+#define TIMER_WHEEL0_SIZE (1U << TIMER_WHEEL0_BITS)
+#define TIMER_WHEEL0_MASK (TIMER_WHEEL0_SIZE - 1)
+#define TIMER_WHEEL1_BITS 6
+#define TIMER_WHEEL1_SIZE (1U << TIMER_WHEEL1_BITS)
+#define TIMER_WHEEL1_MASK (TIMER_WHEEL1_SIZE - 1)
+#define TIMER_WHEEL_SPAN (1U << (TIMER_WHEEL0_BITS + TIMER_WHEEL1_BITS))
+
+static struct list_node timer_wheel0[TIMER_WHEEL0_SIZE];
+static struct list_node timer_wheel1[TIMER_WHEEL1_SIZE];
+static struct list_node timer_overflow;
+
+/* bitmaps of the non empty slots in each level */
+static uint32_t timer_wheel0_bitmap[TIMER_WHEEL0_SIZE / 32];
+static uint32_t timer_wheel1_bitmap[TIMER_WHEEL1_SIZE / 32];
+
+/* the next millisecond the wheel will process, slots are relative to this */
+static lk_time_t timer_wheel_time;
+static uint timer_count;
+
+/* timer_tick() is walking the wheel, which must not move under it */
+static bool timer_ticking;
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* expiry the hardware one shot timer is currently programmed for */
+static bool timer_deadline_set;
+static lk_time_t timer_deadline;
+#endif
 
 static enum handler_return timer_tick(void *arg, lk_time_t now);
 
@@ -58,22 +95,176 @@ void timer_initialize(timer_t *timer)
 	*timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+static inline void timer_bitmap_set(uint32_t *bitmap, uint slot)
+{
+	bitmap[slot / 32] |= (1U << (slot % 32));
+}
+
+static inline void timer_bitmap_clear(uint32_t *bitmap, uint slot)
+{
+	bitmap[slot / 32] &= ~(1U << (slot % 32));
+}
+
+/* find the first non empty slot in [start, end), returns -1 if none */
+static int timer_bitmap_find(const uint32_t *bitmap, uint start, uint end)
+{
+	while (start < end) {
+		uint32_t word = bitmap[start / 32] >> (start % 32);
+		if (word) {
+			uint bit = start + __builtin_ctz(word);
+			return (bit < end) ? (int)bit : -1;
+		}
+
+		start = ROUNDUP(start + 1, 32);
+	}
+
+	return -1;
+}
+
 static void insert_timer_in_queue(timer_t *timer)
 {
-	timer_t *entry;
+	lk_time_t expires = timer->scheduled_time;
 
 	LTRACEF("timer %p, scheduled %lu, periodic %lu\n", timer, timer->scheduled_time, timer->periodic_time);
 
-	list_for_every_entry(&timer_queue, entry, timer_t, node) {
-		if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-			list_add_before(&entry->node, &timer->node);
-			return;
+	/* anything already due goes in the slot the wheel processes next */
+	if (TIME_LT(expires, timer_wheel_time))
+		expires = timer_wheel_time;
+
+	lk_time_t delta = expires - timer_wheel_time;
+
+	if (delta < TIMER_WHEEL0_SIZE) {
+		uint slot = expires & TIMER_WHEEL0_MASK;
+		list_add_tail(&timer_wheel0[slot], &timer->node);
+		timer_bitmap_set(timer_wheel0_bitmap, slot);
+	} else if (delta < TIMER_WHEEL_SPAN) {
+		uint slot = (expires >> TIMER_WHEEL0_BITS) & TIMER_WHEEL1_MASK;
+		list_add_tail(&timer_wheel1[slot], &timer->node);
+		timer_bitmap_set(timer_wheel1_bitmap, slot);
+	} else {
+		list_add_tail(&timer_overflow, &timer->node);
+	}
+
+	timer_count++;
+}
+
+static void remove_timer_from_queue(timer_t *timer)
+{
+	struct list_node *head = timer->node.next;
+
+	/* if this is the last timer in a wheel slot, the neighbor on both sides is the slot */
+	if (head == timer->node.prev) {
+		if (head >= &timer_wheel0[0] && head < &timer_wheel0[TIMER_WHEEL0_SIZE])
+			timer_bitmap_clear(timer_wheel0_bitmap, head - timer_wheel0);
+		else if (head >= &timer_wheel1[0] && head < &timer_wheel1[TIMER_WHEEL1_SIZE])
+			timer_bitmap_clear(timer_wheel1_bitmap, head - timer_wheel1);
+	}
+
+	list_delete(&timer->node);
+	timer_count--;
+}
+
+/* move the timers in a slot of the second level down, called as the first level wraps */
+static void timer_cascade(uint slot)
+{
+	timer_t *timer;
+
+	while ((timer = list_peek_head_type(&timer_wheel1[slot], timer_t, node))) {
+		remove_timer_from_queue(timer);
+		insert_timer_in_queue(timer);
+	}
+}
+
+/* pull in any overflow timers that now fall inside the wheel */
+static void timer_rescan_overflow(void)
+{
+	timer_t *timer, *temp;
+
+	list_for_every_entry_safe(&timer_overflow, timer, temp, timer_t, node) {
+		if (timer->scheduled_time - timer_wheel_time < TIMER_WHEEL_SPAN) {
+			remove_timer_from_queue(timer);
+			insert_timer_in_queue(timer);
+		}
+	}
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* find the earliest expiry of all the queued timers */
+static bool timer_next_expiry(lk_time_t *expiry)
+{
+	if (timer_count == 0)
+		return false;
+
+	/* first level slots each hold a single millisecond, in order starting at the
+	 * current one. Anything before the first level wraps is the earliest timer.
+	 */
+	uint cur = timer_wheel_time & TIMER_WHEEL0_MASK;
+	int slot = timer_bitmap_find(timer_wheel0_bitmap, cur, TIMER_WHEEL0_SIZE);
+	if (slot >= 0) {
+		*expiry = timer_wheel_time + (slot - cur);
+		return true;
+	}
+
+	/* past the wrap the first level overlaps the next second level slot and
+	 * possibly the overflow list, so compare against those as well.
+	 */
+	bool found = false;
+	timer_t *timer;
+
+	slot = timer_bitmap_find(timer_wheel0_bitmap, 0, cur);
+	if (slot >= 0) {
+		*expiry = timer_wheel_time + ((slot - cur) & TIMER_WHEEL0_MASK);
+		found = true;
+	}
+
+	cur = (timer_wheel_time >> TIMER_WHEEL0_BITS) & TIMER_WHEEL1_MASK;
+	for (uint i = 1; i <= TIMER_WHEEL1_SIZE; i++) {
+		uint s = (cur + i) & TIMER_WHEEL1_MASK;
+		if (list_is_empty(&timer_wheel1[s]))
+			continue;
+
+		list_for_every_entry(&timer_wheel1[s], timer, timer_t, node) {
+			if (!found || TIME_LT(timer->scheduled_time, *expiry))
+				*expiry = timer->scheduled_time;
+			found = true;
 		}
+		break;
 	}
 
-	/* walked off the end of the list */
-	list_add_tail(&timer_queue, &timer->node);
+	list_for_every_entry(&timer_overflow, timer, timer_t, node) {
+		if (!found || TIME_LT(timer->scheduled_time, *expiry))
+			*expiry = timer->scheduled_time;
+		found = true;
+	}
+
+	return found;
+}
+
+/* program the one shot hardware timer for the earliest queued timer */
+static void timer_update_deadline(lk_time_t now)
+{
+	lk_time_t expiry;
+
+	if (!timer_next_expiry(&expiry)) {
+		if (timer_deadline_set) {
+			LTRACEF("clearing old hw timer, nothing in the queue\n");
+			platform_stop_timer();
+			timer_deadline_set = false;
+		}
+		return;
+	}
+
+	if (timer_deadline_set && expiry == timer_deadline)
+		return;
+
+	lk_time_t delay = TIME_LT(expiry, now) ? 0 : expiry - now;
+
+	LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+	timer_deadline = expiry;
+	timer_deadline_set = true;
+	platform_set_oneshot_timer(timer_tick, NULL, delay);
 }
+#endif
 
 static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
 {
@@ -97,12 +288,19 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
 
 	enter_critical_section();
 
+	/* nothing is pending, so the wheel can skip forward to keep the slot math
+	 * short. not from a callback though, the tick is still using its position */
+	if (timer_count == 0 && !timer_ticking && TIME_GT(now, timer_wheel_time))
+		timer_wheel_time = now;
+
 	insert_timer_in_queue(timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	if (list_peek_head_type(&timer_queue, timer_t, node) == timer) {
-		/* we just modified the head of the timer queue */
+	if (!timer_deadline_set || TIME_LT(timer->scheduled_time, timer_deadline)) {
+		/* we just queued the earliest timer */
 		LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+		timer_deadline = timer->scheduled_time;
+		timer_deadline_set = true;
 		platform_set_oneshot_timer(timer_tick, NULL, delay);
 	}
 #endif
@@ -161,12 +359,9 @@ void timer_cancel(timer_t *timer)
 
 	enter_critical_section();
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-	timer_t *oldhead = list_peek_head_type(&timer_queue, timer_t, node);
-#endif
-
-	if (list_in_list(&timer->node))
-		list_delete(&timer->node);
+	bool queued = list_in_list(&timer->node);
+	if (queued)
+		remove_timer_from_queue(timer);
 
 	/* to keep it from being reinserted into the queue if called from
 	 * periodic timer callback.
@@ -176,55 +371,37 @@ void timer_cancel(timer_t *timer)
 	timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	/* see if we've just modified the head of the timer queue */
-	timer_t *newhead = list_peek_head_type(&timer_queue, timer_t, node);
-	if (newhead == NULL) {
-		LTRACEF("clearing old hw timer, nothing in the queue\n");
-		platform_stop_timer();
-	} else if (newhead != oldhead) {
-		lk_time_t delay;
-		lk_time_t now = current_time();
-
-		if (TIME_LT(newhead->scheduled_time, now))
-			delay = 0;
-		else
-			delay = newhead->scheduled_time - now;
-
-		LTRACEF("setting new timer to %u\n", (uint) delay);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+	/* see if we've just removed the timer the hardware is programmed for */
+	if (queued && timer_deadline_set &&
+	        (timer_count == 0 || timer->scheduled_time == timer_deadline)) {
+		timer_update_deadline(current_time());
 	}
 #endif
 
 	exit_critical_section();
 }
 
-/* called at interrupt time to process any pending timers */
-static enum handler_return timer_tick(void *arg, lk_time_t now)
+/* fire everything in the first level slot the wheel is currently at */
+static enum handler_return timer_fire_slot(uint slot, lk_time_t now)
 {
 	timer_t *timer;
 	enum handler_return ret = INT_NO_RESCHEDULE;
 
-	THREAD_STATS_INC(timer_ints);
-//	KEVLOG_TIMER_TICK(); // enable only if necessary
-
-	LTRACEF("now %lu, sp %p\n", now, __GET_FRAME());
-
-	for (;;) {
-		/* see if there's an event to process */
-		timer = list_peek_head_type(&timer_queue, timer_t, node);
-		if (likely(timer == 0))
-			break;
-		LTRACEF("next item on timer queue %p at %lu now %lu (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-		if (likely(TIME_LT(now, timer->scheduled_time)))
-			break;
-
+	while ((timer = list_peek_head_type(&timer_wheel0[slot], timer_t, node))) {
 		/* process it */
 		LTRACEF("timer %p\n", timer);
 		DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-		list_delete(&timer->node);
+		remove_timer_from_queue(timer);
 
 		LTRACEF("dequeued timer %p, scheduled %lu periodic %lu\n", timer, timer->scheduled_time, timer->periodic_time);
 
+		/* not due yet, put it back where it belongs. slots only hold timers
+		 * for the current millisecond, but don't trust that with an early fire */
+		if (TIME_GT(timer->scheduled_time, now)) {
+			insert_timer_in_queue(timer);
+			continue;
+		}
+
 		THREAD_STATS_INC(timers);
 
 		bool periodic = timer->periodic_time > 0;
@@ -244,18 +421,55 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 		}
 	}
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-	/* reset the timer to the next event */
-	timer = list_peek_head_type(&timer_queue, timer_t, node);
-	if (timer) {
-		/* has to be the case or it would have fired already */
-		DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
+	return ret;
+}
+
+/* called at interrupt time to process any pending timers */
+static enum handler_return timer_tick(void *arg, lk_time_t now)
+{
+	enum handler_return ret = INT_NO_RESCHEDULE;
 
-		lk_time_t delay = timer->scheduled_time - now;
+	THREAD_STATS_INC(timer_ints);
+//	KEVLOG_TIMER_TICK(); // enable only if necessary
 
-		LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
+	LTRACEF("now %lu, wheel time %lu, sp %p\n", now, timer_wheel_time, __GET_FRAME());
+
+	timer_ticking = true;
+
+	while (TIME_LTE(timer_wheel_time, now)) {
+		if (timer_count == 0) {
+			timer_wheel_time = now + 1;
+			break;
+		}
+
+		lk_time_t t = timer_wheel_time;
+		uint slot = t & TIMER_WHEEL0_MASK;
+
+		if (timer_fire_slot(slot, now) == INT_RESCHEDULE)
+			ret = INT_RESCHEDULE;
+
+		/* skip over empty slots, but stop at the next wrap of the first level */
+		int next = timer_bitmap_find(timer_wheel0_bitmap, slot + 1, TIMER_WHEEL0_SIZE);
+		lk_time_t next_time = t - slot + ((next < 0) ? TIMER_WHEEL0_SIZE : (uint)next);
+		if (TIME_GT(next_time, now + 1))
+			next_time = now + 1;
+
+		timer_wheel_time = next_time;
+
+		/* the first level wrapped, refill it from the second level */
+		if ((next_time & TIMER_WHEEL0_MASK) == 0) {
+			if ((next_time & (TIMER_WHEEL_SPAN - 1)) == 0)
+				timer_rescan_overflow();
+			timer_cascade((next_time >> TIMER_WHEEL0_BITS) & TIMER_WHEEL1_MASK);
+		}
 	}
+
+	timer_ticking = false;
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	/* reset the timer to the next event */
+	timer_deadline_set = false;
+	timer_update_deadline(now);
 #else
 	/* let the scheduler have a shot to do quantum expiration, etc */
 	/* in case of dynamic timer, the scheduler will set up a periodic timer */
@@ -269,11 +483,15 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
 void timer_init(void)
 {
-	list_initialize(&timer_queue);
+	for (uint i = 0; i < TIMER_WHEEL0_SIZE; i++)
+		list_initialize(&timer_wheel0[i]);
+	for (uint i = 0; i < TIMER_WHEEL1_SIZE; i++)
+		list_initialize(&timer_wheel1[i]);
+	list_initialize(&timer_overflow);
 
 #if !PLATFORM_HAS_DYNAMIC_TIMER
 	/* register for a periodic timer tick */
-	platform_set_periodic_timer(timer_tick, NULL, 10); /* 10ms */
+	platform_set_periodic_timer(timer_tick, NULL, TIMER_TICK_INTERVAL);
 #endif
 }
 
@@ -44,7 +44,7 @@ static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
     (paddr_t)(((uintptr_t)page - (uintptr_t)a->page_array) / sizeof(vm_page_t)) * PAGE_SIZE + a->base;
 
 #define ADDRESS_IN_ARENA(address, arena) \
-    ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size)
+    ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size - 1)
 
 static inline bool page_is_free(const vm_page_t *page)
 {
@@ -74,6 +74,171 @@ vm_page_t *address_to_page(paddr_t addr)
     return NULL;
 }
 
+/*
+ * Free pages are kept in per arena buddy free lists, indexed by order. The
+ * buddy relationship is computed on physical page frame numbers, so a free
+ * block of order n is always naturally aligned to PAGE_SIZE << n in physical
+ * memory. Only the first page of a free block is on a list, it carries
+ * VM_PAGE_FLAG_BUDDY and the order of the block.
+ */
+static inline paddr_t arena_base_pfn(const pmm_arena_t *a)
+{
+    return a->base / PAGE_SIZE;
+}
+
+static inline uint count_to_order(uint count)
+{
+    return log2_uint(count) + (ispow2(count) ? 0 : 1);
+}
+
+static void buddy_add_block(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *p = &a->page_array[index];
+
+    DEBUG_ASSERT(!(p->flags & (VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_BUDDY)));
+
+    p->flags |= VM_PAGE_FLAG_BUDDY;
+    p->order = order;
+    list_add_head(&a->free_area[order], &p->node);
+}
+
+static void buddy_remove_block(vm_page_t *p)
+{
+    DEBUG_ASSERT(p->flags & VM_PAGE_FLAG_BUDDY);
+
+    list_delete(&p->node);
+    p->flags &= ~VM_PAGE_FLAG_BUDDY;
+}
+
+/* add a run of free pages as the largest naturally aligned blocks that fit */
+static void buddy_add_run(pmm_arena_t *a, size_t index, size_t count)
+{
+    paddr_t base_pfn = arena_base_pfn(a);
+    size_t end = index + count;
+
+    while (index < end) {
+        uint order = 0;
+        while (order < PMM_MAX_ORDER) {
+            size_t len = 1UL << (order + 1);
+            if (((base_pfn + index) & (len - 1)) != 0 || index + len > end)
+                break;
+            order++;
+        }
+
+        buddy_add_block(a, index, order);
+        index += 1UL << order;
+    }
+}
+
+/* return the index of the buddy of a block, or -1 if it is not inside the arena */
+static ssize_t buddy_index(const pmm_arena_t *a, size_t index, uint order)
+{
+    paddr_t base_pfn = arena_base_pfn(a);
+    paddr_t pfn = (base_pfn + index) ^ (1UL << order);
+
+    if (pfn < base_pfn || pfn + (1UL << order) > base_pfn + a->size / PAGE_SIZE)
+        return -1;
+
+    return pfn - base_pfn;
+}
+
+/* put a single page back, coalescing it with its free buddies */
+static void buddy_free_page(pmm_arena_t *a, size_t index)
+{
+    uint order = 0;
+
+    while (order < PMM_MAX_ORDER) {
+        ssize_t buddy = buddy_index(a, index, order);
+        if (buddy < 0)
+            break;
+
+        vm_page_t *b = &a->page_array[buddy];
+        if (!(b->flags & VM_PAGE_FLAG_BUDDY) || b->order != order)
+            break;
+
+        buddy_remove_block(b);
+        index = MIN(index, (size_t)buddy);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* remove a block of exactly the requested order, splitting a larger one if needed.
+ * returns the index of the first page or -1.
+ */
+static ssize_t buddy_alloc_block(pmm_arena_t *a, uint order)
+{
+    uint o;
+    for (o = order; o <= PMM_MAX_ORDER; o++) {
+        if (!list_is_empty(&a->free_area[o]))
+            break;
+    }
+    if (o > PMM_MAX_ORDER)
+        return -1;
+
+    vm_page_t *p = list_peek_head_type(&a->free_area[o], vm_page_t, node);
+    buddy_remove_block(p);
+
+    size_t index = p - a->page_array;
+
+    /* give back the upper halves until the block is the size asked for */
+    while (o > order) {
+        o--;
+        buddy_add_block(a, index + (1UL << o), o);
+    }
+
+    return index;
+}
+
+/* carve a single free page out of whichever free block holds it */
+static void buddy_take_page(pmm_arena_t *a, size_t index)
+{
+    paddr_t base_pfn = arena_base_pfn(a);
+
+    for (uint order = 0; order <= PMM_MAX_ORDER; order++) {
+        paddr_t head_pfn = ROUNDDOWN(base_pfn + index, 1UL << order);
+        if (head_pfn < base_pfn)
+            break;
+
+        size_t head_index = head_pfn - base_pfn;
+        vm_page_t *head = &a->page_array[head_index];
+        if (!(head->flags & VM_PAGE_FLAG_BUDDY) || head->order != order)
+            continue;
+
+        buddy_remove_block(head);
+
+        /* split the block, giving back the halves the page is not in */
+        while (order > 0) {
+            order--;
+            size_t half = 1UL << order;
+            if (index >= head_index + half) {
+                buddy_add_block(a, head_index, order);
+                head_index += half;
+            } else {
+                buddy_add_block(a, head_index + half, order);
+            }
+        }
+        return;
+    }
+
+    panic("pmm: free page %zu in arena %p is not in a free block\n", index, a);
+}
+
+/* mark a page pulled out of the free lists as allocated */
+static void alloc_page(pmm_arena_t *a, size_t index, struct list_node *list)
+{
+    vm_page_t *p = &a->page_array[index];
+
+    DEBUG_ASSERT(!(p->flags & (VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_BUDDY)));
+
+    p->flags |= VM_PAGE_FLAG_NONFREE;
+    a->free_count--;
+
+    if (list)
+        list_add_tail(list, &p->node);
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena)
 {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%x\n", arena, arena->name, arena->base, arena->size);
@@ -97,8 +262,8 @@ status_t pmm_add_arena(pmm_arena_t *arena)
 done_add:
 
     /* zero out some of the structure */
-    arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_area[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -107,14 +272,9 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
-
-        arena->free_count++;
-    }
+    /* add them to the free lists */
+    buddy_add_run(arena, 0, page_count);
+    arena->free_count = page_count;
 
     return NO_ERROR;
 }
@@ -134,20 +294,16 @@ uint pmm_alloc_pages(uint count, struct list_node *list)
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
-
-            a->free_count--;
+            ssize_t index = buddy_alloc_block(a, 0);
+            if (index < 0)
+                break;
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            alloc_page(a, index, list);
 
             allocated++;
         }
     }
 
-done:
     return allocated;
 }
 
@@ -177,13 +333,9 @@ uint pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            buddy_take_page(a, index);
+            alloc_page(a, index, list);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -214,7 +366,7 @@ uint pmm_free(struct list_node *list)
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
                 page->flags &= ~VM_PAGE_FLAG_NONFREE;
 
-                list_add_head(&a->free_list, &page->node);
+                buddy_free_page(a, page - a->page_array);
                 a->free_count++;
                 count++;
                 break;
@@ -251,6 +403,52 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
     return paddr_to_kvaddr(pa);
 }
 
+/* slow path for runs the buddy lists cannot satisfy: walk the page array
+ * starting at alignment boundaries looking for a long enough run of free pages.
+ */
+static ssize_t pmm_find_run(pmm_arena_t *a, uint count, uint8_t alignment_log2)
+{
+    /* calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base >= a->base + a->size)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+retry:
+    while (start < a->size / PAGE_SIZE) {
+        if (start + count > a->size / PAGE_SIZE)
+            break;
+
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        /* we found a run, pull the pages out of their free blocks */
+        LTRACEF("found run from pn %u to %u\n", start, start + count);
+
+        for (uint i = start; i < start + count; i++) {
+            buddy_take_page(a, i);
+        }
+
+        return start;
+    }
+
+    return -1;
+}
+
 uint pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
 {
     LTRACEF("count %u, align %u\n", count, alignment_log2);
@@ -260,58 +458,37 @@ uint pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struc
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* a naturally aligned buddy block covering both the count and the alignment */
+    uint order = MAX(count_to_order(count), (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         // XXX make this a flag to only search kmap?
         if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base >= a->base + a->size)
-                continue;
+            ssize_t start = -1;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-retry:
-            while (start < a->size / PAGE_SIZE) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
+            if (order <= PMM_MAX_ORDER) {
+                start = buddy_alloc_block(a, order);
+                if (start >= 0) {
+                    /* hand back the tail of the block past the requested count */
+                    buddy_add_run(a, start + count, (1UL << order) - count);
                 }
+            }
 
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
+            /* too large for a single block, or too fragmented to find one */
+            if (start < 0)
+                start = pmm_find_run(a, count, alignment_log2);
+            if (start < 0)
+                continue;
 
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
+            for (uint i = start; i < start + count; i++) {
+                alloc_page(a, i, list);
+            }
 
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
+            if (pa)
+                *pa = a->base + start * PAGE_SIZE;
 
-                return count;
-            }
+            return count;
         }
     }
 
@@ -331,6 +508,13 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
 
+    /* dump the free block counts of the buddy lists */
+    printf("\tfree blocks by order:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        printf(" %zu", list_length((struct list_node *)&arena->free_area[i]));
+    }
+    printf("\n");
+
     /* dump all of the pages */
     if (dump_pages) {
         for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <debug.h>
 #include <trace.h>
+#include <kernel/mutex.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
@@ -34,9 +35,11 @@
 
 struct bcache_block {
 	struct list_node node;
+	struct list_node hash_node;
 	bnum_t blocknum;
 	int ref_count;
 	bool is_dirty;
+	bool accessed;
 	void *ptr;
 };
 
@@ -46,20 +49,37 @@ struct bcache_stats {
 	uint32_t misses;
 	uint32_t reads;
 	uint32_t writes;
+	uint32_t evictions;
 };
 
 struct bcache {
+	struct list_node node;
 	bdev_t *dev;
 	size_t block_size;
 	int count;
 	struct bcache_stats stats;
 
 	struct list_node free_list;
-	struct list_node lru_list;
+
+	/* valid blocks are hashed on block number */
+	struct list_node *hash;
+	uint hash_mask;
+
+	/* CLOCK replacement, the hand sweeps the blocks array */
+	int clock_hand;
 
 	struct bcache_block *blocks;
 };
 
+/* list of all the caches, for the debug command */
+static struct list_node bcache_list = LIST_INITIAL_VALUE(bcache_list);
+static mutex_t bcache_list_lock = MUTEX_INITIAL_VALUE(bcache_list_lock);
+
+static inline struct list_node *hash_bucket(struct bcache *cache, uint blocknum)
+{
+	return &cache->hash[blocknum & cache->hash_mask];
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
 	struct bcache *cache;
@@ -72,18 +92,35 @@ bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 	memset(&cache->stats, 0, sizeof(cache->stats));
 
 	list_initialize(&cache->free_list);
-	list_initialize(&cache->lru_list);
+
+	/* at least one bucket per block, rounded up to a power of 2 */
+	uint hash_size = 1;
+	while (hash_size < (uint)block_count)
+		hash_size <<= 1;
+
+	cache->hash = malloc(sizeof(struct list_node) * hash_size);
+	cache->hash_mask = hash_size - 1;
+	for (uint i = 0; i < hash_size; i++)
+		list_initialize(&cache->hash[i]);
+
+	cache->clock_hand = 0;
 
 	cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
 	int i;
 	for (i=0; i < block_count; i++) {
 		cache->blocks[i].ref_count = 0;
 		cache->blocks[i].is_dirty = false;
+		cache->blocks[i].accessed = false;
 		cache->blocks[i].ptr = malloc(block_size);
+		list_clear_node(&cache->blocks[i].hash_node);
 		// add to the free list
 		list_add_head(&cache->free_list, &cache->blocks[i].node);
 	}
 
+	mutex_acquire(&bcache_list_lock);
+	list_add_tail(&bcache_list, &cache->node);
+	mutex_release(&bcache_list_lock);
+
 	return (bcache_t)cache;
 }
 
@@ -109,6 +146,10 @@ void bcache_destroy(bcache_t _cache)
 	struct bcache *cache = _cache;
 	int i;
 
+	mutex_acquire(&bcache_list_lock);
+	list_delete(&cache->node);
+	mutex_release(&bcache_list_lock);
+
 	for (i=0; i < cache->count; i++) {
 		DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
@@ -119,6 +160,8 @@ void bcache_destroy(bcache_t _cache)
 		free(cache->blocks[i].ptr);
 	}
 
+	free(cache->blocks);
+	free(cache->hash);
 	free(cache);
 }
 
@@ -131,13 +174,12 @@ static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
 	LTRACEF("num %u\n", blocknum);
 
 	block = NULL;
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+	list_for_every_entry(hash_bucket(cache, blocknum), block, struct bcache_block, hash_node) {
 		LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
 		depth++;
 
 		if (block->blocknum == blocknum) {
-			list_delete(&block->node);
-			list_add_tail(&cache->lru_list, &block->node);
+			block->accessed = true;
 			cache->stats.hits++;
 			cache->stats.depth += depth;
 			return block;
@@ -148,7 +190,25 @@ static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
 	return NULL;
 }
 
-/* allocate a new block */
+/* give a newly allocated block an identity */
+static void hash_block(struct bcache *cache, struct bcache_block *block, uint blocknum)
+{
+	DEBUG_ASSERT(!list_in_list(&block->hash_node));
+
+	block->blocknum = blocknum;
+	block->accessed = true;
+	list_add_head(hash_bucket(cache, blocknum), &block->hash_node);
+}
+
+/* put a block that failed to fill back on the free list */
+static void release_block(struct bcache *cache, struct bcache_block *block)
+{
+	if (list_in_list(&block->hash_node))
+		list_delete(&block->hash_node);
+	list_add_tail(&cache->free_list, &block->node);
+}
+
+/* allocate a new block, detached from the hash */
 static struct bcache_block *alloc_block(struct bcache *cache)
 {
 	int err;
@@ -158,26 +218,35 @@ static struct bcache_block *alloc_block(struct bcache *cache)
 	block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
 	if (block) {
 		block->ref_count = 0;
-		list_add_tail(&cache->lru_list, &block->node);
 		LTRACEF("found block %p on free list\n", block);
 		return block;
 	}
 
-	/* walk the lru, looking for a free block */
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+	/* sweep the clock, giving recently accessed blocks a second chance.
+	 * two passes are enough to clear every accessed bit once.
+	 */
+	for (int i = 0; i < cache->count * 2; i++) {
+		block = &cache->blocks[cache->clock_hand];
+		cache->clock_hand = (cache->clock_hand + 1) % cache->count;
+
 		LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-		if (block->ref_count == 0) {
-			if (block->is_dirty) {
-				err = flush_block(cache, block);
-				if (err)
-					return NULL;
-			}
-
-			// add it to the tail of the lru
-			list_delete(&block->node);
-			list_add_tail(&cache->lru_list, &block->node);
-			return block;
+		if (block->ref_count > 0 || list_in_list(&block->node))
+			continue;
+
+		if (block->accessed) {
+			block->accessed = false;
+			continue;
+		}
+
+		if (block->is_dirty) {
+			err = flush_block(cache, block);
+			if (err)
+				return NULL;
 		}
+
+		list_delete(&block->hash_node);
+		cache->stats.evictions++;
+		return block;
 	}
 
 	return NULL;
@@ -200,11 +269,11 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 
 		LTRACEF("wasn't allocated, new block %p\n", block);
 
-		block->blocknum = blocknum;
+		hash_block(cache, block, blocknum);
 		err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
 		if (err < 0) {
 			/* free the block, return an error */
-			list_add_tail(&cache->free_list, &block->node);
+			release_block(cache, block);
 			return NULL;
 		}
 
@@ -302,7 +371,7 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 			goto exit;
 		}
 
-		block->blocknum = blocknum;
+		hash_block(cache, block, blocknum);
 	}
 
 	memset(block->ptr, 0, cache->block_size);
@@ -318,7 +387,8 @@ int bcache_flush(bcache_t priv)
 	struct bcache *cache = priv;
 	struct bcache_block *block;
 
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+	for (int i = 0; i < cache->count; i++) {
+		block = &cache->blocks[i];
 		if (block->is_dirty) {
 			err = flush_block(cache, block);
 			if (err)
@@ -338,7 +408,7 @@ void bcache_dump(bcache_t priv, const char *name)
 
 	finds = cache->stats.hits + cache->stats.misses;
 
-	printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+	printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u evictions=%u\n",
 	       name,
 	       cache->stats.hits,
 	       finds ? (cache->stats.hits * 100) / finds : 0,
@@ -346,5 +416,30 @@ void bcache_dump(bcache_t priv, const char *name)
 	       cache->stats.misses,
 	       finds ? (cache->stats.misses * 100) / finds : 0,
 	       cache->stats.reads,
-	       cache->stats.writes);
+	       cache->stats.writes,
+	       cache->stats.evictions);
+}
+
+#if defined(WITH_LIB_CONSOLE)
+#include <lib/console.h>
+
+#if LK_DEBUGLEVEL > 0
+static int cmd_bcache(int argc, const cmd_args *argv)
+{
+	struct bcache *cache;
+
+	mutex_acquire(&bcache_list_lock);
+	list_for_every_entry(&bcache_list, cache, struct bcache, node) {
+		bcache_dump(cache, cache->dev->name);
+	}
+	mutex_release(&bcache_list_lock);
+
+	return 0;
 }
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bcache", "dump block cache stats", &cmd_bcache)
+STATIC_COMMAND_END(bcache);
+#endif
+
+#endif
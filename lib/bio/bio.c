@@ -41,10 +41,94 @@ struct bdev_struct {
 
 static struct bdev_struct *bdevs;
 
-/* default implementation is to use the read_block hook to 'deblock' the device */
-static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size_t len)
+/* position within an iovec array */
+struct iov_cursor {
+	const iovec_t *iov;
+	uint iov_cnt;
+	size_t pos;
+};
+
+static void iov_cursor_advance(struct iov_cursor *cur, size_t len)
+{
+	while (len > 0) {
+		DEBUG_ASSERT(cur->iov_cnt > 0);
+
+		size_t left = cur->iov->iov_len - cur->pos;
+		if (len < left) {
+			cur->pos += len;
+			return;
+		}
+
+		len -= left;
+		cur->iov++;
+		cur->iov_cnt--;
+		cur->pos = 0;
+	}
+}
+
+/* how many bytes starting at the cursor are contiguous in memory, folding
+ * in following iovecs that pick up where the previous one left off */
+static size_t iov_cursor_contig(const struct iov_cursor *cur, uint8_t **ptr)
+{
+	/* skip over any empty entries */
+	const iovec_t *iov = cur->iov;
+	uint iov_cnt = cur->iov_cnt;
+	size_t pos = cur->pos;
+	while (iov_cnt > 0 && pos == iov->iov_len) {
+		iov++;
+		iov_cnt--;
+		pos = 0;
+	}
+	if (iov_cnt == 0)
+		return 0;
+
+	uint8_t *start = (uint8_t *)iov->iov_base + pos;
+	size_t len = iov->iov_len - pos;
+	for (iov++, iov_cnt--; iov_cnt > 0; iov++, iov_cnt--) {
+		if ((uint8_t *)iov->iov_base != start + len)
+			break;
+		len += iov->iov_len;
+	}
+
+	*ptr = start;
+	return len;
+}
+
+/* copy between a linear buffer and the iovecs at the cursor, advancing it */
+static void iov_cursor_copy(struct iov_cursor *cur, uint8_t *buf, size_t len, bool to_iov)
+{
+	while (len > 0) {
+		DEBUG_ASSERT(cur->iov_cnt > 0);
+
+		size_t tocopy = MIN(cur->iov->iov_len - cur->pos, len);
+		if (tocopy == 0) {
+			/* empty entry */
+			cur->iov++;
+			cur->iov_cnt--;
+			cur->pos = 0;
+			continue;
+		}
+
+		uint8_t *ptr = (uint8_t *)cur->iov->iov_base + cur->pos;
+		if (to_iov)
+			memcpy(ptr, buf, tocopy);
+		else
+			memcpy(buf, ptr, tocopy);
+
+		buf += tocopy;
+		len -= tocopy;
+		iov_cursor_advance(cur, tocopy);
+	}
+}
+
+/* default implementation is to use the read_block hook to 'deblock' the device.
+ * Runs of whole blocks that land in contiguous memory go straight to the driver
+ * as one multi block read, only partial blocks and blocks split across iovecs
+ * are bounced through a temporary buffer.
+ */
+static ssize_t bio_default_readv(struct bdev *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
 {
-	uint8_t *buf = (uint8_t *)_buf;
+	struct iov_cursor cur = { iov, iov_cnt, 0 };
 	ssize_t bytes_read = 0;
 	bnum_t block;
 	int err = 0;
@@ -52,68 +136,56 @@ static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size
 
 	/* find the starting block */
 	block = offset / dev->block_size;
+	size_t block_offset = offset % dev->block_size;
+
+	LTRACEF("iov_cnt %u, offset %lld, block %u, len %zd\n", iov_cnt, offset, block, len);
+	while (len > 0) {
+		/* handle runs of whole blocks */
+		if (block_offset == 0 && len >= dev->block_size) {
+			uint8_t *ptr;
+			size_t contig = MIN(iov_cursor_contig(&cur, &ptr), len);
+			if (contig >= dev->block_size) {
+				size_t block_count = contig / dev->block_size;
+				err = bio_read_block(dev, ptr, block, block_count);
+				if (err < 0)
+					goto err;
+
+				/* increment our buffers */
+				size_t bytes = block_count * dev->block_size;
+				DEBUG_ASSERT(bytes <= len);
+
+				iov_cursor_advance(&cur, bytes);
+				len -= bytes;
+				bytes_read += bytes;
+				block += block_count;
+				continue;
+			}
+		}
 
-	LTRACEF("buf %p, offset %lld, block %u, len %zd\n", buf, offset, block, len);
-	/* handle partial first block */
-	if ((offset % dev->block_size) != 0) {
-		/* read in the block */
+		/* partial block, or one split across buffers */
 		err = bio_read_block(dev, temp, block, 1);
 		if (err < 0)
 			goto err;
 
 		/* copy what we need */
-		size_t block_offset = offset % dev->block_size;
 		size_t tocopy = MIN(dev->block_size - block_offset, len);
-		memcpy(buf, temp + block_offset, tocopy);
+		iov_cursor_copy(&cur, temp + block_offset, tocopy, true);
 
 		/* increment our buffers */
-		buf += tocopy;
 		len -= tocopy;
 		bytes_read += tocopy;
+		block_offset = 0;
 		block++;
 	}
 
-	LTRACEF("buf %p, block %u, len %zd\n", buf, block, len);
-	/* handle middle blocks */
-	if (len >= dev->block_size) {
-		/* do the middle reads */
-		size_t block_count = len / dev->block_size;
-		err = bio_read_block(dev, buf, block, block_count);
-		if (err < 0)
-			goto err;
-
-		/* increment our buffers */
-		size_t bytes = block_count * dev->block_size;
-		DEBUG_ASSERT(bytes <= len);
-
-		buf += bytes;
-		len -= bytes;
-		bytes_read += bytes;
-		block += block_count;
-	}
-
-	LTRACEF("buf %p, block %u, len %zd\n", buf, block, len);
-	/* handle partial last block */
-	if (len > 0) {
-		/* read the block */
-		err = bio_read_block(dev, temp, block, 1);
-		if (err < 0)
-			goto err;
-
-		/* copy the partial block from our temp buffer */
-		memcpy(buf, temp, len);
-
-		bytes_read += len;
-	}
-
 err:
 	/* return error or bytes read */
 	return (err >= 0) ? bytes_read : err;
 }
 
-static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offset, size_t len)
+static ssize_t bio_default_writev(struct bdev *dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
 {
-	const uint8_t *buf = (const uint8_t *)_buf;
+	struct iov_cursor cur = { iov, iov_cnt, 0 };
 	ssize_t bytes_written = 0;
 	bnum_t block;
 	int err = 0;
@@ -121,19 +193,43 @@ static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offse
 
 	/* find the starting block */
 	block = offset / dev->block_size;
+	size_t block_offset = offset % dev->block_size;
+
+	LTRACEF("iov_cnt %u, offset %lld, block %u, len %zd\n", iov_cnt, offset, block, len);
+	while (len > 0) {
+		/* handle runs of whole blocks */
+		if (block_offset == 0 && len >= dev->block_size) {
+			uint8_t *ptr;
+			size_t contig = MIN(iov_cursor_contig(&cur, &ptr), len);
+			if (contig >= dev->block_size) {
+				size_t block_count = contig / dev->block_size;
+				err = bio_write_block(dev, ptr, block, block_count);
+				if (err < 0)
+					goto err;
+
+				/* increment our buffers */
+				size_t bytes = block_count * dev->block_size;
+				DEBUG_ASSERT(bytes <= len);
+
+				iov_cursor_advance(&cur, bytes);
+				len -= bytes;
+				bytes_written += bytes;
+				block += block_count;
+				continue;
+			}
+		}
 
-	LTRACEF("buf %p, offset %lld, block %u, len %zd\n", buf, offset, block, len);
-	/* handle partial first block */
-	if ((offset % dev->block_size) != 0) {
-		/* read in the block */
-		err = bio_read_block(dev, temp, block, 1);
-		if (err < 0)
-			goto err;
+		/* partial block, or one split across buffers */
+		size_t tocopy = MIN(dev->block_size - block_offset, len);
+		if (tocopy < dev->block_size) {
+			/* read in the block */
+			err = bio_read_block(dev, temp, block, 1);
+			if (err < 0)
+				goto err;
+		}
 
 		/* copy what we need */
-		size_t block_offset = offset % dev->block_size;
-		size_t tocopy = MIN(dev->block_size - block_offset, len);
-		memcpy(temp + block_offset, buf, tocopy);
+		iov_cursor_copy(&cur, temp + block_offset, tocopy, false);
 
 		/* write it back out */
 		err = bio_write_block(dev, temp, block, 1);
@@ -141,53 +237,29 @@ static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offse
 			goto err;
 
 		/* increment our buffers */
-		buf += tocopy;
 		len -= tocopy;
 		bytes_written += tocopy;
+		block_offset = 0;
 		block++;
 	}
 
-	LTRACEF("buf %p, block %u, len %zd\n", buf, block, len);
-	/* handle middle blocks */
-	if (len >= dev->block_size) {
-		/* do the middle writes */
-		size_t block_count = len / dev->block_size;
-		err = bio_write_block(dev, buf, block, block_count);
-		if (err < 0)
-			goto err;
-
-		/* increment our buffers */
-		size_t bytes = block_count * dev->block_size;
-		DEBUG_ASSERT(bytes <= len);
-
-		buf += bytes;
-		len -= bytes;
-		bytes_written += bytes;
-		block += block_count;
-	}
-
-	LTRACEF("buf %p, block %u, len %zd\n", buf, block, len);
-	/* handle partial last block */
-	if (len > 0) {
-		/* read the block */
-		err = bio_read_block(dev, temp, block, 1);
-		if (err < 0)
-			goto err;
+err:
+	/* return error or bytes written */
+	return (err >= 0) ? bytes_written : err;
+}
 
-		/* copy the partial block from our temp buffer */
-		memcpy(temp, buf, len);
+static ssize_t bio_default_read(struct bdev *dev, void *buf, off_t offset, size_t len)
+{
+	iovec_t iov = { buf, len };
 
-		/* write it back out */
-		err = bio_write_block(dev, temp, block, 1);
-		if (err < 0)
-			goto err;
+	return bio_default_readv(dev, &iov, 1, offset, len);
+}
 
-		bytes_written += len;
-	}
+static ssize_t bio_default_write(struct bdev *dev, const void *buf, off_t offset, size_t len)
+{
+	iovec_t iov = { (void *)buf, len };
 
-err:
-	/* return error or bytes written */
-	return (err >= 0) ? bytes_written : err;
+	return bio_default_writev(dev, &iov, 1, offset, len);
 }
 
 static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
@@ -332,6 +404,24 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
 	return dev->read_block(dev, buf, block, count);
 }
 
+ssize_t bio_readv(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset)
+{
+	LTRACEF("dev '%s', iov %p, iov_cnt %u, offset %lld\n", dev->name, iov, iov_cnt, offset);
+
+	DEBUG_ASSERT(dev->ref > 0);
+
+	ssize_t total = iovec_size(iov, iov_cnt);
+	if (total < 0)
+		return total;
+
+	/* range check */
+	size_t len = bio_trim_range(dev, offset, total);
+	if (len == 0)
+		return 0;
+
+	return dev->readv(dev, iov, iov_cnt, offset, len);
+}
+
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len)
 {
 	LTRACEF("dev '%s', buf %p, offset %lld, len %zd\n", dev->name, buf, offset, len);
@@ -360,6 +450,24 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
 	return dev->write_block(dev, buf, block, count);
 }
 
+ssize_t bio_writev(bdev_t *dev, const iovec_t *iov, uint iov_cnt, off_t offset)
+{
+	LTRACEF("dev '%s', iov %p, iov_cnt %u, offset %lld\n", dev->name, iov, iov_cnt, offset);
+
+	DEBUG_ASSERT(dev->ref > 0);
+
+	ssize_t total = iovec_size(iov, iov_cnt);
+	if (total < 0)
+		return total;
+
+	/* range check */
+	size_t len = bio_trim_range(dev, offset, total);
+	if (len == 0)
+		return 0;
+
+	return dev->writev(dev, iov, iov_cnt, offset, len);
+}
+
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
 {
 	LTRACEF("dev '%s', offset %lld, len %zd\n", dev->name, offset, len);
@@ -402,8 +510,10 @@ void bio_initialize_bdev(bdev_t *dev, const char *name, size_t block_size, bnum_
 	/* set up the default hooks, the sub driver should override the block operations at least */
 	dev->read = bio_default_read;
 	dev->read_block = bio_default_read_block;
+	dev->readv = bio_default_readv;
 	dev->write = bio_default_write;
 	dev->write_block = bio_default_write_block;
+	dev->writev = bio_default_writev;
 	dev->erase = bio_default_erase;
 	dev->close = NULL;
 }
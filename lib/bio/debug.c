@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,6 +43,184 @@ STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
 STATIC_COMMAND_END(bio);
 
+static void bio_bench_report(const char *name, size_t len, uint iter, lk_bigtime_t t)
+{
+	uint64_t bytes = (uint64_t)len * iter;
+
+	printf("%-32s took %llu usecs (%llu bytes/sec)\n", name, t, (t > 0) ? bytes * 1000000 / t : 0);
+}
+
+/*
+ * memory backed device that only provides the block hooks, so that read, write,
+ * readv and writev go through the default split/merge paths in bio.c
+ */
+typedef struct bench_bdev {
+	bdev_t dev;
+
+	uint8_t *ptr;
+} bench_bdev_t;
+
+static ssize_t bench_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+	bench_bdev_t *bench = (bench_bdev_t *)bdev;
+
+	memcpy(buf, bench->ptr + block * bdev->block_size, count * bdev->block_size);
+
+	return count * bdev->block_size;
+}
+
+static ssize_t bench_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+	bench_bdev_t *bench = (bench_bdev_t *)bdev;
+
+	memcpy(bench->ptr + block * bdev->block_size, buf, count * bdev->block_size);
+
+	return count * bdev->block_size;
+}
+
+static bdev_t *bench_bdev_open(const char *name, void *ptr, size_t len)
+{
+	bench_bdev_t *bench = malloc(sizeof(bench_bdev_t));
+	if (!bench)
+		return NULL;
+
+	bio_initialize_bdev(&bench->dev, name, 512, len / 512);
+
+	bench->ptr = ptr;
+	bench->dev.read_block = bench_bdev_read_block;
+	bench->dev.write_block = bench_bdev_write_block;
+
+	bio_register_device(&bench->dev);
+
+	return bio_open(name);
+}
+
+static void bio_bench_vectored(bdev_t *dev, const char *which, uint8_t *buf, iovec_t *iov,
+                               uint iov_cnt, size_t len, uint iter)
+{
+	size_t slice = len / iov_cnt;
+	char name[32];
+	lk_bigtime_t t;
+
+	/* slices laid out back to front so nothing can be merged in memory */
+	for (uint i = 0; i < iov_cnt; i++) {
+		iov[i].iov_base = buf + (iov_cnt - 1 - i) * slice;
+		iov[i].iov_len = slice;
+	}
+
+	t = current_time_hires();
+	for (uint i = 0; i < iter; i++)
+		bio_readv(dev, iov, iov_cnt, 0);
+	snprintf(name, sizeof(name), "%s readv scattered", which);
+	bio_bench_report(name, len, iter, current_time_hires() - t);
+
+	t = current_time_hires();
+	for (uint i = 0; i < iter; i++)
+		bio_writev(dev, iov, iov_cnt, 0);
+	snprintf(name, sizeof(name), "%s writev scattered", which);
+	bio_bench_report(name, len, iter, current_time_hires() - t);
+
+	/* the same slices in order, which the default path merges into one run */
+	for (uint i = 0; i < iov_cnt; i++)
+		iov[i].iov_base = buf + i * slice;
+
+	t = current_time_hires();
+	for (uint i = 0; i < iter; i++)
+		bio_readv(dev, iov, iov_cnt, 0);
+	snprintf(name, sizeof(name), "%s readv contiguous", which);
+	bio_bench_report(name, len, iter, current_time_hires() - t);
+}
+
+/*
+ * throughput of the block layer itself. the plain read passes and the "mem"
+ * vectored passes run on a membdev, which brings its own readv/writev. the
+ * "default" vectored passes run on a device with only block hooks, which is
+ * what exercises the generic split/merge code.
+ */
+static int bio_bench(size_t len)
+{
+	const uint ITER = 16;
+	const uint IOV_CNT = 64;
+
+	len = ROUNDDOWN(len, IOV_CNT * 512);
+	if (len == 0)
+		return ERR_INVALID_ARGS;
+
+	void *backing = malloc(len);
+	uint8_t *buf = malloc(len);
+	iovec_t *iov = malloc(IOV_CNT * sizeof(iovec_t));
+	if (!backing || !buf || !iov) {
+		printf("not enough memory for a %zu byte benchmark\n", len);
+		free(backing);
+		free(buf);
+		free(iov);
+		return ERR_NO_MEMORY;
+	}
+	memset(backing, 0x55, len);
+
+	create_membdev("bio_bench", backing, len);
+	bdev_t *dev = bio_open("bio_bench");
+	if (!dev) {
+		free(backing);
+		free(buf);
+		free(iov);
+		return ERR_NOT_FOUND;
+	}
+
+	bdev_t *blkdev = bench_bdev_open("bio_bench_blk", backing, len);
+	if (!blkdev) {
+		bio_unregister_device(dev);
+		bio_close(dev);
+		free(backing);
+		free(buf);
+		free(iov);
+		return ERR_NO_MEMORY;
+	}
+
+	size_t slice = len / IOV_CNT;
+	lk_bigtime_t t;
+
+	printf("bio benchmark over %zu bytes, %u iterations\n", len, ITER);
+
+	t = current_time_hires();
+	for (uint i = 0; i < ITER; i++) {
+		for (bnum_t b = 0; b < dev->block_count; b++)
+			bio_read_block(dev, buf + b * dev->block_size, b, 1);
+	}
+	bio_bench_report("read_block per block", len, ITER, current_time_hires() - t);
+
+	t = current_time_hires();
+	for (uint i = 0; i < ITER; i++)
+		bio_read(dev, buf, 0, len);
+	bio_bench_report("read", len, ITER, current_time_hires() - t);
+
+	t = current_time_hires();
+	for (uint i = 0; i < ITER; i++)
+		bio_read(dev, buf, 1, len - dev->block_size);
+	bio_bench_report("read unaligned", len - dev->block_size, ITER, current_time_hires() - t);
+
+	t = current_time_hires();
+	for (uint i = 0; i < ITER; i++) {
+		for (uint j = 0; j < IOV_CNT; j++)
+			bio_read(dev, buf + (IOV_CNT - 1 - j) * slice, j * slice, slice);
+	}
+	bio_bench_report("read per slice", len, ITER, current_time_hires() - t);
+
+	bio_bench_vectored(dev, "mem", buf, iov, IOV_CNT, len, ITER);
+	bio_bench_vectored(blkdev, "default", buf, iov, IOV_CNT, len, ITER);
+
+	bio_unregister_device(blkdev);
+	bio_close(blkdev);
+	bio_unregister_device(dev);
+	bio_close(dev);
+
+	free(backing);
+	free(buf);
+	free(iov);
+
+	return 0;
+}
+
 static int cmd_bio(int argc, const cmd_args *argv)
 {
 	int rc = 0;
@@ -56,6 +235,7 @@ usage:
 		printf("%s erase <device> <offset> <len>\n", argv[0].str);
 		printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
 		printf("%s remove <device>\n", argv[0].str);
+		printf("%s bench [len]\n", argv[0].str);
 #if WITH_LIB_PARTITION
 		printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -158,6 +338,10 @@ usage:
 
 		bio_unregister_device(dev);
 		bio_close(dev);
+	} else if (!strcmp(argv[1].str, "bench")) {
+		size_t len = (argc > 2) ? argv[2].u : 1024*1024;
+
+		rc = bio_bench(len);
 #if WITH_LIB_PARTITION
 	} else if (!strcmp(argv[1].str, "partscan")) {
 		if (argc < 3) goto notenoughargs;
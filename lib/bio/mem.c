@@ -58,6 +58,23 @@ static ssize_t mem_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, u
 	return count * BLOCKSIZE;
 }
 
+static ssize_t mem_bdev_readv(bdev_t *bdev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	mem_bdev_t *mem = (mem_bdev_t *)bdev;
+	const uint8_t *src = (uint8_t *)mem->ptr + offset;
+
+	LTRACEF("bdev %s, iov_cnt %u, offset %lld, len %zu\n", bdev->name, iov_cnt, offset, len);
+
+	for (size_t left = len; left > 0; iov++) {
+		size_t tocopy = MIN(iov->iov_len, left);
+		memcpy(iov->iov_base, src, tocopy);
+		src += tocopy;
+		left -= tocopy;
+	}
+
+	return len;
+}
+
 static ssize_t mem_bdev_write(bdev_t *bdev, const void *buf, off_t offset, size_t len)
 {
 	mem_bdev_t *mem = (mem_bdev_t *)bdev;
@@ -80,6 +97,23 @@ static ssize_t mem_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t b
 	return count * BLOCKSIZE;
 }
 
+static ssize_t mem_bdev_writev(bdev_t *bdev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	mem_bdev_t *mem = (mem_bdev_t *)bdev;
+	uint8_t *dst = (uint8_t *)mem->ptr + offset;
+
+	LTRACEF("bdev %s, iov_cnt %u, offset %lld, len %zu\n", bdev->name, iov_cnt, offset, len);
+
+	for (size_t left = len; left > 0; iov++) {
+		size_t tocopy = MIN(iov->iov_len, left);
+		memcpy(dst, iov->iov_base, tocopy);
+		dst += tocopy;
+		left -= tocopy;
+	}
+
+	return len;
+}
+
 int create_membdev(const char *name, void *ptr, size_t len)
 {
 	mem_bdev_t *mem = malloc(sizeof(mem_bdev_t));
@@ -91,8 +125,10 @@ int create_membdev(const char *name, void *ptr, size_t len)
 	mem->ptr = ptr;
 	mem->dev.read = mem_bdev_read;
 	mem->dev.read_block = mem_bdev_read_block;
+	mem->dev.readv = mem_bdev_readv;
 	mem->dev.write = mem_bdev_write;
 	mem->dev.write_block = mem_bdev_write_block;
+	mem->dev.writev = mem_bdev_writev;
 
 	/* register it */
 	bio_register_device(&mem->dev);
@@ -8,4 +8,7 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/mem.c \
 	$(LOCAL_DIR)/subdev.c 
 
+MODULE_DEPS += \
+	lib/iovec
+
 include make/module.mk
@@ -52,6 +52,15 @@ static ssize_t subdev_read_block(struct bdev *_dev, void *buf, bnum_t block, uin
 	return bio_read_block(subdev->parent, buf, block + subdev->offset, count);
 }
 
+static ssize_t subdev_readv(struct bdev *_dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	/* the range was trimmed against us and we fit inside the parent, so hand
+	 * the vector straight to its hook rather than retrimming it */
+	return subdev->parent->readv(subdev->parent, iov, iov_cnt, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
 static ssize_t subdev_write(struct bdev *_dev, const void *buf, off_t offset, size_t len)
 {
 	subdev_t *subdev = (subdev_t *)_dev;
@@ -66,6 +75,13 @@ static ssize_t subdev_write_block(struct bdev *_dev, const void *buf, bnum_t blo
 	return bio_write_block(subdev->parent, buf, block + subdev->offset, count);
 }
 
+static ssize_t subdev_writev(struct bdev *_dev, const iovec_t *iov, uint iov_cnt, off_t offset, size_t len)
+{
+	subdev_t *subdev = (subdev_t *)_dev;
+
+	return subdev->parent->writev(subdev->parent, iov, iov_cnt, offset + subdev->offset * subdev->dev.block_size, len);
+}
+
 static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len)
 {
 	subdev_t *subdev = (subdev_t *)_dev;
@@ -101,8 +117,10 @@ status_t bio_publish_subdevice(const char *parent_dev, const char *subdev, bnum_
 
 	sub->dev.read = &subdev_read;
 	sub->dev.read_block = &subdev_read_block;
+	sub->dev.readv = &subdev_readv;
 	sub->dev.write = &subdev_write;
 	sub->dev.write_block = &subdev_write_block;
+	sub->dev.writev = &subdev_writev;
 	sub->dev.erase = &subdev_erase;
 	sub->dev.close = &subdev_close;
 
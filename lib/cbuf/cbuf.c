@@ -34,12 +34,51 @@
 #define INC_POINTER(cbuf, ptr, inc) \
     modpow2(((ptr) + (inc)), (cbuf)->len_pow2)
 
+/*
+ * Each side publishes its own index with a release store and reads the other
+ * side's with an acquire load, so the data copied in or out before an index
+ * moves is visible to whoever sees the new index. Outside of SPSC mode all of
+ * this also happens inside a critical section, which is what serializes
+ * multiple readers or writers.
+ */
+static inline uint cbuf_load_index(const uint *index)
+{
+	return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void cbuf_store_index(uint *index, uint val)
+{
+	__atomic_store_n(index, val, __ATOMIC_RELEASE);
+}
+
+static inline bool cbuf_is_spsc(cbuf_t *cbuf)
+{
+	return !!(cbuf->flags & CBUF_FLAG_SPSC);
+}
+
+static inline void cbuf_lock(cbuf_t *cbuf)
+{
+	if (!cbuf_is_spsc(cbuf))
+		enter_critical_section();
+}
+
+static inline void cbuf_unlock(cbuf_t *cbuf)
+{
+	if (!cbuf_is_spsc(cbuf))
+		exit_critical_section();
+}
+
 void cbuf_initialize(cbuf_t *cbuf, size_t len)
 {
 	cbuf_initialize_etc(cbuf, len, malloc(len));
 }
 
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf)
+{
+	cbuf_initialize_flags(cbuf, len, buf, 0);
+}
+
+void cbuf_initialize_flags(cbuf_t *cbuf, size_t len, void *buf, uint flags)
 {
 	DEBUG_ASSERT(cbuf);
 	DEBUG_ASSERT(len > 0);
@@ -48,26 +87,134 @@ void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf)
 	cbuf->head = 0;
 	cbuf->tail = 0;
 	cbuf->len_pow2 = log2_uint(len);
+	cbuf->flags = flags;
+	cbuf->watermark = 0;
 	cbuf->buf = buf;
 	event_init(&cbuf->event, false, 0);
 
-	LTRACEF("len %zd, len_pow2 %u\n", len, cbuf->len_pow2);
+	LTRACEF("len %zd, len_pow2 %u, flags 0x%x\n", len, cbuf->len_pow2, flags);
+}
+
+void cbuf_set_watermark(cbuf_t *cbuf, size_t watermark)
+{
+	DEBUG_ASSERT(watermark < valpow2(cbuf->len_pow2));
+
+	cbuf->watermark = (uint)watermark;
 }
 
 size_t cbuf_space_avail(cbuf_t *cbuf)
 {
-	uint consumed = modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+	uint consumed = modpow2((uint)(cbuf_load_index(&cbuf->head) - cbuf_load_index(&cbuf->tail)), cbuf->len_pow2);
 	return valpow2(cbuf->len_pow2) - consumed - 1;
 }
 
 size_t cbuf_space_used(cbuf_t *cbuf)
 {
-	return modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+	return modpow2((uint)(cbuf_load_index(&cbuf->head) - cbuf_load_index(&cbuf->tail)), cbuf->len_pow2);
+}
+
+/* the data between tail and head, as seen by the reader */
+static size_t cbuf_data_regions(cbuf_t *cbuf, iovec_t regions[2])
+{
+	uint tail = cbuf->tail;
+	size_t used = modpow2((uint)(cbuf_load_index(&cbuf->head) - tail), cbuf->len_pow2);
+	size_t first = MIN(used, valpow2(cbuf->len_pow2) - tail);
+
+	regions[0].iov_base = cbuf->buf + tail;
+	regions[0].iov_len = first;
+	regions[1].iov_base = cbuf->buf;
+	regions[1].iov_len = used - first;
+
+	return used;
+}
+
+/* the free space from head up to one short of tail, as seen by the writer */
+static size_t cbuf_space_regions(cbuf_t *cbuf, iovec_t regions[2])
+{
+	uint head = cbuf->head;
+	size_t used = modpow2((uint)(head - cbuf_load_index(&cbuf->tail)), cbuf->len_pow2);
+	size_t avail = valpow2(cbuf->len_pow2) - used - 1;
+	size_t first = MIN(avail, valpow2(cbuf->len_pow2) - head);
+
+	regions[0].iov_base = cbuf->buf + head;
+	regions[0].iov_len = first;
+	regions[1].iov_base = cbuf->buf;
+	regions[1].iov_len = avail - first;
+
+	return avail;
+}
+
+/* make len more bytes visible to the reader, signalling it only if it may
+ * be waiting for them */
+static void cbuf_publish(cbuf_t *cbuf, size_t len, bool canreschedule)
+{
+	if (len == 0)
+		return;
+
+	uint head = INC_POINTER(cbuf, cbuf->head, len);
+	cbuf_store_index(&cbuf->head, head);
+
+	/* order the head store before the tail load, pairs with the fence in
+	 * cbuf_wait_for_data() so one side always sees the other's update */
+	if (cbuf_is_spsc(cbuf))
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	size_t used = modpow2((uint)(head - cbuf_load_index(&cbuf->tail)), cbuf->len_pow2);
+
+	bool signal;
+	if (cbuf->watermark <= 1) {
+		/* the reader had caught up with everything before this */
+		signal = (used <= len);
+	} else {
+		/* just crossed the watermark */
+		signal = (used >= cbuf->watermark && used - len < cbuf->watermark);
+	}
+
+	if (signal)
+		event_signal(&cbuf->event, canreschedule);
+}
+
+/* release len bytes back to the writer */
+static void cbuf_consume(cbuf_t *cbuf, size_t len)
+{
+	if (len == 0)
+		return;
+
+	uint tail = INC_POINTER(cbuf, cbuf->tail, len);
+	cbuf_store_index(&cbuf->tail, tail);
+
+	if (!cbuf_is_spsc(cbuf) && tail == cbuf->head) {
+		// we've emptied the buffer, unsignal the event
+		event_unsignal(&cbuf->event);
+	}
+}
+
+/* block until there is something to read */
+static void cbuf_wait_for_data(cbuf_t *cbuf)
+{
+	while (cbuf_load_index(&cbuf->head) == cbuf->tail) {
+		event_unsignal(&cbuf->event);
+
+		/* a writer either sees our tail and signals after the unsignal
+		 * above, or published its head before we look again here */
+		if (cbuf_is_spsc(cbuf))
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (cbuf_load_index(&cbuf->head) != cbuf->tail)
+			break;
+
+		event_wait(&cbuf->event);
+	}
+}
+
+void cbuf_signal(cbuf_t *cbuf, bool canreschedule)
+{
+	event_signal(&cbuf->event, canreschedule);
 }
 
 size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule)
 {
 	const char *buf = (const char *)_buf;
+	iovec_t regions[2];
 
 	LTRACEF("len %zd\n", len);
 
@@ -75,33 +222,18 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
 	DEBUG_ASSERT(_buf);
 	DEBUG_ASSERT(len < valpow2(cbuf->len_pow2));
 
-	enter_critical_section();
+	cbuf_lock(cbuf);
 
-	size_t write_len;
-	size_t pos = 0;
+	// if it's full, write what fits and return how much we've written
+	size_t pos = MIN(len, cbuf_space_regions(cbuf, regions));
+	size_t first = MIN(pos, regions[0].iov_len);
 
-	while (pos < len && cbuf_space_avail(cbuf) > 0) {
-		if (cbuf->head >= cbuf->tail) {
-			write_len = MIN(valpow2(cbuf->len_pow2) - cbuf->head, len - pos);
-		} else {
-			write_len = MIN(cbuf->tail - cbuf->head - 1, len - pos);
-		}
+	memcpy(regions[0].iov_base, buf, first);
+	memcpy(regions[1].iov_base, buf + first, pos - first);
 
-		// if it's full, abort and return how much we've written
-		if (write_len == 0) {
-			break;
-		}
-
-		memcpy(cbuf->buf + cbuf->head, buf + pos, write_len);
-
-		cbuf->head = INC_POINTER(cbuf, cbuf->head, write_len);
-		pos += write_len;
-	}
-
-	if (cbuf->head != cbuf->tail)
-		event_signal(&cbuf->event, canreschedule);
+	cbuf_publish(cbuf, pos, canreschedule);
 
-	exit_critical_section();
+	cbuf_unlock(cbuf);
 
 	return pos;
 }
@@ -109,69 +241,89 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
 size_t cbuf_read(cbuf_t *cbuf, void *_buf, size_t buflen, bool block)
 {
 	char *buf = (char *)_buf;
+	iovec_t regions[2];
 
 	DEBUG_ASSERT(cbuf);
 	DEBUG_ASSERT(_buf);
 
-	enter_critical_section();
+	cbuf_lock(cbuf);
 
 	if (block)
-		event_wait(&cbuf->event);
+		cbuf_wait_for_data(cbuf);
 
-	// see if there's data available
-	size_t ret = 0;
-	if (cbuf->tail != cbuf->head) {
-		size_t pos = 0;
-
-		// loop until we've read everything we need
-		// at most this will make two passes to deal with wraparound
-		while (pos < buflen && cbuf->tail != cbuf->head) {
-			size_t read_len;
-			if (cbuf->head > cbuf->tail) {
-				// simple case where there is no wraparound
-				read_len = MIN(cbuf->head - cbuf->tail, buflen - pos);
-			} else {
-				// read to the end of buffer in this pass
-				read_len = MIN(valpow2(cbuf->len_pow2) - cbuf->tail, buflen - pos);
-			}
-
-			memcpy(buf + pos, cbuf->buf + cbuf->tail, read_len);
-
-			cbuf->tail = INC_POINTER(cbuf, cbuf->tail, read_len);
-			pos += read_len;
-		}
-
-		if (cbuf->tail == cbuf->head) {
-			// we've emptied the buffer, unsignal the event
-			event_unsignal(&cbuf->event);
-		}
-
-		ret = pos;
-	}
+	// at most two copies to deal with wraparound
+	size_t ret = MIN(buflen, cbuf_data_regions(cbuf, regions));
+	size_t first = MIN(ret, regions[0].iov_len);
+
+	memcpy(buf, regions[0].iov_base, first);
+	memcpy(buf + first, regions[1].iov_base, ret - first);
+
+	cbuf_consume(cbuf, ret);
 
-	exit_critical_section();
+	cbuf_unlock(cbuf);
 
 	return ret;
 }
 
+size_t cbuf_peek(cbuf_t *cbuf, iovec_t regions[2])
+{
+	DEBUG_ASSERT(cbuf);
+	DEBUG_ASSERT(regions);
+
+	cbuf_lock(cbuf);
+	size_t ret = cbuf_data_regions(cbuf, regions);
+	cbuf_unlock(cbuf);
+
+	return ret;
+}
+
+void cbuf_read_commit(cbuf_t *cbuf, size_t len)
+{
+	DEBUG_ASSERT(cbuf);
+
+	cbuf_lock(cbuf);
+	DEBUG_ASSERT(len <= cbuf_space_used(cbuf));
+	cbuf_consume(cbuf, len);
+	cbuf_unlock(cbuf);
+}
+
+size_t cbuf_peek_write(cbuf_t *cbuf, iovec_t regions[2])
+{
+	DEBUG_ASSERT(cbuf);
+	DEBUG_ASSERT(regions);
+
+	cbuf_lock(cbuf);
+	size_t ret = cbuf_space_regions(cbuf, regions);
+	cbuf_unlock(cbuf);
+
+	return ret;
+}
+
+void cbuf_write_commit(cbuf_t *cbuf, size_t len, bool canreschedule)
+{
+	DEBUG_ASSERT(cbuf);
+
+	cbuf_lock(cbuf);
+	DEBUG_ASSERT(len <= cbuf_space_avail(cbuf));
+	cbuf_publish(cbuf, len, canreschedule);
+	cbuf_unlock(cbuf);
+}
+
 size_t cbuf_write_char(cbuf_t *cbuf, char c, bool canreschedule)
 {
 	DEBUG_ASSERT(cbuf);
 
-	enter_critical_section();
+	cbuf_lock(cbuf);
 
 	size_t ret = 0;
-	if (cbuf_space_avail(cbuf) > 0) {
-		cbuf->buf[cbuf->head] = c;
-
-		cbuf->head = INC_POINTER(cbuf, cbuf->head, 1);
+	uint head = cbuf->head;
+	if (INC_POINTER(cbuf, head, 1) != cbuf_load_index(&cbuf->tail)) {
+		cbuf->buf[head] = c;
+		cbuf_publish(cbuf, 1, canreschedule);
 		ret = 1;
-
-		if (cbuf->head != cbuf->tail)
-			event_signal(&cbuf->event, canreschedule);
 	}
 
-	exit_critical_section();
+	cbuf_unlock(cbuf);
 
 	return ret;
 }
@@ -181,27 +333,20 @@ size_t cbuf_read_char(cbuf_t *cbuf, char *c, bool block)
 	DEBUG_ASSERT(cbuf);
 	DEBUG_ASSERT(c);
 
-	enter_critical_section();
+	cbuf_lock(cbuf);
 
 	if (block)
-		event_wait(&cbuf->event);
+		cbuf_wait_for_data(cbuf);
 
 	// see if there's data available
 	size_t ret = 0;
-	if (cbuf->tail != cbuf->head) {
-
+	if (cbuf_load_index(&cbuf->head) != cbuf->tail) {
 		*c = cbuf->buf[cbuf->tail];
-		cbuf->tail = INC_POINTER(cbuf, cbuf->tail, 1);
-
-		if (cbuf->tail == cbuf->head) {
-			// we've emptied the buffer, unsignal the event
-			event_unsignal(&cbuf->event);
-		}
-
+		cbuf_consume(cbuf, 1);
 		ret = 1;
 	}
 
-	exit_critical_section();
+	cbuf_unlock(cbuf);
 
 	return ret;
 }
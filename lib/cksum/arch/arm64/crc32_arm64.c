@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <arch/arm64.h>
+#include <lib/cksum.h>
+
+#include "../../crc32_arch.h"
+
+/* ID_AA64ISAR0_EL1.CRC32, bits [19:16] */
+#define ISAR0_CRC32_SHIFT   16
+#define ISAR0_CRC32_MASK    0xf
+
+typedef uint64_t __MAY_ALIAS crc_dword_t;
+
+/* the crc32 instructions are optional in armv8.0, so the assembler has to
+ * be told they are available even if the target cpu doesn't imply them */
+#define CRC_INSN(insn, crc, v, width) \
+    __asm__ (".arch_extension crc\n" insn " %w0, %w0, %" width "1" : "+r" (crc) : "r" (v))
+
+static inline uint32_t crc_byte(uint32_t crc, uint32_t v, bool castagnoli)
+{
+    if (castagnoli)
+        CRC_INSN("crc32cb", crc, v, "w");
+    else
+        CRC_INSN("crc32b", crc, v, "w");
+    return crc;
+}
+
+static inline uint32_t crc_dword(uint32_t crc, uint64_t v, bool castagnoli)
+{
+    if (castagnoli)
+        CRC_INSN("crc32cx", crc, v, "x");
+    else
+        CRC_INSN("crc32x", crc, v, "x");
+    return crc;
+}
+
+static inline uint32_t crc_arm64(uint32_t crc, const uint8_t *p, size_t len, bool castagnoli)
+{
+    crc = ~crc;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc_byte(crc, *p++, castagnoli);
+        len--;
+    }
+
+    while (len >= 8) {
+        crc = crc_dword(crc, *(const crc_dword_t *)p, castagnoli);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = crc_byte(crc, *p++, castagnoli);
+
+    return ~crc;
+}
+
+static uint32_t crc32_arm64(uint32_t crc, const void *buf, size_t len)
+{
+    return crc_arm64(crc, buf, len, false);
+}
+
+static uint32_t crc32c_arm64(uint32_t crc, const void *buf, size_t len)
+{
+    return crc_arm64(crc, buf, len, true);
+}
+
+void crc32_arch_init(void)
+{
+    uint64_t isar0 = ARM64_READ_SYSREG(id_aa64isar0_el1);
+
+    if ((isar0 >> ISAR0_CRC32_SHIFT) & ISAR0_CRC32_MASK) {
+        crc32_hw = crc32_arm64;
+        crc32c_hw = crc32c_arm64;
+    }
+}
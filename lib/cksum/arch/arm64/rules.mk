@@ -0,0 +1,6 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/crc32_arm64.c
+
+MODULE_DEFINES += CKSUM_ARCH_CRC=1
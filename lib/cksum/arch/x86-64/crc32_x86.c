@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <arch/x86.h>
+#include <lib/cksum.h>
+
+#include "../../crc32_arch.h"
+
+typedef uint64_t __MAY_ALIAS crc_dword_t;
+
+#define X86_CPUID_FEATURES      1
+#define X86_CPUID_SSE4_2        (1 << 20) /* ecx */
+
+/*
+ * The sse4.2 crc32 instruction only implements the castagnoli polynomial, so
+ * plain crc32 stays on the slicing-by-8 tables. A pclmulqdq fold would need
+ * the xmm registers, which the kernel does not save across interrupts or
+ * context switches.
+ */
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t c = ~crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		__asm__ ("crc32b %1, %k0" : "+r" (c) : "rm" (*p));
+		p++;
+		len--;
+	}
+
+	while (len >= 8) {
+		__asm__ ("crc32q %1, %0" : "+r" (c) : "rm" (*(const crc_dword_t *)p));
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		__asm__ ("crc32b %1, %k0" : "+r" (c) : "rm" (*p));
+		p++;
+	}
+
+	return ~(uint32_t)c;
+}
+
+void crc32_arch_init(void)
+{
+	uint32_t a, b, c, d;
+
+	x86_cpuid(X86_CPUID_FEATURES, 0, &a, &b, &c, &d);
+
+	if (c & X86_CPUID_SSE4_2)
+		crc32c_hw = crc32c_sse42;
+}
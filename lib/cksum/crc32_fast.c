@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <compiler.h>
+#include <endian.h>
+#include <lk/init.h>
+#include <lib/cksum.h>
+
+#include "crc32_arch.h"
+
+/*
+ * Slicing-by-8: table[k][b] is the crc of byte b followed by k zero bytes,
+ * so eight input bytes can be folded into the crc with eight independent
+ * lookups per step instead of eight dependent ones.
+ */
+static uint32_t crc32_tables[8][256];
+static uint32_t crc32c_tables[8][256];
+static int crc_ready;
+
+uint32_t (*crc32_hw)(uint32_t crc, const void *buf, size_t len);
+uint32_t (*crc32c_hw)(uint32_t crc, const void *buf, size_t len);
+
+typedef uint32_t __MAY_ALIAS crc_word_t;
+
+static void crc_make_tables(uint32_t table[8][256], uint32_t poly)
+{
+	for (uint i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (uint j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+		table[0][i] = c;
+	}
+
+	for (uint i = 0; i < 256; i++) {
+		for (uint k = 1; k < 8; k++)
+			table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+	}
+}
+
+/* racing callers build identical tables, so only publishing needs ordering */
+static void crc_init(void)
+{
+	if (likely(__atomic_load_n(&crc_ready, __ATOMIC_ACQUIRE)))
+		return;
+
+	crc_make_tables(crc32_tables, CRC32_POLY);
+	crc_make_tables(crc32c_tables, CRC32C_POLY);
+#if CKSUM_ARCH_CRC
+	crc32_arch_init();
+#endif
+
+	__atomic_store_n(&crc_ready, 1, __ATOMIC_RELEASE);
+}
+
+static void crc_init_hook(uint level)
+{
+	crc_init();
+}
+
+LK_INIT_HOOK(cksum, crc_init_hook, LK_INIT_LEVEL_PLATFORM_EARLY);
+
+static uint32_t crc_slice8(uint32_t table[8][256], uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+	while (len && ((uintptr_t)p & 3)) {
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint32_t lo = *(const crc_word_t *)p ^ crc;
+		uint32_t hi = *(const crc_word_t *)(p + 4);
+
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+		      table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+		      table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+		      table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+#endif
+
+	while (len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+uint32_t crc32_slice8(uint32_t crc, const void *buf, size_t len)
+{
+	crc_init();
+
+	return crc_slice8(crc32_tables, crc, buf, len);
+}
+
+uint32_t crc32c_slice8(uint32_t crc, const void *buf, size_t len)
+{
+	crc_init();
+
+	return crc_slice8(crc32c_tables, crc, buf, len);
+}
+
+unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len)
+{
+	if (!buf)
+		return 0;
+
+	crc_init();
+
+	if (crc32_hw)
+		return crc32_hw(crc, buf, len);
+	return crc_slice8(crc32_tables, crc, buf, len);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if (!buf)
+		return 0;
+
+	crc_init();
+
+	if (crc32c_hw)
+		return crc32c_hw(crc, buf, len);
+	return crc_slice8(crc32c_tables, crc, buf, len);
+}
@@ -34,6 +34,7 @@
 
 static int cmd_crc16(int argc, const cmd_args *argv);
 static int cmd_crc32(int argc, const cmd_args *argv);
+static int cmd_crc32c(int argc, const cmd_args *argv);
 static int cmd_adler32(int argc, const cmd_args *argv);
 static int cmd_cksum_bench(int argc, const cmd_args *argv);
 
@@ -41,6 +42,7 @@ STATIC_COMMAND_START
 #if LK_DEBUGLEVEL > 0
 	{ "crc16", "crc16", &cmd_crc16 },
 	{ "crc32", "crc32", &cmd_crc32 },
+	{ "crc32c", "crc32c", &cmd_crc32c },
 	{ "adler32", "adler32", &cmd_adler32 },
 #endif
 #if LK_DEBUGLEVEL > 1
@@ -78,6 +80,21 @@ static int cmd_crc32(int argc, const cmd_args *argv)
 	return 0;
 }
 
+static int cmd_crc32c(int argc, const cmd_args *argv)
+{
+	if (argc < 3) {
+		printf("not enough arguments\n");
+		printf("usage: %s <address> <size>\n", argv[0].str);
+		return -1;
+	}
+
+	uint32_t crc = crc32c(0, (void *)argv[1].u, argv[2].u);
+
+	printf("0x%x\n", crc);
+
+	return 0;
+}
+
 static int cmd_adler32(int argc, const cmd_args *argv)
 {
 	if (argc < 3) {
@@ -93,38 +110,73 @@ static int cmd_adler32(int argc, const cmd_args *argv)
 	return 0;
 }
 
-static int cmd_cksum_bench(int argc, const cmd_args *argv)
+static uint32_t crc32_bytewise_wrapper(uint32_t crc, const void *buf, size_t len)
 {
-#define BUFSIZE 0x1000
-#define ITER 16384
-	void *buf = malloc(BUFSIZE);
-	if (!buf)
-		return -1;
+	return crc32_bytewise(crc, buf, len);
+}
 
-	lk_bigtime_t t;
-	uint32_t crc;
+static uint32_t adler32_wrapper(uint32_t crc, const void *buf, size_t len)
+{
+	return adler32(crc, buf, len);
+}
+
+/* time one implementation over the buffer, returning its result so the
+ * implementations of the same crc can be checked against each other */
+static uint32_t cksum_bench_one(const char *name, uint32_t (*fn)(uint32_t, const void *, size_t),
+                                const void *buf, size_t len, uint iter)
+{
+	if (!fn) {
+		printf("%16s: no hardware path on this cpu\n", name);
+		return 0;
+	}
 
-	t = current_time_hires();
-	crc = 0;
-	for (int i = 0; i < ITER; i++) {
-		crc = crc32(crc, buf, BUFSIZE);
+	uint32_t crc = 0;
+	lk_bigtime_t t = current_time_hires();
+	for (uint i = 0; i < iter; i++) {
+		crc = fn(crc, buf, len);
 	}
 	t = current_time_hires() - t;
+	if (t == 0)
+		t = 1;
 
-	printf("took %llu usecs to crc32 %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
+	printf("%16s: 0x%08x, took %llu usecs for %zu bytes (%llu MB/sec)\n", name, crc, t, len * iter,
+	       (unsigned long long)len * iter * 1000000ULL / t / (1024 * 1024));
+
+	return crc;
+}
+
+static int cmd_cksum_bench(int argc, const cmd_args *argv)
+{
+#define BUFSIZE (1024 * 1024)
+#define ITER 32
+	uint8_t *buf = malloc(BUFSIZE);
+	if (!buf)
+		return -1;
+
+	for (uint i = 0; i < BUFSIZE; i++)
+		buf[i] = i * 0x9b + (i >> 11);
+
+	printf("crc32\n");
+	uint32_t ref = cksum_bench_one("bytewise", crc32_bytewise_wrapper, buf, BUFSIZE, ITER);
+	uint32_t slice8 = cksum_bench_one("slice by 8", crc32_slice8, buf, BUFSIZE, ITER);
+	uint32_t hw = cksum_bench_one("hardware", crc32_hw, buf, BUFSIZE, ITER);
+	if (slice8 != ref || (crc32_hw && hw != ref))
+		printf("crc32 implementations disagree!\n");
 	thread_sleep(500);
 
-	t = current_time_hires();
-	crc = 0;
-	for (int i = 0; i < ITER; i++) {
-		crc = adler32(crc, buf, BUFSIZE);
-	}
-	t = current_time_hires() - t;
+	printf("crc32c\n");
+	ref = cksum_bench_one("slice by 8", crc32c_slice8, buf, BUFSIZE, ITER);
+	hw = cksum_bench_one("hardware", crc32c_hw, buf, BUFSIZE, ITER);
+	if (crc32c_hw && hw != ref)
+		printf("crc32c implementations disagree!\n");
+	thread_sleep(500);
 
-	printf("took %llu usecs to adler32 %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
+	cksum_bench_one("adler32", adler32_wrapper, buf, BUFSIZE, ITER);
 
 	free(buf);
 	return 0;
+#undef BUFSIZE
+#undef ITER
 }
 
 #endif // WITH_LIB_CONSOLE
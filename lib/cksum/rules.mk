@@ -6,8 +6,14 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/adler32.c \
 	$(LOCAL_DIR)/crc16.c \
 	$(LOCAL_DIR)/crc32.c \
+	$(LOCAL_DIR)/crc32_fast.c \
 	$(LOCAL_DIR)/debug.c
 
+# hardware crc paths where the architecture has them
+ifneq ($(wildcard $(LOCAL_DIR)/arch/$(ARCH)/rules.mk),)
+include $(LOCAL_DIR)/arch/$(ARCH)/rules.mk
+endif
+
 MODULE_CFLAGS += -Wno-strict-prototypes
 
 include make/module.mk
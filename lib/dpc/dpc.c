@@ -21,41 +21,114 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <assert.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <list.h>
-#include <malloc.h>
 #include <err.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
-#include <kernel/event.h>
+#include <kernel/mp.h>
 #include <lk/init.h>
+#include <platform.h>
+
+#ifndef DPC_POOL_SIZE
+#define DPC_POOL_SIZE 64
+#endif
+
+/* one worker per cpu, or a pair on a single cpu so one slow call doesn't
+ * hold up everything queued behind it */
+#ifndef DPC_NUM_WORKERS
+#if WITH_SMP
+#define DPC_NUM_WORKERS SMP_MAX_CPUS
+#else
+#define DPC_NUM_WORKERS 2
+#endif
+#endif
+
+/* most entries a worker takes off the queue per wakeup */
+#define DPC_BATCH_MAX 16
+
+/* internal flags */
+#define DPC_FLAG_QUEUED 0x10000
+#define DPC_FLAG_POOL   0x20000
+
+/* everything here is protected by the critical section */
+static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
+static wait_queue_t dpc_wait = WAIT_QUEUE_INITIAL_VALUE(dpc_wait);
+
+static dpc_t dpc_pool[DPC_POOL_SIZE];
+static struct list_node dpc_free_list = LIST_INITIAL_VALUE(dpc_free_list);
+
+static struct {
+	uint32_t queued;
+	uint32_t ran;
+	uint32_t batches;
+	uint32_t pool_exhausted;
+	uint32_t pool_in_use;
+	uint32_t pool_max_in_use;
+	lk_bigtime_t latency_max;
+	lk_bigtime_t latency_total;
+} dpc_stats;
 
-struct dpc {
-	struct list_node node;
+static int dpc_thread_routine(void *arg);
 
-	dpc_callback cb;
-	void *arg;
-};
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg)
+{
+	*dpc = (dpc_t)DPC_INITIAL_VALUE(*dpc, cb, arg);
+}
 
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+/* must be called in a critical section */
+static void dpc_enqueue_locked(dpc_t *dpc, uint flags)
+{
+	dpc->flags |= DPC_FLAG_QUEUED;
+	dpc->queue_time = current_time_hires();
+	list_add_tail(&dpc_list, &dpc->node);
+	dpc_stats.queued++;
 
-static int dpc_thread_routine(void *arg);
+	/* a worker that is already awake will pick it up in its next batch */
+	wait_queue_wake_one(&dpc_wait, (flags & DPC_FLAG_NORESCHED) ? false : true, NO_ERROR);
+}
+
+status_t dpc_queue_etc(dpc_t *dpc, uint flags)
+{
+	DEBUG_ASSERT(dpc->cb);
+
+	enter_critical_section();
+
+	if (dpc->flags & DPC_FLAG_QUEUED) {
+		exit_critical_section();
+		return ERR_ALREADY_STARTED;
+	}
+
+	dpc_enqueue_locked(dpc, flags);
+
+	exit_critical_section();
+
+	return NO_ERROR;
+}
 
 status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
 {
-	struct dpc *dpc;
+	dpc_t *dpc;
 
-	dpc = malloc(sizeof(struct dpc));
+	enter_critical_section();
 
-	if (dpc == NULL)
+	dpc = list_remove_head_type(&dpc_free_list, dpc_t, node);
+	if (dpc == NULL) {
+		dpc_stats.pool_exhausted++;
+		exit_critical_section();
 		return ERR_NO_MEMORY;
+	}
+
+	if (++dpc_stats.pool_in_use > dpc_stats.pool_max_in_use)
+		dpc_stats.pool_max_in_use = dpc_stats.pool_in_use;
 
 	dpc->cb = cb;
 	dpc->arg = arg;
-	enter_critical_section();
-	list_add_tail(&dpc_list, &dpc->node);
-	event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
+	dpc->flags = DPC_FLAG_POOL;
+	dpc_enqueue_locked(dpc, flags);
+
 	exit_critical_section();
 
 	return NO_ERROR;
@@ -63,33 +136,101 @@ status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
 
 static int dpc_thread_routine(void *arg)
 {
+	struct {
+		dpc_callback cb;
+		void *arg;
+	} batch[DPC_BATCH_MAX];
+
 	for (;;) {
-		event_wait(&dpc_event);
+		uint count = 0;
 
 		enter_critical_section();
-		struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-		if (!dpc)
-			event_unsignal(&dpc_event);
-		exit_critical_section();
 
-		if (dpc) {
-//			dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-			dpc->cb(dpc->arg);
+		while (list_is_empty(&dpc_list))
+			wait_queue_block(&dpc_wait, INFINITE_TIME);
+
+		/* take a batch, the entries are free to be requeued or reused as
+		 * soon as they are off the list */
+		lk_bigtime_t now = current_time_hires();
+		dpc_t *dpc;
+		while (count < DPC_BATCH_MAX && (dpc = list_remove_head_type(&dpc_list, dpc_t, node))) {
+			lk_bigtime_t latency = now - dpc->queue_time;
+
+			dpc->runs++;
+			dpc->latency_total += latency;
+			if (latency > dpc->latency_max)
+				dpc->latency_max = latency;
+			dpc_stats.latency_total += latency;
+			if (latency > dpc_stats.latency_max)
+				dpc_stats.latency_max = latency;
+
+			batch[count].cb = dpc->cb;
+			batch[count].arg = dpc->arg;
+			count++;
+
+			dpc->flags &= ~DPC_FLAG_QUEUED;
+			if (dpc->flags & DPC_FLAG_POOL) {
+				list_add_head(&dpc_free_list, &dpc->node);
+				dpc_stats.pool_in_use--;
+			}
+		}
+
+		/* more left, get another worker going on it */
+		if (!list_is_empty(&dpc_list))
+			wait_queue_wake_one(&dpc_wait, false, NO_ERROR);
 
-			free(dpc);
+		dpc_stats.batches++;
+		dpc_stats.ran += count;
+
+		exit_critical_section();
+
+		for (uint i = 0; i < count; i++) {
+//			dprintf("dpc calling %p, arg %p\n", batch[i].cb, batch[i].arg);
+			batch[i].cb(batch[i].arg);
 		}
 	}
 
 	return 0;
 }
 
-static void dpc_init(uint level)
+static void dpc_lib_init(uint level)
 {
-	event_init(&dpc_event, false, 0);
-
-	thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
+	for (uint i = 0; i < countof(dpc_pool); i++)
+		list_add_tail(&dpc_free_list, &dpc_pool[i].node);
+
+	for (uint i = 0; i < DPC_NUM_WORKERS; i++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "dpc %u", i);
+		thread_t *t = thread_create(name, &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE);
+		if (!t)
+			break;
+#if WITH_SMP
+		thread_set_cpu_affinity(t, 1U << (i % SMP_MAX_CPUS));
+#endif
+		thread_detach_and_resume(t);
+	}
 }
 
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+LK_INIT_HOOK(libdpc, &dpc_lib_init, LK_INIT_LEVEL_THREADING);
+
+#if defined(WITH_LIB_CONSOLE)
+#include <lib/console.h>
+
+static int cmd_dpc(int argc, const cmd_args *argv)
+{
+	printf("dpc: %u workers, queued %u ran %u in %u batches\n",
+	       DPC_NUM_WORKERS, dpc_stats.queued, dpc_stats.ran, dpc_stats.batches);
+	printf("\tpool %u in use, max %u of %u, exhausted %u times\n",
+	       dpc_stats.pool_in_use, dpc_stats.pool_max_in_use, DPC_POOL_SIZE, dpc_stats.pool_exhausted);
+	printf("\tlatency avg %llu usecs max %llu usecs\n",
+	       dpc_stats.ran ? dpc_stats.latency_total / dpc_stats.ran : 0, dpc_stats.latency_max);
+
+	return 0;
+}
 
+STATIC_COMMAND_START
+STATIC_COMMAND("dpc", "deferred procedure call stats", &cmd_dpc)
+STATIC_COMMAND_END(dpc);
 
+#endif
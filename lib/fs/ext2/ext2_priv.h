@@ -42,16 +42,40 @@ typedef struct {
 	struct ext2_inode root_inode;
 } ext2_t;
 
-struct cache_block {
-	blocknum_t num;
-	void *ptr;
+/* a run of file blocks that are contiguous on disk, phys_block 0 is a hole */
+struct ext2_block_run {
+	uint32_t file_block;
+	blocknum_t phys_block;
+	uint32_t count;
+};
+
+#define EXT2_MAP_RUNS 16
+
+/* readahead window, in bytes */
+#define EXT2_READAHEAD_MIN (2 * 1024)
+#define EXT2_READAHEAD_MAX (64 * 1024)
+
+/* per open file state that speeds up streaming reads */
+struct ext2_file_map {
+	/* recently resolved logical to physical runs, replaced round robin */
+	struct ext2_block_run runs[EXT2_MAP_RUNS];
+	uint next_run;
+
+	/* readahead buffer and the file blocks it currently holds */
+	uint8_t *ra_buf;
+	uint32_t ra_block;
+	uint32_t ra_count;
+	size_t ra_window;
+
+	/* where the last read ended, to spot sequential access */
+	off_t last_offset;
 };
 
 /* open file handle */
 typedef struct {
 	ext2_t *ext2;
 
-	struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+	struct ext2_file_map map;
 	struct ext2_inode inode;
 } ext2_file_t;
 
@@ -65,7 +89,7 @@ int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum);
 int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
-int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_file_map *map, void *buf, off_t offset, size_t len);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* mode stuff */
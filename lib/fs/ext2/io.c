@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <debug.h>
 #include <trace.h>
+#include <err.h>
 #include <lib/fs/ext2.h>
 #include "ext2_priv.h"
 
@@ -143,49 +144,131 @@ error:
 	return err;
 }
 
-/* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock)
+/* translate a file block to a physical block, and count how many of the
+ * blocks after it follow on contiguously on disk (or are holes as well) */
+static uint32_t file_block_to_fs_run(ext2_t *ext2, struct ext2_inode *inode, uint fileblock, uint32_t max, blocknum_t *block)
 {
 	int err;
-	blocknum_t block;
 
-	LTRACEF("inode %p, fileblock %u\n", inode, fileblock);
+	LTRACEF("inode %p, fileblock %u, max %u\n", inode, fileblock, max);
 
 	uint32_t pos[4];
 	uint32_t level = 0;
-	ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+	if (ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos) < 0) {
+		*block = 0;
+		return 1;
+	}
 
 	LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
 
+	/* find the table holding the entry, runs never extend past its end */
+	const uint32_t *table;
+	uint32_t entries;
+	blocknum_t phys_block = 0;
 	if (level == 0) {
-		/* direct block, just return it directly */
-		block = LE32(inode->i_block[fileblock]);
+		/* direct block, scan the inode itself */
+		table = inode->i_block;
+		entries = EXT2_NDIR_BLOCKS;
 	} else {
-		/* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
+		/* at least one level of indirection, get a pointer to the final indirect block table */
 		blocknum_t *ind_table;
-		blocknum_t phys_block;
 		err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block);
-		if (err < 0)
-			return 0;
+		if (err < 0) {
+			*block = 0;
+			return 1;
+		}
+		table = ind_table;
+		entries = EXT2_ADDR_PER_BLOCK(ext2->sb);
+	}
 
-		/* dereference the final entry in the final table */
-		block = LE32(ind_table[pos[level]]);
-		LTRACEF("block %u, indirect_block %u\n", block, phys_block);
+	uint32_t i = pos[level];
+	blocknum_t start = LE32(table[i]);
+	uint32_t count = 1;
+	while (count < max && i + count < entries) {
+		blocknum_t next = LE32(table[i + count]);
+		if (start == 0 ? (next != 0) : (next != start + count))
+			break;
+		count++;
+	}
 
-		/* release the ref on the cache block */
+	/* release the ref on the cache block */
+	if (phys_block != 0)
 		ext2_put_block(ext2, phys_block);
+
+	LTRACEF("returning %u, count %u\n", start, count);
+
+	*block = start;
+	return count;
+}
+
+/* look up the run starting at a file block, consulting and filling the open
+ * file's map if there is one. Returns the run length, capped at max. */
+static uint32_t ext2_map_lookup(ext2_t *ext2, struct ext2_inode *inode, struct ext2_file_map *map,
+                                uint32_t file_block, uint32_t max, blocknum_t *block)
+{
+	if (!map)
+		return file_block_to_fs_run(ext2, inode, file_block, max, block);
+
+	for (uint i = 0; i < EXT2_MAP_RUNS; i++) {
+		struct ext2_block_run *run = &map->runs[i];
+		if (run->count > 0 && file_block >= run->file_block && file_block - run->file_block < run->count) {
+			uint32_t skip = file_block - run->file_block;
+			*block = run->phys_block ? run->phys_block + skip : 0;
+			return MIN(run->count - skip, max);
+		}
 	}
 
-	LTRACEF("returning %u\n", block);
+	/* resolve the whole run so later reads of it skip the indirect blocks */
+	struct ext2_block_run *run = &map->runs[map->next_run];
+	map->next_run = (map->next_run + 1) % EXT2_MAP_RUNS;
+
+	run->file_block = file_block;
+	run->count = file_block_to_fs_run(ext2, inode, file_block, UINT32_MAX, &run->phys_block);
 
-	return block;
+	*block = run->phys_block;
+	return MIN(run->count, max);
+}
+
+/* read whole file blocks, issuing one device read per physically contiguous
+ * run. Single blocks still go through the block cache. */
+static int ext2_read_file_blocks(ext2_t *ext2, struct ext2_inode *inode, struct ext2_file_map *map,
+                                 uint8_t *buf, uint32_t file_block, uint32_t count)
+{
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+	while (count > 0) {
+		blocknum_t phys_block;
+		uint32_t run = ext2_map_lookup(ext2, inode, map, file_block, count, &phys_block);
+		size_t bytes = run * block_size;
+
+		if (phys_block == 0) {
+			memset(buf, 0, bytes);
+		} else if (run == 1) {
+			int err = ext2_read_block(ext2, buf, phys_block);
+			if (err < 0)
+				return err;
+		} else {
+			ssize_t err = bio_read(ext2->dev, buf, (off_t)phys_block * block_size, bytes);
+			if (err < 0)
+				return err;
+			if ((size_t)err != bytes)
+				return ERR_IO;
+		}
+
+		buf += bytes;
+		file_block += run;
+		count -= run;
+	}
+
+	return 0;
 }
 
-int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
+int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_file_map *map, void *_buf, off_t offset, size_t len)
 {
 	int err = 0;
 	int bytes_read = 0;
 	uint8_t *buf = _buf;
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
 
 	/* calculate the file size */
 	off_t file_size = ext2_file_len(ext2, inode);
@@ -201,70 +284,88 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 		return 0;
 
 	/* calculate the starting file block */
-	uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+	uint32_t file_block = offset / block_size;
+	size_t block_offset = offset % block_size;
+	uint32_t file_blocks = (file_size + block_size - 1) / block_size;
+
+	/* a read picking up where the last one stopped grows the readahead window,
+	 * anything else shrinks it back down */
+	uint32_t ra_blocks = 0;
+	if (map) {
+		if (offset == map->last_offset)
+			map->ra_window = MIN(map->ra_window * 2, EXT2_READAHEAD_MAX);
+		else
+			map->ra_window = EXT2_READAHEAD_MIN;
+		map->last_offset = offset + len;
+
+		if (!map->ra_buf)
+			map->ra_buf = malloc(MAX(EXT2_READAHEAD_MAX, block_size));
+		if (map->ra_buf)
+			ra_blocks = MAX(map->ra_window / block_size, 1);
+	}
 
-	/* handle partial first block */
-	if ((offset % EXT2_BLOCK_SIZE(ext2->sb)) != 0) {
-		uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+	while (len > 0) {
+		/* serve what we can out of the readahead buffer */
+		if (ra_blocks > 0 && file_block >= map->ra_block && file_block - map->ra_block < map->ra_count) {
+			uint8_t *src = map->ra_buf + (file_block - map->ra_block) * block_size + block_offset;
+			size_t tocopy = MIN(len, (map->ra_block + map->ra_count - file_block) * block_size - block_offset);
+			memcpy(buf, src, tocopy);
+
+			/* increment our stuff */
+			file_block += (block_offset + tocopy) / block_size;
+			block_offset = (block_offset + tocopy) % block_size;
+			len -= tocopy;
+			bytes_read += tocopy;
+			buf += tocopy;
+			continue;
+		}
 
-		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-		if (phys_block == 0) {
-			memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-		} else {
-			ext2_read_block(ext2, temp, phys_block);
+		/* whole blocks beyond the readahead window go straight into the caller's buffer */
+		if (block_offset == 0 && len >= block_size && len / block_size >= ra_blocks) {
+			uint32_t count = len / block_size;
+			err = ext2_read_file_blocks(ext2, inode, map, buf, file_block, count);
+			if (err < 0)
+				break;
+
+			/* increment our stuff */
+			file_block += count;
+			len -= count * block_size;
+			bytes_read += count * block_size;
+			buf += count * block_size;
+			continue;
 		}
 
+		if (ra_blocks > 0) {
+			/* refill the readahead buffer from here and go around again */
+			uint32_t count = MIN(ra_blocks, file_blocks - file_block);
+			map->ra_count = 0;
+			err = ext2_read_file_blocks(ext2, inode, map, map->ra_buf, file_block, count);
+			if (err < 0)
+				break;
+			map->ra_block = file_block;
+			map->ra_count = count;
+			continue;
+		}
+
+		/* partial block without a readahead buffer, bounce it */
+		uint8_t temp[block_size];
+		err = ext2_read_file_blocks(ext2, inode, NULL, temp, file_block, 1);
+		if (err < 0)
+			break;
+
 		/* copy out what we need */
-		size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
-		size_t tocopy = MIN(len, EXT2_BLOCK_SIZE(ext2->sb) - block_offset);
+		size_t tocopy = MIN(len, block_size - block_offset);
 		memcpy(buf, temp + block_offset, tocopy);
 
 		/* increment our stuff */
 		file_block++;
+		block_offset = 0;
 		len -= tocopy;
 		bytes_read += tocopy;
 		buf += tocopy;
 	}
 
-	/* handle middle blocks */
-	while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-		if (phys_block == 0) {
-			memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
-		} else {
-			ext2_read_block(ext2, buf, phys_block);
-		}
-
-		/* increment our stuff */
-		file_block++;
-		len -= EXT2_BLOCK_SIZE(ext2->sb);
-		bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-		buf += EXT2_BLOCK_SIZE(ext2->sb);
-	}
-
-	/* handle partial last block */
-	if (len > 0) {
-		uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
-
-		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-		if (phys_block == 0) {
-			memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-		} else {
-			ext2_read_block(ext2, temp, phys_block);
-		}
-
-		/* copy out what we need */
-		memcpy(buf, temp, len);
-
-		/* increment our stuff */
-		bytes_read += len;
-	}
-
 	LTRACEF("err %d, bytes_read %d\n", err, bytes_read);
 
 	return (err < 0) ? err : bytes_read;
 }
-
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pow2.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <lib/heap.h>
@@ -44,6 +45,11 @@
 
 #define HEAP_MAGIC 'HEAP'
 
+/* small allocations are serviced from power of 2 size classes in front of the chunk allocator */
+#define HEAP_CLASS_MIN_SHIFT 5 /* smallest class is 32 bytes, header included */
+#define HEAP_CLASS_SLAB_SIZE 4096 /* size of the chunks carved into class objects */
+#define HEAP_CLASS_TAG 0x1 /* set in the size field of allocations owned by a size class */
+
 #if WITH_KERNEL_VM
 
 #include <kernel/vm.h>
@@ -79,6 +85,20 @@ struct free_heap_chunk {
 	size_t len;
 };
 
+// free object sitting in a size class quick list
+struct heap_class_obj {
+	struct heap_class_obj *next;
+};
+
+struct heap_class {
+	mutex_t lock;
+	size_t size;
+	struct heap_class_obj *free_list;
+	size_t total;
+	size_t free;
+	size_t allocs;
+};
+
 struct heap {
 	void *base;
 	size_t len;
@@ -87,6 +107,7 @@ struct heap {
 	mutex_t lock;
 	struct list_node free_list;
 	struct list_node delayed_free_list;
+	struct heap_class classes[HEAP_NUM_CLASSES];
 };
 
 // heap static vars
@@ -106,6 +127,7 @@ struct alloc_struct_begin {
 };
 
 static ssize_t heap_grow(size_t len);
+static void heap_class_free(void *ptr, size_t size);
 
 static void dump_free_chunk(struct free_heap_chunk *chunk)
 {
@@ -130,6 +152,16 @@ static void heap_dump(void)
 		dump_free_chunk(chunk);
 	}
 	mutex_release(&theheap.lock);
+
+	dprintf(INFO, "\tsize classes:\n");
+	for (uint i = 0; i < HEAP_NUM_CLASSES; i++) {
+		struct heap_class *hc = &theheap.classes[i];
+
+		mutex_acquire(&hc->lock);
+		dprintf(INFO, "\t\tsize %5zu, objects %6zu, free %6zu, allocs %zu\n",
+		        hc->size, hc->total, hc->free, hc->allocs);
+		mutex_release(&hc->lock);
+	}
 }
 
 static void heap_test(void)
@@ -279,28 +311,21 @@ static void heap_free_delayed_list(void)
 
 	while ((chunk = list_remove_head_type(&list, struct free_heap_chunk, node))) {
 		LTRACEF("freeing chunk %p\n", chunk);
-		heap_insert_free_chunk(chunk);
+		if (chunk->len & HEAP_CLASS_TAG)
+			heap_class_free(chunk, chunk->len & ~HEAP_CLASS_TAG);
+		else
+			heap_insert_free_chunk(chunk);
 	}
 }
 
-void *heap_alloc(size_t size, unsigned int alignment)
+// first fit allocation out of the free chunk list
+static void *heap_alloc_chunk(size_t size, unsigned int alignment)
 {
 	void *ptr;
 #if DEBUG_HEAP
 	size_t original_size = size;
 #endif
 
-	LTRACEF("size %zd, align %d\n", size, alignment);
-
-	// deal with the pending free list
-	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
-		heap_free_delayed_list();
-	}
-
-	// alignment must be power of 2
-	if (alignment & (alignment - 1))
-		return NULL;
-
 	// we always put a size field + base pointer + magic in front of the allocation
 	size += sizeof(struct alloc_struct_begin);
 #if DEBUG_HEAP
@@ -413,6 +438,131 @@ retry:
 	}
 #endif
 
+	return ptr;
+}
+
+// returns the size class able to hold an unaligned allocation of size bytes, or -1
+static int heap_size_to_class(size_t size)
+{
+	size += sizeof(struct alloc_struct_begin);
+#if DEBUG_HEAP
+	size += PADDING_SIZE;
+#endif
+
+	for (int i = 0; i < HEAP_NUM_CLASSES; i++) {
+		if (size <= theheap.classes[i].size)
+			return i;
+	}
+
+	return -1;
+}
+
+// carve a new slab out of the chunk allocator into objects of this class
+static void heap_class_refill(struct heap_class *hc)
+{
+	uint8_t *slab = heap_alloc_chunk(HEAP_CLASS_SLAB_SIZE, 0);
+	if (!slab)
+		return;
+
+	LTRACEF("class size %zu, new slab %p\n", hc->size, slab);
+
+	for (size_t off = 0; off + hc->size <= HEAP_CLASS_SLAB_SIZE; off += hc->size) {
+		struct heap_class_obj *obj = (struct heap_class_obj *)(slab + off);
+
+		obj->next = hc->free_list;
+		hc->free_list = obj;
+		hc->total++;
+		hc->free++;
+	}
+}
+
+static void *heap_class_alloc(int class, size_t size)
+{
+	struct heap_class *hc = &theheap.classes[class];
+
+	mutex_acquire(&hc->lock);
+
+	if (!hc->free_list)
+		heap_class_refill(hc);
+
+	struct heap_class_obj *obj = hc->free_list;
+	if (obj) {
+		hc->free_list = obj->next;
+		hc->free--;
+		hc->allocs++;
+	}
+
+	mutex_release(&hc->lock);
+
+	if (!obj)
+		return NULL;
+
+#if DEBUG_HEAP
+	memset(obj, ALLOC_FILL, hc->size);
+#endif
+
+	struct alloc_struct_begin *as = (struct alloc_struct_begin *)obj;
+#if LK_DEBUGLEVEL > 1
+	as->magic = HEAP_MAGIC;
+#endif
+	as->ptr = (void *)obj;
+	as->size = hc->size | HEAP_CLASS_TAG;
+
+	void *ptr = (void *)(as + 1);
+#if DEBUG_HEAP
+	as->padding_start = ((uint8_t *)ptr + size);
+	as->padding_size = (((addr_t)obj + hc->size) - ((addr_t)ptr + size));
+
+	memset(as->padding_start, PADDING_FILL, as->padding_size);
+#endif
+
+	return ptr;
+}
+
+// return an object to its size class, size is the untagged class size
+static void heap_class_free(void *ptr, size_t size)
+{
+	DEBUG_ASSERT(ispow2(size));
+
+	struct heap_class *hc = &theheap.classes[log2_uint(size) - HEAP_CLASS_MIN_SHIFT];
+	struct heap_class_obj *obj = (struct heap_class_obj *)ptr;
+
+	DEBUG_ASSERT(hc->size == size);
+
+#if DEBUG_HEAP
+	memset(obj, FREE_FILL, size);
+#endif
+
+	mutex_acquire(&hc->lock);
+	obj->next = hc->free_list;
+	hc->free_list = obj;
+	hc->free++;
+	mutex_release(&hc->lock);
+}
+
+void *heap_alloc(size_t size, unsigned int alignment)
+{
+	void *ptr;
+
+	LTRACEF("size %zd, align %d\n", size, alignment);
+
+	// deal with the pending free list
+	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
+		heap_free_delayed_list();
+	}
+
+	// alignment must be power of 2
+	if (alignment & (alignment - 1))
+		return NULL;
+
+	// small unaligned allocations come out of the size classes, everything else
+	// walks the chunk list
+	int class = (alignment == 0) ? heap_size_to_class(size) : -1;
+	if (class >= 0)
+		ptr = heap_class_alloc(class, size);
+	else
+		ptr = heap_alloc_chunk(size, alignment);
+
 	LTRACEF("returning ptr %p\n", ptr);
 
 	return ptr;
@@ -448,6 +598,12 @@ void heap_free(void *ptr)
 
 	LTRACEF("allocation was %zd bytes long at ptr %p\n", as->size, as->ptr);
 
+	// objects owned by a size class go back to its quick list
+	if (as->size & HEAP_CLASS_TAG) {
+		heap_class_free(as->ptr, as->size & ~HEAP_CLASS_TAG);
+		return;
+	}
+
 	// looks good, create a free chunk and add it to the pool
 	heap_insert_free_chunk(heap_create_free_chunk(as->ptr, as->size, true));
 }
@@ -462,7 +618,16 @@ void heap_delayed_free(void *ptr)
 
 	DEBUG_ASSERT(as->magic == HEAP_MAGIC);
 
-	struct free_heap_chunk *chunk = heap_create_free_chunk(as->ptr, as->size, false);
+	struct free_heap_chunk *chunk;
+	if (as->size & HEAP_CLASS_TAG) {
+		// keep the tag in the length so the delayed list hands it back to the size class
+		size_t size = as->size;
+
+		chunk = (struct free_heap_chunk *)as->ptr;
+		chunk->len = size;
+	} else {
+		chunk = heap_create_free_chunk(as->ptr, as->size, false);
+	}
 
 	enter_critical_section();
 	list_add_head(&theheap.delayed_free_list, &chunk->node);
@@ -499,6 +664,17 @@ void heap_get_stats(struct heap_stats *ptr)
 	ptr->heap_low_watermark = theheap.low_watermark;
 
 	mutex_release(&theheap.lock);
+
+	for (uint i = 0; i < HEAP_NUM_CLASSES; i++) {
+		struct heap_class *hc = &theheap.classes[i];
+
+		mutex_acquire(&hc->lock);
+		ptr->heap_class[i].size = hc->size;
+		ptr->heap_class[i].total = hc->total;
+		ptr->heap_class[i].free = hc->free;
+		ptr->heap_class[i].allocs = hc->allocs;
+		mutex_release(&hc->lock);
+	}
 }
 
 static ssize_t heap_grow(size_t size)
@@ -542,6 +718,12 @@ void heap_init(void)
 	// initialize the delayed free list
 	list_initialize(&theheap.delayed_free_list);
 
+	// initialize the size classes, they get populated on demand
+	for (uint i = 0; i < HEAP_NUM_CLASSES; i++) {
+		mutex_init(&theheap.classes[i].lock);
+		theheap.classes[i].size = 1UL << (HEAP_CLASS_MIN_SHIFT + i);
+	}
+
 	// set the heap range
 #if WITH_KERNEL_VM
 	theheap.base = pmm_alloc_kpages(HEAP_GROW_SIZE / PAGE_SIZE, NULL);
@@ -587,6 +769,7 @@ notenoughargs:
 usage:
 		printf("usage:\n");
 		printf("\t%s info\n", argv[0].str);
+		printf("\t%s stats\n", argv[0].str);
 		printf("\t%s alloc <size> [alignment]\n", argv[0].str);
 		printf("\t%s free <address>\n", argv[0].str);
 		return -1;
@@ -594,6 +777,18 @@ usage:
 
 	if (strcmp(argv[1].str, "info") == 0) {
 		heap_dump();
+	} else if (strcmp(argv[1].str, "stats") == 0) {
+		struct heap_stats stats;
+
+		heap_get_stats(&stats);
+		printf("heap %p, len 0x%zx, free 0x%zx, max chunk 0x%zx, low watermark 0x%zx\n",
+		       stats.heap_start, stats.heap_len, stats.heap_free,
+		       stats.heap_max_chunk, stats.heap_low_watermark);
+		for (uint i = 0; i < HEAP_NUM_CLASSES; i++) {
+			printf("\tclass %5zu: objects %6zu, free %6zu, allocs %zu\n",
+			       stats.heap_class[i].size, stats.heap_class[i].total,
+			       stats.heap_class[i].free, stats.heap_class[i].allocs);
+		}
 	} else if (strcmp(argv[1].str, "alloc") == 0) {
 		if (argc < 3) goto notenoughargs;
 
@@ -27,19 +27,28 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "word.h"
+
 void *
 memchr(void const *buf, int c, size_t len)
 {
-	size_t i;
-	unsigned char const *b= buf;
-	unsigned char        x= (c&0xff);
+	unsigned char const *b = buf;
+	unsigned char x = (c & 0xff);
+	const word *w;
+	word cc = ONES * x;
 
-	for (i= 0; i< len; i++) {
-		if (b[i]== x) {
-			return (void*)(b+i);
-		}
+	for (; len && ((uintptr_t)b & lmask); b++, len--) {
+		if (*b == x)
+			return (void *)b;
+	}
+
+	for (w = (const word *)b; len >= lsize && !HASZERO(*w ^ cc); w++, len -= lsize)
+		;
+
+	for (b = (unsigned char const *)w; len; b++, len--) {
+		if (*b == x)
+			return (void *)b;
 	}
 
 	return NULL;
 }
-
@@ -27,11 +27,27 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "word.h"
+
 char *
 strchr(const char *s, int c)
 {
-	for (; *s != (char) c; ++s)
+	const word *w;
+	word cc = ONES * (unsigned char)c;
+
+	for (; (uintptr_t)s & lmask; ++s) {
+		if (*s == (char)c)
+			return (char *)s;
+		if (*s == '\0')
+			return NULL;
+	}
+
+	/* stop at the word holding either the terminator or c */
+	for (w = (const word *)s; !HASZERO(*w) && !HASZERO(*w ^ cc); w++)
+		;
+
+	for (s = (const char *)w; *s != (char)c; ++s)
 		if (*s == '\0')
 			return NULL;
-	return (char *) s;
+	return (char *)s;
 }
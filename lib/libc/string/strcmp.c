@@ -27,11 +27,30 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "word.h"
+
 int
 strcmp(char const *cs, char const *ct)
 {
 	signed char __res;
 
+	/* compare a word at a time once both strings are aligned, which needs
+	 * them to start at the same offset within a word */
+	if ((((uintptr_t)cs ^ (uintptr_t)ct) & lmask) == 0) {
+		for (; (uintptr_t)cs & lmask; cs++, ct++) {
+			if (*cs != *ct || !*cs)
+				goto bytes;
+		}
+
+		const word *ws = (const word *)cs;
+		const word *wt = (const word *)ct;
+		for (; *ws == *wt && !HASZERO(*ws); ws++, wt++)
+			;
+		cs = (const char *)ws;
+		ct = (const char *)wt;
+	}
+
+bytes:
 	while (1) {
 		if ((__res = *cs - *ct++) != 0 || !*cs++)
 			break;
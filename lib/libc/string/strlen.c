@@ -27,15 +27,26 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "word.h"
+
+/* Aligned word reads never cross into a page the string doesn't touch, so
+ * reading past the terminator within the last word is harmless. */
 size_t
 strlen(char const *s)
 {
-	size_t i;
+	const char *a = s;
+	const word *w;
 
-	i= 0;
-	while (s[i]) {
-		i+= 1;
+	for (; (uintptr_t)s & lmask; s++) {
+		if (!*s)
+			return s - a;
 	}
 
-	return i;
+	for (w = (const word *)s; !HASZERO(*w); w++)
+		;
+
+	for (s = (const char *)w; *s; s++)
+		;
+
+	return s - a;
 }
@@ -27,12 +27,24 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include "word.h"
+
 size_t
 strnlen(char const *s, size_t count)
 {
-	const char *sc;
+	const char *a = s;
+	const word *w;
+
+	for (; count && ((uintptr_t)s & lmask); s++, count--) {
+		if (!*s)
+			return s - a;
+	}
 
-	for (sc = s; count-- && *sc != '\0'; ++sc)
+	for (w = (const word *)s; count >= lsize && !HASZERO(*w); w++, count -= lsize)
 		;
-	return sc - s;
+
+	for (s = (const char *)w; count && *s; s++, count--)
+		;
+
+	return s - a;
 }
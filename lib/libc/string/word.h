@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __LIBC_STRING_WORD_H
+#define __LIBC_STRING_WORD_H
+
+#include <compiler.h>
+#include <sys/types.h>
+
+/* helpers for the word at a time string routines */
+
+typedef unsigned long __MAY_ALIAS word;
+
+#define lsize sizeof(word)
+#define lmask (lsize - 1)
+
+/* nonzero if any byte of x is zero, exact for the lowest such byte */
+#define ONES ((word)-1 / 0xff)
+#define HIGHS (ONES * 0x80)
+#define HASZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+
+#endif
@@ -150,3 +150,23 @@ status_t class_netstack_input(struct device *dev, struct netstack_state *state,
 	return NO_ERROR;
 }
 
+status_t class_netstack_input_batch(struct device *dev, struct netstack_state *state, struct pbuf **pkts, size_t count)
+{
+	LTRACE_ENTRY;
+
+	struct local_netif *nif = (struct local_netif *) state;
+	status_t res = NO_ERROR;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!nif || nif->netif.input(pkts[i], &nif->netif) != ERR_OK)
+			pbuf_free(pkts[i]);
+	}
+
+	if (!nif)
+		res = ERR_INVALID_ARGS;
+
+	LTRACE_EXIT;
+
+	return res;
+}
+
@@ -0,0 +1,6 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/chksum.S
+
+MODULE_DEFINES += MINIP_ARCH_CSUM=1
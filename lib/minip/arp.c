@@ -28,6 +28,10 @@
 #include <malloc.h>
 #include <stdio.h>
 #include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <kernel/mutex.h>
+#include <platform.h>
 
 typedef union {
     uint32_t u;
@@ -35,32 +39,162 @@ typedef union {
 } ipv4_t;
 
 #define LOCAL_TRACE 0
-static struct list_node arp_list;
+
+#define ARP_HASH_SIZE       32      /* buckets, power of 2 */
+#define ARP_CACHE_MAX       64      /* entries before the least recently used is evicted */
+#define ARP_PENDING_MAX     4       /* packets held per unresolved address */
+#define ARP_REACHABLE_TIME  30000   /* ms before an entry in use is refreshed */
+#define ARP_ENTRY_TIMEOUT   300000  /* ms without confirmation before an entry is dropped */
+#define ARP_RETRY_INTERVAL  1000    /* ms between requests, also the sweep period */
+#define ARP_MAX_RETRIES     3       /* requests sent for an address before giving up */
+
+enum arp_state {
+    ARP_INCOMPLETE,     /* request sent, no reply yet */
+    ARP_REACHABLE,
+    ARP_STALE,          /* past ARP_REACHABLE_TIME, still used while a refresh is out */
+};
+
 typedef struct {
-    struct list_node node;
+    struct list_node node;      /* hash bucket */
     uint32_t addr;
     uint8_t mac[6];
+    uint8_t state;
+    uint8_t retries;
+    lk_time_t updated;          /* last time the mapping was learned or confirmed */
+    lk_time_t used;             /* last time a packet was sent with it */
+    lk_time_t requested;        /* last request sent for it */
+    struct list_node pending;   /* pktbufs waiting on the reply */
+    uint pending_count;
 } arp_entry_t;
 
-void arp_cache_init(void)
+static struct {
+    uint hits;
+    uint misses;
+    uint queued;
+    uint flushed;
+    uint queue_drops;           /* pending queue was full */
+    uint timeout_drops;         /* address never resolved */
+    uint requests;
+    uint evictions;
+} arp_stats;
+
+static struct list_node arp_hash[ARP_HASH_SIZE];
+static uint arp_count;
+static mutex_t arp_lock = MUTEX_INITIAL_VALUE(arp_lock);
+static net_timer_t arp_timer;
+static bool arp_initialized;
+
+static void arp_sweep(void *arg);
+
+static inline struct list_node *arp_bucket(uint32_t addr)
 {
-    list_initialize(&arp_list);
+    /* addresses on a subnet differ in the low bytes, which are the high bits in network order */
+    uint32_t h = addr ^ (addr >> 16);
+    h ^= h >> 8;
+    return &arp_hash[h & (ARP_HASH_SIZE - 1)];
 }
 
-static inline void mru_update(struct list_node *entry)
+void arp_cache_init(void)
 {
-    if (arp_list.next == entry)
+    if (arp_initialized)
         return;
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+    for (uint i = 0; i < ARP_HASH_SIZE; i++)
+        list_initialize(&arp_hash[i]);
+    arp_initialized = true;
+
+    net_timer_set(&arp_timer, arp_sweep, NULL, ARP_RETRY_INTERVAL);
+}
+
+static arp_entry_t *arp_find(uint32_t addr)
+{
+    arp_entry_t *arp;
+
+    DEBUG_ASSERT(is_mutex_held(&arp_lock));
+
+    list_for_every_entry(arp_bucket(addr), arp, arp_entry_t, node) {
+        if (arp->addr == addr)
+            return arp;
+    }
+
+    return NULL;
+}
+
+/* unlinks an entry, moving any packets still waiting on it to drop_list */
+static void arp_remove(arp_entry_t *arp, struct list_node *drop_list)
+{
+    pktbuf_t *p;
+
+    DEBUG_ASSERT(is_mutex_held(&arp_lock));
+
+    while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)) != NULL)
+        list_add_tail(drop_list, &p->list);
+
+    list_delete(&arp->node);
+    arp_count--;
+    free(arp);
+}
+
+/* makes room by evicting the least recently used entry that has nothing queued */
+static bool arp_evict(struct list_node *drop_list)
+{
+    arp_entry_t *arp, *lru = NULL;
+
+    DEBUG_ASSERT(is_mutex_held(&arp_lock));
+
+    for (uint i = 0; i < ARP_HASH_SIZE; i++) {
+        list_for_every_entry(&arp_hash[i], arp, arp_entry_t, node) {
+            if (arp->pending_count > 0)
+                continue;
+            if (!lru || TIME_LT(arp->used, lru->used))
+                lru = arp;
+        }
+    }
+
+    if (!lru)
+        return false;
+
+    LTRACEF("evicting %u.%u.%u.%u\n", IPV4_SPLIT(lru->addr));
+    arp_remove(lru, drop_list);
+    arp_stats.evictions++;
+    return true;
+}
+
+static arp_entry_t *arp_alloc(uint32_t addr, struct list_node *drop_list)
+{
+    DEBUG_ASSERT(is_mutex_held(&arp_lock));
+
+    if (arp_count >= ARP_CACHE_MAX && !arp_evict(drop_list))
+        return NULL;
+
+    arp_entry_t *arp = calloc(1, sizeof(arp_entry_t));
+    if (!arp)
+        return NULL;
+
+    arp->addr = addr;
+    arp->used = current_time();
+    list_initialize(&arp->pending);
+    list_add_head(arp_bucket(addr), &arp->node);
+    arp_count++;
+
+    return arp;
+}
+
+static void arp_free_list(struct list_node *list)
+{
+    pktbuf_t *p;
+
+    while ((p = list_remove_head_type(list, pktbuf_t, list)) != NULL)
+        pktbuf_free(p);
 }
 
 void arp_cache_update(uint32_t addr, const uint8_t mac[6])
 {
     arp_entry_t *arp;
     ipv4_t ip;
-    bool found = false;
+    struct list_node flush_list = LIST_INITIAL_VALUE(flush_list);
+    struct list_node drop_list = LIST_INITIAL_VALUE(drop_list);
+    pktbuf_t *p;
 
     ip.u = addr;
 
@@ -69,66 +203,195 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6])
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
-            break;
-        }
-    }
+    mutex_acquire(&arp_lock);
 
-    if (!found) {
-        LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x%02x:%02x:%02x to cache\n",
+    arp = arp_find(addr);
+    if (!arp) {
+        LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x to cache\n",
             ip.b[0], ip.b[1], ip.b[2], ip.b[3],
             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
-        if (arp == NULL) {
-            return;
-        }
+        arp = arp_alloc(addr, &drop_list);
+    }
 
-        arp->addr = addr;
+    if (arp) {
         memcpy(arp->mac, mac, sizeof(arp->mac));
-        list_add_head(&arp_list, &arp->node);
+        arp->state = ARP_REACHABLE;
+        arp->retries = 0;
+        arp->updated = current_time();
+
+        /* take the waiting packets, they're sent once the lock is dropped */
+        while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)) != NULL)
+            list_add_tail(&flush_list, &p->list);
+        arp_stats.flushed += arp->pending_count;
+        arp->pending_count = 0;
+    }
+
+    mutex_release(&arp_lock);
+
+    while ((p = list_remove_head_type(&flush_list, pktbuf_t, list)) != NULL)
+        minip_tx_resolved(p, mac);
+    arp_free_list(&drop_list);
+}
+
+/* Looks up the MAC address for the provided ip addr, copying it to mac if it's known */
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6])
+{
+    arp_entry_t *arp;
+    bool found = false;
+
+    mutex_acquire(&arp_lock);
+    arp = arp_find(addr);
+    if (arp && arp->state != ARP_INCOMPLETE) {
+        if (mac)
+            memcpy(mac, arp->mac, sizeof(arp->mac));
+        found = true;
     }
+    mutex_release(&arp_lock);
+
+    return found;
 }
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr)
+status_t arp_cache_resolve(uint32_t addr, pktbuf_t *p, uint8_t mac[6])
 {
     arp_entry_t *arp;
+    status_t err;
+    bool request = false;
+    struct list_node drop_list = LIST_INITIAL_VALUE(drop_list);
+    lk_time_t now = current_time();
+
+    mutex_acquire(&arp_lock);
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            return arp->mac;
+    arp = arp_find(addr);
+    if (arp && arp->state != ARP_INCOMPLETE) {
+        memcpy(mac, arp->mac, sizeof(arp->mac));
+        arp->used = now;
+        arp_stats.hits++;
+        err = NO_ERROR;
+        goto out;
+    }
+
+    arp_stats.misses++;
+    if (!arp) {
+        arp = arp_alloc(addr, &drop_list);
+        if (!arp) {
+            arp_stats.queue_drops++;
+            err = ERR_NO_MEMORY;
+            goto out;
         }
+        arp->state = ARP_INCOMPLETE;
+        arp->requested = now;
+        request = true;
     }
 
-    return NULL;
+    if (arp->pending_count >= ARP_PENDING_MAX) {
+        arp_stats.queue_drops++;
+        err = ERR_NOT_ENOUGH_BUFFER;
+        goto out;
+    }
+
+    list_add_tail(&arp->pending, &p->list);
+    arp->pending_count++;
+    arp_stats.queued++;
+    err = ERR_NOT_READY;
+
+out:
+    if (request)
+        arp_stats.requests++;
+    mutex_release(&arp_lock);
+
+    if (err < 0 && err != ERR_NOT_READY)
+        pktbuf_free(p);
+    arp_free_list(&drop_list);
+    if (request)
+        send_arp_request(addr);
+
+    return err;
+}
+
+/* periodic pass: retries and times out unresolved addresses, refreshes entries
+ * that are in use and ages out ones that aren't */
+static void arp_sweep(void *arg)
+{
+    arp_entry_t *arp, *temp;
+    uint32_t requests[ARP_HASH_SIZE];
+    uint request_count = 0;
+    struct list_node drop_list = LIST_INITIAL_VALUE(drop_list);
+    lk_time_t now = current_time();
+
+    mutex_acquire(&arp_lock);
+
+    for (uint i = 0; i < ARP_HASH_SIZE; i++) {
+        list_for_every_entry_safe(&arp_hash[i], arp, temp, arp_entry_t, node) {
+            bool request = false;
+
+            if (arp->state == ARP_INCOMPLETE) {
+                if (now - arp->requested < ARP_RETRY_INTERVAL)
+                    continue;
+                if (arp->retries >= ARP_MAX_RETRIES) {
+                    LTRACEF("%u.%u.%u.%u did not resolve\n", IPV4_SPLIT(arp->addr));
+                    arp_stats.timeout_drops += arp->pending_count;
+                    arp_remove(arp, &drop_list);
+                    continue;
+                }
+                request = true;
+            } else if (now - arp->updated >= ARP_ENTRY_TIMEOUT) {
+                arp_remove(arp, &drop_list);
+                continue;
+            } else if (now - arp->updated >= ARP_REACHABLE_TIME) {
+                arp->state = ARP_STALE;
+                /* only chase entries that are still being sent to */
+                if (TIME_GT(arp->used, arp->updated) && arp->retries < ARP_MAX_RETRIES &&
+                        now - arp->requested >= ARP_RETRY_INTERVAL)
+                    request = true;
+            }
+
+            if (request && request_count < countof(requests)) {
+                arp->retries++;
+                arp->requested = now;
+                requests[request_count++] = arp->addr;
+            }
+        }
+    }
+    arp_stats.requests += request_count;
+
+    mutex_release(&arp_lock);
+
+    arp_free_list(&drop_list);
+    for (uint i = 0; i < request_count; i++)
+        send_arp_request(requests[i]);
+
+    net_timer_set(&arp_timer, arp_sweep, NULL, ARP_RETRY_INTERVAL);
 }
 
 void arp_cache_dump(void)
 {
+    static const char *state_names[] = { "incomplete", "reachable", "stale" };
     int i = 0;
     arp_entry_t *arp;
+    lk_time_t now = current_time();
 
-    if (!list_is_empty(&arp_list)) {
-            list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-            ipv4_t ip;
-            ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+    mutex_acquire(&arp_lock);
+
+    if (arp_count > 0) {
+        for (uint b = 0; b < ARP_HASH_SIZE; b++) {
+            list_for_every_entry(&arp_hash[b], arp, arp_entry_t, node) {
+                ipv4_t ip;
+                ip.u = arp->addr;
+                printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x %-10s age %u ms, %u pending\n",
+                    i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
+                    arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5],
+                    state_names[arp->state], (uint)(now - arp->updated), arp->pending_count);
             }
+        }
     } else {
         printf("The arp table is empty\n");
     }
+
+    printf("hits %u misses %u requests %u queued %u flushed %u queue drops %u timeout drops %u evictions %u\n",
+        arp_stats.hits, arp_stats.misses, arp_stats.requests, arp_stats.queued, arp_stats.flushed,
+        arp_stats.queue_drops, arp_stats.timeout_drops, arp_stats.evictions);
+
+    mutex_release(&arp_lock);
 }
 
 // vim: set ts=4 sw=4 expandtab:
-
@@ -23,77 +23,217 @@
 
 #include "minip-internal.h"
 
-/* XXX alternate implementation, merge */
-uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
+#include <string.h>
+
+/*
+ * The internet checksum is the ones complement sum of 16 bit words, and
+ * since 2^16 == 1 mod 0xffff any wider sum of the same bytes folds down to
+ * the same value. The bulk is summed as 32 bit halves of 64 bit words into
+ * a 64 bit accumulator, which can't overflow for any buffer we'd ever see,
+ * and folded once at the end.
+ */
+
+typedef uint64_t __MAY_ALIAS csum_word_t;
+
+#if MINIP_ARCH_CSUM
+/* sum of len bytes, len a multiple of 64. only the folded value is
+ * meaningful, but it stays below 2^34 so more words can be added to it. */
+uint64_t ones_sum_blocks(const void *buf, size_t len);
+#endif
+
+static inline uint16_t csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/* a lone byte's share of the sum, going by which half of a word it is in */
+static inline uint32_t csum_byte(uint8_t b, size_t offset)
+{
+#if BYTE_ORDER == BIG_ENDIAN
+    return (offset & 1) ? b : (uint32_t)b << 8;
+#else
+    return (offset & 1) ? (uint32_t)b << 8 : b;
+#endif
+}
+
+static inline uint64_t csum_add_word(uint64_t sum, uint64_t w)
 {
-    const uint16_t *buf = _buf;
+    return sum + (w & 0xffffffff) + (w >> 32);
+}
 
-    while (len >= 2) {
-        sum += *buf++;
-        if(sum & 0x80000000)
-            sum = (sum & 0xffff) + (sum >> 16);
-        len -= 2;
+/* sum of an 8 byte aligned run, len a multiple of 8 */
+static uint64_t csum_words(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+
+#if MINIP_ARCH_CSUM
+    size_t bulk = len & ~(size_t)63;
+    if (bulk) {
+        sum = ones_sum_blocks(buf, bulk);
+        buf += bulk;
+        len -= bulk;
     }
+#endif
 
-    if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
-        sum += temp;
+    const csum_word_t *w = (const csum_word_t *)buf;
+    uint64_t sum2 = 0;
+    while (len >= 32) {
+        sum = csum_add_word(sum, w[0]);
+        sum2 = csum_add_word(sum2, w[1]);
+        sum = csum_add_word(sum, w[2]);
+        sum2 = csum_add_word(sum2, w[3]);
+        w += 4;
+        len -= 32;
+    }
+    while (len >= 8) {
+        sum = csum_add_word(sum, *w++);
+        len -= 8;
     }
 
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
+    return sum + sum2;
+}
 
+/* the words of a run starting on an odd offset pair the bytes up the other
+ * way round, which byte swapping the folded sum undoes */
+static inline uint64_t csum_realign(uint64_t sum, size_t offset)
+{
+    if (offset & 1) {
+        uint16_t f = csum_fold(sum);
+        return (uint16_t)((f << 8) | (f >> 8));
+    }
     return sum;
 }
 
-uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+uint16_t ones_sum16(uint32_t sum, const void *_buf, int len)
 {
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    const uint16_t *p = (const uint16_t *) buf;
+    const uint8_t *buf = _buf;
+    size_t n = len;
+    size_t offset = 0;
+    uint64_t acc = sum;
+
+    /* bytes up to the first aligned word */
+    while (n && ((uintptr_t)buf & 7)) {
+        acc += csum_byte(*buf++, offset++);
+        n--;
+    }
+
+    size_t bulk = n & ~(size_t)7;
+    acc += csum_realign(csum_words(buf, bulk), offset);
+    buf += bulk;
+    offset += bulk;
+    n -= bulk;
 
-    // Length is in bytes
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
+    while (n--)
+        acc += csum_byte(*buf++, offset++);
+
+    return csum_fold(acc);
+}
+
+uint16_t ones_sum16_copy(uint32_t sum, void *_dst, const void *_src, int len)
+{
+    uint8_t *dst = _dst;
+    const uint8_t *src = _src;
+    size_t n = len;
+    size_t offset = 0;
+    uint64_t acc = sum;
+
+    /* the word loop needs both sides aligned together, otherwise copy
+     * first and sum the destination while it is still in the cache */
+    if (((uintptr_t)dst ^ (uintptr_t)src) & 7) {
+        memcpy(dst, src, n);
+        return ones_sum16(sum, dst, len);
     }
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+    while (n && ((uintptr_t)src & 7)) {
+        uint8_t b = *src++;
+        *dst++ = b;
+        acc += csum_byte(b, offset++);
+        n--;
+    }
+
+    const csum_word_t *s = (const csum_word_t *)src;
+    csum_word_t *d = (csum_word_t *)dst;
+    uint64_t bulk = 0;
+    uint64_t bulk2 = 0;
+    size_t words = n / 8;
+    while (words >= 2) {
+        uint64_t w0 = s[0];
+        uint64_t w1 = s[1];
+        d[0] = w0;
+        d[1] = w1;
+        bulk = csum_add_word(bulk, w0);
+        bulk2 = csum_add_word(bulk2, w1);
+        s += 2;
+        d += 2;
+        words -= 2;
+    }
+    if (words) {
+        uint64_t w0 = *s++;
+        *d++ = w0;
+        bulk = csum_add_word(bulk, w0);
+    }
+    acc += csum_realign(bulk + bulk2, offset);
+    offset += n & ~(size_t)7;
+    n &= 7;
+
+    src = (const uint8_t *)s;
+    dst = (uint8_t *)d;
+    while (n--) {
+        uint8_t b = *src++;
+        *dst++ = b;
+        acc += csum_byte(b, offset++);
+    }
 
-    return chksum;
+    return csum_fold(acc);
 }
 
-#if MINIP_USE_UDP_CHECKSUM
-uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, struct udp_hdr *udp)
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m') */
+uint16_t ones_csum_update16(uint16_t csum, uint16_t old_val, uint16_t new_val)
 {
-    uint32_t total = 0;
-    uint16_t chksum = 0;
-    size_t len = ntohs(udp->len);
-    uint16_t *p;
+    uint32_t sum = (uint16_t)~csum + (uint16_t)~old_val + new_val;
 
-    p = (uint16_t *)ipv4->src_addr;
-    total += htons(p[0]);
-    total += htons(p[1]);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
 
-    p = (uint16_t *)ipv4->dst_addr;
-    total += htons(p[0]);
-    total += htons(p[1]);
+    return ~sum;
+}
 
-    p = (const uint16_t *)udp->data;
-    for (size_t i = 0; i < len / 2; i++ ) {
-        total += p[i];
-    }
+uint16_t ones_csum_update32(uint16_t csum, uint32_t old_val, uint32_t new_val)
+{
+    uint32_t sum = (uint16_t)~csum;
+
+    sum += (uint16_t)~old_val + (uint16_t)~(old_val >> 16);
+    sum += (new_val & 0xffff) + (new_val >> 16);
 
-    total += IP_PROTO_UDP;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+uint16_t rfc1701_chksum(const uint8_t *buf, size_t len)
+{
+    return ~ones_sum16(0, buf, len);
+}
+
+#if MINIP_USE_UDP_CHECKSUM
+uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, struct udp_hdr *udp)
+{
+    /* pseudo header, every field already in network order */
+    uint32_t total = 0;
+    total += (ipv4->src_addr & 0xffff) + (ipv4->src_addr >> 16);
+    total += (ipv4->dst_addr & 0xffff) + (ipv4->dst_addr >> 16);
+    total += htons(IP_PROTO_UDP);
     total += udp->len;
-    total += udp->src_port;
-    total += udp->dst_port;
-    total += ipv4->len;
 
-    chksum = (total & 0xFFFF) + (total >> 16);
-    chksum = ~chksum;
+    uint16_t chksum = ~ones_sum16(total, udp, ntohs(udp->len));
 
-    return chksum;
+    /* zero means no checksum was computed */
+    return chksum ? chksum : 0xffff;
 }
 #endif
 
@@ -272,9 +272,13 @@ static int dhcp_thread(void *arg) {
 static thread_t *dhcp_thr;
 
 void minip_init_dhcp(tx_func_t tx_func, void *tx_arg) {
+	minip_init_dhcp_etc(tx_func, tx_arg, 0);
+}
+
+void minip_init_dhcp_etc(tx_func_t tx_func, void *tx_arg, uint32_t tx_flags) {
 	minip_get_macaddr(mac);
 
-	minip_init(tx_func, tx_arg, IPV4_NONE, IPV4_NONE, IPV4_NONE);
+	minip_init_etc(tx_func, tx_arg, tx_flags, IPV4_NONE, IPV4_NONE, IPV4_NONE);
 
 	minip_udp_listen(DHCP_CLIENT_PORT, dhcp_cb, NULL);
 
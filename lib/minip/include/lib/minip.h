@@ -26,6 +26,7 @@
 #include <endian.h>
 #include <list.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <lib/pktbuf.h>
 
@@ -38,12 +39,19 @@ typedef int (*tx_func_t)(pktbuf_t *p);
 typedef void (*udp_callback_t)(void *data, size_t len,
     uint32_t srcaddr, uint16_t srcport, void *arg);
 
+/* tx flags passed to minip_init_etc() */
+#define MINIP_TX_GATHER (1 << 0) /* tx_func walks p->next and sends chained segments */
+#define MINIP_TX_CSUM   (1 << 1) /* tx_func honors PKTBUF_FLAG_CSUM_PARTIAL */
+
 /* initialize minip with static configuration */
 void minip_init(tx_func_t tx_func, void *tx_arg,
     uint32_t ip, uint32_t netmask, uint32_t gateway);
+void minip_init_etc(tx_func_t tx_func, void *tx_arg, uint32_t tx_flags,
+    uint32_t ip, uint32_t netmask, uint32_t gateway);
 
 /* initialize minip with DHCP configuration */
 void minip_init_dhcp(tx_func_t tx_func, void *tx_arg);
+void minip_init_dhcp_etc(tx_func_t tx_func, void *tx_arg, uint32_t tx_flags);
 
 /* packet rx hook to hand to ethernet driver */
 void minip_rx_driver_callback(pktbuf_t *p);
@@ -74,14 +82,69 @@ int minip_udp_send(const void *data, size_t len,
 
 /* install udp listener */
 int minip_udp_listen(uint16_t port, udp_callback_t rx_handler, void *arg);
+int minip_udp_unlisten(uint16_t port);
+
+/* flags for the _etc socket calls */
+#define MINIP_NONBLOCK (1 << 0) /* return ERR_NOT_READY instead of blocking */
+
+/* queued udp socket, datagrams are held until read */
+typedef struct udp_socket udp_socket_t;
+
+status_t udp_open(udp_socket_t **handle, uint16_t port);
+status_t udp_close(udp_socket_t *socket);
+ssize_t udp_recv(udp_socket_t *socket, void *buf, size_t len,
+    uint32_t *srcaddr, uint16_t *srcport, uint flags);
+status_t udp_send(udp_socket_t *socket, const void *buf, size_t len,
+    uint32_t dstaddr, uint16_t dstport);
 
 /* tcp */
 typedef struct tcp_socket tcp_socket_t;
 
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port);
+
+/* per socket tunables. set on a listen socket, accepted connections inherit them */
+typedef enum {
+    TCP_CC_NEWRENO,
+    TCP_CC_CUBIC,
+} tcp_cc_t;
+
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size);
+status_t tcp_set_congestion_control(tcp_socket_t *socket, tcp_cc_t cc);
+
 status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket);
 status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/* MINIP_NONBLOCK versions. a nonblocking write copies what fits and returns
+ * the byte count, or ERR_NOT_READY if nothing did */
+status_t tcp_accept_etc(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, uint flags);
+ssize_t tcp_read_etc(tcp_socket_t *socket, void *buf, size_t len, uint flags);
+ssize_t tcp_write_etc(tcp_socket_t *socket, const void *buf, size_t len, uint flags);
+
+/* readiness of many sockets from one thread */
+#define MINIP_POLL_IN   (1 << 0)  /* data or eof to read, or a connection to accept */
+#define MINIP_POLL_OUT  (1 << 1)  /* room to write */
+#define MINIP_POLL_HUP  (1 << 2)  /* connection closed, reported whether asked for or not */
+#define MINIP_POLL_EDGE (1u << 31) /* report each change once rather than for as long as it holds */
+
+typedef struct minip_poll_set minip_poll_set_t;
+
+typedef struct {
+    void *cookie;
+    uint32_t events;
+} minip_poll_event_t;
+
+status_t minip_poll_create(minip_poll_set_t **set);
+void minip_poll_destroy(minip_poll_set_t *set);
+
+/* a socket can be in any number of sets, once per set. closing it removes it */
+status_t minip_poll_add_tcp(minip_poll_set_t *set, tcp_socket_t *socket, uint32_t events, void *cookie);
+status_t minip_poll_add_udp(minip_poll_set_t *set, udp_socket_t *socket, uint32_t events, void *cookie);
+status_t minip_poll_modify(minip_poll_set_t *set, const void *socket, uint32_t events);
+status_t minip_poll_remove(minip_poll_set_t *set, const void *socket);
+
+/* fill in up to max events, returns the count or ERR_TIMED_OUT */
+ssize_t minip_poll_wait(minip_poll_set_t *set, minip_poll_event_t *events, size_t max, lk_time_t timeout);
+
 // vim: set ts=4 sw=4 expandtab:
@@ -32,37 +32,92 @@
 #define PKTBUF_MAX_DATA 1536
 #define PKTBUF_MAX_HDR (PKTBUF_BUF_SIZE - PKTBUF_MAX_DATA)
 
+// segment points at external memory instead of its own buffer
+#define PKTBUF_FLAG_EXT (1 << 0)
+
+// rx: the driver's hardware verified the l4 checksum, the stack may skip it
+#define PKTBUF_FLAG_CSUM_VALID (1 << 1)
+
+// tx: the l4 checksum field holds the pseudo header sum and the driver's
+// hardware must fold in everything from csum_start to the end of packet
+#define PKTBUF_FLAG_CSUM_PARTIAL (1 << 2)
+
+// tx: a tcp/ipv4 packet larger than the mtu for the hardware to segment
+// into gso_size byte pieces, implies PKTBUF_FLAG_CSUM_PARTIAL
+#define PKTBUF_FLAG_GSO_TCPV4 (1 << 3)
+
+// owner of memory referenced by external segments. the free hook is
+// called when the last reference is dropped, possibly from the driver's
+// tx completion interrupt, so it must not block.
+struct pktbuf_ext {
+	volatile int ref;
+	void (*free)(struct pktbuf_ext *ext);
+};
+
 typedef struct pktbuf {
 	struct list_node list;
 	u8 *data;
 	u32 dlen;
 	u32 phys_base;
-	u32 rsv0;
-	u32 rsv1;
-	u32 rsv2;
+	struct pktbuf *next;     // next segment of a chained packet
+	struct pktbuf_ext *ext;  // reference held by an external segment
+	u32 flags;
+	u16 csum_start;          // offset into buffer of the checksummed region
+	u16 csum_offset;         // offset of the checksum field from csum_start
+	u16 gso_size;            // payload bytes per segment for GSO packets
+	u16 pad;                 // keeps buffer 4 byte aligned for drivers
 	u8 buffer[PKTBUF_BUF_SIZE];
 } pktbuf_t;
 
 static inline u32 pktbuf_data_phys(pktbuf_t *p) {
+	if (p->flags & PKTBUF_FLAG_EXT)
+		return p->phys_base;
 	return p->phys_base + (p->data - p->buffer);
 }
 
 // number of bytes available for _prepend
 static inline u32 pktbuf_avail_head(pktbuf_t *p) {
+	if (p->flags & PKTBUF_FLAG_EXT)
+		return 0;
 	return p->data - p->buffer;
 }
 
 // number of bytes available for _append or _append_data
 static inline u32 pktbuf_avail_tail(pktbuf_t *p) {
+	if (p->flags & PKTBUF_FLAG_EXT)
+		return 0;
 	return PKTBUF_BUF_SIZE - (p->data - p->buffer) - p->dlen;
 }
 
 // allocate packet buffer from buffer pool
 pktbuf_t *pktbuf_alloc(void);
 
-// return packet buffer to buffer pool
+// allocate a segment that points at len bytes of external memory rather
+// than carrying a copy. if ext is not NULL a reference is taken on it and
+// dropped when the segment is freed, otherwise data must stay valid until
+// the driver is done with the packet.
+pktbuf_t *pktbuf_alloc_ext(const void *data, size_t len, struct pktbuf_ext *ext);
+
+// return packet buffer and every segment chained to it to the buffer pool
 void pktbuf_free(pktbuf_t *p);
 
+// pktbuf_free for interrupt context. a thread waiting in pktbuf_alloc is
+// woken without rescheduling, so the handler should return INT_RESCHEDULE
+void pktbuf_free_irq(pktbuf_t *p);
+
+// drop a reference on an external buffer, freeing it on the last one
+void pktbuf_ext_release(struct pktbuf_ext *ext);
+
+// add seg (and anything chained to it) to the end of p's chain
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *seg);
+
+// number of bytes in the packet across all chained segments
+size_t pktbuf_total_len(const pktbuf_t *p);
+
+// copy the chained segments into the tail of the first one and free
+// them, returning ERR_TOO_BIG if the packet does not fit in one buffer
+status_t pktbuf_linearize(pktbuf_t *p);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
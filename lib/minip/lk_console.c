@@ -25,11 +25,155 @@
 
 #include <lib/console.h>
 #include <kernel/thread.h>
+#include <platform.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #if WITH_LIB_CONSOLE
+/* the straightforward 16 bit at a time sum, as a baseline */
+__NO_INLINE static uint16_t bench_ref_sum16(uint32_t sum, const void *_buf, int len)
+{
+    const uint16_t *buf = _buf;
+
+    while (len >= 2) {
+        sum += *buf++;
+        if (sum & 0x80000000)
+            sum = (sum & 0xffff) + (sum >> 16);
+        len -= 2;
+    }
+    if (len)
+        sum += *(const uint8_t *)buf;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return sum;
+}
+
+#define CSUM_BENCH_MAX   65536
+#define CSUM_BENCH_BYTES (8 * 1024 * 1024)
+
+enum {
+    CSUM_BENCH_REF,
+    CSUM_BENCH_SUM,
+    CSUM_BENCH_MEMCPY_SUM,
+    CSUM_BENCH_COPY,
+    CSUM_BENCH_OPS
+};
+
+static const char *csum_bench_names[CSUM_BENCH_OPS] = {
+    "ref", "sum", "cpy+sum", "fused",
+};
+
+static uint16_t csum_bench_op(uint op, uint8_t *dst, const uint8_t *src, size_t len, uint iter)
+{
+    uint16_t acc = 0;
+
+    for (uint i = 0; i < iter; i++) {
+        switch (op) {
+            case CSUM_BENCH_REF:
+                acc += bench_ref_sum16(0, src, len);
+                break;
+            case CSUM_BENCH_SUM:
+                acc += ones_sum16(0, src, len);
+                break;
+            case CSUM_BENCH_MEMCPY_SUM:
+                memcpy(dst, src, len);
+                acc += ones_sum16(0, dst, len);
+                break;
+            case CSUM_BENCH_COPY:
+                acc += ones_sum16_copy(0, dst, src, len);
+                break;
+        }
+    }
+
+    return acc;
+}
+
+static void csum_bench(void)
+{
+    static const size_t sizes[] = { 20, 64, 256, 576, 1460, 4096, CSUM_BENCH_MAX };
+    volatile uint16_t sink = 0;
+
+    uint8_t *src = malloc(CSUM_BENCH_MAX + 8);
+    uint8_t *dst = malloc(CSUM_BENCH_MAX + 8);
+    if (!src || !dst) {
+        printf("failed to allocate buffers\n");
+        goto out;
+    }
+
+    for (size_t i = 0; i < CSUM_BENCH_MAX + 8; i++)
+        src[i] = rand();
+
+    /* the fast paths have to agree with the baseline before their numbers mean anything */
+    for (uint off = 0; off < 4; off++) {
+        for (size_t len = 0; len < 300; len++) {
+            uint16_t ref = bench_ref_sum16(0, src + off, len);
+            if (ones_sum16(0, src + off, len) != ref ||
+                ones_sum16_copy(0, dst + (off & 1), src + off, len) != ref) {
+                printf("checksum mismatch, offset %u len %zu\n", off, len);
+                goto out;
+            }
+        }
+    }
+
+    printf("ns/byte\n");
+    printf("%8s", "size");
+    for (uint op = 0; op < CSUM_BENCH_OPS; op++)
+        printf(" %8s", csum_bench_names[op]);
+    printf("\n");
+
+    for (uint i = 0; i < countof(sizes); i++) {
+        size_t len = sizes[i];
+        uint iter = CSUM_BENCH_BYTES / len;
+
+        printf("%8zu", len);
+        for (uint op = 0; op < CSUM_BENCH_OPS; op++) {
+            lk_bigtime_t t = current_time_hires();
+            sink += csum_bench_op(op, dst, src, len, iter);
+            t = current_time_hires() - t;
+
+            /* hundredths of a ns per byte */
+            uint64_t cns = (uint64_t)t * 100000ULL / ((uint64_t)len * iter);
+            printf(" %5llu.%02llu", (unsigned long long)cns / 100, (unsigned long long)cns % 100);
+        }
+        printf("\n");
+    }
+
+    /* rewriting one header field: patch the old checksum vs summing again */
+    uint iter = CSUM_BENCH_BYTES / 20;
+
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; i < iter; i++) {
+        uint16_t *ttl = (uint16_t *)(src + 8);
+        uint16_t old = *ttl;
+        *ttl = old + 1;
+        sink += ~ones_sum16(0, src, 20);
+    }
+    lk_bigtime_t full = current_time_hires() - t;
+
+    uint16_t csum = ~ones_sum16(0, src, 20);
+    t = current_time_hires();
+    for (uint i = 0; i < iter; i++) {
+        uint16_t *ttl = (uint16_t *)(src + 8);
+        uint16_t old = *ttl;
+        *ttl = old + 1;
+        csum = ones_csum_update16(csum, old, *ttl);
+    }
+    lk_bigtime_t incr = current_time_hires() - t;
+    sink += csum;
+
+    printf("20 byte header, %u rewrites: full %llu us, incremental %llu us\n",
+           iter, (unsigned long long)full, (unsigned long long)incr);
+    uint16_t full_csum = ~ones_sum16(0, src, 20);
+    if (csum != full_csum)
+        printf("incremental checksum mismatch\n");
+
+out:
+    free(src);
+    free(dst);
+}
+
 static int cmd_minip(int argc, const cmd_args *argv)
 {
     static minip_fd_t fd = {IPV4(192, 168, 1, 1), 65456};
@@ -38,6 +182,7 @@ static int cmd_minip(int argc, const cmd_args *argv)
 minip_usage:
         printf("minip commands\n");
         printf("mi [a]rp                        dump arp table\n");
+        printf("mi [b]ench                      benchmark the checksum routines\n");
         printf("mi [c]onfig <ip addr> <port>    set default dest to <ip addr>:<port>\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est <cnt>                 send <cnt> test packets to the configured dest\n");
@@ -48,6 +193,10 @@ minip_usage:
                 arp_cache_dump();
                 break;
 
+            case 'b':
+                csum_bench();
+                break;
+
             case 'c':
                 if (argc < 4)
                     goto minip_usage;
@@ -69,7 +218,7 @@ minip_usage:
                 memcpy(&fd.addr, ip, 4);
                 fd.port = argv[3].u;
 
-                if (arp_cache_lookup(fd.addr) == NULL) {
+                if (!arp_cache_lookup(fd.addr, NULL)) {
                     send_arp_request(fd.addr);
                 }
 
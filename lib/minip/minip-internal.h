@@ -109,17 +109,36 @@ enum {
 
 void arp_cache_init(void);
 void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6]);
+
+/* find the mac for addr to send p, whose data starts at its ethernet header.
+ * returns NO_ERROR with mac filled in if it's known. otherwise p is queued
+ * until the reply arrives (ERR_NOT_READY), or freed if it can't be. */
+status_t arp_cache_resolve(uint32_t addr, pktbuf_t *p, uint8_t mac[6]);
 void arp_cache_dump(void);
 
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
 uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, struct udp_hdr *udp);
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
 
+/* ones_sum16() of src while copying it to dst */
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, int len);
+
+/* patch a checksum after a field it covers changes, the values in the
+ * byte order they have in the packet (RFC 1624) */
+uint16_t ones_csum_update16(uint16_t csum, uint16_t old_val, uint16_t new_val);
+uint16_t ones_csum_update32(uint16_t csum, uint32_t old_val, uint32_t new_val);
+
 int send_arp_request(uint32_t addr);
 
+/* MINIP_TX_* capabilities of the attached driver */
+extern uint32_t minip_tx_flags;
+
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
 
+/* send an ipv4 packet that was held in the arp cache waiting for mac */
+void minip_tx_resolved(pktbuf_t *p, const uint8_t mac[6]);
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
 
 // timers
@@ -142,5 +161,28 @@ bool net_timer_cancel(net_timer_t *) __NONNULL();
 
 void net_timer_init(void);
 
+// poll sets
+typedef struct minip_poll_src minip_poll_src_t;
+
+/* current MINIP_POLL_* state of a socket, called without the socket's lock */
+typedef uint32_t (*minip_poll_query_t)(minip_poll_src_t *);
+
+/* embedded in each pollable socket */
+struct minip_poll_src {
+    struct list_node entries;
+    minip_poll_query_t query;
+};
+
+void minip_poll_src_init(minip_poll_src_t *src, minip_poll_query_t query);
+
+/* drop every set's entry for a socket that's going away */
+void minip_poll_src_detach(minip_poll_src_t *src);
+
+/* wake any sets watching for events on src */
+void minip_poll_notify(minip_poll_src_t *src, uint32_t events);
+
+status_t minip_poll_add(minip_poll_set_t *set, minip_poll_src_t *src, const void *handle,
+                        uint32_t events, void *cookie);
+
 // vim: set ts=4 sw=4 expandtab:
 
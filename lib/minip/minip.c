@@ -32,6 +32,7 @@
 #include <trace.h>
 #include <malloc.h>
 #include <list.h>
+#include <err.h>
 #include <kernel/mutex.h>
 
 struct udp_listener {
@@ -42,6 +43,7 @@ struct udp_listener {
 };
 
 static struct list_node udp_list = LIST_INITIAL_VALUE(udp_list);
+static mutex_t udp_lock = MUTEX_INITIAL_VALUE(udp_lock);
 static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
 
 // TODO
@@ -76,22 +78,43 @@ const char *minip_get_hostname(void) {
 int minip_udp_listen(uint16_t port, udp_callback_t cb, void *arg) {
     struct udp_listener *entry;
 
+    mutex_acquire(&udp_lock);
     list_for_every_entry(&udp_list, entry, struct udp_listener, list) {
         if (entry->port == port) {
+            mutex_release(&udp_lock);
             return -1;
         }
     }
 
     if ((entry = malloc(sizeof(struct udp_listener))) == NULL) {
+        mutex_release(&udp_lock);
         return -1;
     }
     entry->port = port;
     entry->callback = cb;
     entry->arg = arg;
     list_add_tail(&udp_list, &entry->list);
+    mutex_release(&udp_lock);
     return 0;
 }
 
+/* once this returns the port's callback is not running and won't be called again */
+int minip_udp_unlisten(uint16_t port) {
+    struct udp_listener *entry;
+
+    mutex_acquire(&udp_lock);
+    list_for_every_entry(&udp_list, entry, struct udp_listener, list) {
+        if (entry->port == port) {
+            list_delete(&entry->list);
+            mutex_release(&udp_lock);
+            free(entry);
+            return 0;
+        }
+    }
+    mutex_release(&udp_lock);
+    return -1;
+}
+
 static void compute_broadcast_address(void)
 {
     minip_broadcast = (minip_ip & minip_netmask) | (IPV4_BCAST & ~minip_netmask);
@@ -117,12 +140,20 @@ void minip_set_ipaddr(const uint32_t addr) {
 /* This function is called by minip to send packets */
 tx_func_t minip_tx_handler;
 void *minip_tx_arg;
+uint32_t minip_tx_flags;
 
 void minip_init(tx_func_t tx_handler, void *tx_arg,
     uint32_t ip, uint32_t mask, uint32_t gateway)
+{
+    minip_init_etc(tx_handler, tx_arg, 0, ip, mask, gateway);
+}
+
+void minip_init_etc(tx_func_t tx_handler, void *tx_arg, uint32_t tx_flags,
+    uint32_t ip, uint32_t mask, uint32_t gateway)
 {
     minip_tx_handler = tx_handler;
     minip_tx_arg = tx_arg;
+    minip_tx_flags = tx_flags;
 
     minip_ip = ip;
     minip_netmask = mask;
@@ -139,7 +170,7 @@ uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
     return (pkt->len - ((pkt->ver_ihl >> 4) * 5));
 }
 
-static void fill_in_mac_header(struct eth_hdr *pkt, uint8_t *dst, uint16_t type)
+static void fill_in_mac_header(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type)
 {
     memcpy(pkt->dst_mac, dst, sizeof(pkt->dst_mac));
     memcpy(pkt->src_mac, minip_mac, sizeof(minip_mac));
@@ -163,6 +194,19 @@ static void fill_in_ipv4_header(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t pro
     ipv4->chksum = rfc1701_chksum((uint8_t *) ipv4, sizeof(struct ipv4_hdr));
 }
 
+/* hand a packet to the driver, flattening chains for drivers that can't gather */
+static int minip_tx(pktbuf_t *p)
+{
+    if (p->next && !(minip_tx_flags & MINIP_TX_GATHER)) {
+        if (pktbuf_linearize(p) < 0) {
+            pktbuf_free(p);
+            return -1;
+        }
+    }
+
+    return minip_tx_handler(p);
+}
+
 int send_arp_request(uint32_t addr)
 {
     pktbuf_t *p;
@@ -187,54 +231,56 @@ int send_arp_request(uint32_t addr)
     memcpy(arp->sha, minip_mac, sizeof(arp->sha));
     memcpy(arp->tha, bcast_mac, sizeof(arp->tha));
 
-    minip_tx_handler(p);
+    minip_tx(p);
     return 0;
 }
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
     status_t ret = 0;
-    size_t data_len = p->dlen;
-    uint8_t *dst_mac;
+    size_t data_len = pktbuf_total_len(p);
+    uint8_t dst_mac[6];
 
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
 
+    fill_in_ipv4_header(ip, dest_addr, proto, data_len);
+
     mutex_acquire(&tx_mutex);
 
     if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
-        dst_mac = bcast_mac;
-        goto ready;
-    }
-
-    /* If we're missing an address in the cache send out a request periodically for a bit */
-    dst_mac = arp_cache_lookup(dest_addr);
-    if (!dst_mac) {
-        send_arp_request(dest_addr);
-        // TODO: Add a timeout here rather than an arbitrary iteration limit
-        for (int i = 50000; i > 0; i--) {
-            if ((dst_mac = arp_cache_lookup(dest_addr)) != NULL) {
-                break;
-            }
-        }
-
-        if (dst_mac == NULL) {
+        memcpy(dst_mac, bcast_mac, sizeof(dst_mac));
+    } else {
+        /* an unresolved packet waits in the arp cache and goes out when the reply arrives */
+        ret = arp_cache_resolve(dest_addr, p, dst_mac);
+        if (ret == ERR_NOT_READY) {
+            ret = 0;
+            goto out;
+        } else if (ret < 0) {
             ret = -1;
-            goto err;
+            goto out;
         }
     }
 
-ready:
     fill_in_mac_header(eth, dst_mac, ETH_TYPE_IPV4);
-    fill_in_ipv4_header(ip, dest_addr, proto, data_len);
 
-    minip_tx_handler(p);
+    if (minip_tx(p) < 0) {
+        ret = -1;
+    }
 
-err:
+out:
     mutex_release(&tx_mutex);
     return ret;
 }
 
+void minip_tx_resolved(pktbuf_t *p, const uint8_t mac[6])
+{
+    mutex_acquire(&tx_mutex);
+    fill_in_mac_header((struct eth_hdr *)p->data, mac, ETH_TYPE_IPV4);
+    minip_tx(p);
+    mutex_release(&tx_mutex);
+}
+
 int minip_udp_send(const void *buf, size_t len, uint32_t addr,
     uint16_t dstport, uint16_t srcport)
 {
@@ -242,7 +288,7 @@ int minip_udp_send(const void *buf, size_t len, uint32_t addr,
     struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     struct udp_hdr *udp;
-    uint8_t *dst_mac;
+    uint8_t dst_mac[6];
     int ret = 0;
 
     if ((p = pktbuf_alloc()) == NULL) {
@@ -255,47 +301,37 @@ int minip_udp_send(const void *buf, size_t len, uint32_t addr,
     memset(p->data, 0, p->dlen);
     pktbuf_append_data(p, buf, len);
 
-    mutex_acquire(&tx_mutex);
-
-    if (addr == IPV4_BCAST) {
-        dst_mac = bcast_mac;
-        goto ready;
-    }
-
-    /* If we're missing an address in the cache send out a request periodically for a bit */
-    dst_mac = arp_cache_lookup(addr);
-    if (!dst_mac) {
-        send_arp_request(addr);
-        // TODO: Add a timeout here rather than an arbitrary iteration limit
-        for (int i = 50000; i > 0; i--) {
-            if ((dst_mac = arp_cache_lookup(addr)) != NULL) {
-                break;
-            }
-        }
-
-        if (dst_mac == NULL) {
-            ret = -1;
-            goto err;
-        }
-    }
-
-ready:
     udp->src_port   = htons(srcport);
     udp->dst_port  = htons(dstport);
     udp->len        = htons(sizeof(struct udp_hdr) + len);
     udp->chksum     = 0;
-    memcpy(udp->data, buf, len);
 
-    fill_in_mac_header(eth, dst_mac, ETH_TYPE_IPV4);
     fill_in_ipv4_header(ip, addr, IP_PROTO_UDP, len + sizeof(struct udp_hdr));
 
 #if (MINIP_USE_UDP_CHECKSUM != 0)
     udp->chksum = rfc768_chksum(ip, udp);
 #endif
 
-    minip_tx_handler(p);
+    mutex_acquire(&tx_mutex);
+
+    if (addr == IPV4_BCAST) {
+        memcpy(dst_mac, bcast_mac, sizeof(dst_mac));
+    } else {
+        /* an unresolved packet waits in the arp cache and goes out when the reply arrives */
+        status_t err = arp_cache_resolve(addr, p, dst_mac);
+        if (err == ERR_NOT_READY) {
+            goto out;
+        } else if (err < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    fill_in_mac_header(eth, dst_mac, ETH_TYPE_IPV4);
 
-err:
+    minip_tx(p);
+
+out:
     mutex_release(&tx_mutex);
     return ret;
 }
@@ -311,6 +347,7 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
     struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     struct icmp_pkt *icmp;
+    uint8_t dst_mac[6];
 
     if ((p = pktbuf_alloc()) == NULL) {
         return;
@@ -323,14 +360,24 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    fill_in_mac_header(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
     fill_in_ipv4_header(ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
     icmp->code = 0;
     memcpy(icmp->hdr_data, req->hdr_data, sizeof(icmp->hdr_data));
-    icmp->chksum = 0;
-    icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
+
+    /* only the type changed, so patch the request's checksum instead of
+     * summing the whole payload again */
+    uint16_t old_tc, new_tc;
+    memcpy(&old_tc, &req->type, sizeof(old_tc));
+    memcpy(&new_tc, &icmp->type, sizeof(new_tc));
+    icmp->chksum = ones_csum_update16(req->chksum, old_tc, new_tc);
+
+    /* the request normally just put the sender in the arp cache */
+    if (arp_cache_resolve(ipaddr, p, dst_mac) != NO_ERROR) {
+        return;
+    }
+    fill_in_mac_header(eth, dst_mac, ETH_TYPE_IPV4);
 
     minip_tx_handler(p);
 }
@@ -436,12 +483,15 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
             }
             port = ntohs(udp->dst_port);
 
+            /* callbacks run with the lock held so unlisten can't free one out from under us */
+            mutex_acquire(&udp_lock);
             list_for_every_entry(&udp_list, e, struct udp_listener, list) {
                 if (e->port == port) {
                     e->callback(p->data, p->dlen, ip->src_addr, ntohs(udp->src_port), e->arg);
-                    return;
+                    break;
                 }
             }
+            mutex_release(&udp_lock);
         }
         break;
 
@@ -469,6 +519,11 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
             struct arp_pkt *rarp;
 
             if (memcmp(&arp->tpa, &minip_ip, sizeof(minip_ip)) == 0) {
+                /* the sender will be talking to us, so learn its address now */
+                uint32_t addr;
+                memcpy(&addr, &arp->spa, sizeof(addr)); // unaligned word
+                arp_cache_update(addr, arp->sha);
+
                 if ((rp = pktbuf_alloc()) == NULL) {
                     break;
                 }
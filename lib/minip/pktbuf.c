@@ -25,14 +25,29 @@
 #include <trace.h>
 #include <printf.h>
 #include <string.h>
+#include <malloc.h>
+#include <err.h>
+#include <compiler.h>
 
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/semaphore.h>
 #include <lib/pktbuf.h>
 
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+STATIC_ASSERT(sizeof(pktbuf_t) <= PKTBUF_SIZE);
+
 static struct list_node pb_freelist = LIST_INITIAL_VALUE(pb_freelist);
 static semaphore_t pb_sem = SEMAPHORE_INITIAL_VALUE(pb_sem, 0);
 
+// external segments only need the header, so they are allocated short of
+// the buffer and recycled through their own list rather than the pool
+#define PKTBUF_EXT_SEG_SIZE __offsetof(pktbuf_t, buffer)
+static struct list_node pb_ext_freelist = LIST_INITIAL_VALUE(pb_ext_freelist);
+
 void pktbuf_create(void *ptr, u32 phys, size_t size) {
 	pktbuf_t *p = ptr;
 	if (size != PKTBUF_SIZE) {
@@ -40,9 +55,9 @@ void pktbuf_create(void *ptr, u32 phys, size_t size) {
 	}
 
 	p->phys_base = phys + __offsetof(pktbuf_t, buffer);
-	p->rsv0 = 0;
-	p->rsv1 = 0;
-	p->rsv2 = 0;
+	p->next = NULL;
+	p->ext = NULL;
+	p->flags = 0;
 	list_add_tail(&pb_freelist, &(p->list));
 	sem_post(&pb_sem, false);
 }
@@ -61,15 +76,121 @@ pktbuf_t *pktbuf_alloc(void) {
 
 	p->data = p->buffer + PKTBUF_MAX_HDR;
 	p->dlen = 0;
+	p->next = NULL;
+	p->ext = NULL;
+	p->flags = 0;
 	return p;
 }
 
-void pktbuf_free(pktbuf_t *p) {
+pktbuf_t *pktbuf_alloc_ext(const void *data, size_t len, struct pktbuf_ext *ext) {
+	pktbuf_t *p;
+
 	enter_critical_section();
-	list_add_tail(&pb_freelist, &(p->list));
+	p = list_remove_head_type(&pb_ext_freelist, pktbuf_t, list);
+	exit_critical_section();
+
+	if (!p) {
+		p = malloc(PKTBUF_EXT_SEG_SIZE);
+		if (!p) {
+			return NULL;
+		}
+	}
+
+	p->data = (u8 *)data;
+	p->dlen = len;
+#if WITH_KERNEL_VM
+	p->phys_base = kvaddr_to_paddr((void *)data);
+#else
+	p->phys_base = (uintptr_t)data;
+#endif
+	p->next = NULL;
+	p->ext = ext;
+	p->flags = PKTBUF_FLAG_EXT;
+
+	if (ext) {
+		atomic_add(&ext->ref, 1);
+	}
+
+	return p;
+}
+
+void pktbuf_ext_release(struct pktbuf_ext *ext) {
+	if (atomic_add(&ext->ref, -1) == 1) {
+		ext->free(ext);
+	}
+}
+
+static void pktbuf_free_etc(pktbuf_t *p, bool reschedule) {
+	int pooled = 0;
+
+	// nothing here blocks: pooled buffers and segment headers go back on
+	// free lists. only waking a thread blocked in pktbuf_alloc may
+	// reschedule, and only if asked to
+	enter_critical_section();
+	while (p) {
+		pktbuf_t *next = p->next;
+
+		if (p->flags & PKTBUF_FLAG_EXT) {
+			if (p->ext) {
+				pktbuf_ext_release(p->ext);
+			}
+			list_add_head(&pb_ext_freelist, &(p->list));
+		} else {
+			list_add_tail(&pb_freelist, &(p->list));
+			pooled++;
+		}
+		p = next;
+	}
 	exit_critical_section();
 
-	sem_post(&pb_sem, true);
+	while (pooled--) {
+		sem_post(&pb_sem, reschedule);
+	}
+}
+
+void pktbuf_free(pktbuf_t *p) {
+	pktbuf_free_etc(p, true);
+}
+
+void pktbuf_free_irq(pktbuf_t *p) {
+	pktbuf_free_etc(p, false);
+}
+
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *seg) {
+	while (p->next) {
+		p = p->next;
+	}
+	p->next = seg;
+}
+
+size_t pktbuf_total_len(const pktbuf_t *p) {
+	size_t len = 0;
+
+	for (; p; p = p->next) {
+		len += p->dlen;
+	}
+
+	return len;
+}
+
+status_t pktbuf_linearize(pktbuf_t *p) {
+	if (!p->next) {
+		return NO_ERROR;
+	}
+
+	if (pktbuf_avail_tail(p) < pktbuf_total_len(p->next)) {
+		return ERR_TOO_BIG;
+	}
+
+	for (pktbuf_t *seg = p->next; seg; seg = seg->next) {
+		memcpy(p->data + p->dlen, seg->data, seg->dlen);
+		p->dlen += seg->dlen;
+	}
+
+	pktbuf_free(p->next);
+	p->next = NULL;
+
+	return NO_ERROR;
 }
 
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
@@ -112,6 +233,9 @@ void *pktbuf_consume(pktbuf_t *p, size_t sz) {
 
 	p->data += sz;
 	p->dlen -= sz;
+	if (p->flags & PKTBUF_FLAG_EXT) {
+		p->phys_base += sz;
+	}
 
 	return data;
 }
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "minip-internal.h"
+
+#include <assert.h>
+#include <err.h>
+#include <list.h>
+#include <stdlib.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+/* A set keeps every entry on its entries list and the ones that may have
+ * something to report on its ready list, so a wait only looks at sockets
+ * that were signalled rather than at every socket in the set. Level
+ * triggered entries stay on the ready list for as long as their socket's
+ * query says they're ready; edge triggered ones come off once reported.
+ *
+ * One lock covers all sets. Sockets signal with their own lock held, so
+ * the order is socket lock then poll lock, and the queries run under the
+ * poll lock only, reading socket state without the socket's lock. */
+
+struct minip_poll_set {
+    struct list_node entries;
+    struct list_node ready;
+    event_t event;
+};
+
+typedef struct minip_poll_entry {
+    struct list_node set_node;
+    struct list_node src_node;
+    struct list_node ready_node;
+    minip_poll_set_t *set;
+    minip_poll_src_t *src;
+    const void *handle;
+    void *cookie;
+    uint32_t events;
+    uint32_t pending;       /* signalled since last reported, for edge triggered entries */
+} minip_poll_entry_t;
+
+static mutex_t minip_poll_lock = MUTEX_INITIAL_VALUE(minip_poll_lock);
+
+void minip_poll_src_init(minip_poll_src_t *src, minip_poll_query_t query)
+{
+    list_initialize(&src->entries);
+    src->query = query;
+}
+
+static void poll_entry_make_ready(minip_poll_entry_t *e)
+{
+    DEBUG_ASSERT(is_mutex_held(&minip_poll_lock));
+
+    if (!list_in_list(&e->ready_node))
+        list_add_tail(&e->set->ready, &e->ready_node);
+    event_signal(&e->set->event, false);
+}
+
+void minip_poll_notify(minip_poll_src_t *src, uint32_t events)
+{
+    minip_poll_entry_t *e;
+
+    /* the common case, nobody is polling this socket */
+    if (list_is_empty(&src->entries))
+        return;
+
+    mutex_acquire(&minip_poll_lock);
+    list_for_every_entry(&src->entries, e, minip_poll_entry_t, src_node) {
+        uint32_t interest = (e->events & ~MINIP_POLL_EDGE) | MINIP_POLL_HUP;
+        if (events & interest) {
+            e->pending |= events & interest;
+            poll_entry_make_ready(e);
+        }
+    }
+    mutex_release(&minip_poll_lock);
+}
+
+static void poll_entry_free(minip_poll_entry_t *e)
+{
+    DEBUG_ASSERT(is_mutex_held(&minip_poll_lock));
+
+    list_delete(&e->set_node);
+    list_delete(&e->src_node);
+    if (list_in_list(&e->ready_node))
+        list_delete(&e->ready_node);
+    free(e);
+}
+
+void minip_poll_src_detach(minip_poll_src_t *src)
+{
+    minip_poll_entry_t *e;
+
+    mutex_acquire(&minip_poll_lock);
+    while ((e = list_peek_head_type(&src->entries, minip_poll_entry_t, src_node)) != NULL)
+        poll_entry_free(e);
+    mutex_release(&minip_poll_lock);
+}
+
+status_t minip_poll_create(minip_poll_set_t **handle)
+{
+    if (!handle)
+        return ERR_INVALID_ARGS;
+
+    minip_poll_set_t *set = calloc(1, sizeof(minip_poll_set_t));
+    if (!set)
+        return ERR_NO_MEMORY;
+
+    list_initialize(&set->entries);
+    list_initialize(&set->ready);
+    event_init(&set->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    *handle = set;
+    return NO_ERROR;
+}
+
+void minip_poll_destroy(minip_poll_set_t *set)
+{
+    minip_poll_entry_t *e;
+
+    if (!set)
+        return;
+
+    mutex_acquire(&minip_poll_lock);
+    while ((e = list_peek_head_type(&set->entries, minip_poll_entry_t, set_node)) != NULL)
+        poll_entry_free(e);
+    mutex_release(&minip_poll_lock);
+
+    event_destroy(&set->event);
+    free(set);
+}
+
+static minip_poll_entry_t *poll_find(minip_poll_set_t *set, const void *handle)
+{
+    minip_poll_entry_t *e;
+
+    DEBUG_ASSERT(is_mutex_held(&minip_poll_lock));
+
+    list_for_every_entry(&set->entries, e, minip_poll_entry_t, set_node) {
+        if (e->handle == handle)
+            return e;
+    }
+    return NULL;
+}
+
+status_t minip_poll_add(minip_poll_set_t *set, minip_poll_src_t *src, const void *handle,
+                        uint32_t events, void *cookie)
+{
+    if (!set || !src)
+        return ERR_INVALID_ARGS;
+
+    minip_poll_entry_t *e = calloc(1, sizeof(minip_poll_entry_t));
+    if (!e)
+        return ERR_NO_MEMORY;
+
+    e->set = set;
+    e->src = src;
+    e->handle = handle;
+    e->cookie = cookie;
+    e->events = events;
+
+    mutex_acquire(&minip_poll_lock);
+
+    if (poll_find(set, handle)) {
+        mutex_release(&minip_poll_lock);
+        free(e);
+        return ERR_ALREADY_EXISTS;
+    }
+
+    list_add_tail(&set->entries, &e->set_node);
+    list_add_tail(&src->entries, &e->src_node);
+
+    /* report anything that's already true, for either trigger mode */
+    e->pending = src->query(src) & ((events & ~MINIP_POLL_EDGE) | MINIP_POLL_HUP);
+    if (e->pending)
+        poll_entry_make_ready(e);
+
+    mutex_release(&minip_poll_lock);
+
+    return NO_ERROR;
+}
+
+status_t minip_poll_modify(minip_poll_set_t *set, const void *handle, uint32_t events)
+{
+    status_t err = NO_ERROR;
+
+    if (!set)
+        return ERR_INVALID_ARGS;
+
+    mutex_acquire(&minip_poll_lock);
+
+    minip_poll_entry_t *e = poll_find(set, handle);
+    if (!e) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    e->events = events;
+    e->pending = e->src->query(e->src) & ((events & ~MINIP_POLL_EDGE) | MINIP_POLL_HUP);
+    if (e->pending)
+        poll_entry_make_ready(e);
+
+out:
+    mutex_release(&minip_poll_lock);
+    return err;
+}
+
+status_t minip_poll_remove(minip_poll_set_t *set, const void *handle)
+{
+    status_t err = NO_ERROR;
+
+    if (!set)
+        return ERR_INVALID_ARGS;
+
+    mutex_acquire(&minip_poll_lock);
+
+    minip_poll_entry_t *e = poll_find(set, handle);
+    if (e)
+        poll_entry_free(e);
+    else
+        err = ERR_NOT_FOUND;
+
+    mutex_release(&minip_poll_lock);
+    return err;
+}
+
+/* move what's ready into events, returns how many */
+static size_t poll_collect(minip_poll_set_t *set, minip_poll_event_t *events, size_t max)
+{
+    minip_poll_entry_t *e, *temp;
+    struct list_node again = LIST_INITIAL_VALUE(again);
+    size_t count = 0;
+
+    DEBUG_ASSERT(is_mutex_held(&minip_poll_lock));
+
+    list_for_every_entry_safe(&set->ready, e, temp, minip_poll_entry_t, ready_node) {
+        if (count == max)
+            break;
+
+        uint32_t interest = (e->events & ~MINIP_POLL_EDGE) | MINIP_POLL_HUP;
+        uint32_t ready;
+
+        list_delete(&e->ready_node);
+        if (e->events & MINIP_POLL_EDGE) {
+            ready = e->pending;
+        } else {
+            ready = e->src->query(e->src) & interest;
+            /* still true, so it goes behind the others for the next wait */
+            if (ready)
+                list_add_tail(&again, &e->ready_node);
+        }
+        e->pending = 0;
+
+        if (ready) {
+            events[count].cookie = e->cookie;
+            events[count].events = ready;
+            count++;
+        }
+    }
+
+    while ((e = list_remove_head_type(&again, minip_poll_entry_t, ready_node)) != NULL)
+        list_add_tail(&set->ready, &e->ready_node);
+
+    return count;
+}
+
+ssize_t minip_poll_wait(minip_poll_set_t *set, minip_poll_event_t *events, size_t max, lk_time_t timeout)
+{
+    if (!set || !events || max == 0)
+        return ERR_INVALID_ARGS;
+
+    lk_time_t deadline = current_time() + timeout;
+
+    for (;;) {
+        mutex_acquire(&minip_poll_lock);
+        size_t count = poll_collect(set, events, max);
+        mutex_release(&minip_poll_lock);
+
+        if (count > 0)
+            return count;
+
+        lk_time_t wait = timeout;
+        if (timeout != INFINITE_TIME) {
+            lk_time_t now = current_time();
+            if (TIME_GTE(now, deadline))
+                return ERR_TIMED_OUT;
+            wait = deadline - now;
+        }
+
+        LTRACEF("set %p sleeping for %lu\n", set, wait);
+        if (event_wait_timeout(&set->event, wait) == ERR_TIMED_OUT)
+            return ERR_TIMED_OUT;
+    }
+}
+
+// vim: set ts=4 sw=4 expandtab:
@@ -15,6 +15,13 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/minip.c \
 	$(LOCAL_DIR)/net_timer.c \
 	$(LOCAL_DIR)/pktbuf.c \
+	$(LOCAL_DIR)/poll.c \
 	$(LOCAL_DIR)/tcp.c \
+	$(LOCAL_DIR)/udp.c \
+
+# assembly checksum kernels where the architecture has them
+ifneq ($(wildcard $(LOCAL_DIR)/arch/$(ARCH)/rules.mk),)
+include $(LOCAL_DIR)/arch/$(ARCH)/rules.mk
+endif
 
 include make/module.mk
@@ -28,12 +28,15 @@
 #include <compiler.h>
 #include <stdlib.h>
 #include <err.h>
+#include <pow2.h>
 #include <string.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
+#include <lib/heap.h>
 #include <arch/ops.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
 
@@ -58,11 +61,44 @@ typedef struct tcp_pseudo_header {
     uint16_t tcp_length;
 } __PACKED tcp_pseudo_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+/* option kinds */
+#define TCP_OPT_EOL         0
+#define TCP_OPT_NOP         1
+#define TCP_OPT_MSS         2
+#define TCP_OPT_WSCALE      3
+#define TCP_OPT_SACK_PERM   4
+#define TCP_OPT_SACK        5
+#define TCP_OPT_TIMESTAMP   8
+
+#define TCP_MAX_OPTIONS_LENGTH  40
+#define TCP_TIMESTAMP_LENGTH    12 /* padded to a word */
+#define TCP_MAX_SACK_BLOCKS     4
+#define TCP_MAX_WSCALE          14
+
+typedef struct tcp_sack_block {
+    uint32_t start;
+    uint32_t end;
+} tcp_sack_block_t;
+
+/* options parsed out of an incoming segment */
+typedef struct tcp_options {
+    uint16_t mss;       // 0 if not present
+    int      wscale;    // -1 if not present
+    bool     sack_permitted;
+    bool     ts_present;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+    uint     sack_count;
+    tcp_sack_block_t sack[TCP_MAX_SACK_BLOCKS];
+} tcp_options_t;
+
+/* a segment that arrived ahead of rx_win_low, waiting for the hole to fill */
+typedef struct tcp_ooo_segment {
+    struct list_node node;
+    uint32_t sequence;
+    uint32_t len;
+    uint8_t  data[];
+} tcp_ooo_segment_t;
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -87,8 +123,18 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+/* outgoing data buffer. refcounted so that transmitted segments can point
+ * straight into it instead of carrying a copy of the data */
+#define TCP_SACK_SCOREBOARD_SIZE 8
+
+typedef struct tcp_tx_buffer {
+    struct pktbuf_ext ext;
+    uint8_t data[];
+} tcp_tx_buffer_t;
+
 typedef struct tcp_socket {
-    struct list_node node;
+    struct list_node node;      // tcp_socket_list
+    struct list_node hash_node; // connection or listen hash bucket
 
     mutex_t lock;
     volatile int ref;
@@ -101,6 +147,13 @@ typedef struct tcp_socket {
 
     uint32_t mss;
 
+    /* options negotiated on the SYN */
+    bool     ts_enabled;
+    bool     sack_enabled;
+    uint8_t  snd_wscale; // shift applied to the windows they advertise
+    uint8_t  rcv_wscale; // shift applied to the windows we advertise
+    uint32_t ts_recent;  // last timestamp they sent, echoed back to them
+
     /* rx */
     uint32_t rx_win_size;
     uint32_t rx_win_low;
@@ -110,29 +163,67 @@ typedef struct tcp_socket {
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
+    struct list_node rx_ooo_list; // out of order segments, sorted by sequence
+    uint32_t rx_ooo_bytes;
+    uint32_t rx_ooo_last; // sequence of the most recently queued segment, reported first in SACKs
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
-    uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer;  // our outgoing buffer
+    uint32_t tx_highest_seq; // next sequence to transmit, rewound on timeout
+    uint32_t tx_max_seq;  // highest sequence we have ever txed them
+    tcp_tx_buffer_t *tx_buffer;  // our outgoing buffer
     uint32_t tx_buffer_size; // size of tx_buffer
     uint32_t tx_buffer_offset; // offset into the buffer to append new data to
     event_t  tx_event;
     net_timer_t retransmit_timer;
 
+    /* loss recovery */
+    uint32_t tx_dupacks;
+    bool     tx_in_recovery;
+    uint32_t tx_recover;  // tx_max_seq when recovery started
+    uint32_t tx_rxt_next; // next hole to retransmit during recovery
+    uint     tx_sack_count;
+    tcp_sack_block_t tx_sacked[TCP_SACK_SCOREBOARD_SIZE]; // what they've SACKed, sorted
+
+    /* rtt estimation, in msecs, srtt scaled by 8 and rttvar by 4 */
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    bool     rtt_timing;  // timing rtt_seq, for peers without timestamps
+    uint32_t rtt_seq;
+    lk_time_t rtt_time;
+
+    /* congestion control */
+    tcp_cc_t cc;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t cwnd_acked; // bytes acked toward the next congestion avoidance increment
+    uint32_t cubic_wmax; // window before the last loss, in segments
+    uint32_t cubic_k;    // msecs from the epoch for the cubic to reach wmax again
+    lk_time_t cubic_epoch; // start of the current congestion avoidance epoch, 0 if none
+
     /* listen accept */
     semaphore_t accept_sem;
     struct tcp_socket *accepted;
 
+    /* poll sets watching this socket */
+    minip_poll_src_t poll;
+
     net_timer_t time_wait_timer;
 } tcp_socket_t;
 
 #define DEFAULT_MSS (1460)
-#define DEFAULT_RX_WINDOW_SIZE (4096)
-#define DEFAULT_TX_BUFFER_SIZE (4096)
-
-#define RETRANSMIT_TIMEOUT (50)
+#define DEFAULT_RX_WINDOW_SIZE (16384)
+#define DEFAULT_TX_BUFFER_SIZE (16384)
+#define MIN_BUFFER_SIZE (2048)
+#define MAX_BUFFER_SIZE (1024 * 1024)
+#define DEFAULT_CC (TCP_CC_CUBIC)
+
+#define RTO_INITIAL (1000)
+#define RTO_MIN (200)
+#define RTO_MAX (60000)
+#define DUPACK_THRESHOLD (3)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
@@ -143,25 +234,40 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
+/* every socket lives on tcp_socket_list, which the list mutex serializes changes to,
+ * and in one hash bucket for demultiplexing: connections keyed on the 4-tuple and
+ * listeners on their local port. buckets are only modified inside a critical
+ * section as well, so the per segment lookup walks them without the mutex. */
+#define TCP_CONN_HASH_SIZE 128
+#define TCP_LISTEN_HASH_SIZE 16
+
 static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+static struct list_node tcp_conn_hash[TCP_CONN_HASH_SIZE];
+static struct list_node tcp_listen_hash[TCP_LISTEN_HASH_SIZE];
+static bool tcp_hash_initialized;
 
 /* local routines */
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
-static void add_socket_to_list(tcp_socket_t *s);
+static status_t add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
 static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
+static status_t tcp_socket_alloc_buffers(tcp_socket_t *s);
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-    size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
+    size_t len, struct pktbuf_ext *ext, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack,
+    uint32_t sequence, uint16_t window_size);
+static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, uint32_t sequence);
 static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts, size_t data_len);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
 static void tcp_remote_close(tcp_socket_t *s);
+static void tcp_signal(tcp_socket_t *s, uint32_t events);
 static void tcp_wakeup_waiters(tcp_socket_t *s);
+static uint32_t tcp_poll_query(minip_poll_src_t *src);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
 
@@ -171,6 +277,191 @@ static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *bu
     return ~ones_sum16(checksum, buf, len);
 }
 
+static uint16_t get_be16(const uint8_t *p)
+{
+    uint16_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohs(val);
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohl(val);
+}
+
+static void put_be16(uint8_t *p, uint16_t val)
+{
+    val = htons(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static void put_be32(uint8_t *p, uint32_t val)
+{
+    val = htonl(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static void parse_options(const uint8_t *opt, size_t len, tcp_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->wscale = -1;
+
+    while (len > 0) {
+        uint8_t kind = opt[0];
+        if (kind == TCP_OPT_EOL)
+            break;
+        if (kind == TCP_OPT_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+
+        /* everything else has a length byte */
+        if (len < 2 || opt[1] < 2 || opt[1] > len)
+            break;
+        uint8_t olen = opt[1];
+
+        switch (kind) {
+            case TCP_OPT_MSS:
+                if (olen == 4)
+                    opts->mss = get_be16(opt + 2);
+                break;
+            case TCP_OPT_WSCALE:
+                if (olen == 3)
+                    opts->wscale = MIN(opt[2], TCP_MAX_WSCALE);
+                break;
+            case TCP_OPT_SACK_PERM:
+                if (olen == 2)
+                    opts->sack_permitted = true;
+                break;
+            case TCP_OPT_SACK:
+                for (uint i = 0; i < (olen - 2u) / 8 && i < TCP_MAX_SACK_BLOCKS; i++) {
+                    opts->sack[i].start = get_be32(opt + 2 + i * 8);
+                    opts->sack[i].end = get_be32(opt + 6 + i * 8);
+                    opts->sack_count++;
+                }
+                break;
+            case TCP_OPT_TIMESTAMP:
+                if (olen == 10) {
+                    opts->ts_present = true;
+                    opts->ts_val = get_be32(opt + 2);
+                    opts->ts_ecr = get_be32(opt + 6);
+                }
+                break;
+        }
+
+        opt += olen;
+        len -= olen;
+    }
+}
+
+/* collect the out of order queue into SACK blocks, the one holding the most
+ * recently received segment first as RFC 2018 asks */
+static uint build_sack_blocks(tcp_socket_t *s, tcp_sack_block_t *blocks, uint max)
+{
+    uint count = 1;
+    bool found_last = false;
+    bool have_run = false;
+    tcp_sack_block_t run = { 0, 0 };
+
+    tcp_ooo_segment_t *seg;
+    list_for_every_entry(&s->rx_ooo_list, seg, tcp_ooo_segment_t, node) {
+        uint32_t end = seg->sequence + seg->len;
+        if (have_run && SEQUENCE_LTE(seg->sequence, run.end)) {
+            if (SEQUENCE_GT(end, run.end))
+                run.end = end;
+            continue;
+        }
+        if (have_run) {
+            if (!found_last && SEQUENCE_GTE(s->rx_ooo_last, run.start) && SEQUENCE_LT(s->rx_ooo_last, run.end)) {
+                blocks[0] = run;
+                found_last = true;
+            } else if (count < max) {
+                blocks[count++] = run;
+            }
+        }
+        run.start = seg->sequence;
+        run.end = end;
+        have_run = true;
+    }
+
+    if (!have_run)
+        return 0;
+
+    if (!found_last) {
+        blocks[0] = run;
+    } else if (count < max) {
+        blocks[count++] = run;
+    }
+
+    return count;
+}
+
+/* build the options for an outgoing segment into opt, returning the length */
+static size_t build_options(tcp_socket_t *s, tcp_flags_t flags, uint8_t *opt)
+{
+    size_t len = 0;
+
+    if (flags & PKT_SYN) {
+        opt[len++] = TCP_OPT_MSS;
+        opt[len++] = 4;
+        put_be16(opt + len, DEFAULT_MSS);
+        len += 2;
+
+        if (s->rcv_wscale || s->snd_wscale) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_WSCALE;
+            opt[len++] = 3;
+            opt[len++] = s->rcv_wscale;
+        }
+
+        if (s->sack_enabled) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_SACK_PERM;
+            opt[len++] = 2;
+        }
+    }
+
+    if (s->ts_enabled) {
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_TIMESTAMP;
+        opt[len++] = 10;
+        put_be32(opt + len, (uint32_t)current_time());
+        put_be32(opt + len + 4, s->ts_recent);
+        len += 8;
+    }
+
+    if (s->sack_enabled && !(flags & PKT_SYN) && (flags & PKT_ACK) && !list_is_empty(&s->rx_ooo_list)) {
+        tcp_sack_block_t blocks[TCP_MAX_SACK_BLOCKS];
+        uint count = build_sack_blocks(s, blocks, (TCP_MAX_OPTIONS_LENGTH - len - 4) / 8);
+
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_SACK;
+        opt[len++] = 2 + count * 8;
+        for (uint i = 0; i < count; i++) {
+            put_be32(opt + len, blocks[i].start);
+            put_be32(opt + len + 4, blocks[i].end);
+            len += 8;
+        }
+    }
+
+    DEBUG_ASSERT(len <= TCP_MAX_OPTIONS_LENGTH);
+    DEBUG_ASSERT((len % 4) == 0);
+
+    return len;
+}
+
+/* payload bytes that fit in a segment once our per segment options are added */
+static uint32_t tcp_smss(const tcp_socket_t *s)
+{
+    return s->mss - (s->ts_enabled ? TCP_TIMESTAMP_LENGTH : 0);
+}
+
 __NO_INLINE static void dump_tcp_header(const tcp_header_t *header)
 {
     printf("TCP: src_port %u, dest_port %u, seq %u, ack %u, win %u, flags %c%c%c%c%c%c\n",
@@ -215,38 +506,80 @@ static void dump_socket(tcp_socket_t *s)
                 s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                 s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
                 s->tx_buffer_size, s->tx_buffer_offset);
+        printf("\topts: mss %u wscale %u/%u ts %d sack %d, ooo %u bytes\n",
+                s->mss, s->snd_wscale, s->rcv_wscale, s->ts_enabled, s->sack_enabled, s->rx_ooo_bytes);
+        printf("\tcc: %s cwnd %u ssthresh %u srtt %u rttvar %u rto %u%s\n",
+                (s->cc == TCP_CC_CUBIC) ? "cubic" : "newreno", s->cwnd, s->ssthresh,
+                s->srtt >> 3, s->rttvar >> 2, s->rto, s->tx_in_recovery ? " (recovery)" : "");
     }
 }
 
+static uint tcp_conn_hash_index(ipv4_addr remote_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t h = remote_ip ^ ((uint32_t)remote_port << 16 | local_port);
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+
+    return h % TCP_CONN_HASH_SIZE;
+}
+
+static uint tcp_listen_hash_index(uint16_t local_port)
+{
+    return (local_port ^ (local_port >> 8)) % TCP_LISTEN_HASH_SIZE;
+}
+
+static struct list_node *tcp_socket_bucket(const tcp_socket_t *s)
+{
+    if (s->state == STATE_LISTEN)
+        return &tcp_listen_hash[tcp_listen_hash_index(s->local_port)];
+
+    return &tcp_conn_hash[tcp_conn_hash_index(s->remote_ip, s->remote_port, s->local_port)];
+}
+
+static void tcp_hash_init(void)
+{
+    DEBUG_ASSERT(is_mutex_held(&tcp_socket_list_lock));
+
+    if (tcp_hash_initialized)
+        return;
+
+    for (uint i = 0; i < TCP_CONN_HASH_SIZE; i++)
+        list_initialize(&tcp_conn_hash[i]);
+    for (uint i = 0; i < TCP_LISTEN_HASH_SIZE; i++)
+        list_initialize(&tcp_listen_hash[i]);
+
+    tcp_hash_initialized = true;
+}
+
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
 {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    if (!tcp_hash_initialized)
+        return NULL;
+
+    enter_critical_section();
 
-    /* XXX replace with something faster, like a hash table */
+    /* full match in the connection table */
     tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
-            continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                s->local_ip == local_ip &&
-                s->remote_port == remote_port &&
-                s->local_port == local_port) {
-                goto out;
-            }
+    struct list_node *bucket = &tcp_conn_hash[tcp_conn_hash_index(remote_ip, remote_port, local_port)];
+    list_for_every_entry(bucket, s, tcp_socket_t, hash_node) {
+        if (s->state != STATE_CLOSED &&
+            s->remote_ip == remote_ip &&
+            s->local_ip == local_ip &&
+            s->remote_port == remote_port &&
+            s->local_port == local_port) {
+            goto out;
         }
     }
 
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+    /* sockets in listen state only care about local port */
+    bucket = &tcp_listen_hash[tcp_listen_hash_index(local_port)];
+    list_for_every_entry(bucket, s, tcp_socket_t, hash_node) {
+        if (s->local_port == local_port) {
+            goto out;
         }
     }
 
@@ -254,25 +587,46 @@ static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint
     s = NULL;
 
 out:
-    /* bump the ref before returning it */
+    /* bump the ref before returning it, removal can't race us in here */
     if (s)
         inc_socket_ref(s);
 
-    mutex_release(&tcp_socket_list_lock);
+    exit_critical_section();
 
     return s;
 }
 
-static void add_socket_to_list(tcp_socket_t *s)
+static status_t add_socket_to_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
 
     mutex_acquire(&tcp_socket_list_lock);
 
+    tcp_hash_init();
+
+    struct list_node *bucket = tcp_socket_bucket(s);
+
+    /* only one listener per port */
+    if (s->state == STATE_LISTEN) {
+        tcp_socket_t *e;
+        list_for_every_entry(bucket, e, tcp_socket_t, hash_node) {
+            if (e->local_port == s->local_port) {
+                mutex_release(&tcp_socket_list_lock);
+                return ERR_ALREADY_EXISTS;
+            }
+        }
+    }
+
     list_add_head(&tcp_socket_list, &s->node);
 
+    enter_critical_section();
+    list_add_head(bucket, &s->hash_node);
+    exit_critical_section();
+
     mutex_release(&tcp_socket_list_lock);
+
+    return NO_ERROR;
 }
 
 static void remove_socket_from_list(tcp_socket_t *s)
@@ -285,6 +639,10 @@ static void remove_socket_from_list(tcp_socket_t *s)
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
 
+    enter_critical_section();
+    list_delete(&s->hash_node);
+    exit_critical_section();
+
     mutex_release(&tcp_socket_list_lock);
 }
 
@@ -306,17 +664,41 @@ static bool dec_socket_ref(tcp_socket_t *s)
 
     if (oldval == 1) {
         LTRACEF("destroying socket\n");
+        minip_poll_src_detach(&s->poll);
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
+        tcp_ooo_segment_t *seg;
+        while ((seg = list_remove_head_type(&s->rx_ooo_list, tcp_ooo_segment_t, node)))
+            free(seg);
+
         free(s->rx_buffer_raw);
-        free(s->tx_buffer);
+        if (s->tx_buffer)
+            pktbuf_ext_release(&s->tx_buffer->ext);
 
         free(s);
     }
     return (oldval == 1);
 }
 
+static void tcp_tx_buffer_free(struct pktbuf_ext *ext)
+{
+    /* the last reference may be dropped by the driver's tx completion irq */
+    heap_delayed_free(containerof(ext, tcp_tx_buffer_t, ext));
+}
+
+static tcp_tx_buffer_t *tcp_tx_buffer_alloc(size_t size)
+{
+    tcp_tx_buffer_t *buf = malloc(sizeof(tcp_tx_buffer_t) + size);
+    if (!buf)
+        return NULL;
+
+    buf->ext.ref = 1;
+    buf->ext.free = &tcp_tx_buffer_free;
+
+    return buf;
+}
+
 static void tcp_timer_set(tcp_socket_t *s, net_timer_t *timer, net_timer_callback_t cb, lk_time_t delay)
 {
     DEBUG_ASSERT(s);
@@ -336,6 +718,139 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer)
         dec_socket_ref(s);
 }
 
+/* arm the retransmit timer unless it is already counting down */
+static void tcp_rto_start(tcp_socket_t *s)
+{
+    if (!list_in_list(&s->retransmit_timer.node))
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+}
+
+/* RFC 6298 smoothed rtt and rto, in the fixed point form from Jacobson's paper */
+static void tcp_rtt_sample(tcp_socket_t *s, uint32_t rtt)
+{
+    if (s->srtt == 0) {
+        s->srtt = MAX(rtt, 1u) << 3;
+        s->rttvar = rtt << 1;
+    } else {
+        int32_t delta = rtt - (s->srtt >> 3);
+        s->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        delta -= (s->rttvar >> 2);
+        s->rttvar += delta;
+    }
+
+    s->rto = (s->srtt >> 3) + MAX(s->rttvar, 1u);
+    s->rto = MAX(s->rto, RTO_MIN);
+    s->rto = MIN(s->rto, RTO_MAX);
+
+    LTRACEF("s %p rtt %u srtt %u rttvar %u rto %u\n", s, rtt, s->srtt >> 3, s->rttvar >> 2, s->rto);
+}
+
+/* integer cube root, bit at a time */
+static uint32_t cubic_cbrt(uint64_t a)
+{
+    uint64_t y = 0;
+
+    for (int shift = 63; shift >= 0; shift -= 3) {
+        y <<= 1;
+        uint64_t b = 3 * y * (y + 1) + 1;
+        if ((a >> shift) >= b) {
+            a -= b << shift;
+            y++;
+        }
+    }
+
+    return y;
+}
+
+/* RFC 8312 window growth during congestion avoidance, with C = 0.4 and beta = 0.7.
+ * W(t) = C * (t - K)^3 + wmax with t in seconds works out to
+ * (t - K)^3 * 2 / 5e9 segments with t in msecs. */
+static uint32_t cubic_target(tcp_socket_t *s, uint32_t smss)
+{
+    lk_time_t now = current_time();
+
+    if (s->cubic_epoch == 0) {
+        uint32_t cwnd_seg = s->cwnd / smss;
+
+        s->cubic_epoch = now ? now : 1;
+        if (cwnd_seg < s->cubic_wmax) {
+            s->cubic_k = cubic_cbrt((uint64_t)(s->cubic_wmax - cwnd_seg) * 2500000000ULL);
+        } else {
+            s->cubic_k = 0;
+            s->cubic_wmax = cwnd_seg;
+        }
+    }
+
+    uint32_t rtt = MAX(s->srtt >> 3, 1u);
+    int64_t t = (int64_t)(now - s->cubic_epoch) + rtt - s->cubic_k;
+    t = MIN(t, 1000000); // keep t^3 in range, the window is long since capped by then
+    int64_t target = (int64_t)s->cubic_wmax + t * t * t * 2 / 5000000000LL;
+
+    /* never fall behind what reno would have reached in the same time */
+    int64_t reno = (int64_t)s->cubic_wmax * 7 / 10 + (int64_t)(now - s->cubic_epoch) * 9 / 17 / rtt;
+
+    target = MAX(target, reno);
+    target = MAX(target, 1);
+    return MIN(target, (int64_t)MAX_BUFFER_SIZE / smss + 1) * smss;
+}
+
+static void tcp_cc_on_ack(tcp_socket_t *s, uint32_t acked)
+{
+    uint32_t smss = tcp_smss(s);
+
+    if (s->cwnd < s->ssthresh) {
+        /* slow start, with RFC 3465 byte counting limited to two segments per ack */
+        s->cwnd += MIN(acked, 2 * smss);
+    } else if (s->cc == TCP_CC_CUBIC) {
+        uint32_t target = cubic_target(s, smss);
+
+        if (target > s->cwnd) {
+            s->cwnd_acked += (uint64_t)(target - s->cwnd) * acked / s->cwnd;
+        } else {
+            s->cwnd_acked += acked / 100;
+        }
+        if (s->cwnd_acked >= smss) {
+            s->cwnd += smss;
+            s->cwnd_acked = 0;
+        }
+    } else {
+        /* newreno congestion avoidance: a segment per window's worth of acks */
+        s->cwnd_acked += acked;
+        if (s->cwnd_acked >= s->cwnd) {
+            s->cwnd_acked -= s->cwnd;
+            s->cwnd += smss;
+        }
+    }
+
+    /* there's no point growing past what the send buffer can keep in flight */
+    s->cwnd = MIN(s->cwnd, s->tx_buffer_size + smss);
+}
+
+/* new ssthresh after a loss */
+static void tcp_cc_on_loss(tcp_socket_t *s)
+{
+    uint32_t smss = tcp_smss(s);
+    uint32_t flight = s->tx_max_seq - s->tx_win_low;
+
+    if (s->cc == TCP_CC_CUBIC) {
+        uint32_t cwnd_seg = s->cwnd / smss;
+
+        /* fast convergence: give up some room to newer flows if we're still shrinking */
+        if (cwnd_seg < s->cubic_wmax) {
+            s->cubic_wmax = cwnd_seg * 17 / 20;
+        } else {
+            s->cubic_wmax = cwnd_seg;
+        }
+        s->ssthresh = MAX(s->cwnd * 7 / 10, 2 * smss);
+        s->cubic_epoch = 0;
+    } else {
+        s->ssthresh = MAX(flight / 2, 2 * smss);
+    }
+    s->cwnd_acked = 0;
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 {
     LTRACEF("p %p (len %zu), src_ip 0x%x, dst_ip 0x%x\n", p, p->dlen, src_ip, dst_ip);
@@ -352,13 +867,13 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     /* compute the actual header length (+ options) */
     size_t header_len = ((ntohs(header->length_flags) >> 12) & 0xf) * 4;
-    if (p->dlen < header_len) {
+    if (header_len < sizeof(tcp_header_t) || p->dlen < header_len) {
         LTRACEF("REJECT: packet too large for buffer\n");
         return;
     }
 
-    /* checksum */
-    if (DO_TCP_CHECKSUM) {
+    /* checksum, unless the nic already verified it */
+    if (DO_TCP_CHECKSUM && !(p->flags & PKTBUF_FLAG_CSUM_VALID)) {
         tcp_pseudo_header_t pheader;
 
         // set up the pseudo header for checksum purposes
@@ -384,6 +899,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
     header->win_size = ntohs(header->win_size);
     header->urg_pointer = ntohs(header->urg_pointer);
 
+    /* pull out the options */
+    tcp_options_t opts;
+    parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &opts);
+
     /* get some data from the packet */
     uint8_t packet_flags = header->length_flags & 0x3f;
     size_t data_len = p->dlen - header_len;
@@ -403,6 +922,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     mutex_acquire(&s->lock);
 
+    /* remember their timestamp to echo back, RFC 7323 section 4.3 */
+    if (s->ts_enabled && opts.ts_present && SEQUENCE_LTE(header->seq_num, s->rx_win_low))
+        s->ts_recent = opts.ts_val;
+
     /* check to see if they're resetting us */
     if (packet_flags & PKT_RST) {
         if (s->state != STATE_CLOSED && s->state != STATE_LISTEN) {
@@ -428,11 +951,19 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             if (s->accepted != NULL)
                 goto done;
 
-            /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            /* make a new accept socket, inheriting the listen socket's tunables */
+            tcp_socket_t *accept_socket = create_tcp_socket(false);
             if (!accept_socket)
                 goto done;
 
+            accept_socket->rx_win_size = s->rx_win_size;
+            accept_socket->tx_buffer_size = s->tx_buffer_size;
+            accept_socket->cc = s->cc;
+            if (tcp_socket_alloc_buffers(accept_socket) < 0) {
+                dec_socket_ref(accept_socket);
+                goto done;
+            }
+
             /* set it up */
             accept_socket->local_ip = minip_get_ipaddr();
             accept_socket->local_port = s->local_port;
@@ -440,9 +971,32 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             accept_socket->remote_port = header->source_port;
             accept_socket->state = STATE_SYN_RCVD;
 
-            mutex_acquire(&accept_socket->lock);
+            /* negotiate options, each is only on if they offered it */
+            if (opts.mss)
+                accept_socket->mss = MIN(opts.mss, DEFAULT_MSS);
+            if (opts.wscale >= 0) {
+                accept_socket->snd_wscale = opts.wscale;
+                while ((accept_socket->rx_win_size >> accept_socket->rcv_wscale) > 0xffff &&
+                        accept_socket->rcv_wscale < TCP_MAX_WSCALE)
+                    accept_socket->rcv_wscale++;
+            }
+            accept_socket->sack_enabled = opts.sack_permitted;
+            if (opts.ts_present) {
+                accept_socket->ts_enabled = true;
+                accept_socket->ts_recent = opts.ts_val;
+            }
+
+            /* initial window, RFC 6928 */
+            uint32_t smss = tcp_smss(accept_socket);
+            accept_socket->cwnd = MIN(10 * smss, MAX(2 * smss, 14600u));
+
+            if (add_socket_to_list(accept_socket) < 0) {
+                /* never made it into the tables, so nothing else can see it */
+                dec_socket_ref(accept_socket);
+                goto done;
+            }
 
-            add_socket_to_list(accept_socket);
+            mutex_acquire(&accept_socket->lock);
 
             /* remember their sequence */
             accept_socket->rx_win_low = header->seq_num + 1;
@@ -451,16 +1005,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             /* save this socket and wake anyone up that is waiting to accept */
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
-
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
+            minip_poll_notify(&s->poll, MINIP_POLL_IN);
 
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
-                accept_socket->tx_win_low);
+            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
             accept_socket->tx_win_low++;
@@ -481,10 +1029,16 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + (header->win_size << s->snd_wscale);
                 s->tx_highest_seq = s->tx_win_low;
+                s->tx_max_seq = s->tx_win_low;
 
                 s->state = STATE_ESTABLISHED;
+                tcp_signal(s, MINIP_POLL_OUT);
+
+                /* the ack of our SYN may already carry data */
+                if (data_len > 0)
+                    handle_data(s, p->data, p->dlen, header->seq_num);
             } else {
                 goto send_reset;
             }
@@ -494,7 +1048,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, &opts, data_len);
             }
 
             if (data_len > 0) {
@@ -513,14 +1067,14 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                 s->state = STATE_CLOSE_WAIT;
 
                 /* wake up any read waiters */
-                event_signal(&s->rx_event, true);
+                tcp_signal(s, MINIP_POLL_IN);
             }
             break;
 
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, &opts, data_len);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -593,8 +1147,81 @@ send_reset:
     LTRACEF("SEND RST\n");
     if (!(packet_flags & PKT_RST)) {
         tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
-            NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+            NULL, 0, NULL, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+    }
+}
+
+/* hand in order data to the reader */
+static void tcp_rx_deliver(tcp_socket_t *s, const uint8_t *data, size_t len)
+{
+    len = MIN(len, s->rx_win_high - s->rx_win_low);
+    if (len == 0)
+        return;
+
+    s->rx_win_low += len;
+    cbuf_write(&s->rx_buffer, data, len, false);
+}
+
+/* queue a segment that landed past a hole in the window */
+static void tcp_ooo_insert(tcp_socket_t *s, const uint8_t *data, uint32_t len, uint32_t sequence)
+{
+    if (len == 0 || s->rx_ooo_bytes + len > s->rx_win_size)
+        return;
+
+    /* find the insertion point, dropping it if we already have all of it */
+    tcp_ooo_segment_t *seg;
+    tcp_ooo_segment_t *next = NULL;
+    list_for_every_entry(&s->rx_ooo_list, seg, tcp_ooo_segment_t, node) {
+        if (SEQUENCE_LTE(seg->sequence, sequence) && SEQUENCE_GTE(seg->sequence + seg->len, sequence + len)) {
+            s->rx_ooo_last = seg->sequence;
+            return;
+        }
+        if (SEQUENCE_GT(seg->sequence, sequence)) {
+            next = seg;
+            break;
+        }
+    }
+
+    tcp_ooo_segment_t *new_seg = malloc(sizeof(tcp_ooo_segment_t) + len);
+    if (!new_seg)
+        return;
+
+    new_seg->sequence = sequence;
+    new_seg->len = len;
+    memcpy(new_seg->data, data, len);
+
+    if (next)
+        list_add_before(&next->node, &new_seg->node);
+    else
+        list_add_tail(&s->rx_ooo_list, &new_seg->node);
+
+    s->rx_ooo_bytes += len;
+    s->rx_ooo_last = sequence;
+}
+
+/* move anything the last in order segment made contiguous into the rx buffer */
+static bool tcp_ooo_drain(tcp_socket_t *s)
+{
+    bool delivered = false;
+    tcp_ooo_segment_t *seg;
+
+    while ((seg = list_peek_head_type(&s->rx_ooo_list, tcp_ooo_segment_t, node))) {
+        if (SEQUENCE_GT(seg->sequence, s->rx_win_low))
+            break;
+
+        uint32_t end = seg->sequence + seg->len;
+        if (SEQUENCE_GT(end, s->rx_win_low)) {
+            uint32_t offset = s->rx_win_low - seg->sequence;
+            tcp_rx_deliver(s, seg->data + offset, seg->len - offset);
+            delivered = true;
+        }
+
+        list_delete(&seg->node);
+        s->rx_ooo_bytes -= seg->len;
+        free(seg);
     }
+
+    return delivered;
 }
 
 static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
@@ -612,48 +1239,52 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
         /* it intersects the bottom of our window, so it's in order */
 
         /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
+        size_t offset = s->rx_win_low - sequence;
         size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
 
         DEBUG_ASSERT(offset < len);
 
         LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
 
-        s->rx_win_low += copy_len;
+        tcp_rx_deliver(s, (const uint8_t *)data + offset, copy_len);
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
-        event_signal(&s->rx_event, true);
+        /* this may have filled a hole in front of queued segments */
+        bool filled_hole = tcp_ooo_drain(s);
+
+        tcp_signal(s, MINIP_POLL_IN);
 
         /* keep a counter if they've been sending a full mss */
-        if (copy_len >= s->mss) {
+        if (copy_len >= tcp_smss(s)) {
             s->rx_full_mss_count++;
         } else {
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /* immediately ack if we're more than halfway into our buffer, they've sent 2 or more full packets,
+         * or there's a hole they need to hear about (RFC 5681 section 4.2) */
+        if (s->rx_full_mss_count >= 2 || filled_hole || !list_is_empty(&s->rx_ooo_list) ||
             (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
         } else {
             tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
+    } else if (SEQUENCE_GT(sequence, s->rx_win_low) && SEQUENCE_LT(sequence, s->rx_win_high)) {
+        /* out of order but inside the window, hold on to it and dup ack with SACK info */
+        tcp_ooo_insert(s, data, MIN(len, s->rx_win_high - sequence), sequence);
+        send_ack(s);
     } else {
-        // either out of order or completely out of our window, drop
+        // completely out of our window, drop
         // duplicately ack the last thing we really got
         send_ack(s);
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, 
-    const void *options, size_t options_length, uint32_t sequence)
+static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, uint32_t sequence)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
     DEBUG_ASSERT(len == 0 || data);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
 
     // calculate the new right edge of the rx window
     uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
@@ -661,23 +1292,36 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
     LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %d, new win high %u\n",
         s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
-        win_size = rx_win_high - s->rx_win_low;
+        win = rx_win_high - s->rx_win_low;
     } else {
         // the window size has shrunk, but we can't move the
         // right edge of the window backwards
-        win_size = s->rx_win_high - s->rx_win_low;
+        win = s->rx_win_high - s->rx_win_low;
     }
 
+    // the window in a SYN is never scaled
+    if (!(flags & PKT_SYN))
+        win >>= s->rcv_wscale;
+    uint16_t win_size = MIN(win, 0xffffu);
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    uint8_t options[TCP_MAX_OPTIONS_LENGTH];
+    size_t options_length = build_options(s, flags, options);
+
+    /* any data we send comes out of the tx buffer, so reference it rather than copy */
+    DEBUG_ASSERT(len == 0 || ((const uint8_t *)data >= s->tx_buffer->data &&
+        (const uint8_t *)data + len <= s->tx_buffer->data + s->tx_buffer_size));
+
+    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len,
+            (len > 0) ? &s->tx_buffer->ext : NULL, flags, options, options_length,
+            (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
 
     return err;
 }
@@ -690,11 +1334,12 @@ static void send_ack(tcp_socket_t *s)
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    tcp_socket_send(s, NULL, 0, PKT_ACK, s->tx_win_low);
 }
 
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-    size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+    size_t len, struct pktbuf_ext *ext, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack,
+    uint32_t sequence, uint16_t window_size)
 {
     DEBUG_ASSERT(len == 0 || buf);
     DEBUG_ASSERT(options_length == 0 || options);
@@ -719,20 +1364,49 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
-
-    /* compute the checksum */
+    /* the header is a multiple of 4 bytes, so the sums can be chained */
+    uint16_t checksum = 0;
+    bool sw_csum = DO_TCP_CHECKSUM && !(minip_tx_flags & MINIP_TX_CSUM);
     if (DO_TCP_CHECKSUM) {
         tcp_pseudo_header_t pheader;
         pheader.source_addr = src_ip;
         pheader.dest_addr = dest_ip;
         pheader.zero = 0;
         pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+        pheader.tcp_length = htons(sizeof(tcp_header_t) + options_length + len);
+
+        checksum = ones_sum16(0, &pheader, sizeof(pheader));
+        if (sw_csum)
+            checksum = ones_sum16(checksum, header, sizeof(tcp_header_t) + options_length);
+    }
+
+    /* append the data, chaining a reference to it if the caller's buffer is refcounted */
+    if (len > 0) {
+        if (ext) {
+            pktbuf_t *seg = pktbuf_alloc_ext(buf, len, ext);
+            if (!seg) {
+                pktbuf_free(p);
+                return ERR_NO_MEMORY;
+            }
+            pktbuf_chain(p, seg);
+            if (sw_csum)
+                checksum = ones_sum16(checksum, buf, len);
+        } else if (sw_csum) {
+            /* sum the payload on its way into the packet rather than reading it twice */
+            checksum = ones_sum16_copy(checksum, pktbuf_append(p, len), buf, len);
+        } else {
+            pktbuf_append_data(p, buf, len);
+        }
+    }
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+    if (sw_csum) {
+        header->checksum = ~checksum;
+    } else if (DO_TCP_CHECKSUM) {
+        /* leave the pseudo header sum for the nic to finish */
+        header->checksum = checksum;
+        p->flags |= PKTBUF_FLAG_CSUM_PARTIAL;
+        p->csum_start = (uint8_t *)header - p->buffer;
+        p->csum_offset = __offsetof(tcp_header_t, checksum);
     }
 
     if (LOCAL_TRACE) {
@@ -743,48 +1417,253 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     return minip_ipv4_send(p, dest_ip, IP_PROTO_TCP);
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+/* send len bytes of the tx buffer starting at sequence */
+static void tcp_send_data(tcp_socket_t *s, uint32_t sequence, uint32_t len)
+{
+    DEBUG_ASSERT(SEQUENCE_GTE(sequence, s->tx_win_low));
+    DEBUG_ASSERT(sequence - s->tx_win_low + len <= s->tx_buffer_offset);
+
+    tcp_socket_send(s, s->tx_buffer->data + (sequence - s->tx_win_low), len, PKT_ACK|PKT_PSH, sequence);
+}
+
+/* fold the SACK blocks from an ack into the scoreboard of what they hold past tx_win_low */
+static void tcp_sack_update(tcp_socket_t *s, const tcp_options_t *opts)
+{
+    /* forget anything that has now been cumulatively acked */
+    uint n = 0;
+    for (uint i = 0; i < s->tx_sack_count; i++) {
+        tcp_sack_block_t b = s->tx_sacked[i];
+        if (SEQUENCE_LTE(b.end, s->tx_win_low))
+            continue;
+        if (SEQUENCE_LT(b.start, s->tx_win_low))
+            b.start = s->tx_win_low;
+        s->tx_sacked[n++] = b;
+    }
+    s->tx_sack_count = n;
+
+    if (!s->sack_enabled)
+        return;
+
+    for (uint i = 0; i < opts->sack_count; i++) {
+        tcp_sack_block_t b = opts->sack[i];
+
+        /* ignore anything bogus or already acked */
+        if (SEQUENCE_GTE(b.start, b.end) || SEQUENCE_LTE(b.end, s->tx_win_low) ||
+            SEQUENCE_GT(b.end, s->tx_max_seq))
+            continue;
+        if (SEQUENCE_LT(b.start, s->tx_win_low))
+            b.start = s->tx_win_low;
+
+        /* insert in order, merging with anything it touches */
+        uint j = 0;
+        while (j < s->tx_sack_count && SEQUENCE_LT(s->tx_sacked[j].end, b.start))
+            j++;
+        uint k = j;
+        while (k < s->tx_sack_count && SEQUENCE_LTE(s->tx_sacked[k].start, b.end)) {
+            if (SEQUENCE_LT(s->tx_sacked[k].start, b.start))
+                b.start = s->tx_sacked[k].start;
+            if (SEQUENCE_GT(s->tx_sacked[k].end, b.end))
+                b.end = s->tx_sacked[k].end;
+            k++;
+        }
+
+        /* blocks j..k-1 collapse into b */
+        if (k == j) {
+            if (s->tx_sack_count == TCP_SACK_SCOREBOARD_SIZE) {
+                /* full, drop the highest block, it's the least useful for finding holes */
+                if (j == s->tx_sack_count)
+                    continue;
+                s->tx_sack_count--;
+            }
+            memmove(&s->tx_sacked[j + 1], &s->tx_sacked[j], (s->tx_sack_count - j) * sizeof(tcp_sack_block_t));
+            s->tx_sack_count++;
+        } else if (k > j + 1) {
+            memmove(&s->tx_sacked[j + 1], &s->tx_sacked[k], (s->tx_sack_count - k) * sizeof(tcp_sack_block_t));
+            s->tx_sack_count -= k - j - 1;
+        }
+        s->tx_sacked[j] = b;
+    }
+}
+
+static uint32_t tcp_sacked_bytes(tcp_socket_t *s)
+{
+    uint32_t bytes = 0;
+
+    for (uint i = 0; i < s->tx_sack_count; i++)
+        bytes += s->tx_sacked[i].end - s->tx_sacked[i].start;
+
+    return bytes;
+}
+
+/* retransmit the next hole below tx_recover they haven't SACKed. if lost_only is set
+ * only holes with SACKed data above them are considered lost and resent. */
+static bool tcp_retransmit_hole(tcp_socket_t *s, bool lost_only)
+{
+    uint32_t seq = s->tx_win_low;
+    if (SEQUENCE_GT(s->tx_rxt_next, seq))
+        seq = s->tx_rxt_next;
+
+    uint32_t end = s->tx_recover;
+    if (SEQUENCE_GT(end, s->tx_highest_seq))
+        end = s->tx_highest_seq;
+
+    bool sacked_above = false;
+    for (uint i = 0; i < s->tx_sack_count; i++) {
+        const tcp_sack_block_t *b = &s->tx_sacked[i];
+        if (SEQUENCE_LTE(b->end, seq))
+            continue;
+        if (SEQUENCE_LTE(b->start, seq)) {
+            seq = b->end;
+            continue;
+        }
+        if (SEQUENCE_LT(b->start, end))
+            end = b->start;
+        sacked_above = true;
+        break;
+    }
+
+    if (SEQUENCE_GTE(seq, end) || (lost_only && !sacked_above))
+        return false;
+
+    uint32_t len = MIN(end - seq, tcp_smss(s));
+
+    LTRACEF("s %p, retransmitting hole seq %u len %u\n", s, seq, len);
+    tcp_send_data(s, seq, len);
+    s->tx_rxt_next = seq + len;
+
+    /* Karn: never time a retransmitted segment */
+    s->rtt_timing = false;
+
+    return true;
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts, size_t data_len)
 {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
+    uint32_t smss = tcp_smss(s);
+    uint32_t wnd = win_size << s->snd_wscale;
+
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %zu offset %zu\n",
             s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    if (SEQUENCE_GT(sequence, s->tx_max_seq)) {
+        /* they're acking stuff we haven't sent */
+        return;
+    } else if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
-    } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
-        /* they're acking stuff we haven't sent */
+    } else if (sequence == s->tx_win_low) {
+        /* nothing new acked, maybe a window update or a duplicate ack */
+        bool window_update = (s->tx_win_low + wnd != s->tx_win_high);
+        s->tx_win_high = s->tx_win_low + wnd;
+
+        tcp_sack_update(s, opts);
+
+        /* only a pure ack with data outstanding and an open, unchanged window counts as a dup */
+        if (window_update || data_len > 0 || wnd == 0 || s->tx_max_seq == s->tx_win_low) {
+            tcp_write_pending_data(s);
+            return;
+        }
+
+        s->tx_dupacks++;
+        if (!s->tx_in_recovery) {
+            if (s->tx_dupacks >= DUPACK_THRESHOLD || tcp_sacked_bytes(s) >= DUPACK_THRESHOLD * smss) {
+                /* fast retransmit, RFC 6582 / RFC 6675 */
+                LTRACEF("s %p, entering recovery at %u\n", s, s->tx_win_low);
+                tcp_cc_on_loss(s);
+                s->tx_in_recovery = true;
+                s->tx_recover = s->tx_max_seq;
+                s->tx_rxt_next = s->tx_win_low;
+                s->cwnd = s->ssthresh + DUPACK_THRESHOLD * smss;
+
+                tcp_retransmit_hole(s, false);
+                tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+            }
+        } else {
+            /* every dup ack means a segment left the network, inflate and keep filling holes */
+            s->cwnd += smss;
+            if (s->sack_enabled)
+                tcp_retransmit_hole(s, true);
+        }
+
+        tcp_write_pending_data(s);
         return;
-    } else {
-        /* their ack is somewhere in our window */
-        uint32_t acked_len;
+    }
+
+    /* their ack is somewhere in our window */
+    uint32_t acked_len;
 
-        acked_len = (sequence - s->tx_win_low);
+    acked_len = (sequence - s->tx_win_low);
 
-        LTRACEF("acked len %u\n", acked_len);
+    LTRACEF("acked len %u\n", acked_len);
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+    DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
+    DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+    if (s->tx_buffer->ext.ref > 1) {
+        /* segments still queued in the driver point into the buffer, so move
+         * the unacked data to a fresh one rather than shifting it under them */
+        tcp_tx_buffer_t *buf = tcp_tx_buffer_alloc(s->tx_buffer_size);
+        if (!buf) {
+            /* leave the window alone, the ack will be repeated */
+            return;
+        }
 
-        s->tx_buffer_offset -= acked_len;
-        s->tx_win_low += acked_len;
-        s->tx_win_high = s->tx_win_low + win_size;
+        memcpy(buf->data, s->tx_buffer->data + acked_len, s->tx_buffer_offset - acked_len);
+        pktbuf_ext_release(&s->tx_buffer->ext);
+        s->tx_buffer = buf;
+    } else {
+        memmove(s->tx_buffer->data, s->tx_buffer->data + acked_len, s->tx_buffer_offset - acked_len);
+    }
 
-        /* cancel or reset our retransmit timer */
-        if (s->tx_win_low == s->tx_highest_seq) {
-            tcp_timer_cancel(s, &s->retransmit_timer);
+    s->tx_buffer_offset -= acked_len;
+    s->tx_win_low += acked_len;
+    s->tx_win_high = s->tx_win_low + wnd;
+    if (SEQUENCE_LT(s->tx_highest_seq, s->tx_win_low))
+        s->tx_highest_seq = s->tx_win_low;
+
+    /* measure the round trip, from the echoed timestamp if we have them */
+    lk_time_t now = current_time();
+    if (s->ts_enabled && opts->ts_present && opts->ts_ecr != 0) {
+        tcp_rtt_sample(s, (uint32_t)now - opts->ts_ecr);
+    } else if (s->rtt_timing && SEQUENCE_GT(sequence, s->rtt_seq)) {
+        tcp_rtt_sample(s, now - s->rtt_time);
+        s->rtt_timing = false;
+    }
+
+    tcp_sack_update(s, opts);
+    s->tx_dupacks = 0;
+
+    if (s->tx_in_recovery) {
+        if (SEQUENCE_GTE(sequence, s->tx_recover)) {
+            /* full ack, deflate the window back down */
+            LTRACEF("s %p, leaving recovery at %u\n", s, sequence);
+            s->tx_in_recovery = false;
+            s->cwnd = MIN(s->ssthresh, MAX(s->tx_max_seq - s->tx_win_low, smss) + smss);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            /* partial ack, the next segment was lost too */
+            tcp_retransmit_hole(s, false);
+            s->cwnd = (s->cwnd > acked_len) ? s->cwnd - acked_len + smss : smss;
         }
+    } else {
+        tcp_cc_on_ack(s, acked_len);
+    }
 
-        /* we have opened the transmit buffer */
-        event_signal(&s->tx_event, true);
+    /* cancel or reset our retransmit timer */
+    if (s->tx_win_low == s->tx_max_seq) {
+        tcp_timer_cancel(s, &s->retransmit_timer);
+    } else {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
+
+    /* we have opened the transmit buffer */
+    tcp_signal(s, MINIP_POLL_OUT);
+
+    /* and maybe the send window */
+    tcp_write_pending_data(s);
 }
 
 static ssize_t tcp_write_pending_data(tcp_socket_t *s)
@@ -802,19 +1681,42 @@ static ssize_t tcp_write_pending_data(tcp_socket_t *s)
     uint32_t pending = s->tx_buffer_offset - outstanding;
     LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
 
+    /* we may have as much in flight as both their window and the congestion window allow */
+    uint32_t wnd = MIN(s->tx_win_high - s->tx_win_low, s->cwnd);
+    uint32_t smss = tcp_smss(s);
+
     /* send packets that cover the pending area of the window */
     uint32_t offset = 0;
     while (offset < pending) {
-        uint32_t tosend = MIN(s->mss, pending - offset);
+        uint32_t in_flight = s->tx_highest_seq - s->tx_win_low;
+        if (in_flight >= wnd)
+            break;
+
+        uint32_t tosend = MIN(smss, pending - offset);
+        tosend = MIN(tosend, wnd - in_flight);
+
+        /* don't dribble out a runt if the window will open up for a full segment soon */
+        if (tosend < smss && tosend < pending - offset && in_flight > 0)
+            break;
+
+        /* time one segment per round trip when there are no timestamps to do it for us */
+        if (!s->ts_enabled && !s->rtt_timing && SEQUENCE_GTE(s->tx_highest_seq, s->tx_max_seq)) {
+            s->rtt_timing = true;
+            s->rtt_seq = s->tx_highest_seq;
+            s->rtt_time = current_time();
+        }
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
+        tcp_send_data(s, s->tx_highest_seq, tosend);
         s->tx_highest_seq += tosend;
+        if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+            s->tx_max_seq = s->tx_highest_seq;
         offset += tosend;
     }
 
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* make sure the retransmit timer is running if anything is outstanding, or if
+     * we're stuck behind a zero window and need to probe it */
+    if (offset > 0 || (pending > 0 && s->tx_max_seq == s->tx_win_low)) {
+        tcp_rto_start(s);
     }
 
     return offset;
@@ -829,16 +1731,32 @@ static ssize_t tcp_retransmit(tcp_socket_t *s)
         return 0;
 
     /* how much data have we sent but not gotten an ack for? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    if (outstanding == 0)
+    uint32_t outstanding = (s->tx_max_seq - s->tx_win_low);
+    if (outstanding == 0) {
+        /* nothing in flight, but if data is waiting on a zero window, poke it with a byte */
+        if (s->tx_buffer_offset > 0 && s->tx_win_high == s->tx_win_low) {
+            LTRACEF("s %p, window probe seq %u\n", s, s->tx_win_low);
+            tcp_send_data(s, s->tx_win_low, 1);
+            s->tx_highest_seq = s->tx_max_seq = s->tx_win_low + 1;
+            s->rto = MIN(s->rto * 2, RTO_MAX);
+            return 1;
+        }
         return 0;
+    }
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+    /* timeout: collapse the window, back off and go back to the first unacked byte */
+    tcp_cc_on_loss(s);
+    s->cwnd = tcp_smss(s);
+    s->rto = MIN(s->rto * 2, RTO_MAX);
+    s->rtt_timing = false;
+    s->tx_in_recovery = false;
+    s->tx_dupacks = 0;
+    s->tx_sack_count = 0;
+    s->tx_highest_seq = s->tx_win_low;
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    LTRACEF("s %p, rto %u seq %u\n", s, s->rto, s->tx_win_low);
 
-    return tosend;
+    return tcp_write_pending_data(s);
 }
 
 static void handle_retransmit_timeout(void *_s)
@@ -854,7 +1772,7 @@ static void handle_retransmit_timeout(void *_s)
     if (tcp_retransmit(s) == 0)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
@@ -895,14 +1813,58 @@ static void handle_time_wait_timeout(void *_s)
     dec_socket_ref(s);
 }
 
+/* wake blocked readers and writers and any poll sets waiting on the socket */
+static void tcp_signal(tcp_socket_t *s, uint32_t events)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (events & MINIP_POLL_IN)
+        event_signal(&s->rx_event, true);
+    if (events & MINIP_POLL_OUT)
+        event_signal(&s->tx_event, true);
+    minip_poll_notify(&s->poll, events);
+}
+
 static void tcp_wakeup_waiters(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
     // wake up any waiters
-    event_signal(&s->rx_event, true);
-    event_signal(&s->tx_event, true);
+    tcp_signal(s, MINIP_POLL_IN | MINIP_POLL_OUT | MINIP_POLL_HUP);
+}
+
+/* what a nonblocking call on the socket would find, read without the lock */
+static uint32_t tcp_poll_query(minip_poll_src_t *src)
+{
+    tcp_socket_t *s = containerof(src, tcp_socket_t, poll);
+    uint32_t events = 0;
+
+    switch (s->state) {
+        case STATE_LISTEN:
+            if (s->accepted)
+                events |= MINIP_POLL_IN;
+            break;
+        case STATE_SYN_RCVD:
+            break;
+        case STATE_ESTABLISHED:
+            if (cbuf_space_used(&s->rx_buffer) > 0)
+                events |= MINIP_POLL_IN;
+            if (s->tx_buffer_offset < s->tx_buffer_size)
+                events |= MINIP_POLL_OUT;
+            break;
+        case STATE_CLOSE_WAIT:
+            /* there's either data or the eof to read */
+            events |= MINIP_POLL_IN;
+            if (s->tx_buffer_offset < s->tx_buffer_size)
+                events |= MINIP_POLL_OUT;
+            break;
+        default:
+            events |= MINIP_POLL_IN | MINIP_POLL_HUP;
+            break;
+    }
+
+    return events;
 }
 
 static void tcp_remote_close(tcp_socket_t *s)
@@ -924,6 +1886,20 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_wakeup_waiters(s);
 }
 
+static status_t tcp_socket_alloc_buffers(tcp_socket_t *s)
+{
+    s->rx_buffer_raw = malloc(s->rx_win_size);
+    if (!s->rx_buffer_raw)
+        return ERR_NO_MEMORY;
+    cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
+
+    s->tx_buffer = tcp_tx_buffer_alloc(s->tx_buffer_size);
+    if (!s->tx_buffer)
+        return ERR_NO_MEMORY;
+
+    return NO_ERROR;
+}
+
 static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
 {
     tcp_socket_t *s;
@@ -938,24 +1914,32 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     s->state = STATE_CLOSED;
     s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_ooo_list);
 
     s->mss = DEFAULT_MSS;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_max_seq = s->tx_win_low;
+    s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
     event_init(&s->tx_event, true, 0);
 
-    if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
-    }
+    s->rto = RTO_INITIAL;
+    s->cc = DEFAULT_CC;
+    s->cwnd = 2 * DEFAULT_MSS;
+    s->ssthresh = 0x7fffffff;
 
+    /* before anything that can fail, since dropping the ref tears these down */
     sem_init(&s->accept_sem, 0);
+    minip_poll_src_init(&s->poll, tcp_poll_query);
+
+    if (alloc_buffers) {
+        if (tcp_socket_alloc_buffers(s) < 0) {
+            dec_socket_ref(s);
+            return NULL;
+        }
+    }
 
     return s;
 }
@@ -973,21 +1957,70 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     if (!s)
         return ERR_NO_MEMORY;
 
-    // XXX see if there's another listen socket already on this port
-
     s->local_port = port;
 
     /* go to listen state */
     s->state = STATE_LISTEN;
 
-    add_socket_to_list(s);
+    status_t err = add_socket_to_list(s);
+    if (err < 0) {
+        dec_socket_ref(s);
+        return err;
+    }
 
     *handle = s;
 
     return NO_ERROR;
 }
 
-status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (rx_size < MIN_BUFFER_SIZE || rx_size > MAX_BUFFER_SIZE ||
+        tx_size < MIN_BUFFER_SIZE || tx_size > MAX_BUFFER_SIZE)
+        return ERR_OUT_OF_RANGE;
+
+    tcp_socket_t *s = socket;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&s->lock);
+
+    /* buffers are sized when a connection is accepted, so only listen sockets can change */
+    if (s->state != STATE_LISTEN) {
+        err = ERR_BAD_STATE;
+        goto out;
+    }
+
+    /* the rx buffer is a cbuf, which wants a power of two */
+    s->rx_win_size = 1u << log2_uint(rx_size);
+    if (s->rx_win_size < rx_size)
+        s->rx_win_size <<= 1;
+    s->tx_buffer_size = tx_size;
+
+out:
+    mutex_release(&s->lock);
+    return err;
+}
+
+status_t tcp_set_congestion_control(tcp_socket_t *socket, tcp_cc_t cc)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (cc != TCP_CC_NEWRENO && cc != TCP_CC_CUBIC)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+
+    mutex_acquire(&s->lock);
+    s->cc = cc;
+    s->cubic_epoch = 0;
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
+status_t tcp_accept_etc(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, uint flags)
 {
     if (!listen_socket || !accept_socket)
         return ERR_INVALID_ARGS;
@@ -995,8 +2028,15 @@ status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
     tcp_socket_t *s = listen_socket;
     inc_socket_ref(s);
 
-    /* block to accept a socket */
-    sem_wait(&s->accept_sem);
+    status_t err = NO_ERROR;
+    if (flags & MINIP_NONBLOCK) {
+        err = sem_trywait(&s->accept_sem);
+        if (err < 0)
+            goto out;
+    } else {
+        /* block to accept a socket */
+        sem_wait(&s->accept_sem);
+    }
 
     mutex_acquire(&s->lock);
 
@@ -1006,12 +2046,19 @@ status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
     s->accepted = NULL;
 
     mutex_release(&s->lock);
+
+out:
     dec_socket_ref(s);
 
-    return NO_ERROR;
+    return err;
 }
 
-ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
+{
+    return tcp_accept_etc(listen_socket, accept_socket, 0);
+}
+
+ssize_t tcp_read_etc(tcp_socket_t *socket, void *buf, size_t len, uint flags)
 {
     if (!socket)
         return ERR_INVALID_ARGS;
@@ -1026,7 +2073,8 @@ ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
     ssize_t ret = 0;
 retry:
     /* block on available data */
-    event_wait(&s->rx_event);
+    if (!(flags & MINIP_NONBLOCK))
+        event_wait(&s->rx_event);
 
     mutex_acquire(&s->lock);
 
@@ -1039,11 +2087,20 @@ retry:
             goto out;
         }
 
+        if (flags & MINIP_NONBLOCK) {
+            ret = ERR_NOT_READY;
+            goto out;
+        }
+
         /* we must have raced with another thread then */
         mutex_release(&s->lock);
         goto retry;
     }
 
+    /* drained it, so the next blocking read sleeps until handle_data signals again */
+    if (cbuf_space_used(&s->rx_buffer) == 0 && s->state == STATE_ESTABLISHED)
+        event_unsignal(&s->rx_event);
+
     /* we've read something, make sure the other end knows that our window is opening */
     uint32_t new_rx_win_size = s->rx_win_size - cbuf_space_used(&s->rx_buffer);
 
@@ -1058,7 +2115,12 @@ out:
     return ret;
 }
 
-ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
+ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
+{
+    return tcp_read_etc(socket, buf, len, 0);
+}
+
+ssize_t tcp_write_etc(tcp_socket_t *socket, const void *buf, size_t len, uint flags)
 {
     if (!socket)
         return ERR_INVALID_ARGS;
@@ -1075,8 +2137,10 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         LTRACEF("off %u, len %u\n", off, len);
 
         /* wait for the tx buffer to open up */
-        event_wait(&s->tx_event);
-        LTRACEF("after event_wait\n");
+        if (!(flags & MINIP_NONBLOCK)) {
+            event_wait(&s->tx_event);
+            LTRACEF("after event_wait\n");
+        }
 
         mutex_acquire(&s->lock);
 
@@ -1094,10 +2158,12 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
         if (to_copy == 0) {
             mutex_release(&s->lock);
+            if (flags & MINIP_NONBLOCK)
+                break;
             continue;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
+        memcpy(s->tx_buffer->data + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
         s->tx_buffer_offset += to_copy;
 
         /* if this has completely filled it, unsignal the event */
@@ -1115,7 +2181,12 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
     }
 
     dec_socket_ref(s);
-    return len;
+    return off > 0 ? (ssize_t)off : ERR_NOT_READY;
+}
+
+ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
+{
+    return tcp_write_etc(socket, buf, len, 0);
 }
 
 status_t tcp_close(tcp_socket_t *socket)
@@ -1130,6 +2201,9 @@ status_t tcp_close(tcp_socket_t *socket)
 
     LTRACEF("socket %p, state %d (%s), ref %d\n", s, s->state, tcp_state_to_string(s->state), s->ref);
 
+    /* the handle is gone as far as the caller is concerned, so are its poll entries */
+    minip_poll_src_detach(&s->poll);
+
     status_t err;
     switch (s->state) {
         case STATE_CLOSED:
@@ -1149,14 +2223,14 @@ status_t tcp_close(tcp_socket_t *socket)
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, s->tx_win_low);
             s->tx_win_low++;
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, s->tx_win_low);
             s->tx_win_low++;
 
             // XXX set up fin retransmit timer here
@@ -1187,7 +2261,90 @@ out:
     return err;
 }
 
+status_t minip_poll_add_tcp(minip_poll_set_t *set, tcp_socket_t *socket, uint32_t events, void *cookie)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    return minip_poll_add(set, &socket->poll, socket, events, cookie);
+}
+
 /* debug stuff */
+
+/* populate the tables with fake established connections from TEST-NET-1, then
+ * repeatedly tear one down, bring it back on a new tuple and demultiplex a
+ * segment for it, the way a busy server sees connections come and go. */
+static void tcp_churn_bench(uint count, uint iterations)
+{
+    if (count == 0 || iterations == 0)
+        return;
+
+    tcp_socket_t **socks = calloc(count, sizeof(tcp_socket_t *));
+    if (!socks) {
+        printf("out of memory\n");
+        return;
+    }
+
+    ipv4_addr local_ip = minip_get_ipaddr();
+    uint32_t tuple = 0;
+    uint created;
+    for (created = 0; created < count; created++) {
+        tcp_socket_t *s = create_tcp_socket(false);
+        if (!s)
+            break;
+
+        s->state = STATE_ESTABLISHED;
+        s->local_ip = local_ip;
+        s->local_port = 80;
+        s->remote_ip = htonl(0xc0000200 | (tuple & 0xff));
+        s->remote_port = 1024 + ((tuple >> 8) & 0xefff);
+        tuple++;
+
+        if (add_socket_to_list(s) < 0) {
+            dec_socket_ref(s);
+            break;
+        }
+        socks[created] = s;
+    }
+
+    printf("churning %u sockets for %u iterations\n", created, iterations);
+
+    uint misses = 0;
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; i < iterations && created > 0; i++) {
+        uint slot = i % created;
+        tcp_socket_t *s = socks[slot];
+
+        remove_socket_from_list(s);
+        s->remote_ip = htonl(0xc0000200 | (tuple & 0xff));
+        s->remote_port = 1024 + ((tuple >> 8) & 0xefff);
+        tuple++;
+        if (add_socket_to_list(s) < 0) {
+            /* out of the tables for good, drop it from the set being churned */
+            dec_socket_ref(s);
+            socks[slot] = socks[--created];
+            misses++;
+            continue;
+        }
+
+        tcp_socket_t *found = lookup_socket(s->remote_ip, local_ip, s->remote_port, 80);
+        if (found != s)
+            misses++;
+        if (found)
+            dec_socket_ref(found);
+    }
+    t = current_time_hires() - t;
+
+    printf("%u iterations in %llu usecs, %llu nsecs per remove/add/lookup, %u misses\n",
+            iterations, t, (t * 1000) / iterations, misses);
+
+    for (uint i = 0; i < created; i++) {
+        remove_socket_from_list(socks[i]);
+        dec_socket_ref(socks[i]);
+    }
+    free(socks);
+}
+
 static int cmd_tcp(int argc, const cmd_args *argv)
 {
     status_t err;
@@ -1199,6 +2356,7 @@ usage:
         printf("usage: %s sockets\n", argv[0].str);
         printf("usage: %s listenclose <port>\n", argv[0].str);
         printf("usage: %s listen <port>\n", argv[0].str);
+        printf("usage: %s churn <sockets> <iterations>\n", argv[0].str);
         return ERR_INVALID_ARGS;
     }
 
@@ -1262,6 +2420,10 @@ usage:
 
         err = tcp_close(handle);
         printf("tcp_close returns %d\n", err);
+    } else if (!strcmp(argv[1].str, "churn")) {
+        if (argc < 4) goto notenoughargs;
+
+        tcp_churn_bench(argv[2].u, argv[3].u);
     } else {
         printf("ERROR unknown command\n");
         goto usage;
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "minip-internal.h"
+
+#include <assert.h>
+#include <err.h>
+#include <list.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+
+#define LOCAL_TRACE 0
+
+/* datagrams held per socket before new ones are dropped */
+#define UDP_RX_QUEUE_MAX 32
+
+typedef struct udp_datagram {
+    struct list_node node;
+    uint32_t addr;
+    uint16_t port;
+    size_t len;
+    uint8_t data[];
+} udp_datagram_t;
+
+struct udp_socket {
+    mutex_t lock;
+    uint16_t port;
+
+    struct list_node rx_queue;
+    uint rx_count;
+    uint rx_dropped;
+    event_t rx_event;   // signalled while rx_queue isn't empty
+
+    minip_poll_src_t poll;
+};
+
+static uint32_t udp_poll_query(minip_poll_src_t *src)
+{
+    udp_socket_t *s = containerof(src, udp_socket_t, poll);
+
+    return (s->rx_count > 0 ? MINIP_POLL_IN : 0) | MINIP_POLL_OUT;
+}
+
+/* runs on the rx path for every datagram to the socket's port */
+static void udp_socket_rx(void *data, size_t len, uint32_t srcaddr, uint16_t srcport, void *arg)
+{
+    udp_socket_t *s = arg;
+
+    mutex_acquire(&s->lock);
+
+    if (s->rx_count >= UDP_RX_QUEUE_MAX) {
+        s->rx_dropped++;
+        goto out;
+    }
+
+    udp_datagram_t *d = malloc(sizeof(udp_datagram_t) + len);
+    if (!d) {
+        s->rx_dropped++;
+        goto out;
+    }
+
+    d->addr = srcaddr;
+    d->port = srcport;
+    d->len = len;
+    memcpy(d->data, data, len);
+
+    list_add_tail(&s->rx_queue, &d->node);
+    s->rx_count++;
+
+    event_signal(&s->rx_event, false);
+    minip_poll_notify(&s->poll, MINIP_POLL_IN);
+
+out:
+    mutex_release(&s->lock);
+}
+
+status_t udp_open(udp_socket_t **handle, uint16_t port)
+{
+    if (!handle)
+        return ERR_INVALID_ARGS;
+
+    udp_socket_t *s = calloc(1, sizeof(udp_socket_t));
+    if (!s)
+        return ERR_NO_MEMORY;
+
+    mutex_init(&s->lock);
+    s->port = port;
+    list_initialize(&s->rx_queue);
+    event_init(&s->rx_event, false, 0);
+    minip_poll_src_init(&s->poll, udp_poll_query);
+
+    if (minip_udp_listen(port, udp_socket_rx, s) < 0) {
+        event_destroy(&s->rx_event);
+        mutex_destroy(&s->lock);
+        free(s);
+        return ERR_ALREADY_EXISTS;
+    }
+
+    *handle = s;
+    return NO_ERROR;
+}
+
+status_t udp_close(udp_socket_t *s)
+{
+    udp_datagram_t *d;
+
+    if (!s)
+        return ERR_INVALID_ARGS;
+
+    /* no more datagrams can show up after this */
+    minip_udp_unlisten(s->port);
+    minip_poll_src_detach(&s->poll);
+
+    while ((d = list_remove_head_type(&s->rx_queue, udp_datagram_t, node)) != NULL)
+        free(d);
+
+    event_destroy(&s->rx_event);
+    mutex_destroy(&s->lock);
+    free(s);
+
+    return NO_ERROR;
+}
+
+/* returns the datagram's length, which is truncated to len if it's larger */
+ssize_t udp_recv(udp_socket_t *s, void *buf, size_t len,
+    uint32_t *srcaddr, uint16_t *srcport, uint flags)
+{
+    udp_datagram_t *d;
+
+    if (!s || (len > 0 && !buf))
+        return ERR_INVALID_ARGS;
+
+    for (;;) {
+        if (!(flags & MINIP_NONBLOCK))
+            event_wait(&s->rx_event);
+
+        mutex_acquire(&s->lock);
+        d = list_remove_head_type(&s->rx_queue, udp_datagram_t, node);
+        if (d) {
+            if (--s->rx_count == 0)
+                event_unsignal(&s->rx_event);
+            mutex_release(&s->lock);
+            break;
+        }
+        mutex_release(&s->lock);
+
+        if (flags & MINIP_NONBLOCK)
+            return ERR_NOT_READY;
+    }
+
+    LTRACEF("s %p, datagram len %zu from port %u\n", s, d->len, d->port);
+
+    ssize_t ret = d->len;
+    memcpy(buf, d->data, MIN(len, d->len));
+    if (srcaddr)
+        *srcaddr = d->addr;
+    if (srcport)
+        *srcport = d->port;
+    free(d);
+
+    return ret;
+}
+
+status_t udp_send(udp_socket_t *s, const void *buf, size_t len, uint32_t dstaddr, uint16_t dstport)
+{
+    if (!s || (len > 0 && !buf))
+        return ERR_INVALID_ARGS;
+
+    return minip_udp_send(buf, len, dstaddr, dstport, s->port) < 0 ? ERR_GENERIC : NO_ERROR;
+}
+
+status_t minip_poll_add_udp(minip_poll_set_t *set, udp_socket_t *socket, uint32_t events, void *cookie)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    return minip_poll_add(set, &socket->poll, socket, events, cookie);
+}
+
+// vim: set ts=4 sw=4 expandtab:
@@ -0,0 +1,622 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <trace.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <err.h>
+#include <lib/workqueue.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <lk/init.h>
+#include <platform.h>
+
+#define LOCAL_TRACE 0
+
+#ifndef WORKQUEUE_MIN_THREADS
+#define WORKQUEUE_MIN_THREADS 2
+#endif
+#ifndef WORKQUEUE_MAX_THREADS
+#define WORKQUEUE_MAX_THREADS 8
+#endif
+#ifndef WORKQUEUE_MAX_QUEUED
+#define WORKQUEUE_MAX_QUEUED 32
+#endif
+#ifndef WORKQUEUE_IDLE_TIMEOUT
+#define WORKQUEUE_IDLE_TIMEOUT 10000
+#endif
+#ifndef WORKQUEUE_PRIORITY
+#define WORKQUEUE_PRIORITY DEFAULT_PRIORITY
+#endif
+
+STATIC_ASSERT(WORKQUEUE_MIN_THREADS <= WORKQUEUE_MAX_THREADS);
+
+/* internal flag, item belongs to detached_work[] */
+#define WORK_FLAG_DETACHED 0x80000000
+
+/* everything below is protected by the critical section */
+
+/* queued items, highest priority first, fifo within a priority */
+static struct list_node work_list = LIST_INITIAL_VALUE(work_list);
+static uint queued_count;
+
+/* parked workers */
+static wait_queue_t idle_wait = WAIT_QUEUE_INITIAL_VALUE(idle_wait);
+/* submitters waiting for room in the queue or a free detached item */
+static wait_queue_t full_wait = WAIT_QUEUE_INITIAL_VALUE(full_wait);
+
+static uint thread_count;
+static uint thread_serial;
+
+/* backing store for work_queue() */
+static work_t detached_work[WORKQUEUE_MAX_QUEUED];
+static struct list_node detached_free = LIST_INITIAL_VALUE(detached_free);
+
+static struct {
+	uint32_t submitted;
+	uint32_t completed;
+	uint32_t rejected;
+	uint32_t blocked;
+	uint32_t reused;
+	uint32_t created;
+	uint32_t retired;
+	uint32_t max_queued;
+	lk_bigtime_t latency_total;
+	lk_bigtime_t latency_max;
+} work_stats;
+
+static int work_thread_routine(void *arg);
+
+static void work_spawn_thread(void)
+{
+	char name[32];
+	thread_t *t;
+
+	snprintf(name, sizeof(name), "worker %u", thread_serial++);
+	t = thread_create(name, &work_thread_routine, NULL, WORKQUEUE_PRIORITY, DEFAULT_STACK_SIZE);
+	if (!t) {
+		enter_critical_section();
+		thread_count--;
+		exit_critical_section();
+		return;
+	}
+
+	thread_detach_and_resume(t);
+}
+
+void work_init(work_t *w, work_func func, void *arg, int priority)
+{
+	w->magic = WORK_MAGIC;
+	list_clear_node(&w->node);
+	w->func = func;
+	w->arg = arg;
+	w->priority = priority;
+	w->flags = 0;
+	w->state = WORK_STATE_IDLE;
+	w->retcode = 0;
+	w->queue_time = 0;
+	wait_queue_init(&w->done_wait);
+}
+
+/* must be called in a critical section, with room in the queue */
+static bool work_enqueue_locked(work_t *w, uint flags)
+{
+	work_t *pos;
+
+	DEBUG_ASSERT(queued_count < WORKQUEUE_MAX_QUEUED);
+
+	w->state = WORK_STATE_QUEUED;
+	w->queue_time = current_time_hires();
+
+	/* insert in front of the first item with a lower priority */
+	bool inserted = false;
+	list_for_every_entry(&work_list, pos, work_t, node) {
+		if (pos->priority < w->priority) {
+			list_add_before(&pos->node, &w->node);
+			inserted = true;
+			break;
+		}
+	}
+	if (!inserted)
+		list_add_tail(&work_list, &w->node);
+
+	queued_count++;
+	work_stats.submitted++;
+	if (queued_count > work_stats.max_queued)
+		work_stats.max_queued = queued_count;
+
+	/* hand it to a parked worker if there is one, otherwise grow the pool */
+	if (wait_queue_wake_one(&idle_wait, (flags & WORK_FLAG_NORESCHED) ? false : true, NO_ERROR) > 0) {
+		work_stats.reused++;
+		return false;
+	}
+
+	if (thread_count < WORKQUEUE_MAX_THREADS) {
+		thread_count++;
+		work_stats.created++;
+		return true;
+	}
+
+	return false;
+}
+
+/* must be called in a critical section */
+static status_t work_wait_for_room_locked(uint flags)
+{
+	while (queued_count >= WORKQUEUE_MAX_QUEUED) {
+		if (flags & WORK_FLAG_NOWAIT) {
+			work_stats.rejected++;
+			return ERR_NOT_READY;
+		}
+		work_stats.blocked++;
+		wait_queue_block(&full_wait, INFINITE_TIME);
+	}
+
+	return NO_ERROR;
+}
+
+status_t work_submit(work_t *w, uint flags)
+{
+	status_t err;
+	bool spawn;
+
+	DEBUG_ASSERT(w->magic == WORK_MAGIC);
+	DEBUG_ASSERT(w->func);
+
+	enter_critical_section();
+
+	if (w->state == WORK_STATE_QUEUED || w->state == WORK_STATE_RUNNING) {
+		exit_critical_section();
+		return ERR_BUSY;
+	}
+
+	err = work_wait_for_room_locked(flags);
+	if (err < 0) {
+		exit_critical_section();
+		return err;
+	}
+
+	w->flags = 0;
+	spawn = work_enqueue_locked(w, flags);
+
+	exit_critical_section();
+
+	if (spawn)
+		work_spawn_thread();
+
+	return NO_ERROR;
+}
+
+status_t work_wait(work_t *w, lk_time_t timeout, int *retcode)
+{
+	status_t err = NO_ERROR;
+
+	DEBUG_ASSERT(w->magic == WORK_MAGIC);
+	DEBUG_ASSERT((w->flags & WORK_FLAG_DETACHED) == 0);
+
+	enter_critical_section();
+
+	if (w->state == WORK_STATE_IDLE) {
+		exit_critical_section();
+		return ERR_NOT_VALID;
+	}
+
+	/* a wakeup doesn't have to mean the item is done, so each wait is for
+	 * whatever is left of the timeout rather than all of it again */
+	lk_time_t start = current_time();
+	while (w->state != WORK_STATE_DONE) {
+		lk_time_t remaining = timeout;
+		if (timeout != INFINITE_TIME) {
+			lk_time_t elapsed = current_time() - start;
+			if (elapsed >= timeout) {
+				err = ERR_TIMED_OUT;
+				break;
+			}
+			remaining = timeout - elapsed;
+		}
+
+		err = wait_queue_block(&w->done_wait, remaining);
+		if (err < 0)
+			break;
+	}
+
+	if (err >= 0 && retcode)
+		*retcode = w->retcode;
+
+	exit_critical_section();
+
+	return err;
+}
+
+status_t work_queue(work_func func, void *arg, int priority, uint flags)
+{
+	work_t *w;
+	status_t err;
+	bool spawn;
+
+	enter_critical_section();
+
+	for (;;) {
+		err = work_wait_for_room_locked(flags);
+		if (err < 0)
+			goto out;
+
+		w = list_remove_head_type(&detached_free, work_t, node);
+		if (w)
+			break;
+
+		/* every detached item is queued or running */
+		if (flags & WORK_FLAG_NOWAIT) {
+			work_stats.rejected++;
+			err = ERR_NOT_READY;
+			goto out;
+		}
+		work_stats.blocked++;
+		wait_queue_block(&full_wait, INFINITE_TIME);
+	}
+
+	w->func = func;
+	w->arg = arg;
+	w->priority = priority;
+	w->flags = WORK_FLAG_DETACHED;
+	spawn = work_enqueue_locked(w, flags);
+
+	exit_critical_section();
+
+	if (spawn)
+		work_spawn_thread();
+
+	return NO_ERROR;
+
+out:
+	exit_critical_section();
+	return err;
+}
+
+static int work_thread_routine(void *arg)
+{
+	LTRACEF("worker %s starting\n", get_current_thread()->name);
+
+	enter_critical_section();
+
+	for (;;) {
+		work_t *w = list_remove_head_type(&work_list, work_t, node);
+		if (!w) {
+			lk_time_t timeout = (thread_count > WORKQUEUE_MIN_THREADS) ? WORKQUEUE_IDLE_TIMEOUT : INFINITE_TIME;
+
+			if (wait_queue_block(&idle_wait, timeout) == ERR_TIMED_OUT &&
+			        thread_count > WORKQUEUE_MIN_THREADS && list_is_empty(&work_list)) {
+				thread_count--;
+				work_stats.retired++;
+				break;
+			}
+			continue;
+		}
+
+		queued_count--;
+		wait_queue_wake_all(&full_wait, false, NO_ERROR);
+
+		w->state = WORK_STATE_RUNNING;
+
+		lk_bigtime_t latency = current_time_hires() - w->queue_time;
+		work_stats.latency_total += latency;
+		if (latency > work_stats.latency_max)
+			work_stats.latency_max = latency;
+
+		exit_critical_section();
+
+		thread_set_priority(w->priority);
+		int ret = w->func(w->arg);
+		thread_set_priority(WORKQUEUE_PRIORITY);
+
+		enter_critical_section();
+
+		work_stats.completed++;
+		if (w->flags & WORK_FLAG_DETACHED) {
+			w->state = WORK_STATE_IDLE;
+			list_add_head(&detached_free, &w->node);
+			wait_queue_wake_all(&full_wait, false, NO_ERROR);
+		} else {
+			/* the owner may free the item as soon as it sees DONE */
+			w->retcode = ret;
+			w->state = WORK_STATE_DONE;
+			wait_queue_wake_all(&w->done_wait, false, NO_ERROR);
+		}
+	}
+
+	exit_critical_section();
+
+	LTRACEF("worker %s retiring\n", get_current_thread()->name);
+
+	return 0;
+}
+
+/* take back an item that no worker has picked up yet. must be called in a
+ * critical section. returns false if a worker already owns it */
+static bool work_reclaim_locked(work_t *w)
+{
+	if (w->state != WORK_STATE_QUEUED)
+		return false;
+
+	list_delete(&w->node);
+	queued_count--;
+	wait_queue_wake_all(&full_wait, false, NO_ERROR);
+
+	w->state = WORK_STATE_IDLE;
+
+	return true;
+}
+
+struct work_range {
+	work_t work;
+	work_range_func func;
+	void *arg;
+	uint start;
+	uint end;
+};
+
+static int work_range_routine(void *arg)
+{
+	struct work_range *r = arg;
+
+	for (uint i = r->start; i < r->end; i++)
+		r->func(r->arg, i);
+
+	return 0;
+}
+
+void work_parallel_for(uint count, work_range_func func, void *arg)
+{
+	struct work_range ranges[WORKQUEUE_MAX_THREADS + 1];
+	bool submitted[WORKQUEUE_MAX_THREADS + 1];
+	uint chunks = MIN(count, countof(ranges));
+	int priority = get_current_thread()->priority;
+
+	if (chunks == 0)
+		return;
+
+	for (uint i = 0; i < chunks; i++) {
+		ranges[i].func = func;
+		ranges[i].arg = arg;
+		ranges[i].start = (uint)(((uint64_t)count * i) / chunks);
+		ranges[i].end = (uint)(((uint64_t)count * (i + 1)) / chunks);
+		submitted[i] = false;
+	}
+
+	/* the calling thread takes range 0 and anything the queue has no room for */
+	for (uint i = 1; i < chunks; i++) {
+		work_init(&ranges[i].work, &work_range_routine, &ranges[i], priority);
+		if (work_submit(&ranges[i].work, WORK_FLAG_NOWAIT | WORK_FLAG_NORESCHED) >= 0)
+			submitted[i] = true;
+		else
+			work_range_routine(&ranges[i]);
+	}
+
+	work_range_routine(&ranges[0]);
+
+	/* ranges still sitting in the queue are run here rather than waited on.
+	 * when every worker is busy, possibly in a nested work_parallel_for of
+	 * its own, nothing else would ever pick them up. only ranges a worker is
+	 * already running are waited for, so the wait always makes progress */
+	for (uint i = 1; i < chunks; i++) {
+		if (!submitted[i])
+			continue;
+
+		enter_critical_section();
+		bool reclaimed = work_reclaim_locked(&ranges[i].work);
+		exit_critical_section();
+
+		if (reclaimed)
+			work_range_routine(&ranges[i]);
+		else
+			work_wait(&ranges[i].work, INFINITE_TIME, NULL);
+	}
+}
+
+static void work_pool_init(uint level)
+{
+	for (uint i = 0; i < countof(detached_work); i++) {
+		work_init(&detached_work[i], NULL, NULL, 0);
+		list_add_tail(&detached_free, &detached_work[i].node);
+	}
+
+	enter_critical_section();
+	thread_count = WORKQUEUE_MIN_THREADS;
+	work_stats.created = WORKQUEUE_MIN_THREADS;
+	exit_critical_section();
+
+	for (uint i = 0; i < WORKQUEUE_MIN_THREADS; i++)
+		work_spawn_thread();
+}
+
+LK_INIT_HOOK(libworkqueue, &work_pool_init, LK_INIT_LEVEL_THREADING);
+
+#if defined(WITH_LIB_CONSOLE)
+#include <lib/console.h>
+
+struct work_bench {
+	lk_bigtime_t start;
+	lk_bigtime_t total;
+	event_t ran;
+};
+
+static int work_bench_routine(void *arg)
+{
+	struct work_bench *b = arg;
+
+	b->total += current_time_hires() - b->start;
+	event_signal(&b->ran, true);
+
+	return 0;
+}
+
+static void work_bench_sum(void *arg, uint index)
+{
+	uint64_t *sums = arg;
+
+	sums[index] = (uint64_t)index * index;
+}
+
+/* compare the cost of starting a job on a fresh thread with handing it to
+ * the pool, one job at a time so the number is pure dispatch latency */
+static void work_bench(uint iterations)
+{
+	struct work_bench b;
+
+	event_init(&b.ran, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+	b.total = 0;
+	lk_bigtime_t t = current_time_hires();
+	for (uint i = 0; i < iterations; i++) {
+		b.start = current_time_hires();
+		thread_t *th = thread_create("work bench", &work_bench_routine, &b, WORKQUEUE_PRIORITY, DEFAULT_STACK_SIZE);
+		if (!th)
+			break;
+		thread_detach_and_resume(th);
+		event_wait(&b.ran);
+	}
+	t = current_time_hires() - t;
+	printf("thread_create: %u jobs, %llu usecs submit-to-run avg, %llu usecs per job total\n",
+	       iterations, b.total / iterations, t / iterations);
+
+	/* let the detached bench threads finish exiting */
+	thread_sleep(10);
+
+	b.total = 0;
+	t = current_time_hires();
+	for (uint i = 0; i < iterations; i++) {
+		b.start = current_time_hires();
+		if (work_queue(&work_bench_routine, &b, WORKQUEUE_PRIORITY, 0) < 0)
+			break;
+		event_wait(&b.ran);
+	}
+	t = current_time_hires() - t;
+	printf("work_queue:    %u jobs, %llu usecs submit-to-run avg, %llu usecs per job total\n",
+	       iterations, b.total / iterations, t / iterations);
+
+	event_destroy(&b.ran);
+
+	/* sanity check the fan out helper */
+	uint count = MIN(iterations, 1024U);
+	uint64_t *sums = calloc(count, sizeof(uint64_t));
+	if (!sums)
+		return;
+
+	t = current_time_hires();
+	work_parallel_for(count, &work_bench_sum, sums);
+	t = current_time_hires() - t;
+
+	uint errors = 0;
+	for (uint i = 0; i < count; i++) {
+		if (sums[i] != (uint64_t)i * i)
+			errors++;
+	}
+	printf("work_parallel_for: %u items in %llu usecs, %u errors\n", count, t, errors);
+
+	free(sums);
+}
+
+#define WORK_NESTED_INNER 64
+
+static void work_nested_inner(void *arg, uint index)
+{
+	uint64_t *sums = arg;
+
+	sums[index] = (uint64_t)index * index;
+}
+
+static void work_nested_outer(void *arg, uint index)
+{
+	uint *errors = arg;
+	uint64_t sums[WORK_NESTED_INNER];
+
+	memset(sums, 0xff, sizeof(sums));
+
+	/* every worker ends up in here at once, with the inner ranges queued
+	 * behind the outer ones */
+	work_parallel_for(WORK_NESTED_INNER, &work_nested_inner, sums);
+
+	for (uint i = 0; i < WORK_NESTED_INNER; i++) {
+		if (sums[i] != (uint64_t)i * i) {
+			enter_critical_section();
+			(*errors)++;
+			exit_critical_section();
+		}
+	}
+}
+
+/* work_parallel_for from inside pool workers, with more outer ranges than
+ * workers so the pool is saturated. hangs if nested use can deadlock */
+static void work_nested_test(uint rounds)
+{
+	uint errors = 0;
+
+	for (uint r = 0; r < rounds; r++)
+		work_parallel_for(WORKQUEUE_MAX_THREADS * 4, &work_nested_outer, &errors);
+
+	printf("nested work_parallel_for: %u rounds, %u errors\n", rounds, errors);
+}
+
+static int cmd_workq(int argc, const cmd_args *argv)
+{
+	if (argc >= 2 && !strcmp(argv[1].str, "bench")) {
+		uint iterations = (argc >= 3) ? argv[2].u : 1000;
+		if (iterations == 0)
+			iterations = 1;
+		work_bench(iterations);
+		return NO_ERROR;
+	} else if (argc >= 2 && !strcmp(argv[1].str, "test")) {
+		work_nested_test((argc >= 3) ? argv[2].u : 100);
+		return NO_ERROR;
+	} else if (argc >= 2) {
+		printf("usage: %s [bench [iterations] | test [rounds]]\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	enter_critical_section();
+	uint threads = thread_count;
+	uint idle = idle_wait.count;
+	uint queued = queued_count;
+	exit_critical_section();
+
+	printf("workq: %u threads (%u idle, max %u), %u queued (max %u, limit %u)\n",
+	       threads, idle, WORKQUEUE_MAX_THREADS, queued, work_stats.max_queued, WORKQUEUE_MAX_QUEUED);
+	printf("\tsubmitted %u completed %u rejected %u blocked %u\n",
+	       work_stats.submitted, work_stats.completed, work_stats.rejected, work_stats.blocked);
+	printf("\tworkers reused %u created %u retired %u\n",
+	       work_stats.reused, work_stats.created, work_stats.retired);
+	printf("\tqueue latency avg %llu usecs max %llu usecs\n",
+	       work_stats.completed ? work_stats.latency_total / work_stats.completed : 0,
+	       work_stats.latency_max);
+
+	return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("workq", "work queue thread pool stats and benchmark", &cmd_workq)
+STATIC_COMMAND_END(workq);
+
+#endif
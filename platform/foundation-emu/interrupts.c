@@ -95,6 +95,38 @@ static void gic_set_enable(uint vector, bool enable)
     }
 }
 
+#if WITH_SMP
+/* set up the banked distributor registers and the cpu interface of the calling cpu */
+void platform_init_percpu_interrupts(void)
+{
+    GICDISTREG(CLRENABLE) = 0xffff0000;
+    GICDISTREG(SETENABLE) = 0x0000ffff;
+    GICDISTREG(CLRPEND) = 0xffffffff;
+    GICDISTREG(GROUP) = 0;
+
+    for (int i = 0; i < 32 / 4; i++) {
+        GICDISTREG(PRIORITY + i * 4) = 0x80808080;
+    }
+
+    GICCPUREG(PMR) = 0xf0;
+    GICCPUREG(CONTROL) = 1; // enable GIC0, IRQ only
+}
+
+status_t platform_send_ipi(mp_cpu_mask_t target, uint vector)
+{
+    if (vector >= 16)
+        return ERR_INVALID_ARGS;
+
+    /* make sure anything the target is being told about is visible first */
+    DSB;
+
+    /* target list filter, cpus 0-7 */
+    GICDISTREG(SGIR) = ((target & 0xff) << 16) | vector;
+
+    return NO_ERROR;
+}
+#endif
+
 void platform_init_interrupts(void)
 {
     GICDISTREG(DISTCONTROL) = 0;
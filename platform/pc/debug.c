@@ -35,7 +35,9 @@
 static int uart_baud_rate = 115200;
 static int uart_io_port = 0x3f8;
 
+/* filled only by the irq handler and drained only by uart_getc */
 static cbuf_t uart_rx_buf;
+static char uart_rx_data[16];
 
 static enum handler_return uart_irq_handler(void *arg)
 {
@@ -67,7 +69,7 @@ void platform_init_uart(void)
 void uart_init(void)
 {
 	/* finish uart init to get rx going */
-	cbuf_initialize(&uart_rx_buf, 16);
+	cbuf_initialize_flags(&uart_rx_buf, sizeof(uart_rx_data), uart_rx_data, CBUF_FLAG_SPSC);
 
 	register_int_handler(0x24, uart_irq_handler, NULL);
 	unmask_interrupt(0x24);
@@ -26,10 +26,10 @@
 #include <platform/pc/memmap.h>
 #include <platform/pc/iomap.h>
 
-/* NOTE: keep arch/x86/crt0.S in sync with these definitions */
+/* NOTE: keep arch/x86/crt0.S and arch/x86-64/crt0.S in sync with these definitions */
 
 /* interrupts */
-#define INT_VECTORS 0x31
+#define INT_VECTORS 0x40
 
 /* defined interrupts */
 #define INT_BASE            0x20
@@ -59,6 +59,10 @@
 
 #define INT_SYSCALL         0x30
 
+/* local apic vectors for smp */
+#define INT_IPI_RESCHEDULE  0x31
+#define INT_APIC_SPURIOUS   0x3f
+
 /* PIC remap bases */
 #define PIC1_BASE 0x20
 #define PIC2_BASE 0x28
@@ -34,10 +34,12 @@
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <kernel/event.h>
+#include <lib/console.h>
 #include <dev/class/netif.h>
 #include <dev/pci.h>
 #include <stdlib.h>
 #include <malloc.h>
+#include <stdio.h>
 #include <string.h>
 #include <lwip/pbuf.h>
 
@@ -46,8 +48,42 @@
 #define PCNET_INIT_TIMEOUT 20000
 #define MAX_PACKET_SIZE 1518
 
+/* rx descriptors handled per poll pass before the thread yields and polls
+ * again, with the controller's interrupt still off */
+#define PCNET_RX_BUDGET 64
+
+/* tx completions retired per hold of tx_lock */
+#define PCNET_TX_BATCH 32
+
+/* rx buffers beyond one per descriptor, for the ones the stack is holding */
+#define PCNET_RX_SPARES 64
+
 #define QEMU_IRQ_BUG_WORKAROUND 1
 
+/* most recently initialized device, for the console command */
+static struct pcnet_state *pcnet_last_state;
+
+/* an rx buffer, lent to the stack as a custom pbuf and returned to the
+ * pool by pbuf_free rather than allocated per packet */
+struct pcnet_rx_buf {
+	struct pbuf_custom pc;
+	struct pcnet_state *state;
+	struct pcnet_rx_buf *next;
+	uint8_t data[MAX_PACKET_SIZE];
+};
+
+struct pcnet_stats {
+	uint32_t irqs;
+	uint32_t polls;            /* passes over the rings */
+	uint32_t budget_exhausted; /* passes that stopped at the rx budget */
+	uint32_t rx_packets;
+	uint32_t tx_packets;
+	uint32_t rx_errors;
+	uint32_t rx_dropped;
+	uint32_t rx_copied;        /* pool was empty, copied out to keep the buffer on the ring */
+	uint32_t max_per_irq;      /* most packets handled for one interrupt */
+};
+
 struct pcnet_state {
 	int irq;
 	addr_t base;
@@ -59,9 +95,13 @@ struct pcnet_state {
 	struct rd_style3 *rd;
 	struct td_style3 *td;
 
-	struct pbuf **rx_buffers;
+	struct pcnet_rx_buf **rx_buffers;
 	struct pbuf **tx_buffers;
 
+	/* rx buffer pool, returned to by whichever thread frees the pbuf */
+	struct pcnet_rx_buf *rx_pool_mem;
+	struct pcnet_rx_buf *rx_pool;
+
 	/* queue accounting */
 	int rd_head;
 	int td_head;
@@ -80,6 +120,8 @@ struct pcnet_state {
 	bool done;
 
 	struct netstack_state *netstack_state;
+
+	struct pcnet_stats stats;
 };
 
 static status_t pcnet_init(struct device *dev);
@@ -88,8 +130,9 @@ static status_t pcnet_read_pci_config(struct device *dev, pci_location_t *loc);
 static enum handler_return pcnet_irq_handler(void *arg);
 
 static int pcnet_thread(void *arg);
-static bool pcnet_service_tx(struct device *dev);
-static bool pcnet_service_rx(struct device *dev);
+static uint pcnet_service_tx(struct device *dev);
+static uint pcnet_service_rx(struct device *dev, uint budget);
+static void pcnet_rx_buf_free(struct pbuf *p);
 
 static status_t pcnet_set_state(struct device *dev, struct netstack_state *state);
 static ssize_t pcnet_get_hwaddr(struct device *dev, void *buf, size_t max_len);
@@ -191,12 +234,13 @@ static status_t pcnet_init(struct device *dev)
 	state->td = memalign(16, state->td_count * DESC_SIZE);
 	state->rd = memalign(16, state->rd_count * DESC_SIZE);
 
-	state->rx_buffers = calloc(state->rd_count, sizeof(struct pbuf *));
+	state->rx_buffers = calloc(state->rd_count, sizeof(struct pcnet_rx_buf *));
 	state->tx_buffers = calloc(state->td_count, sizeof(struct pbuf *));
+	state->rx_pool_mem = memalign(16, (state->rd_count + PCNET_RX_SPARES) * sizeof(struct pcnet_rx_buf));
 
 	state->tx_pending = 0;
 
-	if (!state->td || !state->rd || !state->tx_buffers || !state->rx_buffers) {
+	if (!state->td || !state->rd || !state->tx_buffers || !state->rx_buffers || !state->rx_pool_mem) {
 		res = ERR_NO_MEMORY;
 		goto error;
 	}
@@ -228,17 +272,25 @@ static status_t pcnet_init(struct device *dev)
 	pcnet_write_csr(dev, 1, (uint32_t) state->ib);
 	pcnet_write_csr(dev, 2, (uint32_t) state->ib >> 16);
 
-	/* setup receive descriptors */
-	for (i=0; i < state->rd_count; i++) {
-		//LTRACEF("Allocating pbuf %d\n", i);
-		struct pbuf *p = pbuf_alloc(PBUF_RAW, MAX_PACKET_SIZE, PBUF_RAM);
+	/* one pool buffer per receive descriptor, the spares go on the free list */
+	for (i=0; i < state->rd_count + PCNET_RX_SPARES; i++) {
+		struct pcnet_rx_buf *b = &state->rx_pool_mem[i];
+
+		b->pc.custom_free_function = pcnet_rx_buf_free;
+		b->state = state;
+
+		if (i >= state->rd_count) {
+			b->next = state->rx_pool;
+			state->rx_pool = b;
+			continue;
+		}
 
-		state->rd[i].rbadr = (uint32_t) p->payload;
-		state->rd[i].bcnt = -p->tot_len;
+		state->rd[i].rbadr = (uint32_t) b->data;
+		state->rd[i].bcnt = -MAX_PACKET_SIZE;
 		state->rd[i].ones = 0xf;
 		state->rd[i].own = 1;
 
-		state->rx_buffers[i] = p;
+		state->rx_buffers[i] = b;
 	}
 
 	mutex_init(&state->tx_lock);
@@ -259,6 +311,8 @@ static status_t pcnet_init(struct device *dev)
 	unmask_interrupt(INT_BASE + 15);
 #endif
 
+	pcnet_last_state = state;
+
 	/* wait for initialization to complete */
 	res = event_wait_timeout(&state->initialized, PCNET_INIT_TIMEOUT);
 	if (res) {
@@ -279,6 +333,7 @@ error:
 		free(state->ib);
 		free(state->tx_buffers);
 		free(state->rx_buffers);
+		free(state->rx_pool_mem);
 	}
 
 	free(state);
@@ -346,6 +401,7 @@ static enum handler_return pcnet_irq_handler(void *arg)
 	mask_interrupt(INT_BASE + 15);
 #endif
 
+	state->stats.irqs++;
 	event_signal(&state->event, false);
 
 	return INT_RESCHEDULE;
@@ -397,9 +453,31 @@ static int pcnet_thread(void *arg)
 			pcnet_write_csr(dev, 0, csr0 & (CSR0_TXON | CSR0_RXON | CSR0_IENA));
 		}
 
-		bool again = !!(csr0 & (CSR0_RINT | CSR0_TINT));
-		while (again) {
-			again = pcnet_service_tx(dev) | pcnet_service_rx(dev);
+		/* poll with the controller's interrupt off until a pass comes in under
+		 * budget. each pass acks RINT/TINT first, so anything that lands after
+		 * the last pass raises them again and interrupts once IENA is back on */
+		if (csr0 & (CSR0_RINT | CSR0_TINT)) {
+			uint handled = 0;
+
+			for (;;) {
+				pcnet_write_csr(dev, 0, CSR0_RINT | CSR0_TINT);
+
+				uint tx = pcnet_service_tx(dev);
+				uint rx = pcnet_service_rx(dev, PCNET_RX_BUDGET);
+
+				state->stats.polls++;
+				handled += rx + tx;
+
+				if (rx < PCNET_RX_BUDGET)
+					break;
+
+				/* still busy, let everything else at this priority run first */
+				state->stats.budget_exhausted++;
+				thread_yield();
+			}
+
+			if (handled > state->stats.max_per_irq)
+				state->stats.max_per_irq = handled;
 		}
 
 		/* enable interrupts at the controller */
@@ -414,111 +492,160 @@ static int pcnet_thread(void *arg)
 	return 0;
 }
 
-static bool pcnet_service_tx(struct device *dev)
+/* retire completed tx descriptors, returns how many */
+static uint pcnet_service_tx(struct device *dev)
 {
 	LTRACE_ENTRY;
 
 	struct pcnet_state *state = dev->state;
+	struct pbuf *done[PCNET_TX_BATCH];
+	uint total = 0;
+	uint count;
 
-	mutex_acquire(&state->tx_lock);
+	do {
+		count = 0;
 
-	struct td_style3 *td = &state->td[state->td_tail];
+		mutex_acquire(&state->tx_lock);
 
-	if (state->tx_pending && td->own == 0) {
-		struct pbuf *p = state->tx_buffers[state->td_tail];
-		DEBUG_ASSERT(p);
+		while (count < countof(done) && state->tx_pending) {
+			struct td_style3 *td = &state->td[state->td_tail];
+			if (td->own)
+				break;
+			CF;
 
-		state->tx_buffers[state->td_tail] = NULL;
+			struct pbuf *p = state->tx_buffers[state->td_tail];
+			DEBUG_ASSERT(p);
 
-		LTRACEF("Retiring packet: td_tail=%d p=%p tot_len=%u\n", state->td_tail, p, p->tot_len);
+			state->tx_buffers[state->td_tail] = NULL;
 
-		state->tx_pending--;
-		state->td_tail = (state->td_tail + 1) % state->td_count;
+			LTRACEF("Retiring packet: td_tail=%d p=%p tot_len=%u\n", state->td_tail, p, p->tot_len);
 
-		if (td->err) {
-			LTRACEF("Descriptor error status encountered\n");
-			hexdump8(td, sizeof(*td));
+			state->tx_pending--;
+			state->td_tail = (state->td_tail + 1) % state->td_count;
+
+			if (td->err) {
+				LTRACEF("Descriptor error status encountered\n");
+				hexdump8(td, sizeof(*td));
+			}
+
+			done[count++] = p;
 		}
-	
+
 		mutex_release(&state->tx_lock);
 
-		pbuf_free(p);
+		for (uint i = 0; i < count; i++)
+			pbuf_free(done[i]);
 
-		LTRACE_EXIT;
-		return true;
-	} else {
-		mutex_release(&state->tx_lock);
+		total += count;
+	} while (count == countof(done));
 
-#if 0
-		LTRACEF("Nothing to do for TX.\n");
-		for (int i=0; i < state->td_count; i++)
-			printf("%d ", state->td[i].own);
-		printf("\n");
-#endif
+	state->stats.tx_packets += total;
 
-		LTRACE_EXIT;
-		return false;
-	}
+	LTRACE_EXIT;
+	return total;
 }
 
-static bool pcnet_service_rx(struct device *dev)
+static void pcnet_rx_buf_free(struct pbuf *p)
+{
+	struct pcnet_rx_buf *b = (struct pcnet_rx_buf *) p;
+	struct pcnet_state *state = b->state;
+
+	enter_critical_section();
+	b->next = state->rx_pool;
+	state->rx_pool = b;
+	exit_critical_section();
+}
+
+static struct pcnet_rx_buf *pcnet_rx_buf_get(struct pcnet_state *state)
+{
+	enter_critical_section();
+	struct pcnet_rx_buf *b = state->rx_pool;
+	if (b)
+		state->rx_pool = b->next;
+	exit_critical_section();
+
+	return b;
+}
+
+/* take up to budget filled rx descriptors off the ring, refill them from the
+ * pool and hand the packets to the stack in one batch. returns how many
+ * descriptors were consumed */
+static uint pcnet_service_rx(struct device *dev, uint budget)
 {
 	LTRACE_ENTRY;
 
 	struct pcnet_state *state = dev->state;
+	struct pbuf *batch[PCNET_RX_BUDGET];
+	uint count = 0;
+	uint n;
 
-	struct rd_style3 *rd = &state->rd[state->rd_head];
+	DEBUG_ASSERT(budget <= countof(batch));
+
+	for (n = 0; n < budget; n++) {
+		struct rd_style3 *rd = &state->rd[state->rd_head];
+		if (rd->own)
+			break;
+		CF;
+
+		struct pcnet_rx_buf *b = state->rx_buffers[state->rd_head];
+		DEBUG_ASSERT(b);
 
-	if (rd->own == 0) {
-		struct pbuf *p = state->rx_buffers[state->rd_head];
-		DEBUG_ASSERT(p);
-		
 		LTRACEF("Processing RX descriptor %d\n", state->rd_head);
 
 		if (rd->err) {
 			LTRACEF("Descriptor error status encountered\n");
 			hexdump8(rd, sizeof(*rd));
+			state->stats.rx_errors++;
+		} else if (rd->mcnt > MAX_PACKET_SIZE) {
+			LTRACEF("RX packet size error: mcnt = %u, buf len = %u\n", rd->mcnt, MAX_PACKET_SIZE);
+			state->stats.rx_errors++;
 		} else {
-			if (rd->mcnt <= p->tot_len) {
+			struct pbuf *p;
+			struct pcnet_rx_buf *fresh = pcnet_rx_buf_get(state);
 
-				pbuf_realloc(p, rd->mcnt);
+			if (fresh) {
+				/* lend the filled buffer to the stack, the fresh one goes on the ring */
+				p = pbuf_alloced_custom(PBUF_RAW, rd->mcnt, PBUF_REF, &b->pc, b->data, sizeof(b->data));
+				state->rx_buffers[state->rd_head] = b = fresh;
+			} else {
+				/* the stack is holding every spare, copy so this buffer stays on the ring */
+				p = pbuf_alloc(PBUF_RAW, rd->mcnt, PBUF_RAM);
+				if (p)
+					pbuf_take(p, b->data, rd->mcnt);
+				state->stats.rx_copied++;
+			}
 
 #if LOCAL_TRACE
+			if (p) {
 				LTRACEF("payload=%p len=%u\n", p->payload, p->tot_len);
 				hexdump8(p->payload, p->tot_len);
+			}
 #endif
-				
-				class_netstack_input(dev, state->netstack_state, p);
 
-				p = state->rx_buffers[state->rd_head] = pbuf_alloc(PBUF_RAW, MAX_PACKET_SIZE, PBUF_RAM);
-			} else {
-				LTRACEF("RX packet size error: mcnt = %u, buf len = %u\n", rd->mcnt, p->tot_len);
-			}
+			if (p)
+				batch[count++] = p;
+			else
+				state->stats.rx_dropped++;
 		}
 
 		memset(rd, 0, sizeof(*rd));
-		memset(p->payload, 0, p->tot_len);
 
-		rd->rbadr = (uint32_t) p->payload;
-		rd->bcnt = -p->tot_len;
+		rd->rbadr = (uint32_t) b->data;
+		rd->bcnt = -MAX_PACKET_SIZE;
 		rd->ones = 0xf;
+		CF;
 		rd->own = 1;
 
 		state->rd_head = (state->rd_head + 1) % state->rd_count;
-		
-		LTRACE_EXIT;
-		return true;
-	} else {
-#if 0
-		LTRACEF("Nothing to do for RX: rd_head=%d.\n", state->rd_head);
-		for (int i=0; i < state->rd_count; i++)
-			printf("%d ", state->rd[i].own);
-		printf("\n");
-#endif
 	}
 
+	state->stats.rx_packets += count;
+
+	if (count)
+		class_netstack_input_batch(dev, state->netstack_state, batch, count);
+
 	LTRACE_EXIT;
-	return false;
+	return n;
 }
 
 static status_t pcnet_set_state(struct device *dev, struct netstack_state *netstack_state)
@@ -616,3 +743,37 @@ done:
 	return res;
 }
 
+#if WITH_LIB_CONSOLE
+
+static int cmd_pcnet(int argc, const cmd_args *argv)
+{
+	struct pcnet_state *state = pcnet_last_state;
+
+	if (!state) {
+		printf("no pcnet device\n");
+		return ERR_NOT_FOUND;
+	}
+
+	const struct pcnet_stats *st = &state->stats;
+	uint rx_free = 0;
+
+	enter_critical_section();
+	for (struct pcnet_rx_buf *b = state->rx_pool; b; b = b->next)
+		rx_free++;
+	exit_critical_section();
+
+	printf("irqs %u, polls %u, budget exhausted %u\n", st->irqs, st->polls, st->budget_exhausted);
+	printf("rx %u, tx %u, rx errors %u, rx dropped %u, rx copied %u\n",
+		st->rx_packets, st->tx_packets, st->rx_errors, st->rx_dropped, st->rx_copied);
+	printf("packets per irq: avg %u, max %u\n",
+		st->irqs ? (st->rx_packets + st->tx_packets) / st->irqs : 0, st->max_per_irq);
+	printf("rx pool: %u of %u spares free\n", rx_free, PCNET_RX_SPARES);
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("pcnet", "pcnet driver statistics", &cmd_pcnet)
+STATIC_COMMAND_END(pcnet);
+
+#endif
@@ -29,6 +29,7 @@
 #include <dev/timer/arm_cortex_a9.h>
 #include <dev/uart.h>
 #include <dev/virtio.h>
+#include <dev/virtio/net.h>
 #include <lk/init.h>
 #include <kernel/vm.h>
 #include <platform.h>
@@ -37,6 +38,12 @@
 #include <platform/vexpress-a9.h>
 #include "platform_p.h"
 
+#if WITH_LIB_LWIP
+#include <lwip/tcpip.h>
+#else
+#include <lib/minip.h>
+#endif
+
 #define SDRAM_SIZE (512*1024*1024) // XXX get this from the emulator somehow
 
 /* initial memory mappings. parsed by start.S */
@@ -111,4 +118,19 @@ void platform_init(void)
     /* detect any virtio devices */
     const uint virtio_irqs[] = { VIRTIO0_INT, VIRTIO1_INT, VIRTIO2_INT, VIRTIO3_INT };
     virtio_mmio_detect((void *)VIRTIO_BASE, 4, virtio_irqs);
+
+    /* hook the first network device up to whichever stack is built in */
+    if (virtio_net_found() > 0) {
+#if WITH_LIB_LWIP
+        tcpip_init(NULL, NULL);
+        virtio_net_netif_add();
+#else
+        uint8_t mac_addr[6];
+        virtio_net_get_mac_addr(mac_addr);
+
+        minip_set_macaddr(mac_addr);
+        minip_init_dhcp_etc(virtio_net_send_minip_pkt, NULL, virtio_net_minip_tx_flags());
+        virtio_net_start(minip_rx_driver_callback);
+#endif
+    }
 }
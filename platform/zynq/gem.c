@@ -217,7 +217,7 @@ enum handler_return gem_int_handler(void *arg) {
                 list_length(&pktbuf_to_free_list), list_length(&active_tx_list));
         pktbuf_t *p;
         while ((p = list_remove_head_type(&pktbuf_to_free_list, pktbuf_t, list)) != NULL) {
-            pktbuf_free(p);
+            pktbuf_free_irq(p);
         }
 
         regs->tx_status |= (TX_STATUS_COMPLETE | TX_STATUS_USED_READ);
@@ -8,6 +8,7 @@ MODULES += \
 	app/tests \
 	app/stringtests \
 	app/shell \
+	app/inetsrv \
 	lib/aes \
 	lib/aes/test \
 	lib/bytes \
@@ -34,6 +34,7 @@
 #include <target.h>
 #include <lib/heap.h>
 #include <kernel/thread.h>
+#include <kernel/mp.h>
 #include <lk/init.h>
 
 /* saved boot arguments from whoever loaded the system */
@@ -119,6 +120,25 @@ void lk_main(ulong arg0, ulong arg1, ulong arg2, ulong arg3)
 	thread_become_idle();
 }
 
+#if WITH_SMP
+/* called from arch code on each secondary cpu, interrupts disabled and on a private stack */
+void lk_secondary_cpu_entry(void)
+{
+	// give the cpu a thread context before anything can look for one
+	thread_secondary_cpu_init_early();
+
+	enter_critical_section();
+
+	// per cpu interrupt setup
+	arch_mp_init_percpu();
+
+	dprintf(SPEW, "secondary cpu %u starting\n", arch_curr_cpu_num());
+
+	// become this cpu's idle thread
+	thread_secondary_cpu_entry();
+}
+#endif
+
 static int bootstrap2(void *arg)
 {
 	dprintf(SPEW, "top of bootstrap2()\n");